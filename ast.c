@@ -4,6 +4,10 @@
 #include "rhd/linked_list.h"
 #include "rhd/hash_map.h"
 #include "std.h"
+#ifndef _WIN32
+#include <pthread.h>
+#include <unistd.h>
+#endif
 
 static ast_node_t *push_node(ast_context_t *ctx, int type)
 {
@@ -11,6 +15,7 @@ static ast_node_t *push_node(ast_context_t *ctx, int type)
 	n->parent = NULL;
 	n->type = type;
 	n->rvalue = 0;
+	n->scope_id = 0;
 	return n;
 }
 
@@ -33,6 +38,7 @@ void ast_init_context(ast_context_t *ctx, arena_t *allocator)
 	fn->func_decl_data.return_data_type = NULL;
 	fn->func_decl_data.numparms = 0;
 	fn->func_decl_data.variadic = 0;
+	fn->func_decl_data.inline_hint = 0;
 	fn->func_decl_data.numdeclarations = 0;
 	fn->func_decl_data.id = identifier(ctx, "default_function");
 	ctx->default_function = fn;
@@ -40,11 +46,208 @@ void ast_init_context(ast_context_t *ctx, arena_t *allocator)
 	ctx->verbose = 0;
 	ctx->function = ctx->default_function;
 	ctx->type_definitions = hash_map_create_with_custom_allocator(ast_node_t, ctx->allocator, arena_alloc);
+	ctx->shared_type_definitions = NULL;
 	ctx->numtypes = 0;
+	ctx->numthreads = 0;
+	ctx->numthreadallocators = 0;
+	ctx->functions = hash_map_create_with_custom_allocator(ast_node_t*, ctx->allocator, arena_alloc);
+	ctx->deferred_functions = NULL;
+	ctx->flags = AST_FLAGS_NONE;
 }
 
 static void statement(ast_context_t *ctx, ast_node_t **node);
 
+bool ast_is_scope_node(ast_node_t *n)
+{
+	switch(n->type)
+	{
+	case AST_PROGRAM:
+	case AST_FUNCTION_DECL:
+	case AST_BLOCK_STMT:
+	case AST_DO_WHILE_STMT:
+	case AST_WHILE_STMT:
+	case AST_FOR_STMT:
+	case AST_IF_STMT:
+		return true;
+	}
+	return false;
+}
+
+bool ast_is_loop_node(ast_node_t *n)
+{
+	return n->type == AST_WHILE_STMT || n->type == AST_DO_WHILE_STMT || n->type == AST_FOR_STMT;
+}
+
+ast_node_t *ast_enclosing_scope(ast_node_t *n)
+{
+	for(ast_node_t *it = n->parent; it; it = it->parent)
+	{
+		if(ast_is_scope_node(it))
+			return it;
+	}
+	return NULL;
+}
+
+ast_node_t *ast_enclosing_function(ast_node_t *n)
+{
+	for(ast_node_t *it = n->parent; it; it = it->parent)
+	{
+		if(it->type == AST_FUNCTION_DECL)
+			return it;
+	}
+	return NULL;
+}
+
+ast_node_t *ast_enclosing_loop(ast_node_t *n)
+{
+	for(ast_node_t *it = n->parent; it; it = it->parent)
+	{
+		// don't look past the function we're in
+		if(it->type == AST_FUNCTION_DECL)
+			break;
+		if(ast_is_loop_node(it))
+			return it;
+	}
+	return NULL;
+}
+
+#define VISIT_CHILD(child)                                                                                             \
+	do                                                                                                                 \
+	{                                                                                                                  \
+		if(child)                                                                                                      \
+			visitor(n, (child), userdata);                                                                             \
+	} while(0)
+
+void ast_visit_children(ast_node_t *n, ast_child_visitor_fn_t visitor, void *userdata)
+{
+	switch(n->type)
+	{
+	case AST_PROGRAM:
+		linked_list_reversed_foreach(n->program_data.body, ast_node_t**, it, { VISIT_CHILD(*it); });
+		break;
+	case AST_BLOCK_STMT:
+		linked_list_reversed_foreach(n->block_stmt_data.body, ast_node_t**, it, { VISIT_CHILD(*it); });
+		break;
+	case AST_FUNCTION_DECL:
+		VISIT_CHILD(n->func_decl_data.id);
+		VISIT_CHILD(n->func_decl_data.return_data_type);
+		for(int i = 0; i < n->func_decl_data.numparms; ++i)
+			VISIT_CHILD(n->func_decl_data.parameters[i]);
+		// declarations are part of the body already
+		VISIT_CHILD(n->func_decl_data.body);
+		break;
+	case AST_VARIABLE_DECL:
+		VISIT_CHILD(n->variable_decl_data.id);
+		VISIT_CHILD(n->variable_decl_data.data_type);
+		VISIT_CHILD(n->variable_decl_data.initializer_value);
+		break;
+	case AST_UNARY_EXPR:
+		VISIT_CHILD(n->unary_expr_data.argument);
+		break;
+	case AST_BIN_EXPR:
+		VISIT_CHILD(n->bin_expr_data.lhs);
+		VISIT_CHILD(n->bin_expr_data.rhs);
+		break;
+	case AST_ASSIGNMENT_EXPR:
+		VISIT_CHILD(n->assignment_expr_data.lhs);
+		VISIT_CHILD(n->assignment_expr_data.rhs);
+		break;
+	case AST_TERNARY_EXPR:
+		VISIT_CHILD(n->ternary_expr_data.condition);
+		VISIT_CHILD(n->ternary_expr_data.consequent);
+		VISIT_CHILD(n->ternary_expr_data.alternative);
+		break;
+	case AST_EXPR_STMT:
+		VISIT_CHILD(n->expr_stmt_data.expr);
+		break;
+	case AST_FUNCTION_CALL_EXPR:
+		VISIT_CHILD(n->call_expr_data.callee);
+		for(int i = 0; i < n->call_expr_data.numargs; ++i)
+			VISIT_CHILD(n->call_expr_data.arguments[i]);
+		break;
+	case AST_IF_STMT:
+		VISIT_CHILD(n->if_stmt_data.test);
+		VISIT_CHILD(n->if_stmt_data.consequent);
+		VISIT_CHILD(n->if_stmt_data.alternative);
+		break;
+	case AST_FOR_STMT:
+		VISIT_CHILD(n->for_stmt_data.init);
+		VISIT_CHILD(n->for_stmt_data.test);
+		VISIT_CHILD(n->for_stmt_data.update);
+		VISIT_CHILD(n->for_stmt_data.body);
+		break;
+	case AST_WHILE_STMT:
+		VISIT_CHILD(n->while_stmt_data.test);
+		VISIT_CHILD(n->while_stmt_data.body);
+		break;
+	case AST_DO_WHILE_STMT:
+		VISIT_CHILD(n->do_while_stmt_data.body);
+		VISIT_CHILD(n->do_while_stmt_data.test);
+		break;
+	case AST_RETURN_STMT:
+		VISIT_CHILD(n->return_stmt_data.argument);
+		break;
+	case AST_MEMBER_EXPR:
+	case AST_STRUCT_MEMBER_EXPR:
+		VISIT_CHILD(n->member_expr_data.object);
+		VISIT_CHILD(n->member_expr_data.property);
+		break;
+	case AST_POINTER_DATA_TYPE:
+	case AST_ARRAY_DATA_TYPE:
+		VISIT_CHILD(n->data_type_data.data_type);
+		break;
+	case AST_STRUCT_DECL:
+	case AST_UNION_DECL:
+		for(int i = 0; i < n->struct_decl_data.numfields; ++i)
+			VISIT_CHILD(n->struct_decl_data.fields[i]);
+		break;
+	case AST_SIZEOF:
+		VISIT_CHILD(n->sizeof_data.subject);
+		break;
+	case AST_SEQ_EXPR:
+		for(int i = 0; i < n->seq_expr_data.numexpr; ++i)
+			VISIT_CHILD(n->seq_expr_data.expr[i]);
+		break;
+	case AST_CAST:
+		VISIT_CHILD(n->cast_data.type);
+		VISIT_CHILD(n->cast_data.expr);
+		break;
+	case AST_TYPEDEF:
+		VISIT_CHILD(n->typedef_data.type);
+		break;
+	case AST_ENUM:
+		for(int i = 0; i < n->enum_data.numvalues; ++i)
+			VISIT_CHILD(n->enum_data.values[i]);
+		break;
+	// AST_DATA_TYPE and AST_STRUCT_DATA_TYPE only reference a type definition, which is shared
+	}
+}
+
+#undef VISIT_CHILD
+
+typedef struct
+{
+	int numscopes;
+} ast_link_context_t;
+
+static void link_node(ast_node_t *parent, ast_node_t *n, void *userdata)
+{
+	ast_link_context_t *lc = userdata;
+	n->parent = parent;
+	n->scope_id = parent ? parent->scope_id : 0;
+	// scope nodes get the id of the scope they open
+	if(ast_is_scope_node(n) && n->type != AST_PROGRAM)
+		n->scope_id = ++lc->numscopes;
+	ast_visit_children(n, link_node, lc);
+}
+
+// fills in the parent links and scope ids for a (top level) node once it's fully parsed
+static void ast_link(ast_node_t *parent, ast_node_t *n)
+{
+	ast_link_context_t lc = { .numscopes = 0 };
+	link_node(parent, n, &lc);
+}
+
 static int ast_accept(ast_context_t *ctx, int type)
 {
     return parse_accept(&ctx->parse_context, type);
@@ -182,11 +385,15 @@ static void add_type_definition(ast_context_t *ctx, const char *key, ast_node_t
 {
 	hash_map_insert(ctx->type_definitions, key, *n);
 	++ctx->numtypes;
+	// the node is copied, so link the children to the copy that's stored
+	ast_link(NULL, hash_map_find(ctx->type_definitions, key));
 }
 
 static ast_node_t *find_type_definition(ast_context_t *ctx, const char *key)
 {
     ast_node_t *n = hash_map_find(ctx->type_definitions, key);
+	if(!n && ctx->shared_type_definitions)
+		n = hash_map_find(ctx->shared_type_definitions, key);
 	if(!n)
 		return NULL;
 	if(n->type == AST_TYPEDEF)
@@ -286,6 +493,26 @@ static ast_node_t *find_declaration(ast_context_t *ctx, const char *name)
 	return NULL;
 }
 
+static ast_node_t *find_function(ast_context_t *ctx, const char *name)
+{
+	ast_node_t **fn = hash_map_find(ctx->functions, name);
+	return fn ? *fn : NULL;
+}
+
+static void reference_function(ast_context_t *ctx, const char *name)
+{
+	if(!(ctx->flags & AST_FLAGS_LAZY_FUNCTION_BODIES) || (ctx->flags & AST_FLAGS_PARALLEL_FUNCTION_BODIES))
+		return;
+	ast_node_t *fn = find_function(ctx, name);
+	if(!fn || fn->func_decl_data.referenced)
+		return;
+	fn->func_decl_data.referenced = 1;
+	if(!fn->func_decl_data.body_deferred)
+		return;
+	fn->func_decl_data.next_deferred = ctx->deferred_functions;
+	ctx->deferred_functions = fn;
+}
+
 static ast_node_t *ident_factor(ast_context_t *ctx)
 {
 	const char* ident_string = ast_token(ctx)->string;
@@ -299,6 +526,7 @@ static ast_node_t *ident_factor(ast_context_t *ctx)
 	}
 	if ( is_func_call )
 	{
+		reference_function( ctx, ident_string );
 		ast_node_t* n = push_node( ctx, AST_FUNCTION_CALL_EXPR );
 		n->call_expr_data.callee = ident;
 		n->call_expr_data.numargs = 0;
@@ -530,16 +758,40 @@ static void bitwise_or(ast_context_t *ctx, ast_node_t **node)
     }
 }
 
-static void ternary(ast_context_t *ctx, ast_node_t **node)
+static void logical_and(ast_context_t *ctx, ast_node_t **node)
 {
     bitwise_or(ctx, node);
+    while(!ast_accept(ctx, TK_LOGICAL_AND))
+    {
+        int operator = ast_token(ctx)->type;
+    	ast_node_t *rhs;
+        bitwise_or(ctx, &rhs);
+        *node = bin_expr(ctx, operator, *node, rhs);
+    }
+}
+
+static void logical_or(ast_context_t *ctx, ast_node_t **node)
+{
+    logical_and(ctx, node);
+    while(!ast_accept(ctx, TK_LOGICAL_OR))
+    {
+        int operator = ast_token(ctx)->type;
+    	ast_node_t *rhs;
+        logical_and(ctx, &rhs);
+        *node = bin_expr(ctx, operator, *node, rhs);
+    }
+}
+
+static void ternary(ast_context_t *ctx, ast_node_t **node)
+{
+    logical_or(ctx, node);
     
     while(!ast_accept(ctx, '?'))
     {
     	ast_node_t *consequent, *alternative, *ternary_node;
-        bitwise_or(ctx, &consequent);
+        logical_or(ctx, &consequent);
         ast_expect(ctx, ':', "expected : for ternary operator");
-    	bitwise_or(ctx, &alternative);
+    	logical_or(ctx, &alternative);
 		ternary_node = push_node( ctx, AST_TERNARY_EXPR );
         ternary_node->ternary_expr_data.condition = *node;
         ternary_node->ternary_expr_data.consequent = consequent;
@@ -702,6 +954,9 @@ void print_ast(ast_node_t *n, int depth)
 				print_ast(n->func_decl_data.parameters[i]->variable_decl_data.data_type, depth + 1);
 			}
 			print_ast(n->func_decl_data.body, depth + 1);
+		} else if(n->func_decl_data.body_deferred)
+		{
+			printf("unreferenced function '%s'\n", n->func_decl_data.id->identifier_data.name);
 		} else
 		{
 			printf("import function '%s'\n", n->func_decl_data.id->identifier_data.name);
@@ -1204,7 +1459,53 @@ static void handle_struct_or_union_declaration(ast_context_t *ctx)
     add_type_definition(ctx, struct_node.struct_decl_data.name, &struct_node);
 }
 
-static void handle_function_definition(ast_context_t *ctx, ast_node_t *type_decl, ast_node_t *id)
+// records the token range of a function body by matching the braces, without parsing it
+static void defer_function_body(ast_context_t *ctx, ast_node_t *decl)
+{
+	ast_expect(ctx, '{', "expected { after function");
+	struct parse_context *pc = &ctx->parse_context;
+	decl->func_decl_data.body_token_start = pc->token_index - 1;
+	int depth = 1;
+	while(depth > 0)
+	{
+		struct token *tk = parse_advance(pc);
+		ast_assert(ctx, tk && tk->type != TK_EOF, "no ending } for function '%s'", decl->func_decl_data.id->identifier_data.name);
+		if(tk->type == '{')
+			++depth;
+		else if(tk->type == '}')
+			--depth;
+	}
+	decl->func_decl_data.body_token_end = pc->token_index - 1;
+	decl->func_decl_data.body_deferred = 1;
+}
+
+static void parse_function_body(ast_context_t *ctx, ast_node_t *decl)
+{
+	ast_node_t* block_node = NULL;
+	ctx->function = decl;
+	statement_node(ctx, &block_node);
+	ast_assert(ctx, block_node->type == AST_BLOCK_STMT, "expected { after function");
+	ctx->function = ctx->default_function;
+	decl->func_decl_data.body = block_node;
+}
+
+static void parse_deferred_function_body(ast_context_t *ctx, ast_node_t *decl)
+{
+	struct parse_context *pc = &ctx->parse_context;
+	int token_index = pc->token_index;
+	struct token *current_token = pc->current_token;
+
+	pc->token_index = decl->func_decl_data.body_token_start;
+	parse_function_body(ctx, decl);
+	ast_assert(ctx, pc->token_index == decl->func_decl_data.body_token_end + 1, "function body range mismatch");
+	decl->func_decl_data.body_deferred = 0;
+	ast_link(ctx->program_node, decl);
+
+	pc->token_index = token_index;
+	pc->current_token = current_token;
+}
+
+static void handle_function_definition(ast_context_t *ctx, ast_node_t *type_decl, ast_node_t *id, int inline_hint)
 {
 	if ( !type_decl )
 		ast_error( ctx, "expected function return type got '%s'", token_type_to_string( parse_token(&ctx->parse_context)->type ) );
@@ -1212,8 +1513,13 @@ static void handle_function_definition(ast_context_t *ctx, ast_node_t *type_decl
 	decl->func_decl_data.return_data_type = type_decl;
 	decl->func_decl_data.numparms = 0;
 	decl->func_decl_data.variadic = 0;
+	decl->func_decl_data.inline_hint = inline_hint;
 	decl->func_decl_data.numdeclarations = 0;
 	decl->func_decl_data.id = id;
+	decl->func_decl_data.body = NULL;
+	decl->func_decl_data.body_deferred = 0;
+	decl->func_decl_data.referenced = 0;
+	decl->func_decl_data.next_deferred = NULL;
 	ctx->function = decl;
 	//ast_expect( ctx, '(', "expected ( after function" );
 
@@ -1241,20 +1547,51 @@ static void handle_function_definition(ast_context_t *ctx, ast_node_t *type_decl
 
 	ast_expect( ctx, ')', "expected ) after function" );
 
-	ast_node_t* block_node = NULL;
 	//check if it's just a forward decl
 	if (ast_accept(ctx, ';'))
 	{
-		statement_node(ctx, &block_node);
-		ast_assert(ctx, block_node->type == AST_BLOCK_STMT, "expected { after function");
+		if(ctx->flags & (AST_FLAGS_LAZY_FUNCTION_BODIES | AST_FLAGS_PARALLEL_FUNCTION_BODIES))
+			defer_function_body(ctx, decl);
+		else
+			parse_function_body(ctx, decl);
+		// a definition takes precedence over any prototype
+		hash_map_insert(ctx->functions, id->identifier_data.name, decl);
+	} else if(!find_function(ctx, id->identifier_data.name))
+	{
+		hash_map_insert(ctx->functions, id->identifier_data.name, decl);
 	}
 	linked_list_prepend( ctx->program_node->program_data.body, decl );
 	ctx->function = ctx->default_function;
-	decl->func_decl_data.body = block_node;
+	ast_link(ctx->program_node, decl);
+}
+
+// parses the bodies of all functions reachable from the entry function, unreachable bodies are left unparsed
+// if there's no entry function everything is parsed
+static void parse_referenced_function_bodies(ast_context_t *ctx, const char *entry)
+{
+	ast_node_t *entry_fn = find_function(ctx, entry);
+	if(entry_fn)
+	{
+		reference_function(ctx, entry);
+	} else
+	{
+		linked_list_reversed_foreach(ctx->program_node->program_data.body, ast_node_t**, it, {
+			if((*it)->type == AST_FUNCTION_DECL)
+				reference_function(ctx, (*it)->func_decl_data.id->identifier_data.name);
+		});
+	}
+	while(ctx->deferred_functions)
+	{
+		ast_node_t *fn = ctx->deferred_functions;
+		ctx->deferred_functions = fn->func_decl_data.next_deferred;
+		fn->func_decl_data.next_deferred = NULL;
+		parse_deferred_function_body(ctx, fn);
+	}
 }
 
 static bool handle_function_definition_or_variable_declaration(ast_context_t *ctx)
 {
+	int inline_hint = !ast_accept(ctx, TK_INLINE);
 	ast_node_t* type_decl = NULL;
 	int td = type_declaration( ctx , &type_decl );
 	ast_assert( ctx, !td, "error in type declaration" );
@@ -1269,11 +1606,13 @@ static bool handle_function_definition_or_variable_declaration(ast_context_t *ct
 	
 	if(!ast_accept(ctx, '('))
 	{
-		handle_function_definition(ctx, type_decl, id);
+		handle_function_definition(ctx, type_decl, id, inline_hint);
 		return true;
 	}
+	ast_assert( ctx, !inline_hint, "inline is only allowed on functions" );
 	ast_node_t *variable_decl = handle_variable_declaration(ctx, type_decl, id, 0);
 	linked_list_prepend( ctx->program_node->program_data.body, variable_decl );
+	ast_link(ctx->program_node, variable_decl);
 	ast_expect( ctx, ';', "missing ;" );
 	return true;
 }
@@ -1471,6 +1810,129 @@ ast_node_t* ast_tree_node_by_identifier(traverse_context_t* ctx, ast_node_t* hea
     return NULL;
 }
 
+#ifndef _WIN32
+typedef struct
+{
+	ast_context_t *ctx;
+	arena_t *allocator;
+	ast_node_t **functions;
+	int numfunctions;
+	int *next;
+	bool failed;
+} parse_worker_t;
+
+static void *parse_worker(void *arg)
+{
+	parse_worker_t *w = arg;
+
+	// each worker gets a copy of the context with it's own allocator and token position
+	// type definitions from the top level are shared read only, types declared inside a function body stay local
+	ast_context_t wctx = *w->ctx;
+	wctx.allocator = w->allocator;
+	wctx.shared_type_definitions = w->ctx->type_definitions;
+	wctx.type_definitions = hash_map_create_with_custom_allocator(ast_node_t, wctx.allocator, arena_alloc);
+	wctx.deferred_functions = NULL;
+	
+	if(setjmp(wctx.jmp))
+	{
+		w->failed = true;
+		return NULL;
+	}
+
+	while(1)
+	{
+		int i = __sync_fetch_and_add(w->next, 1);
+		if(i >= w->numfunctions)
+			break;
+		ast_node_t *decl = w->functions[i];
+		wctx.parse_context.token_index = decl->func_decl_data.body_token_start;
+		parse_function_body(&wctx, decl);
+		ast_assert(&wctx, wctx.parse_context.token_index == decl->func_decl_data.body_token_end + 1, "function body range mismatch");
+	}
+	return NULL;
+}
+#endif
+
+// parses all deferred function bodies, the bodies don't depend on eachother so they can be parsed concurrently
+static bool parse_function_bodies_parallel(ast_context_t *ctx)
+{
+	int numfunctions = 0;
+	linked_list_reversed_foreach(ctx->program_node->program_data.body, ast_node_t**, it, {
+		if((*it)->type == AST_FUNCTION_DECL && (*it)->func_decl_data.body_deferred)
+			++numfunctions;
+	});
+	if(!numfunctions)
+		return true;
+	
+	ast_node_t **functions = (ast_node_t**)arena_alloc(ctx->allocator, sizeof(ast_node_t*) * numfunctions);
+	ast_assert(ctx, functions, "failed to allocate function list");
+	numfunctions = 0;
+	linked_list_reversed_foreach(ctx->program_node->program_data.body, ast_node_t**, it, {
+		if((*it)->type == AST_FUNCTION_DECL && (*it)->func_decl_data.body_deferred)
+			functions[numfunctions++] = *it;
+	});
+
+#ifdef _WIN32
+	// windows has no pthreads, the bodies are parsed one after the other on this thread like with -j 1
+	for(int i = 0; i < numfunctions; ++i)
+		parse_deferred_function_body(ctx, functions[i]);
+	return true;
+#else
+	int numthreads = ctx->numthreads;
+	if(numthreads <= 0)
+		numthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if(numthreads > (int)COUNT_OF(ctx->thread_allocators))
+		numthreads = COUNT_OF(ctx->thread_allocators);
+	if(numthreads > numfunctions)
+		numthreads = numfunctions;
+	if(numthreads < 1)
+		numthreads = 1;
+
+	pthread_t threads[COUNT_OF(ctx->thread_allocators)];
+	parse_worker_t workers[COUNT_OF(ctx->thread_allocators)];
+	int next = 0;
+	for(int i = 0; i < numthreads; ++i)
+	{
+		// keep the allocators around, the nodes are still used after parsing
+		arena_t *allocator = NULL;
+		if(arena_create(&allocator, "ast thread", ctx->allocator->reserved))
+			ast_error(ctx, "failed to create allocator for thread %d", i);
+		ctx->thread_allocators[ctx->numthreadallocators++] = allocator;
+
+		workers[i].ctx = ctx;
+		workers[i].allocator = allocator;
+		workers[i].functions = functions;
+		workers[i].numfunctions = numfunctions;
+		workers[i].next = &next;
+		workers[i].failed = false;
+	}
+	int numstarted = 0;
+	for(; numstarted < numthreads; ++numstarted)
+	{
+		if(pthread_create(&threads[numstarted], NULL, parse_worker, &workers[numstarted]))
+			break;
+	}
+	// if no thread could be started parse them on this thread instead
+	if(!numstarted)
+		parse_worker(&workers[0]);
+	bool failed = false;
+	for(int i = 0; i < numstarted; ++i)
+		pthread_join(threads[i], NULL);
+	for(int i = 0; i < numthreads; ++i)
+		failed = failed || workers[i].failed;
+	if(failed)
+		return false;
+
+	// linking is done afterwards, type nodes can be shared between functions
+	for(int i = 0; i < numfunctions; ++i)
+	{
+		functions[i]->func_decl_data.body_deferred = 0;
+		ast_link(ctx->program_node, functions[i]);
+	}
+	return true;
+#endif
+}
+
 bool ast_process_tokens(ast_context_t* ctx, struct token* tokens, int num_tokens)
 {
 	ctx->function = ctx->default_function;
@@ -1485,5 +1947,9 @@ bool ast_process_tokens(ast_context_t* ctx, struct token* tokens, int num_tokens
     }
     
     program(ctx);
+	if(ctx->flags & AST_FLAGS_PARALLEL_FUNCTION_BODIES)
+		return parse_function_bodies_parallel(ctx);
+	if(ctx->flags & AST_FLAGS_LAZY_FUNCTION_BODIES)
+		parse_referenced_function_bodies(ctx, "main");
 	return true;
 }
@@ -148,9 +148,17 @@ typedef struct
     ast_node_t *body; //no body means just forward declaration, just prototype function
     ast_node_t *return_data_type;
     int variadic;
+    int inline_hint; // declared inline, lets the inliner take bigger functions
     //TODO: access same named variables in different scopes
     ast_node_t *declarations[64]; //TODO: increase max amount of local variables, for now this'll do
     int numdeclarations;
+
+    // with AST_FLAGS_LAZY_FUNCTION_BODIES the body is only parsed once the function is referenced
+    // body stays NULL while body_deferred is set, the token range includes the braces
+    int body_deferred;
+    int body_token_start, body_token_end;
+    int referenced;
+    ast_node_t *next_deferred;
 } ast_function_decl_t;
 
 typedef struct
@@ -195,11 +203,31 @@ typedef struct
 	int array_size;
 } ast_data_type_t;
 
+typedef struct
+{
+	ast_node_t *field; // variable declaration of the field
+	int offset; // in bytes
+	int size; // in bytes
+} ast_struct_field_layout_t;
+
+typedef struct
+{
+	int size; // in bytes, including the padding at the end
+	int alignment; // in bytes
+	int numfields;
+	ast_struct_field_layout_t fields[32];
+	struct hash_map *field_indices; // field name -> index in fields
+} ast_struct_layout_t;
+
 typedef struct
 {
 	char name[IDENT_CHARLEN];
 	ast_node_t* fields[32]; // TODO: increase N
 	int numfields;
+	// computed once by the compiler on first use, the sizes depend on the target. compile.c aligns the fields and
+	// compiler.c packs them, so each has its own
+	ast_struct_layout_t *layout;
+	ast_struct_layout_t *packed_layout;
 } ast_struct_decl_t;
 
 typedef struct
@@ -277,6 +305,7 @@ struct ast_node_s
 	ast_node_type_t type;
 	int start, end;
 	int rvalue;
+	int scope_id; // id of the innermost scope this node is in, 0 is the program scope. unique per function only
 	union
 	{
 		ast_block_stmt_t block_stmt_data;
@@ -316,6 +345,14 @@ static void ast_print_node_type(const char* key, ast_node_t* n)
 	printf("node type: %s -> %s\n", key, ast_node_type_t_to_string(n->type));
 }
 
+typedef enum
+{
+	AST_FLAGS_NONE = 0,
+	AST_FLAGS_LAZY_FUNCTION_BODIES = 1,
+	// parse all function bodies after the top level pass with a pool of threads, takes precedence over lazy parsing
+	AST_FLAGS_PARALLEL_FUNCTION_BODIES = 2
+} ast_flags_t;
+
 struct ast_context
 {
 	arena_t *allocator;
@@ -323,9 +360,18 @@ struct ast_context
     ast_node_t *function;
     ast_node_t *default_function;
     struct hash_map *type_definitions;
+    struct hash_map *shared_type_definitions; // read only type definitions of the top level pass when parsing in a worker thread
 	int numtypes;
 	
+    int numthreads; // 0 uses the amount of online cores
+    arena_t *thread_allocators[64];
+    int numthreadallocators;
+	
+    struct hash_map *functions; // name -> ast_node_t* of the function definition
+    ast_node_t *deferred_functions; // referenced functions that still need their body parsed
+	
     int verbose;
+    int flags;
 	
     struct parse_context parse_context;
     jmp_buf jmp;
@@ -359,4 +405,16 @@ ast_node_t* ast_tree_traverse_get_visitee(traverse_context_t* ctx, size_t index)
 size_t ast_tree_nodes_by_type(traverse_context_t* ctx, ast_node_t* head, int type, ast_node_t** results, size_t maxresults);
 ast_node_t* ast_tree_node_by_node(traverse_context_t* ctx, ast_node_t* head, ast_node_t* node);
 
+typedef void (*ast_child_visitor_fn_t)(ast_node_t *parent, ast_node_t *child, void *userdata);
+
+// visits the direct children of a node in source order, shared type definitions are not visited
+void ast_visit_children(ast_node_t *n, ast_child_visitor_fn_t visitor, void *userdata);
+
+// parent link based lookups, these only walk up the tree so they're O(depth)
+bool ast_is_scope_node(ast_node_t *n);
+bool ast_is_loop_node(ast_node_t *n);
+ast_node_t *ast_enclosing_scope(ast_node_t *n);
+ast_node_t *ast_enclosing_function(ast_node_t *n);
+ast_node_t *ast_enclosing_loop(ast_node_t *n);
+
 #endif
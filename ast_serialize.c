@@ -0,0 +1,737 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "ast_serialize.h"
+#include "rhd/linked_list.h"
+#include "rhd/hash_map.h"
+#include "rhd/std.h"
+#include "std.h"
+#include "util.h"
+
+// pointer -> index, open addressing
+typedef struct
+{
+	ast_node_t **keys;
+	u32 *values;
+	size_t capacity;
+	size_t count;
+} node_index_map_t;
+
+static size_t node_index_hash(ast_node_t *n, size_t capacity)
+{
+	uintptr_t h = (uintptr_t)n;
+	h ^= h >> 17;
+	h *= 0x9e3779b97f4a7c15ull;
+	return (h >> 16) & (capacity - 1);
+}
+
+static u32 node_index_find(node_index_map_t *m, ast_node_t *n)
+{
+	if(!m->capacity)
+		return AST_SERIALIZED_NONE;
+	for(size_t i = node_index_hash(n, m->capacity);; i = (i + 1) & (m->capacity - 1))
+	{
+		if(!m->keys[i])
+			return AST_SERIALIZED_NONE;
+		if(m->keys[i] == n)
+			return m->values[i];
+	}
+}
+
+static void node_index_insert(node_index_map_t *m, ast_node_t *n, u32 value)
+{
+	if((m->count + 1) * 2 > m->capacity)
+	{
+		node_index_map_t grown = { .capacity = m->capacity ? m->capacity * 2 : 1024, .count = 0 };
+		grown.keys = calloc(grown.capacity, sizeof(ast_node_t*));
+		grown.values = calloc(grown.capacity, sizeof(u32));
+		for(size_t i = 0; i < m->capacity; ++i)
+		{
+			if(m->keys[i])
+				node_index_insert(&grown, m->keys[i], m->values[i]);
+		}
+		free(m->keys);
+		free(m->values);
+		*m = grown;
+	}
+	size_t i = node_index_hash(n, m->capacity);
+	while(m->keys[i])
+		i = (i + 1) & (m->capacity - 1);
+	m->keys[i] = n;
+	m->values[i] = value;
+	++m->count;
+}
+
+typedef void (*reference_fn_t)(void *userdata, ast_node_t *n);
+
+// calls fn for every node that n refers to, in the order they're stored in the children table
+// unlike ast_visit_children NULL children are passed aswell, so the position of a child is fixed
+static void foreach_reference(ast_node_t *n, reference_fn_t fn, void *userdata)
+{
+	switch(n->type)
+	{
+	case AST_PROGRAM:
+		linked_list_reversed_foreach(n->program_data.body, ast_node_t**, it, { fn(userdata, *it); });
+		break;
+	case AST_BLOCK_STMT:
+		linked_list_reversed_foreach(n->block_stmt_data.body, ast_node_t**, it, { fn(userdata, *it); });
+		break;
+	case AST_FUNCTION_DECL:
+		fn(userdata, n->func_decl_data.id);
+		fn(userdata, n->func_decl_data.return_data_type);
+		fn(userdata, n->func_decl_data.body_deferred ? NULL : n->func_decl_data.body);
+		for(int i = 0; i < n->func_decl_data.numparms; ++i)
+			fn(userdata, n->func_decl_data.parameters[i]);
+		for(int i = 0; i < n->func_decl_data.numdeclarations; ++i)
+			fn(userdata, n->func_decl_data.declarations[i]);
+		break;
+	case AST_VARIABLE_DECL:
+		fn(userdata, n->variable_decl_data.id);
+		fn(userdata, n->variable_decl_data.data_type);
+		fn(userdata, n->variable_decl_data.initializer_value);
+		break;
+	case AST_UNARY_EXPR:
+		fn(userdata, n->unary_expr_data.argument);
+		break;
+	case AST_BIN_EXPR:
+		fn(userdata, n->bin_expr_data.lhs);
+		fn(userdata, n->bin_expr_data.rhs);
+		break;
+	case AST_ASSIGNMENT_EXPR:
+		fn(userdata, n->assignment_expr_data.lhs);
+		fn(userdata, n->assignment_expr_data.rhs);
+		break;
+	case AST_TERNARY_EXPR:
+		fn(userdata, n->ternary_expr_data.condition);
+		fn(userdata, n->ternary_expr_data.consequent);
+		fn(userdata, n->ternary_expr_data.alternative);
+		break;
+	case AST_EXPR_STMT:
+		fn(userdata, n->expr_stmt_data.expr);
+		break;
+	case AST_FUNCTION_CALL_EXPR:
+		fn(userdata, n->call_expr_data.callee);
+		for(int i = 0; i < n->call_expr_data.numargs; ++i)
+			fn(userdata, n->call_expr_data.arguments[i]);
+		break;
+	case AST_IF_STMT:
+		fn(userdata, n->if_stmt_data.test);
+		fn(userdata, n->if_stmt_data.consequent);
+		fn(userdata, n->if_stmt_data.alternative);
+		break;
+	case AST_FOR_STMT:
+		fn(userdata, n->for_stmt_data.init);
+		fn(userdata, n->for_stmt_data.test);
+		fn(userdata, n->for_stmt_data.update);
+		fn(userdata, n->for_stmt_data.body);
+		break;
+	case AST_WHILE_STMT:
+		fn(userdata, n->while_stmt_data.test);
+		fn(userdata, n->while_stmt_data.body);
+		break;
+	case AST_DO_WHILE_STMT:
+		fn(userdata, n->do_while_stmt_data.test);
+		fn(userdata, n->do_while_stmt_data.body);
+		break;
+	case AST_RETURN_STMT:
+		fn(userdata, n->return_stmt_data.argument);
+		break;
+	case AST_MEMBER_EXPR:
+	case AST_STRUCT_MEMBER_EXPR:
+		fn(userdata, n->member_expr_data.object);
+		fn(userdata, n->member_expr_data.property);
+		break;
+	case AST_POINTER_DATA_TYPE:
+	case AST_ARRAY_DATA_TYPE:
+	case AST_DATA_TYPE:
+	case AST_STRUCT_DATA_TYPE:
+		fn(userdata, n->data_type_data.data_type);
+		break;
+	case AST_STRUCT_DECL:
+	case AST_UNION_DECL:
+		for(int i = 0; i < n->struct_decl_data.numfields; ++i)
+			fn(userdata, n->struct_decl_data.fields[i]);
+		break;
+	case AST_SIZEOF:
+		fn(userdata, n->sizeof_data.subject);
+		break;
+	case AST_SEQ_EXPR:
+		for(int i = 0; i < n->seq_expr_data.numexpr; ++i)
+			fn(userdata, n->seq_expr_data.expr[i]);
+		break;
+	case AST_CAST:
+		fn(userdata, n->cast_data.type);
+		fn(userdata, n->cast_data.expr);
+		break;
+	case AST_TYPEDEF:
+		fn(userdata, n->typedef_data.type);
+		break;
+	case AST_ENUM:
+		for(int i = 0; i < n->enum_data.numvalues; ++i)
+			fn(userdata, n->enum_data.values[i]);
+		break;
+	}
+}
+
+typedef struct
+{
+	node_index_map_t indices;
+	ast_node_t **nodes; // in order of their index
+	size_t numnodes;
+	size_t maxnodes;
+	heap_string children;
+	heap_string strings;
+	struct hash_map *interned; // string -> offset in strings
+} serializer_t;
+
+static void discover_node(void *userdata, ast_node_t *n)
+{
+	serializer_t *s = userdata;
+	if(!n || node_index_find(&s->indices, n) != AST_SERIALIZED_NONE)
+		return;
+	if(s->numnodes >= s->maxnodes)
+	{
+		s->maxnodes = s->maxnodes ? s->maxnodes * 2 : 1024;
+		s->nodes = realloc(s->nodes, sizeof(ast_node_t*) * s->maxnodes);
+	}
+	node_index_insert(&s->indices, n, s->numnodes);
+	s->nodes[s->numnodes++] = n;
+}
+
+static void write_child(void *userdata, ast_node_t *n)
+{
+	serializer_t *s = userdata;
+	dd(&s->children, n ? node_index_find(&s->indices, n) : AST_SERIALIZED_NONE);
+}
+
+static u32 intern_string(serializer_t *s, const char *str)
+{
+	u32 *offset = hash_map_find(s->interned, str);
+	if(offset)
+		return *offset;
+	u32 o = heap_string_size(&s->strings);
+	buf(&s->strings, str, strlen(str) + 1);
+	hash_map_insert(s->interned, str, o);
+	return o;
+}
+
+static void write_node(serializer_t *s, ast_node_t *n, ast_serialized_node_t *out)
+{
+	memset(out, 0, sizeof(ast_serialized_node_t));
+	out->type = n->type;
+	out->parent = n->parent ? node_index_find(&s->indices, n->parent) : AST_SERIALIZED_NONE;
+	out->start = n->start;
+	out->end = n->end;
+	out->rvalue = n->rvalue;
+	out->scope_id = n->scope_id;
+	out->string = AST_SERIALIZED_NONE;
+	out->children = heap_string_size(&s->children) / sizeof(u32);
+	foreach_reference(n, write_child, s);
+	out->numchildren = heap_string_size(&s->children) / sizeof(u32) - out->children;
+
+	switch(n->type)
+	{
+	case AST_IDENTIFIER:
+		out->string = intern_string(s, n->identifier_data.name);
+		break;
+	case AST_LITERAL:
+		out->values[0] = n->literal_data.type;
+		switch(n->literal_data.type)
+		{
+		case LITERAL_INTEGER:
+			memcpy(out->literal, &n->literal_data.integer.value, sizeof(i64));
+			out->values[1] = n->literal_data.integer.is_unsigned;
+			out->values[2] = n->literal_data.integer.suffix;
+			break;
+		case LITERAL_NUMBER:
+			memcpy(out->literal, &n->literal_data.scalar.value, sizeof(long double) < sizeof(out->literal) ? sizeof(long double) : sizeof(out->literal));
+			out->values[1] = n->literal_data.scalar.suffix;
+			break;
+		case LITERAL_STRING:
+			out->string = intern_string(s, n->literal_data.string);
+			break;
+		}
+		break;
+	case AST_UNARY_EXPR:
+		out->values[0] = n->unary_expr_data.operator;
+		out->values[1] = n->unary_expr_data.prefix;
+		break;
+	case AST_BIN_EXPR:
+		out->values[0] = n->bin_expr_data.operator;
+		break;
+	case AST_ASSIGNMENT_EXPR:
+		out->values[0] = n->assignment_expr_data.operator;
+		break;
+	case AST_FUNCTION_DECL:
+		out->values[0] = n->func_decl_data.numparms;
+		out->values[1] = n->func_decl_data.numdeclarations;
+		out->values[2] = n->func_decl_data.variadic | (n->func_decl_data.inline_hint << 1);
+		break;
+	case AST_MEMBER_EXPR:
+	case AST_STRUCT_MEMBER_EXPR:
+		out->values[0] = n->member_expr_data.computed;
+		out->values[1] = n->member_expr_data.as_pointer;
+		break;
+	case AST_PRIMITIVE:
+		out->values[0] = n->primitive_data.primitive_type;
+		out->values[1] = n->primitive_data.qualifiers;
+		break;
+	case AST_POINTER_DATA_TYPE:
+	case AST_ARRAY_DATA_TYPE:
+	case AST_DATA_TYPE:
+	case AST_STRUCT_DATA_TYPE:
+		out->values[0] = n->data_type_data.qualifiers;
+		out->values[1] = n->data_type_data.array_size;
+		break;
+	case AST_STRUCT_DECL:
+	case AST_UNION_DECL:
+		out->string = intern_string(s, n->struct_decl_data.name);
+		break;
+	case AST_EMIT:
+		out->values[0] = n->emit_data.opcode;
+		break;
+	case AST_TYPEDEF:
+		out->string = intern_string(s, n->typedef_data.name);
+		break;
+	case AST_ENUM:
+		out->string = intern_string(s, n->enum_data.name);
+		break;
+	case AST_ENUM_VALUE:
+		out->string = intern_string(s, n->enum_value_data.ident);
+		out->values[0] = n->enum_value_data.value;
+		break;
+	}
+}
+
+bool ast_serialize(ast_node_t *root, arena_t *allocator, heap_string *out)
+{
+	serializer_t s = { 0 };
+	s.interned = hash_map_create_with_custom_allocator(u32, allocator, arena_alloc);
+
+	// breadth first so we don't recurse on deeply nested trees
+	discover_node(&s, root);
+	for(size_t i = 0; i < s.numnodes; ++i)
+		foreach_reference(s.nodes[i], discover_node, &s);
+
+	heap_string nodes = NULL;
+	for(size_t i = 0; i < s.numnodes; ++i)
+	{
+		ast_serialized_node_t sn;
+		write_node(&s, s.nodes[i], &sn);
+		buf(&nodes, (const char*)&sn, sizeof(sn));
+	}
+	// make sure there's always a string table to point into
+	if(!heap_string_size(&s.strings))
+		db(&s.strings, 0);
+
+	ast_serialized_header_t hdr = { 0 };
+	hdr.magic = AST_SERIALIZED_MAGIC;
+	hdr.version = AST_SERIALIZED_VERSION;
+	hdr.root = 0;
+	hdr.numnodes = s.numnodes;
+	hdr.nodes_offset = sizeof(hdr);
+	hdr.numchildren = heap_string_size(&s.children) / sizeof(u32);
+	hdr.children_offset = hdr.nodes_offset + heap_string_size(&nodes);
+	hdr.strings_size = heap_string_size(&s.strings);
+	hdr.strings_offset = hdr.children_offset + heap_string_size(&s.children);
+	hdr.size = hdr.strings_offset + hdr.strings_size;
+
+	buf(out, (const char*)&hdr, sizeof(hdr));
+	buf(out, nodes, heap_string_size(&nodes));
+	buf(out, s.children, heap_string_size(&s.children));
+	buf(out, s.strings, heap_string_size(&s.strings));
+
+	heap_string_free(&nodes);
+	heap_string_free(&s.children);
+	heap_string_free(&s.strings);
+	free(s.nodes);
+	free(s.indices.keys);
+	free(s.indices.values);
+	return true;
+}
+
+bool ast_serialize_to_file(ast_node_t *root, arena_t *allocator, const char *path)
+{
+	heap_string data = NULL;
+	if(!ast_serialize(root, allocator, &data))
+		return false;
+	FILE* fp;
+	std_fopen_s(&fp, path, "wb");
+	if(!fp)
+	{
+		char errorMessage[1024];
+		std_strerror_s(errorMessage, sizeof(errorMessage), errno);
+		printf("failed to open '%s', error = %s\n", path, errorMessage);
+		heap_string_free(&data);
+		return false;
+	}
+	fwrite(data, heap_string_size(&data), 1, fp);
+	fclose(fp);
+	heap_string_free(&data);
+	return true;
+}
+
+static bool section_in_bounds(u32 offset, u64 size, size_t filesize)
+{
+	return offset % sizeof(u32) == 0 && (u64)offset + size <= filesize;
+}
+
+bool ast_serialized_open(ast_serialized_t *s, const void *data, size_t size)
+{
+	s->data = data;
+	s->size = size;
+	s->mapped = 0;
+	s->header = data;
+	if(size < sizeof(ast_serialized_header_t))
+		return false;
+	const ast_serialized_header_t *hdr = s->header;
+	if(hdr->magic != AST_SERIALIZED_MAGIC || hdr->version != AST_SERIALIZED_VERSION || hdr->size > size)
+		return false;
+	if(!section_in_bounds(hdr->nodes_offset, (u64)hdr->numnodes * sizeof(ast_serialized_node_t), size) ||
+	   !section_in_bounds(hdr->children_offset, (u64)hdr->numchildren * sizeof(u32), size) ||
+	   (u64)hdr->strings_offset + hdr->strings_size > size)
+		return false;
+	if(!hdr->strings_size || hdr->root >= hdr->numnodes)
+		return false;
+	s->nodes = (const ast_serialized_node_t*)(s->data + hdr->nodes_offset);
+	s->children = (const u32*)(s->data + hdr->children_offset);
+	s->strings = (const char*)(s->data + hdr->strings_offset);
+	// every string is zero terminated, as long as the last one is any offset in the table is safe to read
+	if(s->strings[hdr->strings_size - 1])
+		return false;
+	return true;
+}
+
+bool ast_serialized_map_file(ast_serialized_t *s, const char *path)
+{
+	memset(s, 0, sizeof(ast_serialized_t));
+#ifdef _WIN32
+	FILE* fp;
+	std_fopen_s(&fp, path, "rb");
+	if(!fp)
+		return false;
+	fseek(fp, 0, SEEK_END);
+	size_t size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	void *data = malloc(size);
+	if(!data || fread(data, size, 1, fp) != 1)
+	{
+		free(data);
+		fclose(fp);
+		return false;
+	}
+	fclose(fp);
+	if(!ast_serialized_open(s, data, size))
+	{
+		free(data);
+		return false;
+	}
+	s->mapped = 2;
+	return true;
+#else
+	int fd = open(path, O_RDONLY);
+	if(fd == -1)
+		return false;
+	struct stat st;
+	if(fstat(fd, &st) == -1 || st.st_size == 0)
+	{
+		close(fd);
+		return false;
+	}
+	void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(data == MAP_FAILED)
+		return false;
+	if(!ast_serialized_open(s, data, st.st_size))
+	{
+		munmap(data, st.st_size);
+		return false;
+	}
+	s->mapped = 1;
+	return true;
+#endif
+}
+
+void ast_serialized_unmap(ast_serialized_t *s)
+{
+#ifdef _WIN32
+	if(s->mapped)
+		free((void*)s->data);
+#else
+	if(s->mapped)
+		munmap((void*)s->data, s->size);
+#endif
+	memset(s, 0, sizeof(ast_serialized_t));
+}
+
+typedef struct
+{
+	ast_serialized_t *s;
+	ast_node_t *nodes;
+	const ast_serialized_node_t *sn;
+	bool invalid;
+} deserializer_t;
+
+static ast_node_t *read_child(deserializer_t *d, u32 i)
+{
+	if(i >= d->sn->numchildren)
+	{
+		d->invalid = true;
+		return NULL;
+	}
+	u32 index = ast_serialized_child(d->s, d->sn, i);
+	if(index == AST_SERIALIZED_NONE)
+		return NULL;
+	if(index >= d->s->header->numnodes)
+	{
+		d->invalid = true;
+		return NULL;
+	}
+	return &d->nodes[index];
+}
+
+static void read_string(deserializer_t *d, char *out, size_t outsize)
+{
+	const char *str = ast_serialized_string(d->s, d->sn->string);
+	if(!str)
+	{
+		d->invalid = true;
+		return;
+	}
+	snprintf(out, outsize, "%s", str);
+}
+
+static int read_count(deserializer_t *d, int count, int max)
+{
+	if(count < 0 || count > max)
+	{
+		d->invalid = true;
+		return 0;
+	}
+	return count;
+}
+
+static void read_node(deserializer_t *d, ast_node_t *n, arena_t *allocator)
+{
+	const ast_serialized_node_t *sn = d->sn;
+	n->type = sn->type;
+	n->start = sn->start;
+	n->end = sn->end;
+	n->rvalue = sn->rvalue;
+	n->scope_id = sn->scope_id;
+	n->parent = NULL;
+	if(sn->parent != AST_SERIALIZED_NONE)
+	{
+		if(sn->parent >= d->s->header->numnodes)
+			d->invalid = true;
+		else
+			n->parent = &d->nodes[sn->parent];
+	}
+	if(sn->numchildren > d->s->header->numchildren || sn->children > d->s->header->numchildren - sn->numchildren)
+	{
+		d->invalid = true;
+		return;
+	}
+
+	switch(n->type)
+	{
+	case AST_PROGRAM:
+		n->program_data.body = linked_list_create_with_custom_allocator(void*, allocator, arena_alloc);
+		for(u32 i = 0; i < sn->numchildren; ++i)
+			linked_list_prepend(n->program_data.body, read_child(d, i));
+		break;
+	case AST_BLOCK_STMT:
+		n->block_stmt_data.body = linked_list_create_with_custom_allocator(void*, allocator, arena_alloc);
+		for(u32 i = 0; i < sn->numchildren; ++i)
+			linked_list_prepend(n->block_stmt_data.body, read_child(d, i));
+		break;
+	case AST_FUNCTION_DECL:
+		n->func_decl_data.id = read_child(d, 0);
+		n->func_decl_data.return_data_type = read_child(d, 1);
+		n->func_decl_data.body = read_child(d, 2);
+		n->func_decl_data.numparms = read_count(d, sn->values[0], COUNT_OF(n->func_decl_data.parameters));
+		n->func_decl_data.numdeclarations = read_count(d, sn->values[1], COUNT_OF(n->func_decl_data.declarations));
+		n->func_decl_data.variadic = sn->values[2] & 1;
+		n->func_decl_data.inline_hint = (sn->values[2] >> 1) & 1;
+		for(int i = 0; i < n->func_decl_data.numparms; ++i)
+			n->func_decl_data.parameters[i] = read_child(d, 3 + i);
+		for(int i = 0; i < n->func_decl_data.numdeclarations; ++i)
+			n->func_decl_data.declarations[i] = read_child(d, 3 + n->func_decl_data.numparms + i);
+		n->func_decl_data.body_deferred = 0;
+		n->func_decl_data.referenced = 0;
+		n->func_decl_data.next_deferred = NULL;
+		break;
+	case AST_VARIABLE_DECL:
+		n->variable_decl_data.id = read_child(d, 0);
+		n->variable_decl_data.data_type = read_child(d, 1);
+		n->variable_decl_data.initializer_value = read_child(d, 2);
+		break;
+	case AST_IDENTIFIER:
+		read_string(d, n->identifier_data.name, sizeof(n->identifier_data.name));
+		break;
+	case AST_LITERAL:
+		n->literal_data.type = sn->values[0];
+		switch(n->literal_data.type)
+		{
+		case LITERAL_INTEGER:
+			memcpy(&n->literal_data.integer.value, sn->literal, sizeof(i64));
+			n->literal_data.integer.is_unsigned = sn->values[1];
+			n->literal_data.integer.suffix = sn->values[2];
+			break;
+		case LITERAL_NUMBER:
+			memcpy(&n->literal_data.scalar.value, sn->literal, sizeof(long double) < sizeof(sn->literal) ? sizeof(long double) : sizeof(sn->literal));
+			n->literal_data.scalar.suffix = sn->values[1];
+			break;
+		case LITERAL_STRING:
+			read_string(d, n->literal_data.string, sizeof(n->literal_data.string));
+			break;
+		default:
+			d->invalid = true;
+			break;
+		}
+		break;
+	case AST_UNARY_EXPR:
+		n->unary_expr_data.argument = read_child(d, 0);
+		n->unary_expr_data.operator = sn->values[0];
+		n->unary_expr_data.prefix = sn->values[1];
+		break;
+	case AST_BIN_EXPR:
+		n->bin_expr_data.lhs = read_child(d, 0);
+		n->bin_expr_data.rhs = read_child(d, 1);
+		n->bin_expr_data.operator = sn->values[0];
+		break;
+	case AST_ASSIGNMENT_EXPR:
+		n->assignment_expr_data.lhs = read_child(d, 0);
+		n->assignment_expr_data.rhs = read_child(d, 1);
+		n->assignment_expr_data.operator = sn->values[0];
+		break;
+	case AST_TERNARY_EXPR:
+		n->ternary_expr_data.condition = read_child(d, 0);
+		n->ternary_expr_data.consequent = read_child(d, 1);
+		n->ternary_expr_data.alternative = read_child(d, 2);
+		break;
+	case AST_EXPR_STMT:
+		n->expr_stmt_data.expr = read_child(d, 0);
+		break;
+	case AST_FUNCTION_CALL_EXPR:
+		n->call_expr_data.callee = read_child(d, 0);
+		n->call_expr_data.numargs = read_count(d, (int)sn->numchildren - 1, COUNT_OF(n->call_expr_data.arguments));
+		for(int i = 0; i < n->call_expr_data.numargs; ++i)
+			n->call_expr_data.arguments[i] = read_child(d, 1 + i);
+		break;
+	case AST_IF_STMT:
+		n->if_stmt_data.test = read_child(d, 0);
+		n->if_stmt_data.consequent = read_child(d, 1);
+		n->if_stmt_data.alternative = read_child(d, 2);
+		break;
+	case AST_FOR_STMT:
+		n->for_stmt_data.init = read_child(d, 0);
+		n->for_stmt_data.test = read_child(d, 1);
+		n->for_stmt_data.update = read_child(d, 2);
+		n->for_stmt_data.body = read_child(d, 3);
+		break;
+	case AST_WHILE_STMT:
+		n->while_stmt_data.test = read_child(d, 0);
+		n->while_stmt_data.body = read_child(d, 1);
+		break;
+	case AST_DO_WHILE_STMT:
+		n->do_while_stmt_data.test = read_child(d, 0);
+		n->do_while_stmt_data.body = read_child(d, 1);
+		break;
+	case AST_RETURN_STMT:
+		n->return_stmt_data.argument = read_child(d, 0);
+		break;
+	case AST_MEMBER_EXPR:
+	case AST_STRUCT_MEMBER_EXPR:
+		n->member_expr_data.object = read_child(d, 0);
+		n->member_expr_data.property = read_child(d, 1);
+		n->member_expr_data.computed = sn->values[0];
+		n->member_expr_data.as_pointer = sn->values[1];
+		break;
+	case AST_PRIMITIVE:
+		n->primitive_data.primitive_type = sn->values[0];
+		n->primitive_data.qualifiers = sn->values[1];
+		break;
+	case AST_POINTER_DATA_TYPE:
+	case AST_ARRAY_DATA_TYPE:
+	case AST_DATA_TYPE:
+	case AST_STRUCT_DATA_TYPE:
+		n->data_type_data.data_type = read_child(d, 0);
+		n->data_type_data.qualifiers = sn->values[0];
+		n->data_type_data.array_size = sn->values[1];
+		break;
+	case AST_STRUCT_DECL:
+	case AST_UNION_DECL:
+		read_string(d, n->struct_decl_data.name, sizeof(n->struct_decl_data.name));
+		n->struct_decl_data.numfields = read_count(d, sn->numchildren, COUNT_OF(n->struct_decl_data.fields));
+		for(int i = 0; i < n->struct_decl_data.numfields; ++i)
+			n->struct_decl_data.fields[i] = read_child(d, i);
+		break;
+	case AST_SIZEOF:
+		n->sizeof_data.subject = read_child(d, 0);
+		break;
+	case AST_EMIT:
+		n->emit_data.opcode = sn->values[0];
+		break;
+	case AST_SEQ_EXPR:
+		n->seq_expr_data.numexpr = read_count(d, sn->numchildren, COUNT_OF(n->seq_expr_data.expr));
+		for(int i = 0; i < n->seq_expr_data.numexpr; ++i)
+			n->seq_expr_data.expr[i] = read_child(d, i);
+		break;
+	case AST_CAST:
+		n->cast_data.type = read_child(d, 0);
+		n->cast_data.expr = read_child(d, 1);
+		break;
+	case AST_TYPEDEF:
+		read_string(d, n->typedef_data.name, sizeof(n->typedef_data.name));
+		n->typedef_data.type = read_child(d, 0);
+		break;
+	case AST_ENUM:
+		read_string(d, n->enum_data.name, sizeof(n->enum_data.name));
+		n->enum_data.numvalues = read_count(d, sn->numchildren, COUNT_OF(n->enum_data.values));
+		for(int i = 0; i < n->enum_data.numvalues; ++i)
+			n->enum_data.values[i] = read_child(d, i);
+		break;
+	case AST_ENUM_VALUE:
+		read_string(d, n->enum_value_data.ident, sizeof(n->enum_value_data.ident));
+		n->enum_value_data.value = sn->values[0];
+		break;
+	case AST_BREAK_STMT:
+	case AST_EMPTY:
+	case AST_EXIT:
+		break;
+	default:
+		d->invalid = true;
+		break;
+	}
+}
+
+ast_node_t *ast_deserialize(ast_serialized_t *s, arena_t *allocator)
+{
+	u32 numnodes = s->header->numnodes;
+	ast_node_t *nodes = (ast_node_t*)arena_alloc(allocator, sizeof(ast_node_t) * numnodes);
+	if(!nodes)
+		return NULL;
+	memset(nodes, 0, sizeof(ast_node_t) * numnodes);
+
+	deserializer_t d = { .s = s, .nodes = nodes, .invalid = false };
+	for(u32 i = 0; i < numnodes && !d.invalid; ++i)
+	{
+		d.sn = &s->nodes[i];
+		read_node(&d, &nodes[i], allocator);
+	}
+	if(d.invalid)
+	{
+		printf("invalid serialized ast node %d\n", (int)(d.sn - s->nodes));
+		return NULL;
+	}
+	return &nodes[s->header->root];
+}
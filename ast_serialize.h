@@ -0,0 +1,90 @@
+#ifndef AST_SERIALIZE_H
+#define AST_SERIALIZE_H
+#include "ast.h"
+#include "types.h"
+#include "arena.h"
+#include "rhd/heap_string.h"
+
+#define AST_SERIALIZED_MAGIC (0x5453414f) // "OAST"
+#define AST_SERIALIZED_VERSION (1)
+#define AST_SERIALIZED_NONE (0xffffffff)
+
+// layout of a serialized tree, everything is in native byte order
+// [header] [nodes] [children] [strings]
+// all offsets are from the start of the file and nodes refer to eachother by index,
+// so the file can be mapped and read in place without fixing up any pointers
+
+typedef struct
+{
+	u32 magic;
+	u32 version;
+	u32 size; // size of the whole file
+	u32 root; // index of the root node
+	u32 numnodes;
+	u32 nodes_offset;
+	u32 numchildren;
+	u32 children_offset;
+	u32 strings_size;
+	u32 strings_offset;
+} ast_serialized_header_t;
+
+typedef struct
+{
+	i32 type;
+	u32 parent; // AST_SERIALIZED_NONE if the parent isn't part of the tree
+	i32 start, end;
+	i32 rvalue;
+	i32 scope_id;
+	u32 children; // index of the first child in the children table, the order of the children depends on the type
+	u32 numchildren;
+	u32 string; // offset in the string table for names, AST_SERIALIZED_NONE if there's no string
+	i32 values[3]; // type specific fields e.g operator, qualifiers, counts
+	u32 literal[4]; // raw bytes of a integer or scalar literal
+} ast_serialized_node_t;
+
+typedef struct
+{
+	const u8 *data;
+	size_t size;
+	int mapped; // whether the data needs to be unmapped or freed
+	const ast_serialized_header_t *header;
+	const ast_serialized_node_t *nodes;
+	const u32 *children;
+	const char *strings;
+} ast_serialized_t;
+
+// strings are interned and nodes that are shared (e.g type definitions) are only written once
+// deferred function bodies are written as prototypes, parse them first if they're needed
+bool ast_serialize(ast_node_t *root, arena_t *allocator, heap_string *out);
+bool ast_serialize_to_file(ast_node_t *root, arena_t *allocator, const char *path);
+
+// validates the header and sections, the data isn't copied and has to stay around while in use
+bool ast_serialized_open(ast_serialized_t *s, const void *data, size_t size);
+bool ast_serialized_map_file(ast_serialized_t *s, const char *path);
+void ast_serialized_unmap(ast_serialized_t *s);
+
+// rebuilds the ast_node_t tree from the serialized data, returns the root node or NULL if the data is invalid
+ast_node_t *ast_deserialize(ast_serialized_t *s, arena_t *allocator);
+
+static const ast_serialized_node_t *ast_serialized_node(ast_serialized_t *s, u32 index)
+{
+	if(index >= s->header->numnodes)
+		return NULL;
+	return &s->nodes[index];
+}
+
+static u32 ast_serialized_child(ast_serialized_t *s, const ast_serialized_node_t *n, u32 i)
+{
+	if(i >= n->numchildren)
+		return AST_SERIALIZED_NONE;
+	return s->children[n->children + i];
+}
+
+static const char *ast_serialized_string(ast_serialized_t *s, u32 offset)
+{
+	if(offset >= s->header->strings_size)
+		return NULL;
+	return s->strings + offset;
+}
+
+#endif
@@ -0,0 +1,356 @@
+#include "cfg.h"
+#include "std.h"
+#include <stdio.h>
+
+static bool starts_block(vinstr_t *instr)
+{
+	return !instr->prev || instr->opcode == VOP_LABEL || vopcode_ends_block(instr->prev->opcode);
+}
+
+static void add_edge(basic_block_t *from, basic_block_t *to)
+{
+	from->succ[from->numsucc++] = to;
+	++to->numpred;
+}
+
+static bool compute_reverse_postorder(cfg_t *cfg)
+{
+	basic_block_t **stack = (basic_block_t **)arena_alloc(cfg->allocator, sizeof(basic_block_t *) * cfg->numblocks);
+	size_t *nextsucc = (size_t *)arena_alloc(cfg->allocator, sizeof(size_t) * cfg->numblocks);
+	cfg->rpo = (basic_block_t **)arena_alloc(cfg->allocator, sizeof(basic_block_t *) * cfg->numblocks);
+	if (!stack || !nextsucc || !cfg->rpo)
+		return false;
+	for (size_t i = 0; i < cfg->numblocks; ++i)
+	{
+		cfg->blocks[i].rpo = -1;
+		nextsucc[i] = 0;
+	}
+
+	// postorder is filled in from the back so it ends up reversed
+	size_t n = cfg->numblocks;
+	size_t sp = 0;
+	stack[sp++] = &cfg->blocks[0];
+	cfg->blocks[0].rpo = 0; // visited
+	while (sp > 0)
+	{
+		basic_block_t *b = stack[sp - 1];
+		if (nextsucc[b->index] < b->numsucc)
+		{
+			basic_block_t *s = b->succ[nextsucc[b->index]++];
+			if (s->rpo == -1)
+			{
+				s->rpo = 0;
+				stack[sp++] = s;
+			}
+			continue;
+		}
+		cfg->rpo[--n] = b;
+		--sp;
+	}
+
+	// move the reachable blocks to the start
+	cfg->numrpo = cfg->numblocks - n;
+	memmove(cfg->rpo, &cfg->rpo[n], sizeof(basic_block_t *) * cfg->numrpo);
+	for (size_t i = 0; i < cfg->numrpo; ++i)
+		cfg->rpo[i]->rpo = i;
+	return true;
+}
+
+static basic_block_t *intersect(basic_block_t *a, basic_block_t *b)
+{
+	while (a != b)
+	{
+		while (a->rpo > b->rpo)
+			a = a->idom;
+		while (b->rpo > a->rpo)
+			b = b->idom;
+	}
+	return a;
+}
+
+// A Simple, Fast Dominance Algorithm, Cooper, Harvey and Kennedy
+static bool compute_dominators(cfg_t *cfg)
+{
+	if (!compute_reverse_postorder(cfg))
+		return false;
+
+	basic_block_t *entry = cfg->rpo[0];
+	entry->idom = entry;
+	bool changed = true;
+	while (changed)
+	{
+		changed = false;
+		for (size_t i = 1; i < cfg->numrpo; ++i)
+		{
+			basic_block_t *b = cfg->rpo[i];
+			basic_block_t *idom = NULL;
+			for (size_t j = 0; j < b->numpred; ++j)
+			{
+				basic_block_t *p = b->pred[j];
+				if (!p->idom)
+					continue;
+				idom = idom ? intersect(p, idom) : p;
+			}
+			if (idom != b->idom)
+			{
+				b->idom = idom;
+				changed = true;
+			}
+		}
+	}
+	entry->idom = NULL;
+
+	for (size_t i = 1; i < cfg->numrpo; ++i)
+		++cfg->rpo[i]->idom->numdomchildren;
+	for (size_t i = 0; i < cfg->numrpo; ++i)
+	{
+		basic_block_t *b = cfg->rpo[i];
+		b->dom_children = (basic_block_t **)arena_alloc(cfg->allocator, sizeof(basic_block_t *) * (b->numdomchildren ? b->numdomchildren : 1));
+		if (!b->dom_children)
+			return false;
+		b->numdomchildren = 0;
+	}
+	for (size_t i = 1; i < cfg->numrpo; ++i)
+	{
+		basic_block_t *b = cfg->rpo[i];
+		b->idom->dom_children[b->idom->numdomchildren++] = b;
+	}
+
+	// number the dominator tree so dominance can be checked without walking it
+	basic_block_t **stack = (basic_block_t **)arena_alloc(cfg->allocator, sizeof(basic_block_t *) * cfg->numrpo);
+	size_t *nextchild = (size_t *)arena_alloc(cfg->allocator, sizeof(size_t) * cfg->numblocks);
+	if (!stack || !nextchild)
+		return false;
+	memset(nextchild, 0, sizeof(size_t) * cfg->numblocks);
+	size_t counter = 0;
+	size_t sp = 0;
+	stack[sp++] = entry;
+	entry->dom_pre = counter++;
+	while (sp > 0)
+	{
+		basic_block_t *b = stack[sp - 1];
+		if (nextchild[b->index] < b->numdomchildren)
+		{
+			basic_block_t *c = b->dom_children[nextchild[b->index]++];
+			c->dom_pre = counter++;
+			stack[sp++] = c;
+			continue;
+		}
+		b->dom_post = counter++;
+		--sp;
+	}
+	return true;
+}
+
+static cfg_loop_t *outermost_loop(cfg_loop_t *loop)
+{
+	while (loop->parent)
+		loop = loop->parent;
+	return loop;
+}
+
+// headers are visited in reverse postorder from the back, so a nested loop is always found before the loop around it
+static bool compute_loops(cfg_t *cfg)
+{
+	cfg->loops = (cfg_loop_t *)arena_alloc(cfg->allocator, sizeof(cfg_loop_t) * (cfg->numblocks ? cfg->numblocks : 1));
+	// every block is expanded once per loop, so the worklist never holds more than all the edges
+	size_t maxwork = cfg->numblocks * 2 + 1;
+	basic_block_t **worklist = (basic_block_t **)arena_alloc(cfg->allocator, sizeof(basic_block_t *) * maxwork);
+	if (!cfg->loops || !worklist)
+		return false;
+
+	for (size_t i = cfg->numrpo; i-- > 0;)
+	{
+		basic_block_t *header = cfg->rpo[i];
+		cfg_loop_t *loop = NULL;
+		size_t numwork = 0;
+		for (size_t j = 0; j < header->numpred; ++j)
+		{
+			basic_block_t *latch = header->pred[j];
+			if (!cfg_dominates(header, latch))
+				continue;
+			if (!loop)
+			{
+				loop = &cfg->loops[cfg->numloops++];
+				memset(loop, 0, sizeof(cfg_loop_t));
+				loop->header = header;
+				header->loop = loop;
+			}
+			if (latch != header)
+				worklist[numwork++] = latch;
+		}
+
+		// walk backwards from the latches, an inner loop is skipped over by continuing at its header
+		while (numwork > 0)
+		{
+			basic_block_t *b = worklist[--numwork];
+			basic_block_t *next = b;
+			if (!b->loop)
+			{
+				b->loop = loop;
+			}
+			else
+			{
+				cfg_loop_t *inner = outermost_loop(b->loop);
+				if (inner == loop)
+					continue;
+				inner->parent = loop;
+				next = inner->header;
+			}
+			for (size_t j = 0; j < next->numpred; ++j)
+			{
+				basic_block_t *p = next->pred[j];
+				if (p->rpo == -1 || p == header)
+					continue;
+				if (p->loop && outermost_loop(p->loop) == loop)
+					continue;
+				if (numwork >= maxwork)
+					return false;
+				worklist[numwork++] = p;
+			}
+		}
+	}
+
+	for (size_t i = cfg->numloops; i-- > 0;)
+	{
+		cfg_loop_t *loop = &cfg->loops[i];
+		loop->depth = loop->parent ? loop->parent->depth + 1 : 1;
+	}
+
+	for (size_t i = 0; i < cfg->numrpo; ++i)
+	{
+		basic_block_t *b = cfg->rpo[i];
+		b->loop_depth = b->loop ? b->loop->depth : 0;
+		for (cfg_loop_t *l = b->loop; l; l = l->parent)
+			++l->numblocks;
+	}
+	for (size_t i = 0; i < cfg->numloops; ++i)
+	{
+		cfg_loop_t *loop = &cfg->loops[i];
+		loop->blocks = (basic_block_t **)arena_alloc(cfg->allocator, sizeof(basic_block_t *) * loop->numblocks);
+		if (!loop->blocks)
+			return false;
+		loop->numblocks = 0;
+	}
+	for (size_t i = 0; i < cfg->numrpo; ++i)
+	{
+		basic_block_t *b = cfg->rpo[i];
+		for (cfg_loop_t *l = b->loop; l; l = l->parent)
+			l->blocks[l->numblocks++] = b;
+	}
+	return true;
+}
+
+bool cfg_build(cfg_t *cfg, function_t *f, arena_t *allocator)
+{
+	memset(cfg, 0, sizeof(cfg_t));
+	cfg->function = f;
+	cfg->allocator = allocator;
+	cfg->numids = f->instructions.nextid;
+
+	if (!f->instructions.head)
+		return true;
+
+	// only map the range of labels used by this function
+	size_t minlabel = (size_t)-1, maxlabel = 0;
+	vinstr_list_foreach(&f->instructions, instr)
+	{
+		if (starts_block(instr))
+			++cfg->numblocks;
+		if (instr->opcode != VOP_LABEL)
+			continue;
+		if (instr->operands[0].label < minlabel)
+			minlabel = instr->operands[0].label;
+		if (instr->operands[0].label > maxlabel)
+			maxlabel = instr->operands[0].label;
+	}
+	size_t numlabels = minlabel <= maxlabel ? maxlabel - minlabel + 1 : 0;
+
+	cfg->blocks = (basic_block_t *)arena_alloc(allocator, sizeof(basic_block_t) * cfg->numblocks);
+	cfg->positions = (size_t *)arena_alloc(allocator, sizeof(size_t) * cfg->numids);
+	cfg->instruction_blocks = (basic_block_t **)arena_alloc(allocator, sizeof(basic_block_t *) * cfg->numids);
+	basic_block_t **label_blocks = (basic_block_t **)arena_alloc(allocator, sizeof(basic_block_t *) * numlabels);
+	if (!cfg->blocks || !cfg->positions || !cfg->instruction_blocks || (numlabels && !label_blocks))
+		return false;
+	cfg->label_blocks = label_blocks;
+	cfg->minlabel = minlabel;
+	cfg->numlabels = numlabels;
+	memset(cfg->blocks, 0, sizeof(basic_block_t) * cfg->numblocks);
+	memset(label_blocks, 0, sizeof(basic_block_t *) * numlabels);
+
+	size_t position = 0;
+	basic_block_t *bb = NULL;
+	vinstr_list_foreach(&f->instructions, instr)
+	{
+		if (starts_block(instr))
+		{
+			bb = bb ? bb + 1 : cfg->blocks;
+			bb->index = bb - cfg->blocks;
+			bb->first = instr;
+			bb->start = position;
+		}
+		bb->last = instr;
+		bb->end = position;
+		cfg->positions[instr->id] = position++;
+		cfg->instruction_blocks[instr->id] = bb;
+		if (instr->opcode == VOP_LABEL)
+			label_blocks[instr->operands[0].label - minlabel] = bb;
+	}
+
+	for (size_t i = 0; i < cfg->numblocks; ++i)
+	{
+		basic_block_t *b = &cfg->blocks[i];
+		basic_block_t *next = i + 1 < cfg->numblocks ? &cfg->blocks[i + 1] : NULL;
+		vinstr_t *last = b->last;
+		if (vopcode_is_jump(last->opcode))
+		{
+			size_t label = last->operands[0].label;
+			if (last->numoperands < 1 || last->operands[0].type != VOPERAND_LABEL || label < minlabel ||
+				label > maxlabel || !label_blocks[label - minlabel])
+			{
+				printf("jump to unknown label in function '%s'\n", f->name);
+				return false;
+			}
+			add_edge(b, label_blocks[label - minlabel]);
+			if (vopcode_is_conditional_jump(last->opcode) && next)
+				add_edge(b, next);
+		}
+		else if (!vopcode_ends_block(last->opcode) && next)
+		{
+			add_edge(b, next);
+		}
+	}
+
+	for (size_t i = 0; i < cfg->numblocks; ++i)
+	{
+		basic_block_t *b = &cfg->blocks[i];
+		b->pred = (basic_block_t **)arena_alloc(allocator, sizeof(basic_block_t *) * (b->numpred ? b->numpred : 1));
+		if (!b->pred)
+			return false;
+		b->numpred = 0;
+	}
+	for (size_t i = 0; i < cfg->numblocks; ++i)
+	{
+		basic_block_t *b = &cfg->blocks[i];
+		for (size_t j = 0; j < b->numsucc; ++j)
+			b->succ[j]->pred[b->succ[j]->numpred++] = b;
+	}
+
+	return compute_dominators(cfg) && compute_loops(cfg);
+}
+
+void cfg_print(cfg_t *cfg)
+{
+	for (size_t i = 0; i < cfg->numblocks; ++i)
+	{
+		basic_block_t *b = &cfg->blocks[i];
+		printf("bb%zu [%zu-%zu] idom=%d loop=%d depth=%d pred:", b->index, b->start, b->end, b->idom ? (int)b->idom->index : -1,
+			   b->loop ? (int)b->loop->header->index : -1, b->loop_depth);
+		for (size_t j = 0; j < b->numpred; ++j)
+			printf(" bb%zu", b->pred[j]->index);
+		printf(" succ:");
+		for (size_t j = 0; j < b->numsucc; ++j)
+			printf(" bb%zu", b->succ[j]->index);
+		printf("\n");
+	}
+}
@@ -0,0 +1,105 @@
+#ifndef CFG_H
+#define CFG_H
+#include "compile.h"
+#include "instruction.h"
+#include "arena.h"
+
+struct cfg_loop_s;
+
+// a block starts at a VOP_LABEL or after a jump and ends at the next jump, return or label
+typedef struct basic_block_s
+{
+	size_t index; // blocks are numbered in the order they appear in the instruction list
+	vinstr_t *first, *last;
+	size_t start, end; // positions of first and last
+
+	// a conditional jump has the jump target as first successor and the next block as second
+	struct basic_block_s *succ[2];
+	size_t numsucc;
+	struct basic_block_s **pred;
+	size_t numpred;
+
+	// unreachable blocks have no immediate dominator and a rpo of -1
+	int rpo; // index in reverse postorder
+	struct basic_block_s *idom;
+	struct basic_block_s **dom_children;
+	size_t numdomchildren;
+	size_t dom_pre, dom_post; // numbering of the dominator tree, a dominates b if it encloses b's numbers
+
+	struct cfg_loop_s *loop; // innermost loop the block is in
+	int loop_depth; // amount of loops the block is in
+} basic_block_t;
+
+// natural loop, the blocks that can reach a backedge to the header without going through the header
+typedef struct cfg_loop_s
+{
+	basic_block_t *header;
+	struct cfg_loop_s *parent;
+	int depth; // 1 for outermost loops
+	basic_block_t **blocks; // including the blocks of nested loops
+	size_t numblocks;
+} cfg_loop_t;
+
+typedef struct
+{
+	function_t *function;
+	arena_t *allocator;
+
+	basic_block_t *blocks;
+	size_t numblocks;
+
+	basic_block_t **rpo; // reachable blocks in reverse postorder, starting with the entry
+	size_t numrpo;
+
+	cfg_loop_t *loops; // inner loops come before the loops containing them
+	size_t numloops;
+
+	// indexed by vinstr_t.id, the position is the index of the instruction in the list
+	size_t *positions;
+	basic_block_t **instruction_blocks;
+	size_t numids;
+
+	basic_block_t **label_blocks; // block starting with each label, from minlabel
+	size_t minlabel, numlabels;
+} cfg_t;
+
+// everything is allocated from allocator, the cfg has to be rebuilt after instructions are added or removed
+bool cfg_build(cfg_t *cfg, function_t *f, arena_t *allocator);
+void cfg_print(cfg_t *cfg);
+
+// whether every path from the entry to b goes through a
+static bool cfg_dominates(basic_block_t *a, basic_block_t *b)
+{
+	if (a->rpo == -1 || b->rpo == -1)
+		return false;
+	return a->dom_pre <= b->dom_pre && b->dom_post <= a->dom_post;
+}
+
+static bool cfg_loop_contains(cfg_loop_t *loop, basic_block_t *bb)
+{
+	for (cfg_loop_t *l = bb->loop; l; l = l->parent)
+	{
+		if (l == loop)
+			return true;
+	}
+	return false;
+}
+
+static size_t cfg_position(cfg_t *cfg, vinstr_t *instr)
+{
+	return cfg->positions[instr->id];
+}
+
+static basic_block_t *cfg_block(cfg_t *cfg, vinstr_t *instr)
+{
+	return cfg->instruction_blocks[instr->id];
+}
+
+static basic_block_t *cfg_label_block(cfg_t *cfg, size_t label)
+{
+	if (label < cfg->minlabel || label - cfg->minlabel >= cfg->numlabels)
+		return NULL;
+	return cfg->label_blocks[label - cfg->minlabel];
+}
+
+#endif
@@ -12,12 +12,34 @@
 #include "types.h"
 #include "virtual_opcodes.h"
 #include "register.h"
+#include "regalloc.h"
+#include "optimize.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
 //gcc -w -g test.c compile.c ast.c lex.c parse.c && ./a.out
 
 bool rvalue(compiler_t* ctx, ast_node_t* n, voperand_t* dst);
 bool compile_visit_node(compiler_t* ctx, ast_node_t* n);
 
+#define compiler_assert(ctx, expr, ...) \
+    compiler_assert_r(ctx, (intptr_t)expr, #expr, ## __VA_ARGS__)
+	
+static void compiler_assert_r(compiler_t *ctx, int expr, const char *expr_str, const char *fmt, ...)
+{
+    if(expr)
+        return;
+
+	char buffer[512] = { 0 };
+	va_list va;
+	va_start( va, fmt );
+	vsnprintf( buffer, sizeof( buffer ), fmt, va );
+	debug_printf( "compiler assert failed: '%s' %s\n", expr_str, buffer );
+	va_end( va );
+
+	longjmp(ctx->jmp, 1);
+}
+
 static size_t get_label(compiler_t *ctx)
 {
 	return ctx->labelindex++;
@@ -37,23 +59,32 @@ typedef enum
 
 static void register_name(voperand_t op, vregister_t reg, char* buf, size_t maxlen)
 {
-	if ((op.size == VOPERAND_SIZE_DOUBLE || op.size == VOPERAND_SIZE_FLOAT) && op.type == VOPERAND_REGISTER)
+	bool floating_point = (op.size == VOPERAND_SIZE_DOUBLE || op.size == VOPERAND_SIZE_FLOAT) && op.type == VOPERAND_REGISTER;
+
+	// after register allocation the index is the x64 register encoding
+	if (!op.virtual)
 	{
-		snprintf(buf, maxlen, "st%d", reg.index);
+		static const char* regnames64[] = {"rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+										   "r8",  "r9",  "r10", "r11", "r12", "r13", "r14", "r15"};
+		static const char* regnames32[] = {"eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi",
+										   "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d"};
+		if (floating_point)
+			snprintf(buf, maxlen, "xmm%d", reg.index);
+		else if (op.type == VOPERAND_REGISTER && op.size == VOPERAND_SIZE_32_BITS)
+			snprintf(buf, maxlen, "%s", regnames32[reg.index]);
+		else
+			snprintf(buf, maxlen, "%s", regnames64[reg.index]);
 		return;
 	}
 
-	//NOTE: actual order is eax, ecx, edx...
-	//but gcc uses edx for some reason over ecx, so i swapped edx and ecx here
-	static const char* x86_regnames[] = {"eax", "edx", "ecx", "ebx", "esp", "ebp", "esi", "edi", NULL};
-	static const char* fakeregnames[] = {"sp", "bp", "ip", "return_value"};
-
-	if (!op.virtual)
+	if (floating_point)
 	{
-		snprintf(buf, maxlen, "%s", x86_regnames[reg.index]);
+		snprintf(buf, maxlen, "st%d", reg.index);
 		return;
 	}
 
+	static const char* fakeregnames[] = {"sp", "bp", "ip", "return_value"};
+
 	if (reg.index < COUNT_OF(fakeregnames))
 		snprintf(buf, maxlen, "%s", fakeregnames[reg.index]);
 	else
@@ -82,6 +113,15 @@ static const char* operand_to_string(voperand_t op)
 						 -op.reg_indirect_displacement.disp);
 			}
 			break;
+		case VOPERAND_INDIRECT_REGISTER_INDEXED:
+		{
+			char indexname[32];
+			register_name(op, op.reg_indirect_indexed.reg, regname, sizeof(regname));
+			register_name(op, op.reg_indirect_indexed.indexed_reg, indexname, sizeof(indexname));
+			snprintf(buf, 128, "%s [%s + %s * %d]", voperand_size_names[op.size], regname, indexname,
+					 op.reg_indirect_indexed.scale);
+		}
+		break;
 		case VOPERAND_LABEL:
 			snprintf(buf, 128, "<sub_%d>", op.label);
 			break;
@@ -95,7 +135,7 @@ static const char* operand_to_string(voperand_t op)
 			break;
 		case VOPERAND_IMMEDIATE:
 			if (op.size == VOPERAND_SIZE_32_BITS)
-				snprintf(buf, 128, "%d", op.imm.dw);
+				snprintf(buf, 128, "%d", op.imm.dd);
 			else if(op.size == VOPERAND_SIZE_DOUBLE)
 			{
 				double as_dbl;
@@ -148,12 +188,12 @@ int add_indexed_data(compiler_t *ctx, const void *buffer, size_t len)
 
 static vinstr_t *emit_instruction(compiler_t* ctx, vopcode_t op)
 {
-	vinstr_t* instr = &ctx->function->instructions[ctx->function->instruction_index++];
-	/* instr->index = ctx->function->instruction_index - 1; */
+	vinstr_t* instr = vinstr_list_append(&ctx->function->instructions);
+	compiler_assert(ctx, instr, "out of memory for instructions in function '%s'", ctx->function->name);
 	instr->opcode = op;
 	instr->numoperands = 0;
 	for (size_t i = 0; i < COUNT_OF(instr->operands); ++i)
-		instr->operands[0] = invalid_operand();
+		instr->operands[i] = invalid_operand();
 	return instr;
 }
 
@@ -170,38 +210,12 @@ static vinstr_t* emit_instruction1(compiler_t* ctx, vopcode_t opcode, voperand_t
 	return instr;
 }
 
-static vopcache_t *find_vopcache_by_key(compiler_t *ctx, voperand_t *key)
-{
-	for(size_t i = 0; i < ctx->function->vopcacheindex; ++i)
-	{
-		if(voperand_type_equal(&ctx->function->vopcache[i].key, key))
-		{
-			return &ctx->function->vopcache[i];
-		}
-	}
-	return NULL;
-}
-
 static vinstr_t* emit_instruction2(compiler_t* ctx, vopcode_t opcode, voperand_t a, voperand_t b)
 {
 	vinstr_t* instr = emit_instruction(ctx, opcode);
 	set_operand(instr, 0, a);
 	set_operand(instr, 1, b);
 	instr->numoperands = 2;
-	/* if (vopcode_overwrites_first_operand(opcode)) */
-	/* if(opcode == VOP_STORE) */
-	/* { */
-	/* 	//when using store save the indirect operand and set it as key and overwrite the value with a immediate value or register */
-	/* 	assert(ctx->function); */
-	/* 	vopcache_t *fnd = find_vopcache_by_key(ctx, &a); */
-	/* 	if(!fnd) */
-	/* 	{ */
-	/* 		fnd = &ctx->function->vopcache[ctx->function->vopcacheindex]; */
-	/* 		ctx->function->vopcacheindex = (ctx->function->vopcacheindex + 1) % VOPCACHE_MAX; */
-	/* 	} */
-	/* 	fnd->key = a; */
-	/* 	fnd->value = b; */
-	/* } */
 	return instr;
 }
 
@@ -218,17 +232,18 @@ static vinstr_t* emit_instruction3(compiler_t* ctx, vopcode_t opcode, voperand_t
 function_t *compiler_alloc_function(compiler_t *ctx, const char *name)
 {
 	function_t gv;
-	gv.vopcacheindex = 0;
 	gv.index = ctx->numfunctions++;
 	/* gv.numreturns = 0; */
 	snprintf(gv.name, sizeof(gv.name), "%s", name);
 	gv.localvariablesize = 0;
+	gv.saved_registers = 0;
+	gv.numparameters = 0;
+	gv.inline_hint = false;
 	//TODO: free/cleanup variables
 	gv.variables = hash_map_create_with_custom_allocator(variable_t, ctx->allocator, arena_alloc);
 	gv.arguments = hash_map_create_with_custom_allocator(variable_t, ctx->allocator, arena_alloc);
 	gv.bytecode = NULL;
-	gv.instructions = arena_alloc(ctx->allocator, sizeof(vinstr_t) * FUNCTION_MAX_INSTRUCTIONS);
-	gv.instruction_index = 0;
+	vinstr_list_init(&gv.instructions, ctx->allocator);
 	hash_map_insert(ctx->functions, name, gv);
 	
 	//TODO: FIXME make insert return a reference to the data inserted instead of having to find it again.
@@ -254,6 +269,8 @@ void compiler_init(compiler_t *c, arena_t *allocator, int numbits, compiler_flag
 	
 	c->vregindex = VREG_MAX;
 	c->labelindex = 0;
+	c->inline_budget = COMPILER_INLINE_BUDGET;
+	c->print_instructions = false;
 	
 	c->numbits = numbits;
 	c->allocator = allocator;
@@ -310,10 +327,145 @@ static variable_t *find_variable(compiler_t *ctx, const char *varname)
 	return NULL;
 }
 
+static int data_type_size(compiler_t* ctx, ast_node_t* n);
+
+static ast_struct_layout_t* struct_layout(compiler_t* ctx, ast_node_t* decl);
+
+// alignment in bits, like data_type_size
+static int data_type_alignment(compiler_t* ctx, ast_node_t* n)
+{
+	switch (n->type)
+	{
+		case AST_STRUCT_DATA_TYPE:
+		{
+			ast_node_t* ref = n->data_type_data.data_type;
+			if (ref->type != AST_STRUCT_DECL && ref->type != AST_UNION_DECL)
+				return 8;
+			return struct_layout(ctx, ref)->alignment * 8;
+		}
+		case AST_DATA_TYPE:
+		case AST_ARRAY_DATA_TYPE:
+			return data_type_alignment(ctx, n->data_type_data.data_type);
+	}
+	int size = data_type_size(ctx, n);
+	return size < 8 ? 8 : size;
+}
+
+// computes the size, alignment and field offsets of a struct or union once and stores it in the declaration
+static ast_struct_layout_t* struct_layout(compiler_t* ctx, ast_node_t* decl)
+{
+	ast_struct_decl_t* sd = &decl->struct_decl_data;
+	if (sd->layout)
+		return sd->layout;
+
+	ast_struct_layout_t* layout = (ast_struct_layout_t*)arena_alloc(ctx->allocator, sizeof(ast_struct_layout_t));
+	layout->field_indices = hash_map_create_with_custom_allocator(int, ctx->allocator, arena_alloc);
+	layout->numfields = sd->numfields;
+	layout->alignment = 1;
+
+	int is_union = decl->type == AST_UNION_DECL;
+	int offset = 0;
+	int size = 0;
+	for (int i = 0; i < sd->numfields; ++i)
+	{
+		ast_node_t* field_type = sd->fields[i]->variable_decl_data.data_type;
+		int field_size = data_type_size(ctx, field_type) / 8;
+		int field_alignment = data_type_alignment(ctx, field_type) / 8;
+
+		offset = is_union ? 0 : (offset + field_alignment - 1) / field_alignment * field_alignment;
+		layout->fields[i].field = sd->fields[i];
+		layout->fields[i].offset = offset;
+		layout->fields[i].size = field_size;
+		hash_map_insert(layout->field_indices, sd->fields[i]->variable_decl_data.id->identifier_data.name, i);
+
+		if (field_alignment > layout->alignment)
+			layout->alignment = field_alignment;
+		if (offset + field_size > size)
+			size = offset + field_size;
+		offset += field_size;
+	}
+	layout->size = (size + layout->alignment - 1) / layout->alignment * layout->alignment;
+	sd->layout = layout;
+	return layout;
+}
+
+// unwraps typedefs (and the pointer for ->) to get to the struct or union declaration
+static ast_node_t* struct_decl_from_data_type(ast_node_t* n, int as_pointer)
+{
+	while (n && n->type == AST_DATA_TYPE)
+		n = n->data_type_data.data_type;
+	if (n && as_pointer)
+	{
+		if (n->type != AST_POINTER_DATA_TYPE)
+			return NULL;
+		n = n->data_type_data.data_type;
+		while (n && n->type == AST_DATA_TYPE)
+			n = n->data_type_data.data_type;
+	}
+	if (!n || n->type != AST_STRUCT_DATA_TYPE)
+		return NULL;
+	return n->data_type_data.data_type;
+}
+
+static ast_struct_field_layout_t* struct_field(compiler_t* ctx, ast_node_t* decl, const char* name)
+{
+	ast_struct_layout_t* layout = struct_layout(ctx, decl);
+	int* index = hash_map_find(layout->field_indices, name);
+	if (!index)
+		return NULL;
+	return &layout->fields[*index];
+}
+
+// the type an array or pointer refers to, NULL for anything else
+static ast_node_t* element_data_type(ast_node_t* n)
+{
+	while (n && n->type == AST_DATA_TYPE)
+		n = n->data_type_data.data_type;
+	if (!n || (n->type != AST_ARRAY_DATA_TYPE && n->type != AST_POINTER_DATA_TYPE))
+		return NULL;
+	return n->data_type_data.data_type;
+}
+
+// the declared type of a variable or member expression
+static ast_node_t* expression_data_type(compiler_t* ctx, ast_node_t* n)
+{
+	switch (n->type)
+	{
+		case AST_MEMBER_EXPR:
+			return element_data_type(expression_data_type(ctx, n->member_expr_data.object));
+		case AST_IDENTIFIER:
+		{
+			variable_t* var = find_variable(ctx, n->identifier_data.name);
+			return var ? var->data_type_node : NULL;
+		}
+		case AST_STRUCT_MEMBER_EXPR:
+		{
+			ast_node_t* decl = struct_decl_from_data_type(expression_data_type(ctx, n->member_expr_data.object), n->member_expr_data.as_pointer);
+			if (!decl)
+				return NULL;
+			ast_struct_field_layout_t* field = struct_field(ctx, decl, n->member_expr_data.property->identifier_data.name);
+			return field ? field->field->variable_decl_data.data_type : NULL;
+		}
+		case AST_UNARY_EXPR:
+			if (n->unary_expr_data.operator == '*')
+				return element_data_type(expression_data_type(ctx, n->unary_expr_data.argument));
+			break;
+	}
+	return NULL;
+}
+
 static int data_type_size(compiler_t* ctx, ast_node_t* n)
 {
 	switch (n->type)
 	{
+		case AST_MEMBER_EXPR:
+		case AST_STRUCT_MEMBER_EXPR:
+		{
+			ast_node_t* type = expression_data_type(ctx, n);
+			assert(type);
+			return data_type_size(ctx, type);
+		}
+
 		case AST_FUNCTION_CALL_EXPR:
 		{
 			ast_node_t* callee = n->call_expr_data.callee;
@@ -336,29 +488,15 @@ static int data_type_size(compiler_t* ctx, ast_node_t* n)
 		
 		case AST_STRUCT_DATA_TYPE:
 		{
-			int total = 0;
 			ast_node_t* ref = n->data_type_data.data_type;
 			assert(ref);
-			if (ref->type == AST_UNION_DECL)
-			{
-				for (int i = 0; i < ref->struct_decl_data.numfields; ++i)
-				{
-					int tmp = data_type_size(ctx, ref->struct_decl_data.fields[i]->variable_decl_data.data_type);
-					if (tmp > total)
-						total = tmp;
-				}
-			}
-			else if (ref->type == AST_STRUCT_DECL)
-			{
-				for (int i = 0; i < ref->struct_decl_data.numfields; ++i)
-					total += data_type_size(ctx, ref->struct_decl_data.fields[i]->variable_decl_data.data_type);
-			}
-			else
+			if (ref->type != AST_STRUCT_DECL && ref->type != AST_UNION_DECL)
 			{
 				/* debug_printf("unhandled struct data type node '%s', can't get size\n", */
 				/* 			 AST_NODE_TYPE_to_string(ref->type)); */
+				return 0;
 			}
-			return total;
+			return struct_layout(ctx, ref)->size * 8;
 		}
 		break;
 		case AST_IDENTIFIER:
@@ -378,20 +516,9 @@ static int data_type_size(compiler_t* ctx, ast_node_t* n)
 		{
 			assert(n->data_type_data.array_size > 0);
 
-			if (n->data_type_data.data_type->type == AST_ARRAY_DATA_TYPE)
-				return data_type_size(ctx, n->data_type_data.data_type) * n->data_type_data.array_size;
-			else if (n->data_type_data.data_type->type == AST_PRIMITIVE)
-			{
-				// printf("array size = %d, primitive_type_size = %d\n", n->data_type_data.array_size,
-				// primitive_data_type_size(  n->data_type_data.data_type->primitive_data_type_data.primitive_type ));
-				return fundamental_type_size(ctx, n->data_type_data.data_type->primitive_data.primitive_type) *
-					   n->data_type_data.array_size;
-			}
-			else
-			{
-				perror("unhandled else for data_type_size\n");
-				return 0;
-			}
+			// printf("array size = %d, primitive_type_size = %d\n", n->data_type_data.array_size,
+			// primitive_data_type_size(  n->data_type_data.data_type->primitive_data_type_data.primitive_type ));
+			return data_type_size(ctx, n->data_type_data.data_type) * n->data_type_data.array_size;
 		}
 		break;
 	}
@@ -399,12 +526,6 @@ static int data_type_size(compiler_t* ctx, ast_node_t* n)
 	return 0;
 }
 
-static bool voperand_is_floating_point(voperand_t* o)
-{
-	return o->size == VOPERAND_SIZE_DOUBLE ||
-		   o->size == VOPERAND_SIZE_FLOAT; // || o->type == VOPERAND_REGISTER && o->reg.usage == VRU_FLOATING_POINT;
-}
-
 static void store_operand(compiler_t *ctx, voperand_t *dst, voperand_t *src)
 {
 	switch(dst->type)
@@ -448,37 +569,8 @@ static void store_operand(compiler_t *ctx, voperand_t *dst, voperand_t *src)
 	}
 }
 
-static vinstr_t *previous_instruction(compiler_t *ctx)
-{
-	assert(ctx->function);
-	if(ctx->function->instruction_index == 0)
-		return NULL;
-	return &ctx->function->instructions[ctx->function->instruction_index - 1];
-}
-
-static void try_reuse_operand(compiler_t* ctx, voperand_t* op)
-{
-	/* assert(ctx->function); */
-	/* for (size_t i = 0; i < ctx->function->vopcacheindex; ++i) */
-	/* { */
-	/* 	/\* print_instruction_operand(&ctx->function->vopcache[i].key, false); *\/ */
-	/* 	/\* printf("\t\t\t"); *\/ */
-	/* 	/\* print_instruction_operand(&ctx->function->vopcache[i].value, false); *\/ */
-	/* 	/\* printf("\t\t\t"); *\/ */
-	/* 	/\* print_instruction_operand(op, false); *\/ */
-	/* 	/\* printf("\n"); *\/ */
-	/* 	if (!memcmp(&ctx->function->vopcache[i].key, op, sizeof(voperand_t))) */
-	/* 	{ */
-	/* 		*op = ctx->function->vopcache[i].value; */
-	/* 		break; */
-	/* 	} */
-	/* } */
-}
-
 static void load_operand(compiler_t* ctx, voperand_t* dst, voperand_t* src)
 {
-	try_reuse_operand(ctx, src);
-	
 	assert(dst->type == VOPERAND_REGISTER);
 	if (dst->reg.index >= VREG_MAX)
 		dst->size = src->size;
@@ -486,7 +578,8 @@ static void load_operand(compiler_t* ctx, voperand_t* dst, voperand_t* src)
 	switch (src->type)
 	{
 		case VOPERAND_REGISTER:
-			if (dst->size != src->size && dst->reg.index != src->reg.index)
+			// a fixed register like the return value has to be written, a new vreg can just become the source
+			if (dst->reg.index < VREG_MAX && dst->reg.index != src->reg.index)
 				emit_instruction2(ctx, VOP_MOV, *dst, *src);
 			else
 				*dst = *src;
@@ -501,17 +594,6 @@ static void load_operand(compiler_t* ctx, voperand_t* dst, voperand_t* src)
 		case VOPERAND_INDIRECT_REGISTER_INDEXED:
 		case VOPERAND_INDIRECT_REGISTER:
 		{
-			//commented out should be fixed by vopcache
-			/* vinstr_t* prev = previous_instruction(ctx); */
-			/* if (prev && prev->opcode == VOP_STORE) */
-			/* { */
-			/* 	voperand_t* prevsrc = &prev->operands[1]; */
-			/* 	if(voperand_equal(prevsrc, dst)) */
-			/* 	{ */
-			/* 		*dst = prev->operands[0]; */
-			/* 		return; */
-			/* 	} */
-			/* } */
 			emit_instruction2(ctx, VOP_MOV, *dst, *src);
 			/* emit_instruction2(ctx, VOP_LOAD, *dst, *src); */
 		}
@@ -523,6 +605,20 @@ static void load_operand(compiler_t* ctx, voperand_t* dst, voperand_t* src)
 	}
 }
 
+static void set_floating_point_operand_size(voperand_t* op, ast_node_t* data_type)
+{
+	if (data_type->type != AST_PRIMITIVE)
+		return;
+	/* *dst = register_operand(get_vreg_with_usage(ctx, VRU_FLOATING_POINT)); */
+	/* emit_instruction2(ctx, VOP_SITOFP, *dst, src); */
+	if (data_type->primitive_data.primitive_type == DT_DOUBLE)
+		op->size = VOPERAND_SIZE_DOUBLE;
+	if (data_type->primitive_data.primitive_type == DT_FLOAT)
+		op->size = VOPERAND_SIZE_FLOAT;
+}
+
+bool rvalue(compiler_t* ctx, ast_node_t* n, voperand_t* dst);
+
 bool lvalue( compiler_t* ctx, ast_node_t* n, voperand_t *dst )
 {
 	switch ( n->type )
@@ -544,15 +640,7 @@ bool lvalue( compiler_t* ctx, ast_node_t* n, voperand_t *dst )
 #else
 			voperand_t src = indirect_register_displacement_operand(bpreg, var->offset, numbytes);
 #endif
-			if (variable_type->type == AST_PRIMITIVE)
-			{
-					/* *dst = register_operand(get_vreg_with_usage(ctx, VRU_FLOATING_POINT)); */
-					/* emit_instruction2(ctx, VOP_SITOFP, *dst, src); */
-					if (variable_type->primitive_data.primitive_type == DT_DOUBLE)
-						src.size = VOPERAND_SIZE_DOUBLE;
-					if (variable_type->primitive_data.primitive_type == DT_FLOAT)
-						src.size = VOPERAND_SIZE_FLOAT;
-			}
+			set_floating_point_operand_size(&src, variable_type);
 
 			// check whether we already referenced this before
 			/* for (size_t i = 0; i < ctx->function->instruction_index; ++i) */
@@ -571,6 +659,107 @@ bool lvalue( compiler_t* ctx, ast_node_t* n, voperand_t *dst )
 			*dst = src;
 		} break;
 
+		case AST_STRUCT_MEMBER_EXPR:
+		{
+			ast_node_t* object = n->member_expr_data.object;
+			ast_node_t* decl = struct_decl_from_data_type(expression_data_type(ctx, object), n->member_expr_data.as_pointer);
+			assert(decl);
+			assert(n->member_expr_data.property->type == AST_IDENTIFIER);
+			ast_struct_field_layout_t* field = struct_field(ctx, decl, n->member_expr_data.property->identifier_data.name);
+			assert(field);
+
+			voperand_t src;
+			if (n->member_expr_data.as_pointer)
+			{
+				voperand_t ptr;
+				if (!rvalue(ctx, object, &ptr))
+					return false;
+				assert(ptr.type == VOPERAND_REGISTER);
+				src = indirect_register_displacement_operand(ptr.reg, field->offset, field->size);
+			}
+			else
+			{
+				if (!lvalue(ctx, object, &src))
+					return false;
+				assert(src.type == VOPERAND_INDIRECT_REGISTER_DISPLACEMENT);
+				src.reg_indirect_displacement.disp += field->offset;
+				src.size = field->size;
+			}
+			set_floating_point_operand_size(&src, field->field->variable_decl_data.data_type);
+			*dst = src;
+		} break;
+
+		case AST_MEMBER_EXPR:
+		{
+			ast_node_t* object = n->member_expr_data.object;
+			ast_node_t* object_type = expression_data_type(ctx, object);
+			ast_node_t* element = element_data_type(object_type);
+			assert(element);
+			int elementsize = data_type_size(ctx, element) / 8;
+
+			// arrays are addressed in place, pointers are loaded first
+			voperand_t base;
+			while (object_type->type == AST_DATA_TYPE)
+				object_type = object_type->data_type_data.data_type;
+			if (object_type->type == AST_ARRAY_DATA_TYPE)
+			{
+				voperand_t array;
+				if (!lvalue(ctx, object, &array))
+					return false;
+				array.size = VOPERAND_SIZE_NATIVE;
+				base = register_operand(get_vreg(ctx));
+				emit_instruction2(ctx, VOP_LEA, base, array);
+			}
+			else if (!rvalue(ctx, object, &base))
+				return false;
+			assert(base.type == VOPERAND_REGISTER);
+
+			voperand_t index;
+			if (!rvalue(ctx, n->member_expr_data.property, &index))
+				return false;
+			voperand_t src;
+			if (index.type == VOPERAND_IMMEDIATE)
+			{
+				src = indirect_register_displacement_operand(base.reg, imm_cast_int64_t(&index.imm) * elementsize,
+															 elementsize);
+			}
+			else
+			{
+				assert(index.type == VOPERAND_REGISTER);
+				int scale = elementsize;
+				if (scale != 1 && scale != 2 && scale != 4 && scale != 8)
+				{
+					voperand_t scaled = register_operand(get_vreg(ctx));
+					load_operand(ctx, &scaled, &index);
+					emit_instruction2(ctx, VOP_MUL, scaled, imm32_operand(elementsize));
+					index = scaled;
+					scale = 1;
+				}
+				src = indirect_register_indexed_operand(base.reg, index.reg, scale, elementsize);
+			}
+			set_floating_point_operand_size(&src, element);
+			*dst = src;
+		} break;
+
+		case AST_UNARY_EXPR:
+		{
+			// only a dereference names a object, the pointer is loaded and points at it
+			if (n->unary_expr_data.operator != '*')
+			{
+				printf("unhandled unary lvalue '%c'\n", n->unary_expr_data.operator);
+				return false;
+			}
+			ast_node_t* element = expression_data_type(ctx, n);
+			assert(element);
+			voperand_t ptr;
+			if (!rvalue(ctx, n->unary_expr_data.argument, &ptr))
+				return false;
+			assert(ptr.type == VOPERAND_REGISTER);
+			voperand_t src = indirect_register_displacement_operand(ptr.reg, 0, data_type_size(ctx, element) / 8);
+			set_floating_point_operand_size(&src, element);
+			*dst = src;
+		} break;
+
 		default:
 			printf("unhandled node type %s\n", ast_node_type_t_to_string(n->type));
 			return false;
@@ -624,7 +813,7 @@ void literal(compiler_t* ctx, ast_node_t* n, voperand_t* dst)
 			else
 			{
 				//TODO: FIXME unsigned etc conversions
-				op.imm.dw = (i32)lit->integer.value;
+				op.imm.dd = (i32)lit->integer.value;
 			}
 			*dst = op;
 		}
@@ -652,11 +841,136 @@ void literal(compiler_t* ctx, ast_node_t* n, voperand_t* dst)
 static size_t instruction_index(compiler_t* ctx)
 {
 	assert(ctx->function);
-	return ctx->function->instruction_index - 1;
+	return ctx->function->instructions.count - 1;
+}
+
+static bool is_relational_operator(int operator)
+{
+	switch (operator)
+	{
+		case '>':
+		case '<':
+		case TK_LEQUAL:
+		case TK_GEQUAL:
+		case TK_EQUAL:
+		case TK_NOT_EQUAL:
+			return true;
+	}
+	return false;
+}
+
+static vopcode_t inverse_jump(vopcode_t opcode)
+{
+	switch (opcode)
+	{
+		case VOP_JZ: return VOP_JNZ;
+		case VOP_JNZ: return VOP_JZ;
+		case VOP_JG: return VOP_JLE;
+		case VOP_JLE: return VOP_JG;
+		case VOP_JL: return VOP_JGE;
+		case VOP_JGE: return VOP_JL;
+	}
+	assert(0);
+	return opcode;
+}
+
+// the jump that tests the same condition with the operands of the compare swapped
+static vopcode_t swapped_jump(vopcode_t opcode)
+{
+	switch (opcode)
+	{
+		case VOP_JG: return VOP_JL;
+		case VOP_JL: return VOP_JG;
+		case VOP_JLE: return VOP_JGE;
+		case VOP_JGE: return VOP_JLE;
+	}
+	return opcode;
+}
+
+// jumps to target when the condition evaluates to jump_if and falls through otherwise. a compare goes straight into
+// the conditional jump and && and || only evaluate their right side when the left side doesn't decide the outcome
+static void conditional_jump(compiler_t* ctx, ast_node_t* n, bool jump_if, voperand_t target)
+{
+	if (n->type == AST_BIN_EXPR)
+	{
+		int operator = n->bin_expr_data.operator;
+		if (operator == TK_LOGICAL_AND || operator == TK_LOGICAL_OR)
+		{
+			// the left side alone decides when && is false or || is true
+			bool decides = operator == TK_LOGICAL_OR;
+			if (jump_if == decides)
+			{
+				conditional_jump(ctx, n->bin_expr_data.lhs, jump_if, target);
+				conditional_jump(ctx, n->bin_expr_data.rhs, jump_if, target);
+				return;
+			}
+			voperand_t skip_label = label_operand(get_label(ctx));
+			conditional_jump(ctx, n->bin_expr_data.lhs, decides, skip_label);
+			conditional_jump(ctx, n->bin_expr_data.rhs, jump_if, target);
+			emit_instruction1(ctx, VOP_LABEL, skip_label);
+			return;
+		}
+		if (is_relational_operator(operator))
+		{
+			static int opcode_map[] = {
+				['>'] = VOP_JG,
+				['<'] = VOP_JL,
+				[TK_LEQUAL] = VOP_JLE,
+				[TK_GEQUAL] = VOP_JGE,
+				[TK_EQUAL] = VOP_JZ,
+				[TK_NOT_EQUAL] = VOP_JNZ
+			};
+			voperand_t lhs, rhs;
+			rvalue(ctx, n->bin_expr_data.lhs, &lhs);
+			rvalue(ctx, n->bin_expr_data.rhs, &rhs);
+			vopcode_t jcc = opcode_map[operator];
+			// cmp can't take a immediate on the left, 5 < x is compared as x > 5 and a constant against a constant
+			// is loaded into a register first
+			if (lhs.type == VOPERAND_IMMEDIATE && rhs.type != VOPERAND_IMMEDIATE)
+			{
+				voperand_t tmp = lhs;
+				lhs = rhs;
+				rhs = tmp;
+				jcc = swapped_jump(jcc);
+			}
+			else if (lhs.type == VOPERAND_IMMEDIATE)
+			{
+				voperand_t imm = lhs;
+				lhs = register_operand(get_vreg(ctx));
+				load_operand(ctx, &lhs, &imm);
+			}
+			emit_instruction2(ctx, VOP_CMP, lhs, rhs);
+			emit_instruction1(ctx, jump_if ? jcc : inverse_jump(jcc), target);
+			return;
+		}
+	}
+	voperand_t op;
+	rvalue(ctx, n, &op);
+	// test can't take a immediate first either, a constant condition like while (1) is tested in a register
+	if (op.type == VOPERAND_IMMEDIATE)
+	{
+		voperand_t imm = op;
+		op = register_operand(get_vreg(ctx));
+		load_operand(ctx, &op, &imm);
+	}
+	emit_instruction2(ctx, VOP_TEST, op, op);
+	emit_instruction1(ctx, jump_if ? VOP_JNZ : VOP_JZ, target);
 }
 
 void bin_expr(compiler_t* ctx, ast_node_t* n, voperand_t* dst)
 {
+	int operator = n->bin_expr_data.operator;
+	if (is_relational_operator(operator) || operator == TK_LOGICAL_AND || operator == TK_LOGICAL_OR)
+	{
+		// 1 unless the condition jumps over the mov of 0
+		*dst = register_operand(get_vreg(ctx));
+		voperand_t true_label = label_operand(get_label(ctx));
+		emit_instruction2(ctx, VOP_MOV, *dst, imm32_operand(1));
+		conditional_jump(ctx, n, true, true_label);
+		emit_instruction2(ctx, VOP_MOV, *dst, imm32_operand(0));
+		emit_instruction1(ctx, VOP_LABEL, true_label);
+		return;
+	}
 	voperand_t lhs, rhs;
 	rvalue(ctx, n->bin_expr_data.lhs, &lhs);
 	rvalue(ctx, n->bin_expr_data.rhs, &rhs);
@@ -724,35 +1038,6 @@ void bin_expr(compiler_t* ctx, ast_node_t* n, voperand_t* dst)
 		}
 		break;
 
-		case '>':
-		case '<':
-		case TK_LEQUAL:
-		case TK_GEQUAL:
-		case TK_EQUAL:
-		case TK_NOT_EQUAL:
-		{
-			static int opcode_map[] = {
-				['>'] = VOP_JG,
-				['<'] = VOP_JL,
-				[TK_LEQUAL] = VOP_JLE,
-				[TK_GEQUAL] = VOP_JGE,
-				[TK_EQUAL] = VOP_JNZ,
-				[TK_NOT_EQUAL] = VOP_JZ
-			};
-			emit_instruction2(ctx, VOP_CMP, lhs, rhs);
-			voperand_t regop = register_operand(get_vreg(ctx));
-			emit_instruction2(ctx, VOP_MOV, regop, imm32_operand(1));
-
-			vinstr_t* jle = emit_instruction(ctx, opcode_map[n->bin_expr_data.operator]);
-			voperand_t jle_label = label_operand(get_label(ctx));
-			
-			set_operand(jle, 0, jle_label);
-			emit_instruction2(ctx, VOP_MOV, regop, imm32_operand(0));
-			/* set_operand(jle, 0, imm32_operand(instruction_index(ctx) - jle->index)); */
-			emit_instruction1(ctx, VOP_LABEL, jle_label);
-			*dst = regop;
-		} break;
-
 		default:
 		{
 			perror("unhandled operator");
@@ -771,45 +1056,94 @@ void assignment_expr(compiler_t* ctx, ast_node_t* n, voperand_t* dst)
 	*dst = rhs;
 }
 
+void unary_expr(compiler_t* ctx, ast_node_t* n, voperand_t* dst)
+{
+	voperand_t object;
+	switch (n->unary_expr_data.operator)
+	{
+		case '&':
+			// the lea keeps the object and everything above it in the frame out of mem2reg and tail calls
+			if (!lvalue(ctx, n->unary_expr_data.argument, &object))
+				break;
+			object.size = VOPERAND_SIZE_NATIVE;
+			*dst = register_operand(get_vreg(ctx));
+			emit_instruction2(ctx, VOP_LEA, *dst, object);
+			break;
+
+		case '*':
+			if (!lvalue(ctx, n, &object))
+				break;
+			*dst = register_operand(get_vreg(ctx));
+			load_operand(ctx, dst, &object);
+			break;
+
+		default:
+			printf("unhandled unary operator '%c'\n", n->unary_expr_data.operator);
+			break;
+	}
+}
+
 void function_call_expr(compiler_t* ctx, ast_node_t* n, voperand_t* dst)
 {
 	ast_node_t** args = n->call_expr_data.arguments;
 	int numargs = n->call_expr_data.numargs;
 	ast_node_t* callee = n->call_expr_data.callee;
 	function_t* fn = lookup_function_by_name(ctx, callee->identifier_data.name);
+	assert(numargs == fn->numparameters);
 
-	size_t cost = 0;
+	// all arguments are evaluated before the first one is passed, a call in one of them would clobber the argument
+	// registers. the inliner and tail calls rely on the pushes and moves being right in front of the call
+	voperand_t ops[FUNCTION_MAX_PARAMETERS];
+	for(size_t i = numargs; i-- > 0;)
+		rvalue(ctx, args[i], &ops[i]);
 
+	// the arguments that don't fit in registers are pushed last to first, 8 bytes each. rsp has to be 16 byte aligned
+	// at the call so a odd amount of them is padded
+	vregister_t spreg = {.index = VREG_SP};
+	int padding = (fn->argcost / 8) % 2 ? 8 : 0;
+	if (padding)
+		emit_instruction2(ctx, VOP_SUB, register_operand(spreg), imm32_operand(padding));
+	for(size_t i = numargs; i-- > 0;)
+	{
+		if (fn->parameters[i].reg == -1)
+			emit_instruction1(ctx, VOP_PUSH, ops[i]);
+	}
+	int numintegers = 0, numfloats = 0;
 	for(size_t i = 0; i < numargs; ++i)
 	{
-		ast_node_t* arg = args[numargs - i - 1];
-		assert(arg->type == AST_IDENTIFIER || arg->type == AST_PRIMITIVE || arg->type == AST_LITERAL || arg->type == AST_FUNCTION_CALL_EXPR);
-		int vs = data_type_size(ctx, arg) / 8;
-		assert(vs > 0);
-		voperand_t op;
-		rvalue(ctx, arg, &op);
-		emit_instruction1(ctx, VOP_PUSH, op);
-		cost += vs;
+		function_parameter_t *p = &fn->parameters[i];
+		if (p->reg == -1)
+			continue;
+		vregister_t argreg = {.index = p->reg};
+		voperand_t dst = register_operand(argreg);
+		if (p->reg >= VREG_FLOAT_ARGUMENT_0)
+		{
+			dst.size = p->size == 4 ? VOPERAND_SIZE_FLOAT : VOPERAND_SIZE_DOUBLE;
+			emit_instruction2(ctx, voperand_is_floating_point(&ops[i]) ? VOP_MOV : VOP_SITOFP, dst, ops[i]);
+			++numfloats;
+		}
+		else
+		{
+			dst.size = (voperand_size_t)p->size;
+			emit_instruction2(ctx, VOP_MOV, dst, ops[i]);
+			++numintegers;
+		}
 	}
 
-	assert(cost == fn->argcost);
-
-	emit_instruction1(ctx, VOP_CALL, imm32_operand(fn->index));
-	vregister_t spreg = {.index = VREG_SP};
-	emit_instruction2(ctx, VOP_ADD, register_operand(spreg), imm32_operand(fn->argcost));
+	// how many of the argument registers are used so liveness sees them read by the call
+	emit_instruction3(ctx, VOP_CALL, imm32_operand(fn->index), imm32_operand(numintegers), imm32_operand(numfloats));
+	if (fn->argcost + padding)
+		emit_instruction2(ctx, VOP_ADD, register_operand(spreg), imm32_operand(fn->argcost + padding));
+	// the next call overwrites the return value
 	vregister_t retreg = {.index = VREG_RETURN_VALUE };
-	*dst = register_operand(retreg);
-	/* if(!fn) */
-	/* { */
-	/* 	printf("can't find function '%s'\n", callee->identifier_data.name); */
-	/* 	return; */
-	/* } */
-	/* emit_instruction1(ctx, VOP_CALL, imm32_operand(fn->index)); */
+	*dst = register_operand(get_vreg(ctx));
+	emit_instruction2(ctx, VOP_MOV, *dst, register_operand(retreg));
 }
 
 rvalue_map_t rvalues[] = {{AST_LITERAL, literal},
 						  {AST_BIN_EXPR, bin_expr},
 						  {AST_ASSIGNMENT_EXPR, assignment_expr},
+						  {AST_UNARY_EXPR, unary_expr},
 						  {AST_FUNCTION_CALL_EXPR, function_call_expr}};
 
 bool rvalue(compiler_t* ctx, ast_node_t* n, voperand_t* dst)
@@ -819,7 +1153,6 @@ bool rvalue(compiler_t* ctx, ast_node_t* n, voperand_t* dst)
 		if(rvalues[i].node_type == n->type)
 		{
 			rvalues[i].callback(ctx, n, dst);
-			try_reuse_operand(ctx, dst);
 			return true;
 		}
 	}
@@ -836,24 +1169,6 @@ bool rvalue(compiler_t* ctx, ast_node_t* n, voperand_t* dst)
 	return true;
 }
 
-#define compiler_assert(ctx, expr, ...) \
-    compiler_assert_r(ctx, (intptr_t)expr, #expr, ## __VA_ARGS__)
-	
-static void compiler_assert_r(compiler_t *ctx, int expr, const char *expr_str, const char *fmt, ...)
-{
-    if(expr)
-        return;
-
-	char buffer[512] = { 0 };
-	va_list va;
-	va_start( va, fmt );
-	vsnprintf( buffer, sizeof( buffer ), fmt, va );
-	debug_printf( "compiler assert failed: '%s' %s\n", expr_str, buffer );
-	va_end( va );
-
-	longjmp(ctx->jmp, 1);
-}
-
 static ast_node_t *allocate_variable(compiler_t *ctx, ast_node_t *n, const char *varname, int offset, int size)
 {
 	variable_t tv = { .offset = offset, .is_param = 0, .data_type_node = n->variable_decl_data.data_type };
@@ -891,6 +1206,9 @@ bool block_statement(compiler_t* ctx, ast_node_t* n)
 }
 bool function_declaration(compiler_t* ctx, ast_node_t* n)
 {
+	// body was never parsed because the function isn't reachable, nothing to emit
+	if (n->func_decl_data.body_deferred)
+		return true;
 	if (n->func_decl_data.body)
 	{
 		const char* function_name = n->func_decl_data.id->identifier_data.name;
@@ -916,24 +1234,36 @@ bool function_declaration(compiler_t* ctx, ast_node_t* n)
 		ast_function_decl_t* fd = &n->func_decl_data;
 		ast_node_t **parms = fd->parameters;
 
-		int poffset = 8;
-		int numbytesarg = 0;
-		
+		compiler_assert(ctx, fd->numparms <= FUNCTION_MAX_PARAMETERS, "too many parameters for '%s'", function_name);
+		func->inline_hint = fd->inline_hint;
+
+		// System V, the first integer and floating point parameters come in registers, the others were pushed by the
+		// caller above the saved frame pointer and return address
+		int numintegers = 0, numfloats = 0;
+		int stackoffset = 16;
 		for(size_t i = 0; i < fd->numparms; ++i)
 		{
-			const char* variable_name = parms[i]->variable_decl_data.id->identifier_data.name;
-			variable_t* tmp = hash_map_find(ctx->function->arguments, variable_name);
-			compiler_assert(ctx, !tmp, "function argument already exists '%s'", variable_name);
-			
-			variable_t tv = {.offset = poffset, .is_param = 1, .data_type_node = parms[i]->variable_decl_data.data_type};
-			hash_map_insert(ctx->function->arguments, variable_name, tv);
-			int variable_size = data_type_size(ctx, parms[i]->variable_decl_data.data_type);
-			poffset += variable_size / 8;
-			numbytesarg += variable_size / 8;
+			ast_node_t *type = parms[i]->variable_decl_data.data_type;
+			int variable_size = data_type_size(ctx, type);
+			compiler_assert(ctx, variable_size / 8 <= 8, "can't pass parameter %d of '%s' by value", (int)i, function_name);
 			//TODO: handle pass by value with rep movsd etc, or just use only pointers for now
+			bool floating_point = type->type == AST_PRIMITIVE && (type->primitive_data.primitive_type == DT_FLOAT ||
+																  type->primitive_data.primitive_type == DT_DOUBLE);
+			function_parameter_t *p = &func->parameters[func->numparameters++];
+			p->size = variable_size / 8;
+			p->reg = -1;
+			if (floating_point && numfloats < VREG_NUM_FLOAT_ARGUMENTS)
+				p->reg = VREG_FLOAT_ARGUMENT_0 + numfloats++;
+			else if (!floating_point && numintegers < VREG_NUM_INTEGER_ARGUMENTS)
+				p->reg = VREG_ARGUMENT_0 + numintegers++;
+			if (p->reg == -1)
+			{
+				p->offset = stackoffset;
+				stackoffset += 8;
+			}
 		}
 
-		func->argcost = numbytesarg;
+		func->argcost = stackoffset - 16;
 
 		// add up all the variables in the function's scope and calculate how much space in bytes we need to allocate
 		/* traverse_context_t traverse_ctx = {0}; */
@@ -943,20 +1273,41 @@ bool function_declaration(compiler_t* ctx, ast_node_t* n)
 		/* 	ast_tree_nodes_by_type(&traverse_ctx, n->func_decl_data.body, AST_VARIABLE_DECL, &variable_declarations, */
 		/* 						   COUNT_OF(variable_declarations)); */
 		// printf("vars %d\n", num_variable_declarations);
-		int offset = -4;
-		size_t numbytes = 0;
 		ast_node_t **declarations = fd->declarations;
+		size_t numslots = fd->numdeclarations + fd->numparms;
+		frame_slot_t *slots = (frame_slot_t *)arena_alloc(ctx->allocator, sizeof(frame_slot_t) * (numslots + 1));
+		int *offsets = (int *)arena_alloc(ctx->allocator, sizeof(int) * (fd->numdeclarations + 1));
+		compiler_assert(ctx, slots && offsets, "out of memory laying out the frame of '%s'", function_name);
+		numslots = 0;
+		for (size_t i = 0; i < fd->numdeclarations; ++i)
+		{
+			int variable_size = data_type_size(ctx, declarations[i]->variable_decl_data.data_type);
+			slots[numslots++] = (frame_slot_t){.size = variable_size / 8, .offset = &offsets[i]};
+		}
+		// the parameters that came in registers are stored to a slot of their own
+		for(size_t i = 0; i < fd->numparms; ++i)
+		{
+			function_parameter_t *p = &func->parameters[i];
+			if (p->reg != -1)
+				slots[numslots++] = (frame_slot_t){.size = p->size, .offset = &p->offset};
+		}
+		size_t numbytes = frame_layout(slots, numslots);
+
 		for (size_t i = 0; i < fd->numdeclarations; ++i)
 		{
 			const char* variable_name = declarations[i]->variable_decl_data.id->identifier_data.name;
 			variable_t* tmp = hash_map_find(ctx->function->variables, variable_name);
 			compiler_assert(ctx, !tmp, "variable already exists '%s'", variable_name);
 			int variable_size = data_type_size(ctx, declarations[i]->variable_decl_data.data_type);
-			size_t nb = variable_size / 8;
-			allocate_variable(ctx, declarations[i], variable_name, offset, nb);
-			/* printf("var name = %s %s, offset = %d, numbits=%d\n", ast_node_type_t_to_string(declarations[i]->type), variable_name, offset, variable_size / 8); */
-			offset -= nb;
-			numbytes += nb;
+			allocate_variable(ctx, declarations[i], variable_name, offsets[i], variable_size / 8);
+		}
+		for(size_t i = 0; i < fd->numparms; ++i)
+		{
+			const char* variable_name = parms[i]->variable_decl_data.id->identifier_data.name;
+			variable_t* tmp = hash_map_find(ctx->function->arguments, variable_name);
+			compiler_assert(ctx, !tmp, "function argument already exists '%s'", variable_name);
+			variable_t tv = {.offset = func->parameters[i].offset, .is_param = 1, .data_type_node = parms[i]->variable_decl_data.data_type};
+			hash_map_insert(ctx->function->arguments, variable_name, tv);
 		}
 
 		vregister_t bpreg = {.index = VREG_BP};
@@ -969,6 +1320,19 @@ bool function_declaration(compiler_t* ctx, ast_node_t* n)
 
 		emit_instruction1(ctx, VOP_ALLOCA, imm32_operand(numbytes));
 
+		for(size_t i = 0; i < fd->numparms; ++i)
+		{
+			function_parameter_t *p = &func->parameters[i];
+			if (p->reg == -1)
+				continue;
+			vregister_t argreg = {.index = p->reg};
+			voperand_t src = register_operand(argreg);
+			voperand_t home = indirect_register_displacement_operand(bpreg, p->offset, p->size);
+			set_floating_point_operand_size(&home, parms[i]->variable_decl_data.data_type);
+			src.size = home.size;
+			emit_instruction2(ctx, VOP_MOV, home, src);
+		}
+
 		compile_visit_node(ctx, n->func_decl_data.body);
 
 		/* for (size_t i = 0; i < func->numreturns; ++i) */
@@ -1053,13 +1417,8 @@ static void actualize_relative_scope_jumps(compiler_t *ctx)
 
 bool if_statement(compiler_t* ctx, ast_node_t* n)
 {
-	voperand_t op;
-	rvalue(ctx, n->if_stmt_data.test, &op);
-
-	emit_instruction2(ctx, VOP_TEST, op, op);
 	voperand_t jz_label = label_operand(get_label(ctx));
-	vinstr_t* jz = emit_instruction1(ctx, VOP_JZ, jz_label);
-	/* vinstr_t* jz = emit_instruction1(ctx, VOP_JZ, imm32_operand(0)); */
+	conditional_jump(ctx, n->if_stmt_data.test, false, jz_label);
 	assert(n->if_stmt_data.consequent);
 	compile_visit_node(ctx, n->if_stmt_data.consequent);
 
@@ -1075,15 +1434,9 @@ bool if_statement(compiler_t* ctx, ast_node_t* n)
 	emit_instruction1(ctx, VOP_LABEL, jz_label);
 	/* set_operand(jz, 0, imm32_operand(instruction_index(ctx) - jz->index)); */
 	
+	// only reached through the jz, the flags of the test don't outlive the block so nothing else may read them
 	if (n->if_stmt_data.alternative)
-	{
-		voperand_t jnz_label = label_operand(get_label(ctx));
-		vinstr_t* jnz = emit_instruction1(ctx, VOP_JNZ, jnz_label);
-		/* vinstr_t* jnz = emit_instruction1(ctx, VOP_JNZ, imm32_operand(0)); */
 		compile_visit_node(ctx, n->if_stmt_data.alternative);
-		emit_instruction1(ctx, VOP_LABEL, jnz_label);
-		/* set_operand(jnz, 0, imm32_operand(instruction_index(ctx) - jnz->index)); */
-	}
 
 	if(jmp)
 	{
@@ -1104,12 +1457,7 @@ bool while_statement(compiler_t* ctx, ast_node_t* n)
 	scope.breaklabel = label_operand(get_label(ctx));
 	emit_instruction1(ctx, VOP_LABEL, beginlabel);
 
-	voperand_t op;
-	rvalue(ctx, n->while_stmt_data.test, &op);
-	
-	emit_instruction2(ctx, VOP_TEST, op, op);
-	/* vinstr_t *jz = emit_instruction1(ctx, VOP_JZ, imm32_operand(0)); //set temporarily to 0 */
-	emit_instruction1(ctx, VOP_JZ, scope.breaklabel);
+	conditional_jump(ctx, n->while_stmt_data.test, false, scope.breaklabel);
 	
 	compile_visit_node(ctx, n->while_stmt_data.body);
 
@@ -1133,6 +1481,7 @@ static ast_node_map_t nodes[] = {{AST_PROGRAM, program},
 								 {AST_FUNCTION_DECL, function_declaration},
 								 {AST_VARIABLE_DECL, variable_declaration},
 								 {AST_WHILE_STMT, while_statement},
+								 {AST_BREAK_STMT, break_statement},
 								 {AST_IF_STMT, if_statement}};
 
 bool compile_visit_node(compiler_t* ctx, ast_node_t* n)
@@ -1157,143 +1506,170 @@ static void print_hex(u8 *buf, size_t n)
 	}
 }
 
-// TODO: instruction scheduling, build a dependency graph etc
-// https://en.wikipedia.org/wiki/Instruction_scheduling
-// Register allocation with graph coloring
-
-static size_t register_lifetime(vinstr_t *instructions, size_t numinstructions, size_t current_index, voperand_t regop)
+static void print_instructions(vinstr_list_t* instructions)
 {
-	assert(regop.type == VOPERAND_REGISTER || regop.type == VOPERAND_INDIRECT_REGISTER);
-	size_t last_index = current_index;
-	int regidx = regop.reg.index;
-	for (size_t i = current_index + 1; i < numinstructions; ++i)
+	size_t i = 0;
+	vinstr_list_foreach(instructions, instr)
 	{
-		vinstr_t* instr = &instructions[i];
-		for(size_t j = 0; j < instr->numoperands; ++j)
+		printf("%zu: %s ", i++, vopcode_names[instr->opcode]);
+		for (size_t j = 0; j < instr->numoperands; ++j)
 		{
-			voperand_t *op = &instr->operands[j];
-			switch(op->type)
-			{
-			case VOPERAND_REGISTER:
-				if(op->reg.index == regidx/* && op->size == regop.size*/) //not needed to check for size, because the index is shared
-					last_index = i;
-				break;
-			case VOPERAND_INDIRECT_REGISTER_INDEXED:
-				if (op->reg_indirect_indexed.indexed_reg.index == regidx ||
-					op->reg_indirect_indexed.indexed_reg.index == regidx)
-					last_index = i;
-				break;
-			case VOPERAND_INDIRECT_REGISTER_DISPLACEMENT:
-				if (op->reg_indirect_displacement.reg.index == regidx)
-					last_index = i;
-				break;
-			case VOPERAND_INDIRECT_REGISTER:
-				if (op->reg.index == regidx)
-					last_index = i;
-				break;
-			}
+			print_instruction_operand(&instr->operands[j], j != instr->numoperands - 1);
+		}
+		for (size_t j = 0; instr->phi && j < instr->phi->numargs; ++j)
+		{
+			vphi_arg_t *arg = &instr->phi->args[j];
+			printf(", [");
+			print_instruction_operand(&arg->value, true);
+			printf("label %d]", arg->label);
 		}
+		printf("\n");
 	}
-	return last_index - current_index;
 }
 
-static void print_instructions(vinstr_t* instructions, size_t n)
+#define COMPILER_SCRATCH_ARENA_SIZE (1000 * 1000 * 64) // 64MB
+
+// vregs and labels are numbered for the whole program while compiling, starting each function at VREG_MAX and 0
+// keeps the tables the passes index by them small. the numbers are made dense as well, the inliner leaves gaps
+static bool renumber_function(function_t *fn, arena_t *scratch)
 {
-	for (size_t i = 0; i < n; ++i)
+	int minvreg = INT_MAX, maxvreg = VREG_MAX - 1;
+	size_t minlabel = (size_t)-1, maxlabel = 0;
+	vinstr_list_foreach(&fn->instructions, instr)
 	{
-		vinstr_t* instr = &instructions[i];
-		printf("%d: %s ", i, vopcode_names[instr->opcode]);
-		for (size_t j = 0; j < instr->numoperands; ++j)
+		for (size_t i = 0; i < instr->numoperands; ++i)
 		{
-			if (instr->operands[j].type == VOPERAND_REGISTER)
+			voperand_t *op = &instr->operands[i];
+			if (op->type == VOPERAND_LABEL)
 			{
-				size_t lf = register_lifetime(instructions, n, i, instr->operands[j]);
-				/* printf("lf=%d ", lf); */
+				minlabel = op->label < minlabel ? op->label : minlabel;
+				maxlabel = op->label > maxlabel ? op->label : maxlabel;
+				continue;
+			}
+			vregister_t *regs[2];
+			size_t n = op->virtual ? voperand_registers(op, regs) : 0;
+			for (size_t k = 0; k < n; ++k)
+			{
+				if (regs[k]->index < VREG_MAX)
+					continue;
+				minvreg = regs[k]->index < minvreg ? regs[k]->index : minvreg;
+				maxvreg = regs[k]->index > maxvreg ? regs[k]->index : maxvreg;
 			}
-			print_instruction_operand(&instr->operands[j], j != instr->numoperands - 1);
 		}
-		printf("\n");
 	}
-}
-
-typedef struct
-{
-	voperand_t op;
-	size_t lifetime;
-	size_t index_pushed_at;
-} vreg_pushed_t;
-
-typedef struct
-{
-	int index;
-	vreg_pushed_t vreg[32];
-	int vregnum;
-} alloc_reg_t;
+	if (minvreg == INT_MAX)
+		minvreg = VREG_MAX;
+	if (minlabel > maxlabel)
+		minlabel = maxlabel = 0;
+
+	// -1 for the numbers that aren't used, then the ones that are get consecutive numbers in the same order
+	size_t numvregs = maxvreg - minvreg + 1, numlabels = maxlabel - minlabel + 1;
+	int *vregmap = (int *)arena_alloc(scratch, sizeof(int) * numvregs);
+	size_t *labelmap = (size_t *)arena_alloc(scratch, sizeof(size_t) * numlabels);
+	if ((numvregs && !vregmap) || !labelmap)
+		return false;
+	memset(vregmap, -1, sizeof(int) * numvregs);
+	memset(labelmap, -1, sizeof(size_t) * numlabels);
+	vinstr_list_foreach(&fn->instructions, instr)
+	{
+		for (size_t i = 0; i < instr->numoperands; ++i)
+		{
+			voperand_t *op = &instr->operands[i];
+			if (op->type == VOPERAND_LABEL)
+			{
+				labelmap[op->label - minlabel] = 0;
+				continue;
+			}
+			vregister_t *regs[2];
+			size_t n = op->virtual ? voperand_registers(op, regs) : 0;
+			for (size_t k = 0; k < n; ++k)
+			{
+				if (regs[k]->index >= VREG_MAX)
+					vregmap[regs[k]->index - minvreg] = 0;
+			}
+		}
+	}
+	int nextvreg = VREG_MAX;
+	for (size_t i = 0; i < numvregs; ++i)
+	{
+		if (vregmap[i] != -1)
+			vregmap[i] = nextvreg++;
+	}
+	size_t nextlabel = 0;
+	for (size_t i = 0; i < numlabels; ++i)
+	{
+		if (labelmap[i] != (size_t)-1)
+			labelmap[i] = nextlabel++;
+	}
 
-static void use_register(function_t *f, size_t instruction_index, alloc_reg_t *r, voperand_t *op)
-{
-	vreg_pushed_t *vp = &r->vreg[r->vregnum];
-	vp->index_pushed_at = instruction_index;
-	vp->lifetime = register_lifetime(f->instructions, f->instruction_index, instruction_index, *op);
-	vp->op = *op;
+	vinstr_list_foreach(&fn->instructions, instr)
+	{
+		for (size_t i = 0; i < instr->numoperands; ++i)
+		{
+			voperand_t *op = &instr->operands[i];
+			if (op->type == VOPERAND_LABEL)
+			{
+				op->label = labelmap[op->label - minlabel];
+				continue;
+			}
+			vregister_t *regs[2];
+			size_t n = op->virtual ? voperand_registers(op, regs) : 0;
+			for (size_t k = 0; k < n; ++k)
+			{
+				if (regs[k]->index >= VREG_MAX)
+					regs[k]->index = vregmap[regs[k]->index - minvreg];
+			}
+		}
+	}
+	fn->eoflabel.label = labelmap[fn->eoflabel.label - minlabel];
+	fn->numvregs = nextvreg;
+	fn->numlabels = nextlabel ? nextlabel : 1;
+	return true;
 }
 
-static alloc_reg_t *alloc_register(alloc_reg_t *registers, size_t numregisters, function_t *f, size_t instruction_index, voperand_t *op, bool *push, int *ignore, bool first)
+// analysis data only lives until the next function, the scratch arena is reset in between
+static bool lower_function(compiler_t *ctx, function_t *fn, arena_t *scratch)
 {
-
-	// find whether we already assigned the register operand
-	for (int k = 0; k < numregisters; ++k)
+	if (!fn->instructions.count)
+		return true;
+	scratch->used = 0;
+	if (!renumber_function(fn, scratch))
+		return false;
+	if (ctx->optimization_level >= 1)
 	{
-		if (k == *ignore && first)
-			continue;
-		alloc_reg_t* r = &registers[k];
-		if (r->vreg[r->vregnum].op.reg.index == op->reg.index)// && r->vreg[r->vregnum].op.size == op->size)
+		if (!optimize_mem2reg(fn, scratch) || !ssa_construct(fn, scratch) || !optimize_sccp(fn, scratch) ||
+			!optimize_cfg_cleanup(fn, scratch) || !optimize_gvn(fn, scratch) || !optimize_licm(fn, scratch) ||
+			!optimize_strength_reduction(fn, scratch) || !optimize_dce(fn, scratch) || !ssa_destruct(fn, scratch) ||
+			!optimize_tail_calls(ctx, fn, scratch) || !optimize_cfg_cleanup(fn, scratch) ||
+			!optimize_stack_slots(fn, scratch) || !optimize_schedule(fn, scratch))
 		{
-			/* printf("reusing reg "); */
-			/* print_instruction_operand(op, false); */
-			/* printf(" for %d\n", k); */
-			return r;
+			printf("failed to optimize function '%s'\n", fn->name);
+			return false;
 		}
+		scratch->used = 0;
 	}
-	if(!first)
+	regalloc_stats_t stats;
+	bool allocated = ctx->optimization_level >= 2 ? regalloc_graph_coloring(fn, scratch, &stats) : false;
+	if (!allocated)
 	{
-		printf("reg %d not set before ii=%d\n", op->reg.index, instruction_index);
-		return NULL;
+		// too big for a interference matrix in the scratch arena, the linear scan always fits
+		scratch->used = 0;
+		allocated = regalloc_linear_scan(fn, scratch, &stats);
 	}
-
-	// we didn't find it, check whether we have unused real registers
-	for (int k = 0; k < numregisters; ++k)
+	if (!allocated)
 	{
-		if (k == *ignore)
-			continue;
-		alloc_reg_t* r = &registers[k];
-		if (r->vregnum == 0)
-		{
-			r->vregnum = 1;
-			use_register(f, instruction_index, r, op);
-			/* printf("unused real reg %d", k); */
-			return r;
-		}
+		printf("failed to allocate registers for function '%s'\n", fn->name);
+		return false;
 	}
-	if(*ignore == 0)
-		return NULL;
-	// find the register with the lowest push count
-	alloc_reg_t* lowest = &registers[0];
-	for (int k = 1; k < numregisters; ++k)
+	scratch->used = 0;
+	if (ctx->optimization_level >= 1 &&
+		(!optimize_peephole(fn, scratch) || (ctx->optimization_level >= 2 && !optimize_schedule(fn, scratch)) ||
+		 !optimize_frame(fn, scratch)))
 	{
-		alloc_reg_t *r = &registers[k];
-		if (r->vregnum < lowest->vregnum)
-			lowest = r;
+		printf("failed to optimize function '%s'\n", fn->name);
+		return false;
 	}
-
-	assert(lowest->vregnum < COUNT_OF(lowest->vreg));
-	lowest->vregnum++;
-	use_register(f, instruction_index, lowest, op);
-	*push = true;
-	/* printf("pushing %d ", 0); */
-	/* print_instruction_operand(op, false); */
-	/* printf("\n"); */
-	return lowest;
+	return true;
 }
 
 int compile(compiler_t* ctx, ast_node_t *head)
@@ -1304,11 +1680,25 @@ int compile(compiler_t* ctx, ast_node_t *head)
     }
 	compile_visit_node(ctx, head);
 
+	arena_t *scratch;
+	if (arena_create(&scratch, "scratch", COMPILER_SCRATCH_ARENA_SIZE))
+		return 1;
+	bool ok = ctx->optimization_level < 1 || optimize_inline(ctx, scratch);
+	if (!ok)
+		printf("failed to inline functions\n");
+	hash_map_foreach_entry(ctx->functions, entry, {
+		if (ok && !lower_function(ctx, entry->data, scratch))
+			ok = false;
+	});
+	arena_destroy(&scratch);
+	if (!ok)
+		return 1;
+
 	//printf("functions:\n");
 	hash_map_foreach_entry(ctx->functions, entry, {
 		function_t* fn = entry->data;
 		/* printf("--------------------------------\n\n"); */
-		/* printf("%s, %d instructions\n", fn->name, fn->instruction_index); */
+		/* printf("%s, %d instructions\n", fn->name, fn->instructions.count); */
 		/* print_function_instructions(fn); */
 		/* printf("--------------------------------\n\n"); */
 		if (!strcmp(fn->name, "main"))
@@ -1316,7 +1706,11 @@ int compile(compiler_t* ctx, ast_node_t *head)
 			//printf("bytecode=%d\n",heap_string_size(&fn->bytecode));
 			/* print_hex(fn->bytecode, heap_string_size(&fn->bytecode)); */
 		}
-		/* print_instructions(fn->instructions, fn->instruction_index); */
+		if (ctx->print_instructions)
+		{
+			printf("%s:\n", fn->name);
+			print_instructions(&fn->instructions);
+		}
 		// printf("--------------------------\n");
 
 		hash_map_foreach_entry(fn->variables, ventry,
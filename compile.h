@@ -12,13 +12,20 @@
 #include "virtual_opcodes.h"
 #include <setjmp.h>
 
+// System V passes the first integer arguments in rdi, rsi, rdx, rcx, r8 and r9 and the first floating point ones in
+// xmm0-7, each has a fixed vreg that is set right before the call
+#define VREG_NUM_INTEGER_ARGUMENTS (6)
+#define VREG_NUM_FLOAT_ARGUMENTS (8)
+
 enum
 {	
 	VREG_SP,
 	VREG_BP,
 	VREG_IP,
 	VREG_RETURN_VALUE,
-	VREG_MAX
+	VREG_ARGUMENT_0,
+	VREG_FLOAT_ARGUMENT_0 = VREG_ARGUMENT_0 + VREG_NUM_INTEGER_ARGUMENTS,
+	VREG_MAX = VREG_FLOAT_ARGUMENT_0 + VREG_NUM_FLOAT_ARGUMENTS
 };
 typedef int vreg_t;
 typedef int reg_t;
@@ -73,12 +80,14 @@ typedef struct variable_s
 } variable_t;
 
 #define FUNCTION_NAME_MAX_CHARACTERS (64)
-#define VOPCACHE_MAX (64)
+#define FUNCTION_MAX_PARAMETERS (32)
 
 typedef struct
 {
-	voperand_t key, value;
-} vopcache_t;
+	int size; // bytes
+	int reg; // the VREG_ARGUMENT_ or VREG_FLOAT_ARGUMENT_ it's passed in, -1 if it's pushed on the stack
+	int offset; // from bp, the slot the callee stores a register argument to or where the pushed one is
+} function_parameter_t;
 
 typedef struct function_s
 {
@@ -90,21 +99,36 @@ typedef struct function_s
 	
 	heap_string bytecode;
 
-	vinstr_t *instructions;
-	size_t instruction_index;
+	vinstr_list_t instructions;
 	size_t index;
 
 	/* vinstr_t *returns[32]; */
 	/* size_t numreturns; */
 
-	vopcache_t vopcache[VOPCACHE_MAX];
-	size_t vopcacheindex;
 	voperand_t eoflabel;
-	int argcost;
+	int argcost; // bytes of the arguments pushed on the stack, 8 for each
 	int returnsize;
+	function_parameter_t parameters[FUNCTION_MAX_PARAMETERS];
+	size_t numparameters;
+	bool inline_hint;
+	u32 saved_registers; // callee saved registers the register allocator used
+
+	// vregs and labels are renumbered for each function before it's lowered, new ones are allocated from these
+	int numvregs;
+	size_t numlabels;
 } function_t;
 
-#define FUNCTION_MAX_INSTRUCTIONS (256)
+static vregister_t function_new_vreg(function_t *f)
+{
+	vregister_t vr;
+	vr.index = f->numvregs++;
+	return vr;
+}
+
+static size_t function_new_label(function_t *f)
+{
+	return f->numlabels++;
+}
 
 struct reljmp_s
 {
@@ -194,6 +218,7 @@ typedef struct
 } fundamental_type_size_t;
 
 #define COMPILER_MAX_FUNCTIONS (64)
+#define COMPILER_INLINE_BUDGET (16) // instructions a callee may have beyond what the call itself costs
 #define COMPILER_MAX_SCOPES (16)
 
 typedef enum
@@ -208,6 +233,9 @@ struct compiler_s
 	arena_t *allocator;
 	int numbits;
 	int flags;
+	int optimization_level; // -O0, -O1 or -O2
+	int inline_budget; // 0 disables inlining
+	bool print_instructions; // prints every function after it is lowered
 	
     jmp_buf jmp;
 	
@@ -248,4 +276,8 @@ typedef struct compiler_s compiler_t;
 int add_indexed_data(compiler_t *ctx, const void *buffer, size_t len);
 function_t *compiler_alloc_function(compiler_t *ctx, const char *name);
 void compiler_init(compiler_t *c, arena_t *allocator, int numbits, compiler_flags_t flags);
+
+// runs main on the register allocated instructions and sets what it returns, false with a message if the program does
+// something the interpreter can't do or a x64 core would fault on
+bool interpret(compiler_t *ctx, i64 *result);
 #endif
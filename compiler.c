@@ -284,7 +284,7 @@ static int function_variable_declaration_stack_size( compiler_t* ctx, struct ast
     
     //align to 32
     //TODO: fix this make sure the esp value is aligned instead
-    int aligned = total & ~31;
+    int aligned = (total + 31) & ~31;
     if(aligned == 0)
         return 32;
     return aligned;
@@ -1121,21 +1121,39 @@ int rvalue(compiler_t *ctx, reg_t reg, struct ast_node *n)
     return 0;
 }
 
-struct ast_node *get_struct_member_info(compiler_t* ctx, struct ast_struct_decl *decl, const char *member_name, int *offset, int *size)
+// fields are packed, the layout is computed once and cached in the declaration apart from the aligned one of compile.c
+static ast_struct_layout_t *struct_layout(compiler_t *ctx, struct ast_struct_decl *decl)
 {
+    if(decl->packed_layout)
+        return decl->packed_layout;
+    ast_struct_layout_t *layout = (ast_struct_layout_t*)arena_alloc(ctx->allocator, sizeof(ast_struct_layout_t));
+    layout->field_indices = hash_map_create_with_custom_allocator(int, ctx->allocator, arena_alloc);
+    layout->numfields = decl->numfields;
+    layout->alignment = 1;
     int total_offset = 0;
     for(int i = 0; i < decl->numfields; ++i)
 	{
         int sz = data_type_operand_size(ctx, decl->fields[i]->variable_decl_data.data_type, 1);
-		if (!strcmp(decl->fields[i]->variable_decl_data.id->identifier_data.name, member_name))
-		{
-            *offset = total_offset;
-            *size = sz;
-            return decl->fields[i];
-		}
+        layout->fields[i].field = decl->fields[i];
+        layout->fields[i].offset = total_offset;
+        layout->fields[i].size = sz;
+        hash_map_insert(layout->field_indices, decl->fields[i]->variable_decl_data.id->identifier_data.name, i);
         total_offset += sz;
 	}
-    return NULL;
+    layout->size = total_offset;
+    decl->packed_layout = layout;
+    return layout;
+}
+
+struct ast_node *get_struct_member_info(compiler_t* ctx, struct ast_struct_decl *decl, const char *member_name, int *offset, int *size)
+{
+    ast_struct_layout_t *layout = struct_layout(ctx, decl);
+    int *index = hash_map_find(layout->field_indices, member_name);
+    if(!index)
+        return NULL;
+    *offset = layout->fields[*index].offset;
+    *size = layout->fields[*index].size;
+    return layout->fields[*index].field;
 }
 
 // locator value, can be local variable, global variable, array offset or any other valid lvalue
@@ -0,0 +1,264 @@
+#include "optimize.h"
+#include "std.h"
+#include <stdio.h>
+
+// mark and sweep dead code elimination, everything with a effect outside of the vregs it defines is live and
+// liveness flows back from the uses to the definitions
+
+static bool has_side_effects(vinstr_t *instr)
+{
+	switch (instr->opcode)
+	{
+		case VOP_STORE:
+		case VOP_PUSH:
+		case VOP_POP:
+		case VOP_ENTER:
+		case VOP_LEAVE:
+		case VOP_CALL:
+		case VOP_RET:
+		case VOP_TAILCALL:
+		case VOP_LABEL:
+		case VOP_ALLOCA:
+		case VOP_HLT:
+			return true;
+	}
+	if (vopcode_is_jump(instr->opcode))
+		return true;
+	if (instr->numoperands == 0 || !vinstr_first_operand_is_written(instr))
+		return false;
+	// stores to memory and writes to the stack or frame pointer
+	voperand_t *dst = &instr->operands[0];
+	return dst->type != VOPERAND_REGISTER || !dst->virtual || dst->reg.index < VREG_RETURN_VALUE;
+}
+
+// a compare is live while a conditional jump later in the block reads the flags it sets
+static bool sets_used_flags(vinstr_t *instr)
+{
+	if (instr->opcode != VOP_CMP && instr->opcode != VOP_TEST)
+		return false;
+	for (vinstr_t *it = instr->next; it && it->opcode != VOP_LABEL; it = it->next)
+	{
+		if (vopcode_is_conditional_jump(it->opcode))
+			return true;
+		if (it->opcode == VOP_CMP || it->opcode == VOP_TEST || vopcode_ends_block(it->opcode))
+			return false;
+	}
+	return false;
+}
+
+static size_t instruction_vregs(vinstr_t *instr, int *vregs, bool uses)
+{
+	if (instr->opcode != VOP_PHI)
+		return uses ? vinstr_used_vregs(instr, vregs) : vinstr_defined_vregs(instr, vregs);
+	if (!uses)
+		return vinstr_defined_vregs(instr, vregs);
+	size_t n = 0;
+	for (size_t i = 0; i < instr->phi->numargs; ++i)
+	{
+		voperand_t *op = &instr->phi->args[i].value;
+		if (op->type == VOPERAND_REGISTER && op->virtual && op->reg.index >= VREG_RETURN_VALUE)
+			vregs[n++] = op->reg.index;
+	}
+	return n;
+}
+
+bool optimize_dce(function_t *f, arena_t *allocator)
+{
+	vinstr_list_t *list = &f->instructions;
+	size_t numids = list->nextid;
+	size_t numvregs = f->numvregs;
+	size_t maxvregs = LIVENESS_MAX_VREGS_PER_INSTRUCTION;
+	vinstr_list_foreach(list, instr)
+	{
+		if (instr->phi && instr->phi->numargs > maxvregs)
+			maxvregs = instr->phi->numargs;
+	}
+
+	// definitions of each vreg, a vreg that isn't in SSA form can have more than one
+	size_t *firstdef = (size_t *)arena_alloc(allocator, sizeof(size_t) * (numvregs + 1));
+	bool *live = (bool *)arena_alloc(allocator, sizeof(bool) * numids);
+	vinstr_t **worklist = (vinstr_t **)arena_alloc(allocator, sizeof(vinstr_t *) * numids);
+	int *vregs = (int *)arena_alloc(allocator, sizeof(int) * maxvregs);
+	if (!firstdef || !live || !worklist || !vregs)
+		return false;
+	memset(firstdef, 0, sizeof(size_t) * (numvregs + 1));
+	memset(live, 0, sizeof(bool) * numids);
+
+	vinstr_list_foreach(list, instr)
+	{
+		size_t n = instruction_vregs(instr, vregs, false);
+		for (size_t i = 0; i < n; ++i)
+			++firstdef[vregs[i] + 1];
+	}
+	for (size_t v = 0; v < numvregs; ++v)
+		firstdef[v + 1] += firstdef[v];
+	vinstr_t **defs = (vinstr_t **)arena_alloc(allocator, sizeof(vinstr_t *) * (firstdef[numvregs] + 1));
+	size_t *fill = (size_t *)arena_alloc(allocator, sizeof(size_t) * (numvregs + 1));
+	if (!defs || !fill)
+		return false;
+	memcpy(fill, firstdef, sizeof(size_t) * numvregs);
+	vinstr_list_foreach(list, instr)
+	{
+		size_t n = instruction_vregs(instr, vregs, false);
+		for (size_t i = 0; i < n; ++i)
+			defs[fill[vregs[i]]++] = instr;
+	}
+
+	size_t numwork = 0;
+	vinstr_list_foreach(list, instr)
+	{
+		if (has_side_effects(instr) || sets_used_flags(instr))
+		{
+			live[instr->id] = true;
+			worklist[numwork++] = instr;
+		}
+	}
+	while (numwork > 0)
+	{
+		vinstr_t *instr = worklist[--numwork];
+		size_t n = instruction_vregs(instr, vregs, true);
+		for (size_t i = 0; i < n; ++i)
+		{
+			for (size_t k = firstdef[vregs[i]]; k < firstdef[vregs[i] + 1]; ++k)
+			{
+				if (live[defs[k]->id])
+					continue;
+				live[defs[k]->id] = true;
+				worklist[numwork++] = defs[k];
+			}
+		}
+	}
+
+	for (vinstr_t *instr = list->head; instr;)
+	{
+		vinstr_t *next = instr->next;
+		if (!live[instr->id])
+			vinstr_list_remove(list, instr);
+		instr = next;
+	}
+	return true;
+}
+
+static bool function_has_phis(function_t *f)
+{
+	vinstr_list_foreach(&f->instructions, instr)
+	{
+		if (instr->opcode == VOP_PHI)
+			return true;
+	}
+	return false;
+}
+
+static void remove_block(function_t *f, basic_block_t *bb)
+{
+	size_t label = ssa_block_label(bb);
+	for (size_t i = 0; i < bb->numsucc; ++i)
+	{
+		if (bb->succ[i] != bb)
+			ssa_remove_phi_arguments(bb->succ[i], label);
+	}
+	vinstr_t *end = bb->last->next;
+	for (vinstr_t *instr = bb->first; instr != end;)
+	{
+		vinstr_t *next = instr->next;
+		vinstr_list_remove(&f->instructions, instr);
+		instr = next;
+	}
+}
+
+// a block that is only a label and a jump
+static bool is_forwarding_block(basic_block_t *bb)
+{
+	return bb->first->opcode == VOP_LABEL && bb->first->next == bb->last && bb->last->opcode == VOP_JMP;
+}
+
+static bool has_phis(basic_block_t *bb)
+{
+	return bb->first->next && bb->first->next->opcode == VOP_PHI;
+}
+
+static bool thread_jumps(function_t *f, cfg_t *cfg)
+{
+	bool changed = false;
+	for (size_t i = 0; i < cfg->numblocks; ++i)
+	{
+		basic_block_t *bb = &cfg->blocks[i];
+		vinstr_t *jump = bb->last;
+		if (bb->rpo == -1 || !vopcode_is_jump(jump->opcode))
+			continue;
+		basic_block_t *target = bb->succ[0];
+
+		// the jump goes where execution would fall through to anyway
+		if (jump->next == target->first)
+		{
+			vinstr_list_remove(&f->instructions, jump);
+			changed = true;
+			continue;
+		}
+
+		// follow chains of empty blocks, phis name their predecessor so a join with phis keeps the edge it has
+		basic_block_t *to = target;
+		for (size_t hops = 0; is_forwarding_block(to) && to->succ[0] != to && hops < cfg->numblocks; ++hops)
+		{
+			if (has_phis(to->succ[0]))
+				break;
+			to = to->succ[0];
+		}
+		if (to != target)
+		{
+			jump->operands[0].label = ssa_block_label(to);
+			changed = true;
+		}
+	}
+	return changed;
+}
+
+static bool remove_unused_labels(function_t *f, cfg_t *cfg, arena_t *allocator)
+{
+	bool *referenced = (bool *)arena_alloc(allocator, sizeof(bool) * (cfg->numlabels + 1));
+	if (!referenced)
+		return false;
+	memset(referenced, 0, sizeof(bool) * (cfg->numlabels + 1));
+	vinstr_list_foreach(&f->instructions, instr)
+	{
+		if (vopcode_is_jump(instr->opcode))
+			referenced[instr->operands[0].label - cfg->minlabel] = true;
+	}
+	for (vinstr_t *instr = f->instructions.head; instr;)
+	{
+		vinstr_t *next = instr->next;
+		if (instr->opcode == VOP_LABEL && !referenced[instr->operands[0].label - cfg->minlabel])
+			vinstr_list_remove(&f->instructions, instr);
+		instr = next;
+	}
+	return true;
+}
+
+bool optimize_cfg_cleanup(function_t *f, arena_t *allocator)
+{
+	bool changed = true;
+	while (changed && f->instructions.head)
+	{
+		changed = false;
+		cfg_t cfg;
+		if (!cfg_build(&cfg, f, allocator))
+			return false;
+		for (size_t i = 1; i < cfg.numblocks; ++i)
+		{
+			if (cfg.blocks[i].rpo == -1)
+			{
+				remove_block(f, &cfg.blocks[i]);
+				changed = true;
+			}
+		}
+		if (changed)
+			continue;
+		changed = thread_jumps(f, &cfg);
+	}
+
+	// labels name the predecessors of phis, they can only go once the function is out of SSA
+	if (!f->instructions.head || function_has_phis(f))
+		return true;
+	cfg_t cfg;
+	return cfg_build(&cfg, f, allocator) && remove_unused_labels(f, &cfg, allocator);
+}
@@ -0,0 +1,264 @@
+#include "optimize.h"
+#include "regalloc.h"
+#include "std.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+// the slots a function accesses are laid out below rbp, which is 16 byte aligned, with the most aligned ones first so
+// there is no padding in between. after optimization most locals live in vregs, the slots that are left are packed
+// again so the ones nothing accesses anymore don't take up space
+
+// the largest power of two the size is a multiple of, up to 16
+static int slot_alignment(int size)
+{
+	int alignment = size > 0 ? size & -size : 1;
+	return alignment > 16 ? 16 : alignment;
+}
+
+static int compare_slots(const void *a, const void *b)
+{
+	const frame_slot_t *sa = a, *sb = b;
+	int aa = slot_alignment(sa->size), ab = slot_alignment(sb->size);
+	if (aa != ab)
+		return aa > ab ? -1 : 1;
+	return sa->index < sb->index ? -1 : sa->index > sb->index;
+}
+
+int frame_layout(frame_slot_t *slots, size_t numslots)
+{
+	for (size_t i = 0; i < numslots; ++i)
+		slots[i].index = i;
+	qsort(slots, numslots, sizeof(frame_slot_t), compare_slots);
+	int depth = 0;
+	for (size_t i = 0; i < numslots; ++i)
+	{
+		int alignment = slot_alignment(slots[i].size);
+		depth = (depth + slots[i].size + alignment - 1) & ~(alignment - 1);
+		*slots[i].offset = -depth;
+	}
+	return (depth + 15) & ~15;
+}
+
+typedef struct
+{
+	i32 disp;
+	int width;
+} slot_access_t;
+
+static int compare_accesses(const void *a, const void *b)
+{
+	const slot_access_t *sa = a, *sb = b;
+	return sa->disp < sb->disp ? -1 : sa->disp > sb->disp;
+}
+
+static voperand_t *local_slot(voperand_t *op)
+{
+	if (!op->virtual || op->type != VOPERAND_INDIRECT_REGISTER_DISPLACEMENT ||
+		op->reg_indirect_displacement.reg.index != VREG_BP || op->reg_indirect_displacement.disp >= 0)
+		return NULL;
+	return op;
+}
+
+bool optimize_stack_slots(function_t *f, arena_t *allocator)
+{
+	vinstr_list_t *list = &f->instructions;
+	vinstr_t *alloca = list->head ? list->head->next : NULL;
+	if (!alloca || list->head->opcode != VOP_ENTER || alloca->opcode != VOP_ALLOCA ||
+		alloca->operands[0].type != VOPERAND_IMMEDIATE || optimize_frame_pointer_escapes(f))
+		return true;
+
+	size_t numaccesses = 0;
+	vinstr_list_foreach(list, instr)
+	{
+		for (size_t i = 0; i < instr->numoperands; ++i)
+		{
+			voperand_t *op = &instr->operands[i];
+			if (op->virtual && op->type == VOPERAND_INDIRECT_REGISTER && op->reg.index == VREG_BP)
+				return true;
+			if (local_slot(op))
+				++numaccesses;
+		}
+	}
+	slot_access_t *accesses = (slot_access_t *)arena_alloc(allocator, sizeof(slot_access_t) * (numaccesses + 1));
+	frame_slot_t *slots = (frame_slot_t *)arena_alloc(allocator, sizeof(frame_slot_t) * (numaccesses + 1));
+	i32 *starts = (i32 *)arena_alloc(allocator, sizeof(i32) * (numaccesses + 1));
+	int *offsets = (int *)arena_alloc(allocator, sizeof(int) * (numaccesses + 1));
+	if (!accesses || !slots || !starts || !offsets)
+		return false;
+	size_t n = 0;
+	vinstr_list_foreach(list, instr)
+	{
+		for (size_t i = 0; i < instr->numoperands; ++i)
+		{
+			voperand_t *op = local_slot(&instr->operands[i]);
+			if (!op)
+				continue;
+			accesses[n].disp = op->reg_indirect_displacement.disp;
+			accesses[n].width = voperand_access_width(op);
+			++n;
+		}
+	}
+	qsort(accesses, n, sizeof(slot_access_t), compare_accesses);
+
+	// accesses that overlap belong to the same slot, it keeps the alignment its start had
+	size_t numslots = 0;
+	i32 end = 0;
+	for (size_t i = 0; i < n; ++i)
+	{
+		if (!numslots || accesses[i].disp >= end)
+		{
+			starts[numslots] = accesses[i].disp;
+			slots[numslots].size = 0;
+			slots[numslots].offset = &offsets[numslots];
+			++numslots;
+			end = accesses[i].disp;
+		}
+		if (accesses[i].disp + accesses[i].width > end)
+			end = accesses[i].disp + accesses[i].width;
+		frame_slot_t *slot = &slots[numslots - 1];
+		slot->size = end - starts[numslots - 1];
+	}
+	for (size_t i = 0; i < numslots; ++i)
+	{
+		// pads the size so the slot is aligned like its start was
+		int alignment = slot_alignment(-starts[i]);
+		while (slot_alignment(slots[i].size) < alignment)
+			slots[i].size += slot_alignment(slots[i].size);
+	}
+	int size = frame_layout(slots, numslots);
+	if (size >= imm_cast_int64_t(&alloca->operands[0].imm))
+		return true;
+
+	vinstr_list_foreach(list, instr)
+	{
+		for (size_t i = 0; i < instr->numoperands; ++i)
+		{
+			voperand_t *op = local_slot(&instr->operands[i]);
+			if (!op)
+				continue;
+			i32 *disp = &op->reg_indirect_displacement.disp;
+			// the slot that starts at or below the displacement, the starts are sorted
+			size_t lo = 0, hi = numslots;
+			while (hi - lo > 1)
+			{
+				size_t mid = (lo + hi) / 2;
+				if (starts[mid] <= *disp)
+					lo = mid;
+				else
+					hi = mid;
+			}
+			*disp = offsets[lo] + (*disp - starts[lo]);
+		}
+	}
+	alloca->operands[0] = imm32_operand(size);
+	return true;
+}
+
+// after register allocation the size of the frame is known. a function that doesn't call anything doesn't need rbp,
+// rsp stays where it was on entry and the slots are addressed from it. System V leaves the 128 bytes below rsp to
+// leaf functions, a frame that fits in there doesn't even have to be allocated
+
+#define FRAME_RED_ZONE_SIZE (128)
+
+static bool is_register(voperand_t *op, int reg)
+{
+	return op->type == VOPERAND_REGISTER && !op->virtual && op->reg.index == reg && !voperand_is_floating_point(op);
+}
+
+// lowest displacement from rbp the function accesses, false if rsp is moved or rbp is used other than as the base of a
+// slot
+static bool frame_accesses(function_t *f, i32 *lowest)
+{
+	*lowest = 0;
+	vinstr_list_foreach(&f->instructions, instr)
+	{
+		switch (instr->opcode)
+		{
+			case VOP_CALL:
+			case VOP_PUSH:
+			case VOP_POP:
+				return false;
+		}
+		for (size_t i = 0; i < instr->numoperands; ++i)
+		{
+			voperand_t *op = &instr->operands[i];
+			if (op->type == VOPERAND_IMMEDIATE || op->type == VOPERAND_LABEL)
+				continue;
+			if (op->virtual || is_register(op, RSP) || is_register(op, RBP))
+				return false;
+			if (op->type == VOPERAND_INDIRECT_REGISTER && (op->reg.index == RBP || op->reg.index == RSP))
+				return false;
+			if (op->type == VOPERAND_INDIRECT_REGISTER_INDEXED &&
+				(op->reg_indirect_indexed.reg.index == RBP || op->reg_indirect_indexed.reg.index == RSP ||
+				 op->reg_indirect_indexed.indexed_reg.index == RBP || op->reg_indirect_indexed.indexed_reg.index == RSP))
+				return false;
+			if (op->type != VOPERAND_INDIRECT_REGISTER_DISPLACEMENT)
+				continue;
+			if (op->reg_indirect_displacement.reg.index == RSP)
+				return false;
+			if (op->reg_indirect_displacement.reg.index == RBP && (i32)op->reg_indirect_displacement.disp < *lowest)
+				*lowest = op->reg_indirect_displacement.disp;
+		}
+	}
+	return true;
+}
+
+static void set_stack_adjustment(vinstr_t *instr, vopcode_t opcode, i32 bytes)
+{
+	vregister_t rsp = {.index = RSP};
+	instr->opcode = opcode;
+	instr->operands[0] = register_operand(rsp);
+	instr->operands[0].size = VOPERAND_SIZE_64_BITS;
+	instr->operands[0].virtual = false;
+	instr->operands[1] = imm32_operand(bytes);
+	instr->numoperands = 2;
+}
+
+bool optimize_frame(function_t *f, arena_t *allocator)
+{
+	vinstr_list_t *list = &f->instructions;
+	vinstr_t *enter = list->head;
+	if (!enter || enter->opcode != VOP_ENTER || !enter->next || enter->next->opcode != VOP_ALLOCA ||
+		enter->next->operands[0].type != VOPERAND_IMMEDIATE)
+		return true;
+	vinstr_t *alloca = enter->next;
+
+	i32 lowest;
+	if (!frame_accesses(f, &lowest))
+	{
+		// still needs the frame pointer, but rsp doesn't have to move for a empty frame
+		if (imm_cast_int64_t(&alloca->operands[0].imm) == 0)
+			vinstr_list_remove(list, alloca);
+		return true;
+	}
+
+	// without the push of rbp the slot at [rbp + d] is at [rsp + d - 8] on entry
+	i32 size = 8 - lowest <= FRAME_RED_ZONE_SIZE ? 0 : (8 - lowest + 7) & ~7;
+	for (vinstr_t *instr = list->head; instr;)
+	{
+		vinstr_t *next = instr->next;
+		if (instr->opcode == VOP_LEAVE && !size)
+		{
+			vinstr_list_remove(list, instr);
+			instr = next;
+			continue;
+		}
+		if (instr->opcode == VOP_LEAVE)
+			set_stack_adjustment(instr, VOP_ADD, size);
+		for (size_t i = 0; i < instr->numoperands; ++i)
+		{
+			voperand_t *op = &instr->operands[i];
+			if (op->type != VOPERAND_INDIRECT_REGISTER_DISPLACEMENT || op->reg_indirect_displacement.reg.index != RBP)
+				continue;
+			op->reg_indirect_displacement.reg.index = RSP;
+			op->reg_indirect_displacement.disp += size - 8;
+		}
+		instr = next;
+	}
+	vinstr_list_remove(list, enter);
+	if (size)
+		set_stack_adjustment(alloca, VOP_SUB, size);
+	else
+		vinstr_list_remove(list, alloca);
+	return true;
+}
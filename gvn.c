@@ -0,0 +1,460 @@
+#include "optimize.h"
+#include "std.h"
+#include <stdio.h>
+
+// dominator based value numbering from Briggs, Cooper and Simpson, Value Numbering. a expression is available in
+// every block dominated by the block computing it, loads are only reused while no store or call in between can write
+// the memory they read, which keeps them within a extended basic block
+
+typedef struct
+{
+	vopcode_t opcode;
+	size_t numoperands;
+	voperand_t operands[3]; // the destination only contributes its size
+	int value; // vreg that holds the result
+	size_t load; // position on the load stack, -1 for expressions that don't read memory
+	bool killed; // a store may have written the memory the load read
+} gvn_entry_t;
+
+typedef struct
+{
+	bool kill; // the entry at index was killed, otherwise the slot at index held previous
+	size_t index;
+	int previous;
+} gvn_undo_t;
+
+typedef struct
+{
+	function_t *function;
+	arena_t *allocator;
+	cfg_t cfg;
+	bool frame_escapes; // the address of a stack slot is taken so pointers can point into the frame
+
+	int *leaders; // the vreg each vreg was found equal to
+
+	gvn_entry_t *entries;
+	size_t numentries;
+	int *slots; // hash table of entry indices, -1 when empty
+	size_t slotmask;
+
+	// loads that are still available, the ones below loadbase were done on another path into the block
+	size_t *loads;
+	size_t numloads, loadbase;
+
+	gvn_undo_t *undo;
+	size_t numundo;
+} gvn_t;
+
+static int leader(gvn_t *g, int vreg)
+{
+	return vreg >= VREG_MAX ? g->leaders[vreg] : vreg;
+}
+
+static void rewrite_operand(gvn_t *g, voperand_t *op)
+{
+	if (!op->virtual)
+		return;
+	vregister_t *regs[2];
+	size_t n = voperand_registers(op, regs);
+	for (size_t i = 0; i < n; ++i)
+		regs[i]->index = leader(g, regs[i]->index);
+}
+
+// only SSA vregs and the frame pointer keep their value, the stack pointer and return value change under us
+static bool operand_is_stable(voperand_t *op)
+{
+	if (op->type == VOPERAND_LABEL || op->type == VOPERAND_INVALID)
+		return false;
+	if (!op->virtual)
+		return op->type == VOPERAND_IMMEDIATE;
+	vregister_t *regs[2];
+	size_t n = voperand_registers(op, regs);
+	for (size_t i = 0; i < n; ++i)
+	{
+		if (regs[i]->index < VREG_MAX && regs[i]->index != VREG_BP)
+			return false;
+	}
+	return true;
+}
+
+static bool is_commutative(vopcode_t op)
+{
+	switch (op)
+	{
+		case VOP_ADD:
+		case VOP_MUL:
+		case VOP_AND:
+		case VOP_OR:
+		case VOP_XOR:
+		case VOP_FADD:
+		case VOP_FMUL:
+			return true;
+	}
+	return false;
+}
+
+// any fixed order works, it only has to put a + b and b + a the same way
+static bool operand_before(voperand_t *a, voperand_t *b)
+{
+	if (a->type != b->type)
+		return a->type > b->type;
+	if (a->type == VOPERAND_REGISTER)
+		return a->reg.index < b->reg.index;
+	if (a->type == VOPERAND_IMMEDIATE)
+		return imm_cast_int64_t(&a->imm) < imm_cast_int64_t(&b->imm);
+	return false;
+}
+
+// fills in the key of a instruction that computes its destination from the operands alone, or from memory
+static bool make_key(vinstr_t *instr, gvn_entry_t *key)
+{
+	if (instr->numoperands < 2 || instr->numoperands > 3)
+		return false;
+	voperand_t *dst = &instr->operands[0];
+	if (dst->type != VOPERAND_REGISTER || !dst->virtual || dst->reg.index < VREG_MAX)
+		return false;
+	for (size_t i = 1; i < instr->numoperands; ++i)
+	{
+		if (!operand_is_stable(&instr->operands[i]))
+			return false;
+	}
+
+	key->opcode = instr->opcode;
+	key->load = (size_t)-1;
+	key->killed = false;
+	switch (instr->opcode)
+	{
+		case VOP_ADD:
+		case VOP_SUB:
+		case VOP_MUL:
+		case VOP_DIV:
+		case VOP_MOD:
+		case VOP_FADD:
+		case VOP_FSUB:
+		case VOP_FMUL:
+		case VOP_FDIV:
+		case VOP_FMOD:
+		case VOP_AND:
+		case VOP_OR:
+		case VOP_XOR:
+		case VOP_SHL:
+		case VOP_SHR:
+		case VOP_SAR:
+		case VOP_MULH:
+			if (instr->numoperands != 3 || voperand_is_memory(&instr->operands[1]) ||
+				voperand_is_memory(&instr->operands[2]))
+				return false;
+			break;
+		case VOP_SITOFP:
+		case VOP_FPTOSI:
+			if (instr->numoperands != 2 || voperand_is_memory(&instr->operands[1]))
+				return false;
+			break;
+		case VOP_LEA:
+			if (instr->numoperands != 2)
+				return false;
+			break;
+		case VOP_MOV:
+		case VOP_LOAD:
+			if (instr->numoperands != 2)
+				return false;
+			// constants are cheaper to materialize again than to keep in a register
+			if (instr->operands[1].type == VOPERAND_IMMEDIATE)
+				return false;
+			if (voperand_is_memory(&instr->operands[1]))
+				key->opcode = VOP_LOAD;
+			break;
+		default:
+			return false;
+	}
+	key->numoperands = instr->numoperands;
+	memcpy(key->operands, instr->operands, sizeof(voperand_t) * instr->numoperands);
+	key->operands[0].reg.index = 0;
+	if (is_commutative(key->opcode) && operand_before(&key->operands[2], &key->operands[1]))
+	{
+		voperand_t tmp = key->operands[1];
+		key->operands[1] = key->operands[2];
+		key->operands[2] = tmp;
+	}
+	return true;
+}
+
+static u32 hash_combine(u32 h, i64 v)
+{
+	h ^= (u32)v + 0x9e3779b9 + (h << 6) + (h >> 2);
+	return h ^ (u32)(v >> 32);
+}
+
+static u32 hash_key(gvn_entry_t *key)
+{
+	u32 h = hash_combine(key->opcode, key->numoperands);
+	for (size_t i = 0; i < key->numoperands; ++i)
+	{
+		voperand_t *op = &key->operands[i];
+		h = hash_combine(h, op->type * 16 + op->size);
+		switch (op->type)
+		{
+			case VOPERAND_IMMEDIATE:
+			case VOPERAND_INDIRECT:
+				h = hash_combine(h, imm_cast_int64_t(&op->imm));
+				break;
+			case VOPERAND_REGISTER:
+			case VOPERAND_INDIRECT_REGISTER:
+				h = hash_combine(h, op->reg.index);
+				break;
+			case VOPERAND_INDIRECT_REGISTER_DISPLACEMENT:
+				h = hash_combine(h, op->reg_indirect_displacement.reg.index);
+				h = hash_combine(h, op->reg_indirect_displacement.disp);
+				break;
+			case VOPERAND_INDIRECT_REGISTER_INDEXED:
+				h = hash_combine(h, op->reg_indirect_indexed.reg.index);
+				h = hash_combine(h, op->reg_indirect_indexed.indexed_reg.index);
+				h = hash_combine(h, op->reg_indirect_indexed.scale);
+				break;
+		}
+	}
+	return h;
+}
+
+static bool key_equal(gvn_entry_t *a, gvn_entry_t *b)
+{
+	if (a->opcode != b->opcode || a->numoperands != b->numoperands)
+		return false;
+	for (size_t i = 0; i < a->numoperands; ++i)
+	{
+		if (!voperand_equal(&a->operands[i], &b->operands[i]))
+			return false;
+	}
+	return true;
+}
+
+// slot holding a equal key, or the empty slot where it would go
+static size_t find_slot(gvn_t *g, gvn_entry_t *key)
+{
+	size_t slot = hash_key(key) & g->slotmask;
+	while (g->slots[slot] != -1 && !key_equal(&g->entries[g->slots[slot]], key))
+		slot = (slot + 1) & g->slotmask;
+	return slot;
+}
+
+static bool entry_available(gvn_t *g, gvn_entry_t *entry)
+{
+	if (entry->load == (size_t)-1)
+		return true;
+	return !entry->killed && entry->load >= g->loadbase;
+}
+
+// a slot only ever changes to a newer entry, so the undo log restores the table as the walk leaves a block
+static void insert_entry(gvn_t *g, size_t slot, gvn_entry_t *key, int value)
+{
+	size_t index = g->numentries++;
+	g->entries[index] = *key;
+	g->entries[index].value = value;
+	if (key->opcode == VOP_LOAD)
+	{
+		g->entries[index].load = g->numloads;
+		g->loads[g->numloads++] = index;
+	}
+	g->undo[g->numundo++] = (gvn_undo_t){false, slot, g->slots[slot]};
+	g->slots[slot] = (int)index;
+}
+
+static void kill_entry(gvn_t *g, size_t index)
+{
+	g->entries[index].killed = true;
+	g->undo[g->numundo++] = (gvn_undo_t){true, index, -1};
+}
+
+// with a NULL store everything the callee could reach is gone
+static void kill_loads(gvn_t *g, voperand_t *store)
+{
+	for (size_t i = g->loadbase; i < g->numloads; ++i)
+	{
+		gvn_entry_t *entry = &g->entries[g->loads[i]];
+		if (entry->killed)
+			continue;
+		voperand_t *addr = &entry->operands[1];
+		bool clobbered = store ? optimize_may_alias(store, addr, g->frame_escapes)
+							   : g->frame_escapes || !voperand_is_frame_slot(addr);
+		if (clobbered)
+			kill_entry(g, g->loads[i]);
+	}
+}
+
+static void replace(gvn_t *g, vinstr_t *instr, int value)
+{
+	g->leaders[instr->operands[0].reg.index] = value;
+	vinstr_list_remove(&g->function->instructions, instr);
+}
+
+// a phi is redundant if every argument is the same vreg, not counting the phi itself on a backedge
+static void visit_phi(gvn_t *g, vinstr_t *phi)
+{
+	int dst = phi->operands[0].reg.index;
+	int same = -1;
+	for (size_t i = 0; i < phi->phi->numargs; ++i)
+	{
+		voperand_t *value = &phi->phi->args[i].value;
+		if (value->type != VOPERAND_REGISTER || !value->virtual)
+			return;
+		int vreg = leader(g, value->reg.index);
+		if (vreg == dst)
+			continue;
+		if (vreg < VREG_MAX || (same != -1 && same != vreg))
+			return;
+		same = vreg;
+	}
+	if (same != -1)
+		replace(g, phi, same);
+}
+
+static void visit_instruction(gvn_t *g, vinstr_t *instr)
+{
+	for (size_t i = 0; i < instr->numoperands; ++i)
+		rewrite_operand(g, &instr->operands[i]);
+
+	if (instr->opcode == VOP_CALL)
+	{
+		kill_loads(g, NULL);
+		return;
+	}
+	if (instr->numoperands > 0 && vinstr_first_operand_is_written(instr) && voperand_is_memory(&instr->operands[0]))
+	{
+		voperand_t *store = &instr->operands[0];
+		kill_loads(g, store);
+
+		// the next load of the same location reads what was just stored
+		voperand_t *src = &instr->operands[1];
+		if (instr->opcode == VOP_MOV && operand_is_stable(store) && src->type == VOPERAND_REGISTER && src->virtual &&
+			src->reg.index >= VREG_MAX && src->size == store->size)
+		{
+			gvn_entry_t key = {.opcode = VOP_LOAD, .numoperands = 2, .load = (size_t)-1};
+			key.operands[0] = register_operand((vregister_t){0});
+			key.operands[0].size = store->size;
+			key.operands[1] = *store;
+			insert_entry(g, find_slot(g, &key), &key, src->reg.index);
+		}
+		return;
+	}
+
+	gvn_entry_t key;
+	if (!make_key(instr, &key))
+		return;
+	// copies of the same size take the value of their source
+	if (key.opcode == VOP_MOV && key.operands[1].type == VOPERAND_REGISTER && key.operands[1].reg.index >= VREG_MAX &&
+		key.operands[1].size == instr->operands[0].size)
+	{
+		replace(g, instr, key.operands[1].reg.index);
+		return;
+	}
+	size_t slot = find_slot(g, &key);
+	if (g->slots[slot] != -1 && entry_available(g, &g->entries[g->slots[slot]]))
+	{
+		replace(g, instr, g->entries[g->slots[slot]].value);
+		return;
+	}
+	insert_entry(g, slot, &key, instr->operands[0].reg.index);
+}
+
+static void visit_block(gvn_t *g, basic_block_t *bb)
+{
+	// the blocks before it could've been left through other paths, which may have stored to memory
+	if (bb->numpred != 1)
+		g->loadbase = g->numloads;
+	vinstr_t *end = bb->last->next;
+	for (vinstr_t *instr = bb->first; instr != end;)
+	{
+		vinstr_t *next = instr->next;
+		if (instr->opcode == VOP_PHI)
+			visit_phi(g, instr);
+		else
+			visit_instruction(g, instr);
+		instr = next;
+	}
+}
+
+typedef struct
+{
+	size_t numundo, numentries, numloads, loadbase;
+	size_t nextchild;
+} gvn_scope_t;
+
+static void leave_block(gvn_t *g, gvn_scope_t *scope)
+{
+	while (g->numundo > scope->numundo)
+	{
+		gvn_undo_t *undo = &g->undo[--g->numundo];
+		if (undo->kill)
+			g->entries[undo->index].killed = false;
+		else
+			g->slots[undo->index] = undo->previous;
+	}
+	g->numentries = scope->numentries;
+	g->numloads = scope->numloads;
+	g->loadbase = scope->loadbase;
+}
+
+bool optimize_gvn(function_t *f, arena_t *allocator)
+{
+	if (!f->instructions.head)
+		return true;
+	gvn_t g = {0};
+	g.function = f;
+	g.allocator = allocator;
+	if (!cfg_build(&g.cfg, f, allocator))
+		return false;
+	cfg_t *cfg = &g.cfg;
+	g.frame_escapes = optimize_frame_pointer_escapes(f);
+
+	size_t numids = f->instructions.nextid + 1;
+	size_t numslots = 16;
+	while (numslots < numids * 2)
+		numslots *= 2;
+	g.slotmask = numslots - 1;
+	g.leaders = (int *)arena_alloc(allocator, sizeof(int) * f->numvregs);
+	g.entries = (gvn_entry_t *)arena_alloc(allocator, sizeof(gvn_entry_t) * numids);
+	g.slots = (int *)arena_alloc(allocator, sizeof(int) * numslots);
+	g.loads = (size_t *)arena_alloc(allocator, sizeof(size_t) * numids);
+	g.undo = (gvn_undo_t *)arena_alloc(allocator, sizeof(gvn_undo_t) * numids * 2);
+	gvn_scope_t *scopes = (gvn_scope_t *)arena_alloc(allocator, sizeof(gvn_scope_t) * cfg->numblocks);
+	basic_block_t **stack = (basic_block_t **)arena_alloc(allocator, sizeof(basic_block_t *) * cfg->numblocks);
+	if (!g.leaders || !g.entries || !g.slots || !g.loads || !g.undo || !scopes || !stack)
+		return false;
+	for (size_t v = 0; v < f->numvregs; ++v)
+		g.leaders[v] = (int)v;
+	for (size_t i = 0; i < numslots; ++i)
+		g.slots[i] = -1;
+
+	size_t sp = 0;
+	basic_block_t *entry = cfg->rpo[0];
+	scopes[entry->index] = (gvn_scope_t){0};
+	stack[sp++] = entry;
+	visit_block(&g, entry);
+	while (sp > 0)
+	{
+		basic_block_t *bb = stack[sp - 1];
+		gvn_scope_t *scope = &scopes[bb->index];
+		if (scope->nextchild < bb->numdomchildren)
+		{
+			basic_block_t *child = bb->dom_children[scope->nextchild++];
+			scopes[child->index] = (gvn_scope_t){g.numundo, g.numentries, g.numloads, g.loadbase, 0};
+			stack[sp++] = child;
+			visit_block(&g, child);
+			continue;
+		}
+		leave_block(&g, scope);
+		--sp;
+	}
+
+	// phi arguments are uses at the end of the predecessor, which may have been visited before the leader was known
+	vinstr_list_foreach(&f->instructions, instr)
+	{
+		for (size_t i = 0; i < instr->numoperands; ++i)
+			rewrite_operand(&g, &instr->operands[i]);
+		if (instr->opcode != VOP_PHI)
+			continue;
+		for (size_t i = 0; i < instr->phi->numargs; ++i)
+			rewrite_operand(&g, &instr->phi->args[i].value);
+	}
+	return true;
+}
@@ -0,0 +1,345 @@
+#include "optimize.h"
+#include "std.h"
+#include <limits.h>
+#include <stdio.h>
+
+// inlines calls to small functions before any function is lowered, while vregs and labels are still numbered for the
+// whole program. the body of the callee is copied in place of the call with vregs and labels of its own, its locals
+// and parameters get stack slots below the ones of the caller and the arguments become stores to them.
+// functions are visited in postorder of the call graph so a callee already contains what it inlined itself
+
+// caller growth is limited to this many times its size plus the budget
+#define INLINE_MAX_GROWTH (4)
+
+typedef enum
+{
+	INLINE_UNVISITED,
+	INLINE_ON_STACK, // calls to these are recursive
+	INLINE_DONE
+} inline_state_t;
+
+typedef struct
+{
+	inline_state_t state;
+	bool inlinable;
+	size_t size; // instructions in the body
+	i32 framesize;
+	vinstr_t *first, *last; // the body starts after the parameters are stored and ends with the label returns jump to
+	int minvreg, maxvreg;
+	size_t minlabel, maxlabel;
+} callee_t;
+
+typedef struct
+{
+	compiler_t *ctx;
+	arena_t *allocator;
+	function_t **functions; // by index
+	callee_t *callees;
+	size_t numfunctions;
+} inliner_t;
+
+static i32 align8(i32 n)
+{
+	return (n + 7) & ~7;
+}
+
+// [bp + 16] up to the size of the pushed parameters are the arguments, anything below bp is a local
+static bool frame_operand_is_remappable(function_t *f, voperand_t *op)
+{
+	vregister_t *regs[2];
+	size_t n = op->virtual ? voperand_registers(op, regs) : 0;
+	for (size_t k = 0; k < n; ++k)
+	{
+		if (regs[k]->index != VREG_BP)
+			continue;
+		if (op->type != VOPERAND_INDIRECT_REGISTER_DISPLACEMENT)
+			return false;
+		i32 disp = op->reg_indirect_displacement.disp;
+		if (disp >= 0 && (disp < 16 || disp >= 16 + f->argcost))
+			return false;
+	}
+	return true;
+}
+
+static bool function_has_frame(function_t *f)
+{
+	vinstr_t *head = f->instructions.head;
+	return head && head->opcode == VOP_ENTER && head->next && head->next->opcode == VOP_ALLOCA &&
+		   head->next->operands[0].type == VOPERAND_IMMEDIATE;
+}
+
+static void summarize_callee(inliner_t *in, function_t *f, callee_t *c)
+{
+	c->inlinable = false;
+	vinstr_t *tail = f->instructions.tail;
+	if (!function_has_frame(f) || tail->opcode != VOP_RET || !tail->prev || tail->prev->opcode != VOP_LEAVE)
+		return;
+	vinstr_t *eof = tail->prev->prev;
+	if (!eof || eof->opcode != VOP_LABEL || eof->operands[0].label != f->eoflabel.label)
+		return;
+	if (f->numparameters > FUNCTION_MAX_PARAMETERS)
+		return;
+
+	c->framesize = (i32)imm_cast_int64_t(&f->instructions.head->next->operands[0].imm);
+	c->first = f->instructions.head->next->next;
+	// the parameters that came in registers are stored to their slots first, the arguments are stored there instead
+	for (size_t i = 0; i < f->numparameters; ++i)
+	{
+		function_parameter_t *p = &f->parameters[i];
+		if (p->reg == -1)
+			continue;
+		voperand_t *home = &c->first->operands[0], *src = &c->first->operands[1];
+		if (c->first == eof || c->first->opcode != VOP_MOV || home->type != VOPERAND_INDIRECT_REGISTER_DISPLACEMENT ||
+			home->reg_indirect_displacement.reg.index != VREG_BP || home->reg_indirect_displacement.disp != p->offset ||
+			src->type != VOPERAND_REGISTER || src->reg.index != p->reg)
+			return;
+		c->first = c->first->next;
+	}
+	c->last = eof;
+	c->size = 0;
+	c->minvreg = INT_MAX;
+	c->maxvreg = VREG_MAX - 1;
+	c->minlabel = (size_t)-1;
+	c->maxlabel = 0;
+	for (vinstr_t *instr = c->first; instr != c->last->next; instr = instr->next)
+	{
+		switch (instr->opcode)
+		{
+			case VOP_ENTER:
+			case VOP_LEAVE:
+			case VOP_RET:
+			case VOP_ALLOCA:
+			case VOP_HLT:
+				return;
+		}
+		++c->size;
+		for (size_t i = 0; i < instr->numoperands; ++i)
+		{
+			voperand_t *op = &instr->operands[i];
+			if (op->type == VOPERAND_LABEL)
+			{
+				c->minlabel = op->label < c->minlabel ? op->label : c->minlabel;
+				c->maxlabel = op->label > c->maxlabel ? op->label : c->maxlabel;
+				continue;
+			}
+			// the frame pointer as a value would point into the frame of the caller
+			if (op->virtual && op->type == VOPERAND_REGISTER && op->reg.index == VREG_BP)
+				return;
+			if (!frame_operand_is_remappable(f, op))
+				return;
+			vregister_t *regs[2];
+			size_t n = op->virtual ? voperand_registers(op, regs) : 0;
+			for (size_t k = 0; k < n; ++k)
+			{
+				if (regs[k]->index < VREG_MAX)
+					continue;
+				c->minvreg = regs[k]->index < c->minvreg ? regs[k]->index : c->minvreg;
+				c->maxvreg = regs[k]->index > c->maxvreg ? regs[k]->index : c->maxvreg;
+			}
+		}
+	}
+	if (c->minvreg == INT_MAX)
+		c->minvreg = VREG_MAX;
+	c->inlinable = true;
+}
+
+static function_t *call_target(inliner_t *in, vinstr_t *instr)
+{
+	if (instr->opcode != VOP_CALL || instr->operands[0].type != VOPERAND_IMMEDIATE)
+		return NULL;
+	i64 index = imm_cast_int64_t(&instr->operands[0].imm);
+	return index >= 0 && index < in->numfunctions ? in->functions[index] : NULL;
+}
+
+// the code that goes away with the call makes up for part of the body, constant arguments likely fold away as well
+static bool worth_inlining(inliner_t *in, function_t *callee, optimize_call_site_t *site)
+{
+	callee_t *c = &in->callees[callee->index];
+	size_t benefit = callee->numparameters + 6; // the arguments, call and add, enter, alloca, leave and ret
+	for (size_t i = 0; i < callee->numparameters; ++i)
+	{
+		if (optimize_call_argument(site->arguments[i])->type == VOPERAND_IMMEDIATE)
+			benefit += 2;
+	}
+	size_t budget = in->ctx->inline_budget;
+	if (callee->inline_hint)
+		budget *= 4;
+	return c->size <= budget + benefit;
+}
+
+static voperand_size_t argument_size(voperand_t *arg, int bytes)
+{
+	if (voperand_is_floating_point(arg))
+		return arg->size;
+	return (voperand_size_t)bytes;
+}
+
+static void remap_vreg(inliner_t *in, callee_t *c, int *vregmap, vregister_t *reg)
+{
+	if (reg->index < VREG_MAX)
+		return;
+	int *mapped = &vregmap[reg->index - c->minvreg];
+	if (*mapped == -1)
+		*mapped = in->ctx->vregindex++;
+	reg->index = *mapped;
+}
+
+static bool inline_call(inliner_t *in, function_t *caller, vinstr_t *call, function_t *callee, size_t limit)
+{
+	callee_t *c = &in->callees[callee->index];
+	vinstr_list_t *list = &caller->instructions;
+	if (list->count + c->size > limit)
+		return true;
+
+	optimize_call_site_t site;
+	if (!optimize_call_site(callee, call, &site) || !worth_inlining(in, callee, &site))
+		return true;
+
+	// the slots of a frame of n bytes lie within [bp - n - 8, bp + 8), the callee's locals are moved below the ones of
+	// the caller and its parameters below those
+	vinstr_t *alloca = list->head->next;
+	i32 framesize = (i32)imm_cast_int64_t(&alloca->operands[0].imm);
+	i32 localshift = align8(framesize + 8) + 8;
+	i32 parameters = -(localshift + align8(c->framesize + 8) + align8(callee->argcost));
+
+	size_t numvregs = c->maxvreg - c->minvreg + 1, numlabels = c->maxlabel - c->minlabel + 1;
+	int *vregmap = (int *)arena_alloc(in->allocator, sizeof(int) * (numvregs + 1));
+	size_t *labelmap = (size_t *)arena_alloc(in->allocator, sizeof(size_t) * numlabels);
+	if (!vregmap || !labelmap)
+		return false;
+	memset(vregmap, -1, sizeof(int) * numvregs);
+	memset(labelmap, -1, sizeof(size_t) * numlabels);
+
+	vregister_t bpreg = {.index = VREG_BP};
+	for (size_t i = 0; i < callee->numparameters; ++i)
+	{
+		function_parameter_t *p = &callee->parameters[i];
+		vinstr_t *instr = site.arguments[i];
+		voperand_t arg = *optimize_call_argument(instr);
+		i32 offset = p->reg == -1 ? parameters + p->offset - 16 : p->offset - localshift;
+		instr->opcode = VOP_MOV;
+		instr->operands[0] = indirect_register_displacement_operand(bpreg, offset, argument_size(&arg, p->size));
+		instr->operands[1] = arg;
+		instr->numoperands = 2;
+	}
+
+	for (vinstr_t *instr = c->first; instr != c->last->next; instr = instr->next)
+	{
+		vinstr_t *copy = vinstr_list_insert_before(list, call);
+		if (!copy)
+			return false;
+		copy->opcode = instr->opcode;
+		copy->numoperands = instr->numoperands;
+		for (size_t i = 0; i < instr->numoperands; ++i)
+		{
+			voperand_t *op = &copy->operands[i];
+			*op = instr->operands[i];
+			if (op->type == VOPERAND_LABEL)
+			{
+				size_t *mapped = &labelmap[op->label - c->minlabel];
+				if (*mapped == (size_t)-1)
+					*mapped = in->ctx->labelindex++;
+				op->label = *mapped;
+				continue;
+			}
+			if (!op->virtual)
+				continue;
+			if (op->type == VOPERAND_INDIRECT_REGISTER_DISPLACEMENT && op->reg_indirect_displacement.reg.index == VREG_BP)
+			{
+				i32 *disp = &op->reg_indirect_displacement.disp;
+				*disp = *disp < 0 ? *disp - localshift : parameters + *disp - 16;
+				continue;
+			}
+			vregister_t *regs[2];
+			size_t n = voperand_registers(op, regs);
+			for (size_t k = 0; k < n; ++k)
+				remap_vreg(in, c, vregmap, regs[k]);
+		}
+	}
+	vinstr_list_remove(list, call);
+	if (site.padding)
+		vinstr_list_remove(list, site.padding);
+	if (site.pop)
+		vinstr_list_remove(list, site.pop);
+	alloca->operands[0] = imm32_operand(-parameters);
+	return true;
+}
+
+static bool inline_calls(inliner_t *in, function_t *f)
+{
+	if (!function_has_frame(f))
+		return true;
+	size_t numcalls = 0;
+	vinstr_list_foreach(&f->instructions, instr)
+	{
+		if (call_target(in, instr))
+			++numcalls;
+	}
+	if (!numcalls)
+		return true;
+	// the calls that come along with a inlined body aren't inlined again
+	vinstr_t **calls = (vinstr_t **)arena_alloc(in->allocator, sizeof(vinstr_t *) * numcalls);
+	if (!calls)
+		return false;
+	numcalls = 0;
+	vinstr_list_foreach(&f->instructions, instr)
+	{
+		if (call_target(in, instr))
+			calls[numcalls++] = instr;
+	}
+	size_t limit = INLINE_MAX_GROWTH * (f->instructions.count + in->ctx->inline_budget);
+	for (size_t i = 0; i < numcalls; ++i)
+	{
+		function_t *callee = call_target(in, calls[i]);
+		callee_t *c = &in->callees[callee->index];
+		if (c->state != INLINE_DONE || !c->inlinable)
+			continue;
+		if (!inline_call(in, f, calls[i], callee, limit))
+			return false;
+	}
+	return true;
+}
+
+static bool visit_function(inliner_t *in, function_t *f)
+{
+	callee_t *c = &in->callees[f->index];
+	c->state = INLINE_ON_STACK;
+	vinstr_list_foreach(&f->instructions, instr)
+	{
+		function_t *callee = call_target(in, instr);
+		if (callee && in->callees[callee->index].state == INLINE_UNVISITED && !visit_function(in, callee))
+			return false;
+	}
+	if (!inline_calls(in, f))
+		return false;
+	c->state = INLINE_DONE;
+	summarize_callee(in, f, c);
+	return true;
+}
+
+bool optimize_inline(compiler_t *ctx, arena_t *allocator)
+{
+	if (ctx->inline_budget <= 0)
+		return true;
+	inliner_t in = {0};
+	in.ctx = ctx;
+	in.allocator = allocator;
+	in.numfunctions = ctx->numfunctions;
+	in.functions = (function_t **)arena_alloc(allocator, sizeof(function_t *) * in.numfunctions);
+	in.callees = (callee_t *)arena_alloc(allocator, sizeof(callee_t) * in.numfunctions);
+	if (!in.functions || !in.callees)
+		return false;
+	memset(in.functions, 0, sizeof(function_t *) * in.numfunctions);
+	memset(in.callees, 0, sizeof(callee_t) * in.numfunctions);
+	hash_map_foreach_entry(ctx->functions, entry, {
+		function_t *f = entry->data;
+		if (f->index < in.numfunctions)
+			in.functions[f->index] = f;
+	});
+	for (size_t i = 0; i < in.numfunctions; ++i)
+	{
+		if (in.functions[i] && in.callees[i].state == INLINE_UNVISITED && !visit_function(&in, in.functions[i]))
+			return false;
+	}
+	return true;
+}
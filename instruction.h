@@ -4,13 +4,190 @@
 #include "imm.h"
 #include "operand.h"
 #include "virtual_opcodes.h"
+#include "arena.h"
 
 typedef struct
+{
+	voperand_t value; // invalid if the value is undefined on that path
+	size_t label; // label of the predecessor block the value comes from
+} vphi_arg_t;
+
+typedef struct vphi_s
+{
+	int vreg; // the vreg the phi was placed for, before renaming
+	size_t numargs;
+	vphi_arg_t args[];
+} vphi_t;
+
+typedef struct vinstr_s
 {
 	/* size_t index; */
 	vopcode_t opcode;
 	voperand_t operands[4];
 	size_t numoperands;
+	vphi_t *phi; // only for VOP_PHI, the destination is the first operand
+
+	// unique within a function and never reused, can be used to check whether a handle still refers to the same
+	// instruction, the order of the ids isn't the order of the instructions after inserting
+	size_t id;
+	struct vinstr_s *prev, *next;
 } vinstr_t;
 
+// instructions are allocated in chunks from the arena and never move,
+// so a vinstr_t* stays valid until the instruction itself is removed
+typedef struct vinstr_chunk_s
+{
+	struct vinstr_chunk_s *next;
+	size_t used;
+	size_t capacity;
+	vinstr_t instructions[];
+} vinstr_chunk_t;
+
+#define VINSTR_CHUNK_MIN_CAPACITY (16)
+#define VINSTR_CHUNK_MAX_CAPACITY (1024)
+
+typedef struct
+{
+	arena_t *allocator;
+	vinstr_chunk_t *chunks; // most recent chunk first
+	vinstr_t *freelist; // removed instructions, linked through next
+	vinstr_t *head, *tail;
+	size_t count;
+	size_t nextid;
+} vinstr_list_t;
+
+// pointers to the registers a operand refers to, so they can be renamed in place
+static size_t voperand_registers(voperand_t *op, vregister_t **regs)
+{
+	switch (op->type)
+	{
+		case VOPERAND_REGISTER:
+		case VOPERAND_INDIRECT_REGISTER:
+			regs[0] = &op->reg;
+			return 1;
+		case VOPERAND_INDIRECT_REGISTER_DISPLACEMENT:
+			regs[0] = &op->reg_indirect_displacement.reg;
+			return 1;
+		case VOPERAND_INDIRECT_REGISTER_INDEXED:
+			regs[0] = &op->reg_indirect_indexed.reg;
+			regs[1] = &op->reg_indirect_indexed.indexed_reg;
+			return 2;
+	}
+	return 0;
+}
+
+#define vinstr_list_foreach(list, it) for (vinstr_t *it = (list)->head; it; it = it->next)
+
+static void vinstr_list_init(vinstr_list_t *list, arena_t *allocator)
+{
+	list->allocator = allocator;
+	list->chunks = NULL;
+	list->freelist = NULL;
+	list->head = NULL;
+	list->tail = NULL;
+	list->count = 0;
+	list->nextid = 0;
+}
+
+static vinstr_t *vinstr_list_alloc(vinstr_list_t *list)
+{
+	vinstr_t *instr = list->freelist;
+	if (instr)
+	{
+		list->freelist = instr->next;
+	}
+	else
+	{
+		vinstr_chunk_t *chunk = list->chunks;
+		if (!chunk || chunk->used >= chunk->capacity)
+		{
+			// start small, most functions only have a handful of instructions
+			size_t capacity = chunk ? chunk->capacity * 2 : VINSTR_CHUNK_MIN_CAPACITY;
+			if (capacity > VINSTR_CHUNK_MAX_CAPACITY)
+				capacity = VINSTR_CHUNK_MAX_CAPACITY;
+			chunk = (vinstr_chunk_t *)arena_alloc(list->allocator, sizeof(vinstr_chunk_t) + sizeof(vinstr_t) * capacity);
+			if (!chunk)
+				return NULL;
+			chunk->next = list->chunks;
+			chunk->used = 0;
+			chunk->capacity = capacity;
+			list->chunks = chunk;
+		}
+		instr = &chunk->instructions[chunk->used++];
+	}
+	memset(instr, 0, sizeof(vinstr_t));
+	instr->id = list->nextid++;
+	return instr;
+}
+
+// inserts a new instruction after at, or at the start of the list if at is NULL
+static vinstr_t *vinstr_list_insert_after(vinstr_list_t *list, vinstr_t *at)
+{
+	vinstr_t *instr = vinstr_list_alloc(list);
+	if (!instr)
+		return NULL;
+	instr->prev = at;
+	instr->next = at ? at->next : list->head;
+	if (instr->next)
+		instr->next->prev = instr;
+	else
+		list->tail = instr;
+	if (at)
+		at->next = instr;
+	else
+		list->head = instr;
+	++list->count;
+	return instr;
+}
+
+// inserts a new instruction before at, or at the end of the list if at is NULL
+static vinstr_t *vinstr_list_insert_before(vinstr_list_t *list, vinstr_t *at)
+{
+	return vinstr_list_insert_after(list, at ? at->prev : list->tail);
+}
+
+static vinstr_t *vinstr_list_append(vinstr_list_t *list)
+{
+	return vinstr_list_insert_after(list, list->tail);
+}
+
+// the removed instruction is reused by a later insert, other handles are unaffected
+static void vinstr_list_remove(vinstr_list_t *list, vinstr_t *instr)
+{
+	if (instr->prev)
+		instr->prev->next = instr->next;
+	else
+		list->head = instr->next;
+	if (instr->next)
+		instr->next->prev = instr->prev;
+	else
+		list->tail = instr->prev;
+	--list->count;
+	instr->prev = NULL;
+	instr->next = list->freelist;
+	list->freelist = instr;
+}
+
+// moves instr in front of at, unlike a remove and insert the instruction keeps its id
+static void vinstr_list_move_before(vinstr_list_t *list, vinstr_t *instr, vinstr_t *at)
+{
+	if (instr == at)
+		return;
+	if (instr->prev)
+		instr->prev->next = instr->next;
+	else
+		list->head = instr->next;
+	if (instr->next)
+		instr->next->prev = instr->prev;
+	else
+		list->tail = instr->prev;
+	instr->next = at;
+	instr->prev = at->prev;
+	if (at->prev)
+		at->prev->next = instr;
+	else
+		list->head = instr;
+	at->prev = instr;
+}
+
 #endif
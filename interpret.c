@@ -0,0 +1,600 @@
+#include "compile.h"
+#include "regalloc.h"
+#include "std.h"
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// runs the lowered program the way a x64 core would, on the registers the allocator assigned. nothing is encoded, so
+// the output of every optimization level can be checked by what main returns. the stack is a buffer of its own and
+// addresses are offsets into it. a call checks that rsp is 16 byte aligned and that the callee kept the callee saved
+// registers, and the caller saved ones are garbage after it like they could be on real hardware
+
+#define INTERPRET_STACK_SIZE (1 << 22)
+
+// addresses below this are treated as a null pointer
+#define INTERPRET_NULL_PAGE (4096)
+
+// pushed as the return address, the value the frame has to leave at the top of the stack when it returns
+#define INTERPRET_RETURN_ADDRESS ((i64)0x7e7e7e7e7e7e7e7e)
+
+// every call pushes at least a return address and keeps rsp aligned
+#define INTERPRET_MAX_FRAMES (INTERPRET_STACK_SIZE / 16)
+
+// room for the tables of functions and labels
+#define INTERPRET_INDEX_SIZE (1 << 24)
+
+#define INTERPRET_MAX_STEPS ((u64)1 << 32)
+
+typedef struct
+{
+	function_t *function;
+	vinstr_t *next; // where the caller continues
+	i64 saved[X64_REGISTER_MAX];
+} interpret_frame_t;
+
+typedef struct
+{
+	compiler_t *compiler;
+	jmp_buf jmp;
+	function_t **functions; // by index
+	vinstr_t ***labels; // by function index and label
+	u8 *stack;
+
+	i64 registers[X64_REGISTER_MAX];
+	i64 xmm[X64_XMM_REGISTER_MAX]; // the bits of a double
+	// the conditional jumps compare these, a compare sets both operands and other instructions the result and 0
+	i64 compare_a, compare_b;
+
+	interpret_frame_t *frames;
+	size_t numframes, maxframes;
+	function_t *function;
+	u64 steps;
+} interpret_t;
+
+static void interpret_error(interpret_t *in, const char *fmt, ...)
+{
+	char buffer[512] = {0};
+	va_list va;
+	va_start(va, fmt);
+	vsnprintf(buffer, sizeof(buffer), fmt, va);
+	va_end(va);
+	printf("Interpret Error: %s in function '%s'.\n", buffer, in->function ? in->function->name : NULL);
+	longjmp(in->jmp, 1);
+}
+
+static int operand_width(voperand_t *op)
+{
+	switch (op->size)
+	{
+		case VOPERAND_SIZE_8_BITS:
+		case VOPERAND_SIZE_16_BITS:
+		case VOPERAND_SIZE_32_BITS:
+			return op->size;
+		case VOPERAND_SIZE_FLOAT:
+			return 4;
+	}
+	return 8;
+}
+
+static i64 sign_extend(i64 value, int width)
+{
+	switch (width)
+	{
+		case 1:
+			return (i8)value;
+		case 2:
+			return (i16)value;
+		case 4:
+			return (i32)value;
+	}
+	return value;
+}
+
+static double as_double(i64 bits)
+{
+	double d;
+	memcpy(&d, &bits, sizeof(d));
+	return d;
+}
+
+static i64 double_bits(double d)
+{
+	i64 bits;
+	memcpy(&bits, &d, sizeof(bits));
+	return bits;
+}
+
+static i64 *register_pointer(interpret_t *in, voperand_t *op, vregister_t *reg)
+{
+	if (op->virtual)
+		interpret_error(in, "vreg %d wasn't allocated", reg->index);
+	if (op->type == VOPERAND_REGISTER && voperand_is_floating_point(op))
+		return &in->xmm[reg->index];
+	return &in->registers[reg->index];
+}
+
+static i64 address(interpret_t *in, voperand_t *op)
+{
+	switch (op->type)
+	{
+		case VOPERAND_INDIRECT_REGISTER:
+			return *register_pointer(in, op, &op->reg);
+		case VOPERAND_INDIRECT_REGISTER_DISPLACEMENT:
+			return *register_pointer(in, op, &op->reg_indirect_displacement.reg) + (i32)op->reg_indirect_displacement.disp;
+		case VOPERAND_INDIRECT_REGISTER_INDEXED:
+			return *register_pointer(in, op, &op->reg_indirect_indexed.reg) +
+				   *register_pointer(in, op, &op->reg_indirect_indexed.indexed_reg) * op->reg_indirect_indexed.scale;
+	}
+	interpret_error(in, "operand type %d isn't a address", op->type);
+	return 0;
+}
+
+static u8 *memory(interpret_t *in, i64 addr, int width)
+{
+	if (addr < INTERPRET_NULL_PAGE || addr > INTERPRET_STACK_SIZE - width)
+		interpret_error(in, "access of %d bytes at %lld is outside the stack", width, (long long)addr);
+	return &in->stack[addr];
+}
+
+// integers are sign extended from the width of the operand, floating point values are the bits of a double
+static i64 read_operand(interpret_t *in, voperand_t *op)
+{
+	switch (op->type)
+	{
+		case VOPERAND_IMMEDIATE:
+			if (voperand_is_floating_point(op))
+				return op->imm.dq;
+			return sign_extend(imm_cast_int64_t(&op->imm), operand_width(op));
+		case VOPERAND_REGISTER:
+		{
+			i64 value = *register_pointer(in, op, &op->reg);
+			return voperand_is_floating_point(op) ? value : sign_extend(value, operand_width(op));
+		}
+		case VOPERAND_INDIRECT_REGISTER:
+		case VOPERAND_INDIRECT_REGISTER_DISPLACEMENT:
+		case VOPERAND_INDIRECT_REGISTER_INDEXED:
+		{
+			int width = operand_width(op);
+			u8 *p = memory(in, address(in, op), width);
+			if (op->size == VOPERAND_SIZE_FLOAT)
+			{
+				float f;
+				memcpy(&f, p, sizeof(f));
+				return double_bits(f);
+			}
+			i64 value = 0;
+			memcpy(&value, p, width);
+			return op->size == VOPERAND_SIZE_DOUBLE ? value : sign_extend(value, width);
+		}
+	}
+	interpret_error(in, "can't read operand type %d", op->type);
+	return 0;
+}
+
+// like x64 a 32 bit write clears the upper half of the register and a 8 or 16 bit one keeps it
+static void write_operand(interpret_t *in, voperand_t *op, i64 value)
+{
+	switch (op->type)
+	{
+		case VOPERAND_REGISTER:
+		{
+			i64 *reg = register_pointer(in, op, &op->reg);
+			int width = operand_width(op);
+			if (voperand_is_floating_point(op) || width == 8)
+				*reg = value;
+			else if (width == 4)
+				*reg = (u32)value;
+			else
+			{
+				u64 mask = width == 1 ? 0xff : 0xffff;
+				*reg = (*reg & ~mask) | (value & mask);
+			}
+			return;
+		}
+		case VOPERAND_INDIRECT_REGISTER:
+		case VOPERAND_INDIRECT_REGISTER_DISPLACEMENT:
+		case VOPERAND_INDIRECT_REGISTER_INDEXED:
+		{
+			int width = operand_width(op);
+			u8 *p = memory(in, address(in, op), width);
+			if (op->size == VOPERAND_SIZE_FLOAT)
+			{
+				float f = (float)as_double(value);
+				memcpy(p, &f, sizeof(f));
+				return;
+			}
+			memcpy(p, &value, width);
+			return;
+		}
+	}
+	interpret_error(in, "can't write operand type %d", op->type);
+}
+
+static void push(interpret_t *in, i64 value)
+{
+	in->registers[RSP] -= 8;
+	memcpy(memory(in, in->registers[RSP], 8), &value, 8);
+}
+
+static i64 pop(interpret_t *in)
+{
+	i64 value;
+	memcpy(&value, memory(in, in->registers[RSP], 8), 8);
+	in->registers[RSP] += 8;
+	return value;
+}
+
+// high 64 bits of the signed 128 bit product
+static i64 multiply_high(i64 a, i64 b)
+{
+	u64 ua = a, ub = b;
+	u64 lo = (ua & 0xffffffff) * (ub & 0xffffffff);
+	u64 mid1 = (ua >> 32) * (ub & 0xffffffff) + (lo >> 32);
+	u64 mid2 = (ua & 0xffffffff) * (ub >> 32) + (mid1 & 0xffffffff);
+	u64 hi = (ua >> 32) * (ub >> 32) + (mid1 >> 32) + (mid2 >> 32);
+	// the unsigned product minus the corrections for negative operands
+	if (a < 0)
+		hi -= ub;
+	if (b < 0)
+		hi -= ua;
+	return (i64)hi;
+}
+
+static i64 arithmetic(interpret_t *in, vinstr_t *instr, i64 a, i64 b, int width)
+{
+	switch (instr->opcode)
+	{
+		case VOP_ADD:
+			return (u64)a + (u64)b;
+		case VOP_SUB:
+			return (u64)a - (u64)b;
+		case VOP_MUL:
+			return (u64)a * (u64)b;
+		case VOP_DIV:
+		case VOP_MOD:
+			// both trap on x64
+			if (b == 0 || (b == -1 && a == sign_extend((u64)1 << (width * 8 - 1), width)))
+				interpret_error(in, "division of %lld by %lld", (long long)a, (long long)b);
+			return instr->opcode == VOP_DIV ? a / b : a % b;
+		case VOP_AND:
+			return a & b;
+		case VOP_OR:
+			return a | b;
+		case VOP_XOR:
+			return a ^ b;
+		case VOP_SHL:
+			return (u64)a << (b & 63);
+		case VOP_SHR:
+			return (width == 8 ? (u64)a : (u64)a & (((u64)1 << (width * 8)) - 1)) >> (b & 63);
+		case VOP_SAR:
+			return a >> (b & 63);
+		case VOP_MULH:
+			return width == 8 ? multiply_high(a, b) : (a * b) >> (width * 8);
+	}
+	interpret_error(in, "%s isn't arithmetic", vopcode_names[instr->opcode]);
+	return 0;
+}
+
+// idiv and the one operand imul take the dividend or multiplicand in rax and write rdx before reading the other
+// operand, which can't be a immediate
+static void check_rdx_rax_operands(interpret_t *in, vinstr_t *instr)
+{
+	voperand_t *ops = instr->operands;
+	if (ops[0].type != VOPERAND_REGISTER || ops[0].virtual || ops[0].reg.index != RAX)
+		interpret_error(in, "%s with a first operand other than rax", vopcode_names[instr->opcode]);
+	if (ops[1].type == VOPERAND_IMMEDIATE)
+		interpret_error(in, "%s with a immediate operand", vopcode_names[instr->opcode]);
+	vregister_t *regs[2];
+	size_t n = voperand_registers(&ops[1], regs);
+	for (size_t i = 0; i < n; ++i)
+	{
+		if (regs[i]->index == RAX || regs[i]->index == RDX)
+			interpret_error(in, "%s reads rax or rdx after they are written", vopcode_names[instr->opcode]);
+	}
+}
+
+static double floating_point_arithmetic(vopcode_t opcode, double a, double b)
+{
+	switch (opcode)
+	{
+		case VOP_FADD:
+			return a + b;
+		case VOP_FSUB:
+			return a - b;
+		case VOP_FMUL:
+			return a * b;
+		case VOP_FDIV:
+			return a / b;
+	}
+	return fmod(a, b);
+}
+
+static bool condition(vopcode_t opcode, i64 a, i64 b)
+{
+	switch (opcode)
+	{
+		case VOP_JZ:
+			return a == b;
+		case VOP_JNZ:
+			return a != b;
+		case VOP_JL:
+			return a < b;
+		case VOP_JLE:
+			return a <= b;
+		case VOP_JG:
+			return a > b;
+		case VOP_JGE:
+			return a >= b;
+	}
+	return true;
+}
+
+static vinstr_t *label_instruction(interpret_t *in, size_t label)
+{
+	function_t *f = in->function;
+	if (label >= f->numlabels || !in->labels[f->index][label])
+		interpret_error(in, "jump to missing label %d", (int)label);
+	return in->labels[f->index][label];
+}
+
+static function_t *call_target(interpret_t *in, vinstr_t *instr)
+{
+	voperand_t *target = &instr->operands[0];
+	if (target->type != VOPERAND_IMMEDIATE)
+		interpret_error(in, "indirect calls aren't supported");
+	i64 index = imm_cast_int64_t(&target->imm);
+	if (index < 0 || index >= (i64)in->compiler->numfunctions || !in->functions[index])
+		interpret_error(in, "call of function %lld without a body", (long long)index);
+	return in->functions[index];
+}
+
+static void call(interpret_t *in, vinstr_t *instr, vinstr_t **next)
+{
+	function_t *callee = call_target(in, instr);
+	if (in->registers[RSP] % 16)
+		interpret_error(in, "rsp isn't 16 byte aligned at the call of '%s'", callee->name);
+	if (in->numframes == in->maxframes)
+		interpret_error(in, "calls nested too deep");
+	interpret_frame_t *frame = &in->frames[in->numframes++];
+	frame->function = in->function;
+	frame->next = *next;
+	memcpy(frame->saved, in->registers, sizeof(frame->saved));
+	push(in, INTERPRET_RETURN_ADDRESS);
+	in->function = callee;
+	*next = callee->instructions.head;
+}
+
+// false once main returns
+static bool ret(interpret_t *in, vinstr_t **next)
+{
+	if (pop(in) != INTERPRET_RETURN_ADDRESS)
+		interpret_error(in, "the return address was overwritten");
+	interpret_frame_t *frame = &in->frames[--in->numframes];
+	for (int reg = 0; reg < X64_REGISTER_MAX; ++reg)
+	{
+		if (x64_register_is_callee_saved(reg) && in->registers[reg] != frame->saved[reg])
+			interpret_error(in, "callee saved register %d wasn't restored", reg);
+		if (!x64_register_is_callee_saved(reg) && reg != RAX)
+			in->registers[reg] = (i64)0x5a5a5a5a5a5a5a5a + reg;
+	}
+	for (int reg = 0; reg < X64_XMM_REGISTER_MAX; ++reg)
+	{
+		if (reg != 0)
+			in->xmm[reg] = double_bits(-12345.678 - reg);
+	}
+	if (!frame->function)
+		return false;
+	in->function = frame->function;
+	*next = frame->next;
+	return true;
+}
+
+static void execute(interpret_t *in)
+{
+	vinstr_t *instr = in->function->instructions.head;
+	while (instr)
+	{
+		if (++in->steps > INTERPRET_MAX_STEPS)
+			interpret_error(in, "too many steps");
+		vinstr_t *next = instr->next;
+		voperand_t *ops = instr->operands;
+		// x64 has no encoding for a compare with the immediate on the left
+		if ((instr->opcode == VOP_CMP || instr->opcode == VOP_TEST) && ops[0].type == VOPERAND_IMMEDIATE)
+			interpret_error(in, "%s with a immediate first operand", vopcode_names[instr->opcode]);
+		if (vopcode_uses_rdx_rax(instr->opcode))
+			check_rdx_rax_operands(in, instr);
+		switch (instr->opcode)
+		{
+			case VOP_ADD:
+			case VOP_SUB:
+			case VOP_MUL:
+			case VOP_DIV:
+			case VOP_MOD:
+			case VOP_AND:
+			case VOP_OR:
+			case VOP_XOR:
+			case VOP_SHL:
+			case VOP_SHR:
+			case VOP_SAR:
+			case VOP_MULH:
+			{
+				// the register allocator leaves the two operand form
+				if (instr->numoperands != 2)
+					interpret_error(in, "%s with %d operands", vopcode_names[instr->opcode], (int)instr->numoperands);
+				int width = operand_width(&ops[0]);
+				i64 a = read_operand(in, &ops[0]), b = read_operand(in, &ops[1]);
+				i64 result = sign_extend(arithmetic(in, instr, a, b, width), width);
+				write_operand(in, &ops[0], result);
+				// idiv leaves the remainder in rdx, the high half of the product is moved from rdx to rax
+				if (vopcode_uses_rdx_rax(instr->opcode))
+				{
+					voperand_t rdx = ops[0];
+					rdx.reg.index = RDX;
+					write_operand(in, &rdx, instr->opcode == VOP_DIV ? a % b : result);
+				}
+				in->compare_a = result;
+				in->compare_b = 0;
+			}
+			break;
+			case VOP_NOT:
+				write_operand(in, &ops[0], ~read_operand(in, &ops[0]));
+				break;
+			case VOP_FADD:
+			case VOP_FSUB:
+			case VOP_FMUL:
+			case VOP_FDIV:
+			case VOP_FMOD:
+			{
+				double a = as_double(read_operand(in, &ops[0])), b = as_double(read_operand(in, &ops[1]));
+				write_operand(in, &ops[0], double_bits(floating_point_arithmetic(instr->opcode, a, b)));
+			}
+			break;
+			case VOP_SITOFP:
+				write_operand(in, &ops[0], double_bits((double)read_operand(in, &ops[1])));
+				break;
+			case VOP_FPTOSI:
+				write_operand(in, &ops[0], (i64)as_double(read_operand(in, &ops[1])));
+				break;
+			case VOP_MOV:
+			case VOP_LOAD:
+				write_operand(in, &ops[0], read_operand(in, &ops[1]));
+				break;
+			case VOP_LEA:
+				write_operand(in, &ops[0], address(in, &ops[1]));
+				break;
+			case VOP_PUSH:
+				push(in, read_operand(in, &ops[0]));
+				break;
+			case VOP_POP:
+				write_operand(in, &ops[0], pop(in));
+				break;
+			case VOP_ENTER:
+				push(in, in->registers[RBP]);
+				in->registers[RBP] = in->registers[RSP];
+				break;
+			case VOP_LEAVE:
+				in->registers[RSP] = in->registers[RBP];
+				in->registers[RBP] = pop(in);
+				break;
+			case VOP_ALLOCA:
+				in->registers[RSP] -= (imm_cast_int64_t(&ops[0].imm) + 15) & ~15;
+				break;
+			case VOP_CALL:
+				call(in, instr, &next);
+				break;
+			case VOP_TAILCALL:
+				// the frame was already left, the callee returns to the caller's caller
+				in->function = call_target(in, instr);
+				next = in->function->instructions.head;
+				break;
+			case VOP_RET:
+				if (!ret(in, &next))
+					return;
+				break;
+			case VOP_CMP:
+				if (voperand_is_floating_point(&ops[0]) || voperand_is_floating_point(&ops[1]))
+				{
+					double a = as_double(read_operand(in, &ops[0])), b = as_double(read_operand(in, &ops[1]));
+					in->compare_a = a < b ? -1 : a > b;
+					in->compare_b = 0;
+					break;
+				}
+				in->compare_a = read_operand(in, &ops[0]);
+				in->compare_b = read_operand(in, &ops[1]);
+				break;
+			case VOP_TEST:
+				in->compare_a = read_operand(in, &ops[0]) & read_operand(in, &ops[1]);
+				in->compare_b = 0;
+				break;
+			case VOP_JMP:
+			case VOP_JNZ:
+			case VOP_JZ:
+			case VOP_JLE:
+			case VOP_JGE:
+			case VOP_JG:
+			case VOP_JL:
+				if (condition(instr->opcode, in->compare_a, in->compare_b))
+					next = label_instruction(in, ops[0].label);
+				break;
+			case VOP_LABEL:
+				break;
+			default:
+				interpret_error(in, "can't execute %s", vopcode_names[instr->opcode]);
+		}
+		instr = next;
+	}
+	interpret_error(in, "ran past the last instruction");
+}
+
+// labels and functions are looked up by their number while running
+static bool index_program(interpret_t *in, arena_t *allocator)
+{
+	compiler_t *ctx = in->compiler;
+	in->functions = (function_t **)arena_alloc(allocator, sizeof(function_t *) * (ctx->numfunctions + 1));
+	in->labels = (vinstr_t ***)arena_alloc(allocator, sizeof(vinstr_t **) * (ctx->numfunctions + 1));
+	if (!in->functions || !in->labels)
+		return false;
+	memset(in->functions, 0, sizeof(function_t *) * ctx->numfunctions);
+	hash_map_foreach_entry(ctx->functions, entry, {
+		function_t *f = entry->data;
+		if (!f->instructions.head || f->index >= ctx->numfunctions)
+			continue;
+		vinstr_t **labels = (vinstr_t **)arena_alloc(allocator, sizeof(vinstr_t *) * (f->numlabels + 1));
+		if (!labels)
+			return false;
+		memset(labels, 0, sizeof(vinstr_t *) * f->numlabels);
+		vinstr_list_foreach(&f->instructions, instr)
+		{
+			if (instr->opcode == VOP_LABEL && instr->operands[0].label < f->numlabels)
+				labels[instr->operands[0].label] = instr;
+		}
+		in->functions[f->index] = f;
+		in->labels[f->index] = labels;
+	});
+	return true;
+}
+
+bool interpret(compiler_t *ctx, i64 *result)
+{
+	arena_t *allocator;
+	if (arena_create(&allocator, "interpret",
+					 INTERPRET_STACK_SIZE + sizeof(interpret_frame_t) * INTERPRET_MAX_FRAMES + INTERPRET_INDEX_SIZE))
+		return false;
+	interpret_t *in = (interpret_t *)arena_alloc(allocator, sizeof(interpret_t));
+	bool ok = in != NULL;
+	if (ok)
+	{
+		memset(in, 0, sizeof(interpret_t));
+		in->compiler = ctx;
+		in->function = hash_map_find(ctx->functions, "main");
+		in->maxframes = INTERPRET_MAX_FRAMES;
+		in->stack = (u8 *)arena_alloc(allocator, INTERPRET_STACK_SIZE);
+		in->frames = (interpret_frame_t *)arena_alloc(allocator, sizeof(interpret_frame_t) * in->maxframes);
+		ok = in->function && in->function->instructions.head && in->stack && in->frames && index_program(in, allocator);
+		if (!ok)
+			printf("Interpret Error: no main function or out of memory.\n");
+	}
+	if (ok && setjmp(in->jmp))
+		ok = false;
+	else if (ok)
+	{
+		// registers start out with garbage, rsp is 8 below a multiple of 16 like after the call of main
+		for (int reg = 0; reg < X64_REGISTER_MAX; ++reg)
+			in->registers[reg] = (i64)(0x1111111111111111ull * (reg + 1));
+		for (int reg = 0; reg < X64_XMM_REGISTER_MAX; ++reg)
+			in->xmm[reg] = double_bits(reg * 1000.5);
+		in->registers[RSP] = INTERPRET_STACK_SIZE - 64;
+		// main is called like any other function, by a frame without one that ends the run
+		interpret_frame_t *entry = &in->frames[in->numframes++];
+		entry->function = NULL;
+		entry->next = NULL;
+		memcpy(entry->saved, in->registers, sizeof(entry->saved));
+		push(in, INTERPRET_RETURN_ADDRESS);
+		execute(in);
+		*result = sign_extend(in->registers[RAX], 4);
+	}
+	arena_destroy(&allocator);
+	return ok;
+}
@@ -322,8 +322,19 @@ retry:
         {
             tk->type = TK_OR_ASSIGN;
             return 0;
-        }
+        } else if(!next_check(lex, '|'))
+		{
+            tk->type = TK_LOGICAL_OR;
+            return 0;
+		}
         break;
+	case '&':
+        if(!next_check(lex, '&'))
+		{
+            tk->type = TK_LOGICAL_AND;
+            return 0;
+		}
+        return 0;
 	case '%':
         if(!next_check(lex, '='))
         {
@@ -335,6 +346,8 @@ retry:
 	case '\'':
     {
         tk->type = TK_INTEGER;
+        tk->integer.is_unsigned = false;
+        tk->integer.suffix = INTEGER_SUFFIX_NONE;
         if(!next_check(lex, '"'))
         {
             perror("error: empty character constant\n");
@@ -385,7 +398,6 @@ retry:
 	case '}':
 	case '[':
 	case ']':
-	case '&':
 	case '(':
     case '?':
 	case ')':
@@ -424,6 +436,8 @@ retry:
             if(is_int)
 			{
 				tk->type = TK_INTEGER;
+				tk->integer.is_unsigned = false;
+				tk->integer.suffix = INTEGER_SUFFIX_NONE;
 				tk->integer.value = atoll( s );
 			} else
 			{
@@ -483,6 +497,8 @@ retry:
 				tk->type = TK_TYPEDEF;
 			else if ( !strcmp( s, "enum" ) )
 				tk->type = TK_ENUM;
+			else if ( !strcmp( s, "inline" ) )
+				tk->type = TK_INLINE;
 		}
 			snprintf(tk->string, sizeof(tk->string), "%s", s);
 			heap_string_free(&s);
@@ -0,0 +1,269 @@
+#include "optimize.h"
+#include "std.h"
+#include <stdio.h>
+
+// loop invariant code motion on SSA form. a instruction is invariant when everything it reads is defined outside
+// the loop or by another invariant instruction, those are moved to the preheader in the order they appear so the
+// definitions stay in front of their uses. only instructions that can't trap run there unconditionally
+
+typedef struct
+{
+	function_t *function;
+	cfg_t *cfg;
+	cfg_loop_t *loop;
+	bool frame_escapes;
+
+	bool *invariant; // per vreg
+	voperand_t **stores; // memory written inside the loop
+	size_t numstores;
+	bool calls;
+} licm_t;
+
+static bool operand_is_invariant(licm_t *l, voperand_t *op)
+{
+	if (op->type == VOPERAND_IMMEDIATE)
+		return true;
+	if (!op->virtual || op->type == VOPERAND_LABEL || op->type == VOPERAND_INVALID)
+		return false;
+	vregister_t *regs[2];
+	size_t n = voperand_registers(op, regs);
+	for (size_t i = 0; i < n; ++i)
+	{
+		int vreg = regs[i]->index;
+		if (vreg != VREG_BP && (vreg < VREG_MAX || !l->invariant[vreg]))
+			return false;
+	}
+	return true;
+}
+
+// a stack slot can always be read, other pointers might only be valid on the paths that dereference them
+static bool load_is_invariant(licm_t *l, voperand_t *src)
+{
+	if (!voperand_is_frame_slot(src) || (l->calls && l->frame_escapes))
+		return false;
+	for (size_t i = 0; i < l->numstores; ++i)
+	{
+		if (optimize_may_alias(l->stores[i], src, l->frame_escapes))
+			return false;
+	}
+	return true;
+}
+
+static bool can_hoist(licm_t *l, vinstr_t *instr)
+{
+	if (instr->numoperands < 2)
+		return false;
+	voperand_t *dst = &instr->operands[0];
+	if (dst->type != VOPERAND_REGISTER || !dst->virtual || dst->reg.index < VREG_MAX)
+		return false;
+	for (size_t i = 1; i < instr->numoperands; ++i)
+	{
+		voperand_t *op = &instr->operands[i];
+		if (instr->opcode != VOP_LEA && voperand_is_memory(op))
+		{
+			if ((instr->opcode != VOP_MOV && instr->opcode != VOP_LOAD) || !load_is_invariant(l, op))
+				return false;
+		}
+		if (!operand_is_invariant(l, op))
+			return false;
+	}
+	switch (instr->opcode)
+	{
+		case VOP_DIV:
+		case VOP_MOD:
+		{
+			// INT_MIN / -1 traps as well
+			voperand_t *divisor = &instr->operands[2];
+			if (instr->numoperands != 3 || divisor->type != VOPERAND_IMMEDIATE)
+				return false;
+			i64 value = imm_cast_int64_t(&divisor->imm);
+			return value != 0 && value != -1;
+		}
+		case VOP_ADD:
+		case VOP_SUB:
+		case VOP_MUL:
+		case VOP_FADD:
+		case VOP_FSUB:
+		case VOP_FMUL:
+		case VOP_FDIV:
+		case VOP_FMOD:
+		case VOP_AND:
+		case VOP_OR:
+		case VOP_XOR:
+		case VOP_SHL:
+		case VOP_SHR:
+		case VOP_SAR:
+		case VOP_MULH:
+			return instr->numoperands == 3;
+		case VOP_SITOFP:
+		case VOP_FPTOSI:
+		case VOP_LEA:
+		case VOP_LOAD:
+			return instr->numoperands == 2;
+		case VOP_MOV:
+			// a constant costs a register for the whole loop, materializing it again is as cheap
+			return instr->numoperands == 2 && instr->operands[1].type != VOPERAND_IMMEDIATE;
+	}
+	return false;
+}
+
+static vinstr_t *insert_instruction(vinstr_list_t *list, vinstr_t *after, vopcode_t opcode, voperand_t a)
+{
+	vinstr_t *instr = vinstr_list_insert_after(list, after);
+	if (!instr)
+		return NULL;
+	instr->opcode = opcode;
+	instr->operands[0] = a;
+	instr->numoperands = 1;
+	return instr;
+}
+
+vinstr_t *optimize_loop_preheader(function_t *f, cfg_loop_t *loop)
+{
+	basic_block_t *header = loop->header;
+	basic_block_t *pred = NULL;
+	for (size_t i = 0; i < header->numpred; ++i)
+	{
+		basic_block_t *p = header->pred[i];
+		if (p->rpo == -1 || cfg_loop_contains(loop, p))
+			continue;
+		if (pred)
+			return NULL;
+		pred = p;
+	}
+	if (!pred)
+		return NULL;
+	vinstr_t *last = pred->last;
+	if (pred->numsucc == 1)
+		return vopcode_is_jump(last->opcode) ? last : last->next;
+	if (pred->succ[0] == pred->succ[1] || !vopcode_is_conditional_jump(last->opcode))
+		return NULL;
+
+	vinstr_list_t *list = &f->instructions;
+	vinstr_t *label, *at;
+	if (pred->succ[0] == header)
+	{
+		// new block at the end of the function that jumps to the header
+		label = insert_instruction(list, list->tail, VOP_LABEL, label_operand(function_new_label(f)));
+		at = label ? insert_instruction(list, label, VOP_JMP, label_operand(ssa_block_label(header))) : NULL;
+		if (!at)
+			return NULL;
+		last->operands[0].label = label->operands[0].label;
+	}
+	else
+	{
+		// falls through into the header
+		label = insert_instruction(list, last, VOP_LABEL, label_operand(function_new_label(f)));
+		if (!label)
+			return NULL;
+		at = header->first;
+	}
+	size_t from = ssa_block_label(pred);
+	ssa_block_foreach_phi(header, phi)
+	{
+		for (size_t i = 0; i < phi->phi->numargs; ++i)
+		{
+			if (phi->phi->args[i].label == from)
+				phi->phi->args[i].label = label->operands[0].label;
+		}
+	}
+	return at;
+}
+
+static bool hoist_loop(licm_t *l, arena_t *allocator, bool *changed)
+{
+	function_t *f = l->function;
+	cfg_t *cfg = l->cfg;
+	cfg_loop_t *loop = l->loop;
+
+	size_t numinstructions = 0;
+	for (size_t i = 0; i < f->numvregs; ++i)
+		l->invariant[i] = true;
+	l->numstores = 0;
+	l->calls = false;
+	int vregs[LIVENESS_MAX_VREGS_PER_INSTRUCTION];
+	for (size_t i = 0; i < loop->numblocks; ++i)
+	{
+		basic_block_t *bb = loop->blocks[i];
+		for (vinstr_t *instr = bb->first; instr != bb->last->next; instr = instr->next)
+		{
+			++numinstructions;
+			size_t n = vinstr_defined_vregs(instr, vregs);
+			for (size_t k = 0; k < n; ++k)
+				l->invariant[vregs[k]] = false;
+			if (instr->opcode == VOP_CALL)
+				l->calls = true;
+			if (instr->numoperands > 0 && vinstr_first_operand_is_written(instr) &&
+				voperand_is_memory(&instr->operands[0]))
+				l->stores[l->numstores++] = &instr->operands[0];
+		}
+	}
+
+	// blocks in reverse postorder see the definitions before the uses
+	vinstr_t **hoisted = (vinstr_t **)arena_alloc(allocator, sizeof(vinstr_t *) * (numinstructions + 1));
+	if (!hoisted)
+		return false;
+	size_t numhoisted = 0;
+	for (size_t i = 0; i < cfg->numrpo; ++i)
+	{
+		basic_block_t *bb = cfg->rpo[i];
+		if (!cfg_loop_contains(loop, bb))
+			continue;
+		for (vinstr_t *instr = bb->first; instr != bb->last->next; instr = instr->next)
+		{
+			if (!can_hoist(l, instr))
+				continue;
+			hoisted[numhoisted++] = instr;
+			l->invariant[instr->operands[0].reg.index] = true;
+		}
+	}
+	if (!numhoisted)
+		return true;
+
+	vinstr_t *at = optimize_loop_preheader(f, loop);
+	if (!at)
+		return true;
+	for (size_t i = 0; i < numhoisted; ++i)
+		vinstr_list_move_before(&f->instructions, hoisted[i], at);
+	*changed = true;
+	return true;
+}
+
+bool optimize_licm(function_t *f, arena_t *allocator)
+{
+	if (!f->instructions.head)
+		return true;
+	licm_t l = {0};
+	l.function = f;
+	l.frame_escapes = optimize_frame_pointer_escapes(f);
+	l.invariant = (bool *)arena_alloc(allocator, sizeof(bool) * f->numvregs);
+	l.stores = (voperand_t **)arena_alloc(allocator, sizeof(voperand_t *) * f->instructions.count);
+	bool *done = (bool *)arena_alloc(allocator, sizeof(bool) * f->numlabels);
+	if (!l.invariant || !l.stores || !done)
+		return false;
+	memset(done, 0, sizeof(bool) * f->numlabels);
+
+	// inner loops come first, what they hoist into a preheader inside the outer loop can move out further once the
+	// cfg is rebuilt. every loop is handled once, by the label of its header
+	size_t numlabels = f->numlabels;
+	bool changed = true;
+	while (changed)
+	{
+		changed = false;
+		cfg_t cfg;
+		if (!cfg_build(&cfg, f, allocator))
+			return false;
+		l.cfg = &cfg;
+		for (size_t i = 0; i < cfg.numloops && !changed; ++i)
+		{
+			size_t label = ssa_block_label(cfg.loops[i].header);
+			if (label >= numlabels || done[label])
+				continue;
+			done[label] = true;
+			l.loop = &cfg.loops[i];
+			if (!hoist_loop(&l, allocator, &changed))
+				return false;
+		}
+	}
+	return true;
+}
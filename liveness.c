@@ -0,0 +1,292 @@
+#include "liveness.h"
+#include "std.h"
+#include <stdio.h>
+
+static size_t operand_vregs(voperand_t *op, int *vregs)
+{
+	size_t n = 0;
+	if (!op->virtual)
+		return 0;
+	switch (op->type)
+	{
+		case VOPERAND_REGISTER:
+		case VOPERAND_INDIRECT_REGISTER:
+			vregs[n++] = op->reg.index;
+			break;
+		case VOPERAND_INDIRECT_REGISTER_DISPLACEMENT:
+			vregs[n++] = op->reg_indirect_displacement.reg.index;
+			break;
+		case VOPERAND_INDIRECT_REGISTER_INDEXED:
+			vregs[n++] = op->reg_indirect_indexed.reg.index;
+			vregs[n++] = op->reg_indirect_indexed.indexed_reg.index;
+			break;
+	}
+	// the stack, frame and instruction pointer are fixed
+	size_t k = 0;
+	for (size_t i = 0; i < n; ++i)
+	{
+		if (vregs[i] >= VREG_RETURN_VALUE)
+			vregs[k++] = vregs[i];
+	}
+	return k;
+}
+
+bool vinstr_first_operand_is_definition(vinstr_t *instr)
+{
+	switch (instr->opcode)
+	{
+		case VOP_PHI:
+		case VOP_MOV:
+		case VOP_LOAD:
+		case VOP_LEA:
+		case VOP_SITOFP:
+		case VOP_FPTOSI:
+		case VOP_POP:
+			return true;
+	}
+	// dst = a op b
+	return vopcode_overwrites_first_operand(instr->opcode) && instr->numoperands == 3;
+}
+
+bool vinstr_first_operand_is_written(vinstr_t *instr)
+{
+	return vopcode_overwrites_first_operand(instr->opcode) || instr->opcode == VOP_POP || instr->opcode == VOP_PHI;
+}
+
+size_t vinstr_used_vregs(vinstr_t *instr, int *vregs)
+{
+	size_t n = 0;
+	for (size_t i = 0; i < instr->numoperands; ++i)
+	{
+		voperand_t *op = &instr->operands[i];
+		// a register that is only written isn't a use, but the registers in a memory operand always are
+		if (i == 0 && op->type == VOPERAND_REGISTER && vinstr_first_operand_is_definition(instr))
+			continue;
+		n += operand_vregs(op, &vregs[n]);
+	}
+	if (instr->opcode == VOP_RET)
+		vregs[n++] = VREG_RETURN_VALUE;
+	// a call reads the argument registers it was given, the amount of each kind follows the target
+	if ((instr->opcode == VOP_CALL || instr->opcode == VOP_TAILCALL) && instr->numoperands == 3)
+	{
+		i64 numintegers = imm_cast_int64_t(&instr->operands[1].imm);
+		i64 numfloats = imm_cast_int64_t(&instr->operands[2].imm);
+		for (i64 i = 0; i < numintegers; ++i)
+			vregs[n++] = VREG_ARGUMENT_0 + i;
+		for (i64 i = 0; i < numfloats; ++i)
+			vregs[n++] = VREG_FLOAT_ARGUMENT_0 + i;
+	}
+	return n;
+}
+
+size_t vinstr_defined_vregs(vinstr_t *instr, int *vregs)
+{
+	if (instr->opcode == VOP_CALL)
+	{
+		vregs[0] = VREG_RETURN_VALUE;
+		return 1;
+	}
+	if (instr->numoperands == 0 || instr->operands[0].type != VOPERAND_REGISTER || !vinstr_first_operand_is_written(instr))
+		return 0;
+	size_t n = operand_vregs(&instr->operands[0], vregs);
+	// once the allocators have moved the first operand into rax the instruction writes rdx as well, which is the
+	// register of the third integer argument
+	if (vopcode_uses_rdx_rax(instr->opcode) && n == 1 && vregs[0] == VREG_RETURN_VALUE)
+		vregs[n++] = VREG_ARGUMENT_0 + 2;
+	return n;
+}
+
+static bool bitset_get(u64 *set, size_t i)
+{
+	return (set[i / 64] >> (i % 64)) & 1;
+}
+
+static void bitset_set(u64 *set, size_t i)
+{
+	set[i / 64] |= (u64)1 << (i % 64);
+}
+
+static void bitset_clear(u64 *set, size_t i)
+{
+	set[i / 64] &= ~((u64)1 << (i % 64));
+}
+
+static void extend_interval(live_interval_t *interval, size_t position)
+{
+	if (interval->start == LIVENESS_NONE || position < interval->start)
+		interval->start = position;
+	if (interval->end == LIVENESS_NONE || position > interval->end)
+		interval->end = position;
+}
+
+static void extend_intervals(liveness_t *lv, u64 *set, size_t position)
+{
+	for (size_t w = 0; w < lv->numwords; ++w)
+	{
+		for (size_t b = 0; b < 64 && set[w] >> b; ++b)
+		{
+			if ((set[w] >> b) & 1)
+				extend_interval(&lv->intervals[w * 64 + b], position);
+		}
+	}
+}
+
+bool liveness_compute(liveness_t *lv, cfg_t *cfg, arena_t *allocator)
+{
+	memset(lv, 0, sizeof(liveness_t));
+	lv->cfg = cfg;
+
+	int vregs[LIVENESS_MAX_VREGS_PER_INSTRUCTION];
+	int minvreg = -1, maxvreg = -1;
+	for (size_t i = 0; i < cfg->numblocks; ++i)
+	{
+		for (vinstr_t *instr = cfg->blocks[i].first; instr != cfg->blocks[i].last->next; instr = instr->next)
+		{
+			size_t n = vinstr_used_vregs(instr, vregs);
+			n += vinstr_defined_vregs(instr, &vregs[n]);
+			for (size_t k = 0; k < n; ++k)
+			{
+				if (vregs[k] < VREG_MAX)
+					continue;
+				if (minvreg == -1 || vregs[k] < minvreg)
+					minvreg = vregs[k];
+				if (vregs[k] > maxvreg)
+					maxvreg = vregs[k];
+			}
+		}
+	}
+	lv->firstvreg = minvreg == -1 ? VREG_MAX : minvreg;
+	lv->numvregs = VREG_MAX + (minvreg == -1 ? 0 : maxvreg - minvreg + 1);
+	lv->numwords = (lv->numvregs + 63) / 64;
+
+	size_t setsize = sizeof(u64) * lv->numwords * cfg->numblocks;
+	lv->live_in = (u64 *)arena_alloc(allocator, setsize);
+	lv->live_out = (u64 *)arena_alloc(allocator, setsize);
+	u64 *uses = (u64 *)arena_alloc(allocator, setsize);
+	u64 *defs = (u64 *)arena_alloc(allocator, setsize);
+	lv->intervals = (live_interval_t *)arena_alloc(allocator, sizeof(live_interval_t) * lv->numvregs);
+	if (!lv->live_in || !lv->live_out || !uses || !defs || !lv->intervals)
+		return false;
+	memset(lv->live_in, 0, setsize);
+	memset(lv->live_out, 0, setsize);
+	memset(uses, 0, setsize);
+	memset(defs, 0, setsize);
+
+	// upward exposed uses and definitions of each block
+	for (size_t i = 0; i < cfg->numblocks; ++i)
+	{
+		basic_block_t *bb = &cfg->blocks[i];
+		u64 *use = &uses[i * lv->numwords];
+		u64 *def = &defs[i * lv->numwords];
+		for (vinstr_t *instr = bb->first; instr != bb->last->next; instr = instr->next)
+		{
+			size_t n = vinstr_used_vregs(instr, vregs);
+			for (size_t k = 0; k < n; ++k)
+			{
+				size_t slot = liveness_slot(lv, vregs[k]);
+				if (!bitset_get(def, slot))
+					bitset_set(use, slot);
+			}
+			n = vinstr_defined_vregs(instr, vregs);
+			for (size_t k = 0; k < n; ++k)
+				bitset_set(def, liveness_slot(lv, vregs[k]));
+		}
+	}
+
+	// live_out = union of live_in of the successors, live_in = use | (live_out & ~def)
+	// visiting the blocks backwards only needs another pass for each loop nesting level
+	bool changed = true;
+	while (changed)
+	{
+		changed = false;
+		for (size_t i = cfg->numblocks; i-- > 0;)
+		{
+			basic_block_t *bb = &cfg->blocks[i];
+			u64 *in = &lv->live_in[i * lv->numwords];
+			u64 *out = &lv->live_out[i * lv->numwords];
+			u64 *use = &uses[i * lv->numwords];
+			u64 *def = &defs[i * lv->numwords];
+			for (size_t w = 0; w < lv->numwords; ++w)
+			{
+				u64 o = 0;
+				for (size_t k = 0; k < bb->numsucc; ++k)
+					o |= lv->live_in[bb->succ[k]->index * lv->numwords + w];
+				u64 n = use[w] | (o & ~def[w]);
+				if (n != in[w] || o != out[w])
+					changed = true;
+				in[w] = n;
+				out[w] = o;
+			}
+		}
+	}
+
+	for (size_t i = 0; i < lv->numvregs; ++i)
+	{
+		live_interval_t *interval = &lv->intervals[i];
+		interval->vreg = i < VREG_MAX ? i : i - VREG_MAX + lv->firstvreg;
+		interval->start = LIVENESS_NONE;
+		interval->end = LIVENESS_NONE;
+		interval->numuses = 0;
+	}
+
+	// one pass backwards over the positions, a interval grows to every position its vreg is used, defined or live at.
+	// positions are linear, so a vreg that is live at the boundary of a block covers the whole block up to it.
+	// the sets of upward exposed uses aren't needed anymore, the first one holds the vregs live at the position
+	u64 *live = uses;
+	for (size_t i = cfg->numblocks; i-- > 0;)
+	{
+		basic_block_t *bb = &cfg->blocks[i];
+		memcpy(live, &lv->live_out[i * lv->numwords], sizeof(u64) * lv->numwords);
+		extend_intervals(lv, live, bb->end);
+		for (vinstr_t *instr = bb->last; instr != bb->first->prev; instr = instr->prev)
+		{
+			size_t position = cfg_position(cfg, instr);
+			size_t n = vinstr_defined_vregs(instr, vregs);
+			for (size_t k = 0; k < n; ++k)
+			{
+				size_t slot = liveness_slot(lv, vregs[k]);
+				extend_interval(&lv->intervals[slot], position);
+				++lv->intervals[slot].numuses;
+				bitset_clear(live, slot);
+			}
+			n = vinstr_used_vregs(instr, vregs);
+			for (size_t k = 0; k < n; ++k)
+			{
+				size_t slot = liveness_slot(lv, vregs[k]);
+				extend_interval(&lv->intervals[slot], position);
+				++lv->intervals[slot].numuses;
+				bitset_set(live, slot);
+			}
+		}
+		// what is left is live in
+		extend_intervals(lv, live, bb->start);
+	}
+	return true;
+}
+
+bool liveness_live_in(liveness_t *lv, basic_block_t *bb, int vreg)
+{
+	size_t slot = liveness_slot(lv, vreg);
+	if (slot >= lv->numvregs)
+		return false;
+	return bitset_get(&lv->live_in[bb->index * lv->numwords], slot);
+}
+
+bool liveness_live_out(liveness_t *lv, basic_block_t *bb, int vreg)
+{
+	size_t slot = liveness_slot(lv, vreg);
+	if (slot >= lv->numvregs)
+		return false;
+	return bitset_get(&lv->live_out[bb->index * lv->numwords], slot);
+}
+
+void liveness_print(liveness_t *lv)
+{
+	for (size_t i = 0; i < lv->numvregs; ++i)
+	{
+		live_interval_t *interval = &lv->intervals[i];
+		if (interval->start == LIVENESS_NONE)
+			continue;
+		printf("r%d: [%zu, %zu] uses=%zu\n", interval->vreg, interval->start, interval->end, interval->numuses);
+	}
+}
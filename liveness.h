@@ -0,0 +1,62 @@
+#ifndef LIVENESS_H
+#define LIVENESS_H
+#include "cfg.h"
+
+#define LIVENESS_MAX_VREGS_PER_INSTRUCTION (16)
+#define LIVENESS_NONE ((size_t)-1)
+
+// conservative single range from the first definition to the last position the vreg is live at,
+// a vreg that is live around a loop backedge is live until the end of the loop
+typedef struct
+{
+	int vreg;
+	size_t start, end; // start is LIVENESS_NONE if the vreg isn't used in the function
+	size_t numuses; // definitions and uses
+} live_interval_t;
+
+typedef struct
+{
+	cfg_t *cfg;
+
+	// vregs are numbered for the whole program, the fixed vregs keep their index and
+	// the function's own vregs are mapped to a dense range after them
+	int firstvreg;
+	size_t numvregs;
+
+	size_t numwords; // words per set
+	u64 *live_in, *live_out; // numblocks sets of numvregs bits each
+
+	live_interval_t *intervals; // indexed by slot
+} liveness_t;
+
+// vregs read and written by a instruction, returns the amount written to vregs
+// the stack and frame pointer aren't included, they're never allocated
+// the arguments of a phi aren't uses here, liveness is only computed for code without phis
+size_t vinstr_used_vregs(vinstr_t *instr, int *vregs);
+size_t vinstr_defined_vregs(vinstr_t *instr, int *vregs);
+
+// whether the first operand is only written and the old value isn't read
+bool vinstr_first_operand_is_definition(vinstr_t *instr);
+bool vinstr_first_operand_is_written(vinstr_t *instr);
+
+bool liveness_compute(liveness_t *lv, cfg_t *cfg, arena_t *allocator);
+bool liveness_live_in(liveness_t *lv, basic_block_t *bb, int vreg);
+bool liveness_live_out(liveness_t *lv, basic_block_t *bb, int vreg);
+void liveness_print(liveness_t *lv);
+
+static size_t liveness_slot(liveness_t *lv, int vreg)
+{
+	if (vreg < VREG_MAX)
+		return vreg;
+	return vreg - lv->firstvreg + VREG_MAX;
+}
+
+static live_interval_t *liveness_interval(liveness_t *lv, int vreg)
+{
+	size_t slot = liveness_slot(lv, vreg);
+	if (slot >= lv->numvregs || lv->intervals[slot].start == LIVENESS_NONE)
+		return NULL;
+	return &lv->intervals[slot];
+}
+
+#endif
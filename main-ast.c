@@ -16,6 +16,7 @@
 #include "types.h"
 #include "parse.h"
 #include "compile.h"
+#include "ast_serialize.h"
 
 static void print_hex(u8 *buf, size_t n)
 {
@@ -30,66 +31,147 @@ int generate_ast(struct token* tokens, int num_tokens, struct linked_list** ll /
 int main(int argc, char **argv)
 {
 	assert(argc > 1);
-	
-	//Step 1. Preprocess file first.
-	/* pre.c */
-	heap_string preprocess_file( const char* filename, const char** includepaths, int verbose, struct hash_map *defines, struct hash_map **defines_out);
-	const char* includepaths[] = { "examples/include/", NULL };
-	heap_string data = preprocess_file( argv[1], includepaths, 0, NULL, NULL );
-
-	if ( !data )
-    {
-	    printf( "failed to read file '%s'\n", argv[1] );
-	    return 1;
-    }
-
-	//Step 2. Tokenize the preprocessed result
-	struct token* tokens = NULL;
-	int num_tokens = 0;
-    
-	// printf("data = %s\n", data);
-	parse( data , &tokens, &num_tokens, LEX_FL_NONE);
 
-	
-	//Optionally print out the tokens.
-	/* char str[256]={0}; */
-	/* for(int i = 0; i < num_tokens; ++i) */
-	/* { */
-	/* 	struct token *tk = &tokens[i]; */
-	/* 	token_stringify(data, heap_string_size(&data), tk, str, sizeof(str)); */
-	/* 	printf("%s", str); */
-	/* } */
+	const char *filename = NULL;
+	const char *emit_ast_path = NULL;
+	const char *load_ast_path = NULL;
+	int numthreads = -1;
+	bool lazy = false;
+	bool run = false;
+	bool print_instructions = false;
+	int optimization_level = 1;
+	int inline_budget = COMPILER_INLINE_BUDGET;
+	for(int i = 1; i < argc; ++i)
+	{
+		// -j <numthreads> parses all function bodies in parallel, 0 uses all cores
+		if(!strcmp(argv[i], "-j") && i + 1 < argc)
+			numthreads = atoi(argv[++i]);
+		// -lazy only parses the bodies of functions that can be reached from main, the others are skipped without any
+		// diagnostics for errors in them. off by default, every body is parsed. ignored with -emit-ast so the file has
+		// all of them
+		else if(!strcmp(argv[i], "-lazy"))
+			lazy = true;
+		// -emit-ast <file> writes the parsed program to a file that can be loaded with -load-ast
+		else if(!strcmp(argv[i], "-emit-ast") && i + 1 < argc)
+			emit_ast_path = argv[++i];
+		else if(!strcmp(argv[i], "-load-ast") && i + 1 < argc)
+			load_ast_path = argv[++i];
+		// -inline-budget <n> is how many instructions a inlined function may add beyond the call, 0 turns it off
+		else if(!strcmp(argv[i], "-inline-budget") && i + 1 < argc)
+			inline_budget = atoi(argv[++i]);
+		// -print-instructions prints the instructions of every function after register allocation
+		else if(!strcmp(argv[i], "-print-instructions"))
+			print_instructions = true;
+		// -run interprets the compiled program instead of encoding it, the exit code is what main returns
+		else if(!strcmp(argv[i], "-run"))
+			run = true;
+		// -O0 and -O1 use the linear scan register allocator, -O2 the graph coloring one
+		else if(argv[i][0] == '-' && argv[i][1] == 'O' && argv[i][2] >= '0' && argv[i][2] <= '9')
+			optimization_level = argv[i][2] - '0';
+		else
+			filename = argv[i];
+	}
 
 	arena_t* arena;
 	arena_create(&arena, "ast", 1000 * 1000 * 128); // 128MB
-	
-	ast_context_t ast_context;
-	ast_init_context(&ast_context, arena);
 
-	if(ast_process_tokens(&ast_context, tokens, num_tokens))
+	heap_string data = NULL;
+	struct token* tokens = NULL;
+	ast_serialized_t serialized_ast = { 0 };
+	ast_node_t *program_node = NULL;
+
+	if(load_ast_path)
 	{
+		if(!ast_serialized_map_file(&serialized_ast, load_ast_path))
+		{
+			printf( "failed to load ast '%s'\n", load_ast_path );
+			return 1;
+		}
+		program_node = ast_deserialize(&serialized_ast, arena);
+		if(!program_node)
+			return 1;
+	} else
+	{
+		assert(filename);
+		//Step 1. Preprocess file first.
+		/* pre.c */
+		heap_string preprocess_file( const char* filename, const char** includepaths, int verbose, struct hash_map *defines, struct hash_map **defines_out);
+		const char* includepaths[] = { "examples/include/", NULL };
+		data = preprocess_file( filename, includepaths, 0, NULL, NULL );
+
+		if ( !data )
+		{
+			printf( "failed to read file '%s'\n", filename );
+			return 1;
+		}
+
+		//Step 2. Tokenize the preprocessed result
+		int num_tokens = 0;
+    
+		// printf("data = %s\n", data);
+		parse( data , &tokens, &num_tokens, LEX_FL_NONE);
+
+	
+		//Optionally print out the tokens.
+		/* char str[256]={0}; */
+		/* for(int i = 0; i < num_tokens; ++i) */
+		/* { */
+		/* 	struct token *tk = &tokens[i]; */
+		/* 	token_stringify(data, heap_string_size(&data), tk, str, sizeof(str)); */
+		/* 	printf("%s", str); */
+		/* } */
+
+		ast_context_t ast_context;
+		ast_init_context(&ast_context, arena);
+		if(lazy && !emit_ast_path)
+			ast_context.flags |= AST_FLAGS_LAZY_FUNCTION_BODIES;
+		if(numthreads != -1)
+		{
+			ast_context.flags |= AST_FLAGS_PARALLEL_FUNCTION_BODIES;
+			ast_context.numthreads = numthreads;
+		}
+
+		if(!ast_process_tokens(&ast_context, tokens, num_tokens))
+			return 1;
 		/* print_ast(ast_context.program_node, 0); */
-		/* printf("done processing tokens\n"); */
-	}
-	// gcc -w -g main-ast.c lex.c ast.c pre.c parse.c && gdb -ex run --args ./a.out examples/syscall.c
+		program_node = ast_context.program_node;
+		// gcc -w -g main-ast.c lex.c ast.c pre.c parse.c && gdb -ex run --args ./a.out examples/syscall.c
 
-	/* struct linked_list *ast_list = NULL; */
-    /* struct ast_node *root = NULL; */
+		/* struct linked_list *ast_list = NULL; */
+		/* struct ast_node *root = NULL; */
 
-	/* //Step 3. Generate AST from tokens. */
-	/* int ast = generate_ast(tokens, num_tokens, &ast_list, &root, 1); */
-	/* if(ast) */
-	/* { */
-	/* 	printf("Failed to generate AST\n"); */
-	/* 	return 0; */
-	/* } */
-	/* root = NULL; */
-	/* linked_list_destroy(&ast_list); */
+		/* //Step 3. Generate AST from tokens. */
+		/* int ast = generate_ast(tokens, num_tokens, &ast_list, &root, 1); */
+		/* if(ast) */
+		/* { */
+		/* 	printf("Failed to generate AST\n"); */
+		/* 	return 0; */
+		/* } */
+		/* root = NULL; */
+		/* linked_list_destroy(&ast_list); */
+	}
+
+	if(emit_ast_path)
+	{
+		if(!ast_serialize_to_file(program_node, arena, emit_ast_path))
+			return 1;
+	}
 
 	compiler_t compile_ctx;
 	compiler_init(&compile_ctx, arena, 64, COMPILER_FLAGS_NONE);
+	compile_ctx.optimization_level = optimization_level;
+	compile_ctx.inline_budget = inline_budget;
+	compile_ctx.print_instructions = print_instructions;
 	int compile(compiler_t * ctx, ast_node_t * head);
-	compile(&compile_ctx, ast_context.program_node);
+	if(compile(&compile_ctx, program_node))
+		return 1;
+	if(run)
+	{
+		i64 result;
+		if(!interpret(&compile_ctx, &result))
+			return 1;
+		return (int)result;
+	}
 
 	function_t* lookup_function_by_name(compiler_t* ctx, const char* name);
 	function_t *fn = lookup_function_by_name(&compile_ctx, "main");
@@ -102,6 +184,7 @@ int main(int argc, char **argv)
 	heap_string_free(&s);
 	free(tokens);
 	heap_string_free(&data);
+	ast_serialized_unmap(&serialized_ast);
 	arena_destroy(&arena);
 	return 0;
 }
@@ -0,0 +1,197 @@
+#include "optimize.h"
+#include "std.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+typedef struct
+{
+	i32 disp;
+	voperand_size_t size;
+	int width; // widest access at this displacement
+	bool promoted;
+	vregister_t vreg;
+} stack_slot_t;
+
+static int operand_width(voperand_size_t size)
+{
+	switch (size)
+	{
+		case VOPERAND_SIZE_8_BITS:
+		case VOPERAND_SIZE_16_BITS:
+		case VOPERAND_SIZE_32_BITS:
+		case VOPERAND_SIZE_64_BITS:
+			return size;
+		case VOPERAND_SIZE_FLOAT:
+			return 4;
+	}
+	return 8;
+}
+
+static int compare_slots(const void *a, const void *b)
+{
+	const stack_slot_t *sa = a, *sb = b;
+	return sa->disp < sb->disp ? -1 : sa->disp > sb->disp;
+}
+
+static bool is_frame_pointer(vregister_t *reg)
+{
+	return reg->index == VREG_BP;
+}
+
+// returns false if the frame pointer escapes and no slot can be promoted
+static bool frame_access(voperand_t *op)
+{
+	switch (op->type)
+	{
+		case VOPERAND_REGISTER:
+			return !is_frame_pointer(&op->reg);
+		case VOPERAND_INDIRECT_REGISTER_INDEXED:
+			return !is_frame_pointer(&op->reg_indirect_indexed.reg) &&
+				   !is_frame_pointer(&op->reg_indirect_indexed.indexed_reg);
+	}
+	return true;
+}
+
+static vregister_t *frame_base(voperand_t *op)
+{
+	if (!op->virtual)
+		return NULL;
+	if (op->type == VOPERAND_INDIRECT_REGISTER && is_frame_pointer(&op->reg))
+		return &op->reg;
+	if (op->type == VOPERAND_INDIRECT_REGISTER_DISPLACEMENT && is_frame_pointer(&op->reg_indirect_displacement.reg))
+		return &op->reg_indirect_displacement.reg;
+	return NULL;
+}
+
+static stack_slot_t *find_slot(stack_slot_t *slots, size_t numslots, i32 disp)
+{
+	size_t lo = 0, hi = numslots;
+	while (lo < hi)
+	{
+		size_t mid = (lo + hi) / 2;
+		if (slots[mid].disp < disp)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < numslots && slots[lo].disp == disp ? &slots[lo] : NULL;
+}
+
+static i32 frame_displacement(voperand_t *op)
+{
+	return op->type == VOPERAND_INDIRECT_REGISTER ? 0 : op->reg_indirect_displacement.disp;
+}
+
+bool optimize_mem2reg(function_t *f, arena_t *allocator)
+{
+	// a object whose address is taken starts at the displacement of the lea, a pointer to it can only reach the
+	// object itself so the slots below it stay promotable
+	i32 escaped = INT32_MAX;
+	size_t numaccesses = 0;
+	vinstr_list_foreach(&f->instructions, instr)
+	{
+		for (size_t i = 0; i < instr->numoperands; ++i)
+		{
+			if (instr->operands[i].virtual && !frame_access(&instr->operands[i]))
+				return true;
+			if (!frame_base(&instr->operands[i]))
+				continue;
+			if (instr->opcode == VOP_LEA)
+			{
+				i32 disp = frame_displacement(&instr->operands[i]);
+				if (disp < escaped)
+					escaped = disp;
+			}
+			else
+				++numaccesses;
+		}
+	}
+	if (!numaccesses)
+		return true;
+
+	stack_slot_t *slots = (stack_slot_t *)arena_alloc(allocator, sizeof(stack_slot_t) * numaccesses);
+	if (!slots)
+		return false;
+	size_t n = 0;
+	vinstr_list_foreach(&f->instructions, instr)
+	{
+		for (size_t i = 0; i < instr->numoperands; ++i)
+		{
+			voperand_t *op = &instr->operands[i];
+			if (!frame_base(op) || instr->opcode == VOP_LEA)
+				continue;
+			slots[n].disp = frame_displacement(op);
+			slots[n].size = op->size;
+			slots[n].width = operand_width(op->size);
+			slots[n].promoted = (i64)slots[n].disp + slots[n].width <= escaped;
+			++n;
+		}
+	}
+	qsort(slots, n, sizeof(stack_slot_t), compare_slots);
+
+	// one slot per displacement, a slot that is accessed with different sizes or overlaps the next one stays
+	size_t numslots = 0;
+	for (size_t i = 0; i < n; ++i)
+	{
+		stack_slot_t *last = numslots ? &slots[numslots - 1] : NULL;
+		if (last && last->disp == slots[i].disp)
+		{
+			if (last->size != slots[i].size || !slots[i].promoted)
+				last->promoted = false;
+			if (slots[i].width > last->width)
+				last->width = slots[i].width;
+			continue;
+		}
+		if (last && last->disp + last->width > slots[i].disp)
+		{
+			last->promoted = false;
+			slots[i].promoted = false;
+		}
+		slots[numslots++] = slots[i];
+	}
+
+	for (size_t i = 0; i < numslots; ++i)
+	{
+		if (slots[i].promoted)
+			slots[i].vreg = function_new_vreg(f);
+	}
+
+	vinstr_list_foreach(&f->instructions, instr)
+	{
+		for (size_t i = 0; i < instr->numoperands; ++i)
+		{
+			voperand_t *op = &instr->operands[i];
+			if (!frame_base(op) || instr->opcode == VOP_LEA)
+				continue;
+			stack_slot_t *slot = find_slot(slots, numslots, frame_displacement(op));
+			if (!slot || !slot->promoted)
+				continue;
+			voperand_size_t size = op->size;
+			*op = register_operand(slot->vreg);
+			op->size = size;
+		}
+	}
+
+	// arguments are passed on the stack, their vreg starts out with the value the caller pushed
+	vinstr_t *entry = f->instructions.head;
+	for (vinstr_t *instr = entry; instr && (instr->opcode == VOP_ENTER || instr->opcode == VOP_ALLOCA);
+		 instr = instr->next)
+		entry = instr;
+	for (size_t i = 0; i < numslots; ++i)
+	{
+		stack_slot_t *slot = &slots[i];
+		if (!slot->promoted || slot->disp <= 0)
+			continue;
+		vinstr_t *load = vinstr_list_insert_after(&f->instructions, entry);
+		if (!load)
+			return false;
+		vregister_t bp = {.index = VREG_BP};
+		load->opcode = VOP_MOV;
+		load->operands[0] = register_operand(slot->vreg);
+		load->operands[0].size = slot->size;
+		load->operands[1] = indirect_register_displacement_operand(bp, slot->disp, slot->size);
+		load->numoperands = 2;
+	}
+	return true;
+}
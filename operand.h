@@ -124,6 +124,12 @@ static voperand_t register_operand(vregister_t reg)
 	return op;
 }
 
+static bool voperand_is_floating_point(voperand_t* o)
+{
+	return o->size == VOPERAND_SIZE_DOUBLE ||
+		   o->size == VOPERAND_SIZE_FLOAT; // || o->type == VOPERAND_REGISTER && o->reg.usage == VRU_FLOATING_POINT;
+}
+
 static bool voperand_type_equal(voperand_t* a, voperand_t* b)
 {
 	if (a->type == VOPERAND_REGISTER && b->type == VOPERAND_REGISTER && a->size == b->size)
@@ -131,4 +137,31 @@ static bool voperand_type_equal(voperand_t* a, voperand_t* b)
 	return !memcmp(a, b, sizeof(voperand_t));
 }
 
+// compares only the fields the operand type uses, memcmp would also compare the padding and unused union bytes
+static bool voperand_equal(voperand_t* a, voperand_t* b)
+{
+	if (a->type != b->type || a->size != b->size || a->virtual != b->virtual)
+		return false;
+	switch (a->type)
+	{
+		case VOPERAND_IMMEDIATE:
+		case VOPERAND_INDIRECT:
+			return a->imm.nbits == b->imm.nbits && a->imm.is_unsigned == b->imm.is_unsigned &&
+				   imm_cast_int64_t(&a->imm) == imm_cast_int64_t(&b->imm);
+		case VOPERAND_REGISTER:
+		case VOPERAND_INDIRECT_REGISTER:
+			return a->reg.index == b->reg.index;
+		case VOPERAND_INDIRECT_REGISTER_DISPLACEMENT:
+			return a->reg_indirect_displacement.reg.index == b->reg_indirect_displacement.reg.index &&
+				   a->reg_indirect_displacement.disp == b->reg_indirect_displacement.disp;
+		case VOPERAND_INDIRECT_REGISTER_INDEXED:
+			return a->reg_indirect_indexed.reg.index == b->reg_indirect_indexed.reg.index &&
+				   a->reg_indirect_indexed.indexed_reg.index == b->reg_indirect_indexed.indexed_reg.index &&
+				   a->reg_indirect_indexed.scale == b->reg_indirect_indexed.scale;
+		case VOPERAND_LABEL:
+			return a->label == b->label;
+	}
+	return true;
+}
+
 #endif
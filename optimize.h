@@ -0,0 +1,256 @@
+#ifndef OPTIMIZE_H
+#define OPTIMIZE_H
+#include "ssa.h"
+
+static bool voperand_is_memory(voperand_t *op)
+{
+	switch (op->type)
+	{
+		case VOPERAND_INDIRECT:
+		case VOPERAND_INDIRECT_REGISTER:
+		case VOPERAND_INDIRECT_REGISTER_DISPLACEMENT:
+		case VOPERAND_INDIRECT_REGISTER_INDEXED:
+			return true;
+	}
+	return false;
+}
+
+// bytes a memory operand reads or writes
+static int voperand_access_width(voperand_t *op)
+{
+	switch (op->size)
+	{
+		case VOPERAND_SIZE_8_BITS:
+		case VOPERAND_SIZE_16_BITS:
+		case VOPERAND_SIZE_32_BITS:
+		case VOPERAND_SIZE_64_BITS:
+			return op->size;
+		case VOPERAND_SIZE_FLOAT:
+			return 4;
+	}
+	return 8;
+}
+
+// whether the address of a stack slot is taken, after that any pointer can point into the frame
+static bool optimize_frame_pointer_escapes(function_t *f)
+{
+	vinstr_list_foreach(&f->instructions, instr)
+	{
+		for (size_t i = 0; i < instr->numoperands; ++i)
+		{
+			voperand_t *op = &instr->operands[i];
+			if (!op->virtual)
+				continue;
+			if (op->type == VOPERAND_REGISTER && op->reg.index == VREG_BP)
+				return true;
+			if (op->type == VOPERAND_INDIRECT_REGISTER_INDEXED &&
+				(op->reg_indirect_indexed.reg.index == VREG_BP || op->reg_indirect_indexed.indexed_reg.index == VREG_BP))
+				return true;
+			if (instr->opcode == VOP_LEA && voperand_is_memory(op))
+			{
+				vregister_t *regs[2];
+				size_t n = voperand_registers(op, regs);
+				for (size_t k = 0; k < n; ++k)
+				{
+					if (regs[k]->index == VREG_BP)
+						return true;
+				}
+			}
+		}
+	}
+	return false;
+}
+
+// register the address is relative to and the displacement, false for indexed and absolute addresses
+static bool voperand_base_displacement(voperand_t *op, int *base, i32 *disp)
+{
+	if (!op->virtual)
+		return false;
+	if (op->type == VOPERAND_INDIRECT_REGISTER)
+	{
+		*base = op->reg.index;
+		*disp = 0;
+		return true;
+	}
+	if (op->type == VOPERAND_INDIRECT_REGISTER_DISPLACEMENT)
+	{
+		*base = op->reg_indirect_displacement.reg.index;
+		*disp = op->reg_indirect_displacement.disp;
+		return true;
+	}
+	return false;
+}
+
+static bool voperand_is_frame_slot(voperand_t *op)
+{
+	int base;
+	i32 disp;
+	return voperand_base_displacement(op, &base, &disp) && base == VREG_BP;
+}
+
+// whether two memory operands can refer to overlapping bytes, the base registers have to be SSA vregs or the frame
+// pointer so the same register means the same value
+static bool optimize_may_alias(voperand_t *a, voperand_t *b, bool frame_escapes)
+{
+	int basea, baseb;
+	i32 dispa, dispb;
+	if (voperand_base_displacement(a, &basea, &dispa) && voperand_base_displacement(b, &baseb, &dispb) &&
+		basea == baseb)
+		return dispa < dispb + voperand_access_width(b) && dispb < dispa + voperand_access_width(a);
+	// nothing but the frame pointer itself can address the frame if its address is never taken
+	if (!frame_escapes && voperand_is_frame_slot(a) != voperand_is_frame_slot(b))
+		return false;
+	return true;
+}
+
+// the instructions that pass the arguments of a call, see function_call_expr
+typedef struct
+{
+	vinstr_t *arguments[FUNCTION_MAX_PARAMETERS]; // by parameter, a mov to its argument register or a push
+	vinstr_t *padding; // sub that keeps the stack aligned for a odd amount of pushes
+	vinstr_t *pop; // add that pops the pushed arguments after the call
+} optimize_call_site_t;
+
+static voperand_t *optimize_call_argument(vinstr_t *instr)
+{
+	return &instr->operands[instr->opcode == VOP_PUSH ? 0 : 1];
+}
+
+static bool optimize_stack_adjustment(vinstr_t *instr, vopcode_t opcode, i64 bytes)
+{
+	return instr && instr->opcode == opcode && instr->operands[0].type == VOPERAND_REGISTER &&
+		   instr->operands[0].reg.index == VREG_SP && instr->operands[1].type == VOPERAND_IMMEDIATE &&
+		   imm_cast_int64_t(&instr->operands[1].imm) == bytes;
+}
+
+// finds what passes each argument of a call to callee, false if anything else is mixed in or a argument is in memory
+static bool optimize_call_site(function_t *callee, vinstr_t *call, optimize_call_site_t *site)
+{
+	if (callee->numparameters > FUNCTION_MAX_PARAMETERS)
+		return false;
+	memset(site, 0, sizeof(optimize_call_site_t));
+	vinstr_t *at = call->prev;
+	// the moves to the argument registers come right before the call
+	for (; at && at->opcode == VOP_MOV && at->operands[0].type == VOPERAND_REGISTER && at->operands[0].virtual &&
+		   at->operands[0].reg.index >= VREG_ARGUMENT_0 && at->operands[0].reg.index < VREG_MAX;
+		 at = at->prev)
+	{
+		for (size_t i = 0; i < callee->numparameters; ++i)
+		{
+			if (callee->parameters[i].reg == at->operands[0].reg.index && !site->arguments[i])
+				site->arguments[i] = at;
+		}
+	}
+	// the pushes before those, the last one pushed is the first stack argument
+	for (size_t i = 0; i < callee->numparameters; ++i)
+	{
+		if (callee->parameters[i].reg != -1)
+			continue;
+		if (!at || at->opcode != VOP_PUSH)
+			return false;
+		site->arguments[i] = at;
+		at = at->prev;
+	}
+	for (size_t i = 0; i < callee->numparameters; ++i)
+	{
+		if (!site->arguments[i] || voperand_is_memory(optimize_call_argument(site->arguments[i])))
+			return false;
+	}
+	i64 padding = (callee->argcost / 8) % 2 ? 8 : 0;
+	if (padding)
+	{
+		if (!optimize_stack_adjustment(at, VOP_SUB, padding))
+			return false;
+		site->padding = at;
+	}
+	if (callee->argcost + padding)
+	{
+		if (!optimize_stack_adjustment(call->next, VOP_ADD, callee->argcost + padding))
+			return false;
+		site->pop = call->next;
+	}
+	return true;
+}
+
+// copies the bodies of small functions into their callers before lower_function, the whole program at once. callees
+// go first in the call graph and recursive calls are left alone. a callee is inlined when its size minus what the
+// call costs stays within ctx->inline_budget, four times that for functions declared inline
+bool optimize_inline(compiler_t *ctx, arena_t *allocator);
+
+// the passes run on one function at a time from lower_function, analysis data is allocated from allocator
+
+// moves the stack slots that are only ever read and written whole into vregs, done before ssa_construct so the
+// loads and stores of a local become copies and phis. slots stay in memory once the frame pointer is used as a
+// value or indexed, when they lie at or above a address that is taken and when accesses of different sizes
+// overlap, which covers arrays and structs copied as a whole
+bool optimize_mem2reg(function_t *f, arena_t *allocator);
+
+// sparse conditional constant propagation on SSA form, folds integer and double arithmetic, conversions and
+// compares, turns conditional jumps with a known outcome into jumps or removes them and deletes the blocks that
+// can't execute
+bool optimize_sccp(function_t *f, arena_t *allocator);
+
+// dominator based global value numbering, a computation or address already available in a dominating block is
+// reused and copies are propagated. loads are reused and stores forwarded to later loads of the same location as
+// long as no store that may write it or call comes in between
+bool optimize_gvn(function_t *f, arena_t *allocator);
+
+// moves the instructions of a loop that compute the same value on every iteration to the preheader, which is
+// created when the loop is entered from a block that also branches elsewhere. loads are only moved for stack slots
+// no store in the loop may write
+bool optimize_licm(function_t *f, arena_t *allocator);
+
+// the instruction code that runs once before the loop goes in front of, a block is made for it if the only edge
+// entering the loop comes from a block that also goes elsewhere. NULL if the loop has more than one entering edge,
+// the cfg has to be rebuilt after a block was added
+vinstr_t *optimize_loop_preheader(function_t *f, cfg_loop_t *loop);
+
+// rewrites multiplies of a induction variable by a constant into a variable of their own that is stepped with a add,
+// multiplies and signed divides by powers of two into shifts and divides by other constants into a multiply with
+// the reciprocal
+bool optimize_strength_reduction(function_t *f, arena_t *allocator);
+
+// removes the instructions whose results are never used, starting from the ones with side effects and marking the
+// definitions of everything they read
+bool optimize_dce(function_t *f, arena_t *allocator);
+
+// turns a call whose result is returned right away into storing the arguments over the incoming ones, leaving the
+// frame and jumping to the callee, when they fit and the frame's address is never taken. runs out of SSA form
+bool optimize_tail_calls(compiler_t *ctx, function_t *f, arena_t *allocator);
+
+// deletes unreachable blocks, jumps to the next instruction and redirects jumps to blocks that only jump elsewhere,
+// until nothing changes. labels nothing jumps to are dropped once the function has no phis left
+bool optimize_cfg_cleanup(function_t *f, arena_t *allocator);
+
+typedef struct
+{
+	int size; // bytes
+	int *offset; // from bp, set by frame_layout
+	size_t index;
+} frame_slot_t;
+
+// gives each slot a offset below rbp aligned to the largest power of two its size is a multiple of, up to 16, and
+// returns the size of the frame rounded up to 16 bytes so rsp stays aligned for calls
+int frame_layout(frame_slot_t *slots, size_t numslots);
+
+// packs the stack slots that are still accessed once the locals were moved into vregs, as long as the frame's
+// address is never taken. runs right before register allocation, which puts its spill slots below them
+bool optimize_stack_slots(function_t *f, arena_t *allocator);
+
+// reorders the instructions of each basic block by a list scheduler over their dependency graph, with latencies for
+// loads, multiplies, divides and the SSE operations, so long latency instructions start as early as their operands
+// allow. runs right before register allocation and at -O2 again on the x64 registers
+bool optimize_schedule(function_t *f, arena_t *allocator);
+
+// runs last, a function that makes no calls and doesn't move rsp itself loses its frame pointer and addresses its
+// slots from rsp, in the red zone when they fit. otherwise only a empty alloca is dropped
+bool optimize_frame(function_t *f, arena_t *allocator);
+
+// runs once, after register allocation on the x64 registers, a table of patterns over neighbouring instructions removes
+// moves whose result isn't needed or that only pass a value on, forwards a store to the load right after it, zeroes
+// with xor, turns a copy and add into lea, folds push and pop into a move and drops adds of 0. there is no pass over
+// the virtual registers, gvn, dce and the copies ssa_destruct coalesces already cover what it would find there, and
+// the moves worth removing only show up once the allocator has assigned registers and spilled
+bool optimize_peephole(function_t *f, arena_t *allocator);
+
+#endif
@@ -0,0 +1,561 @@
+#include "optimize.h"
+#include "regalloc.h"
+#include "std.h"
+#include <stdio.h>
+
+// peephole optimization of the code after register allocation, where the operands are x64 registers. every pattern
+// looks at a instruction and the ones right after it in the same block, liveness of the registers and the flags
+// tells whether a value that is dropped or clobbered is still needed
+
+// registers as bits of a mask, the xmm registers after the general purpose ones and the flags last
+#define PEEPHOLE_XMM(reg) ((u64)1 << (X64_REGISTER_MAX + (reg)))
+#define PEEPHOLE_FLAGS ((u64)1 << (X64_REGISTER_MAX + X64_XMM_REGISTER_MAX))
+#define PEEPHOLE_ALL (~(u64)0)
+
+// the stack and frame pointer are live everywhere
+#define PEEPHOLE_ALWAYS_LIVE (((u64)1 << RSP) | ((u64)1 << RBP))
+
+#define PEEPHOLE_CALLER_SAVED                                                                                          \
+	(((u64)1 << RAX) | ((u64)1 << RCX) | ((u64)1 << RDX) | ((u64)1 << RSI) | ((u64)1 << RDI) | ((u64)1 << R8) |       \
+	 ((u64)1 << R9) | ((u64)1 << R10) | ((u64)1 << R11))
+#define PEEPHOLE_ARGUMENTS                                                                                             \
+	(((u64)1 << RDI) | ((u64)1 << RSI) | ((u64)1 << RDX) | ((u64)1 << RCX) | ((u64)1 << R8) | ((u64)1 << R9) |        \
+	 (PEEPHOLE_XMM(8) - PEEPHOLE_XMM(0)))
+
+typedef struct
+{
+	function_t *function;
+	cfg_t cfg;
+	u64 *live_out; // per block
+	vinstr_t *end; // first instruction after the block that is looked at
+	u64 block_live_out;
+} peephole_t;
+
+static bool is_floating_point_register(voperand_t *op)
+{
+	return op->type == VOPERAND_REGISTER && (op->size == VOPERAND_SIZE_DOUBLE || op->size == VOPERAND_SIZE_FLOAT);
+}
+
+static u64 register_bit(voperand_t *op, vregister_t *reg)
+{
+	if (is_floating_point_register(op))
+		return PEEPHOLE_XMM(reg->index);
+	return (u64)1 << reg->index;
+}
+
+static u64 operand_registers(voperand_t *op)
+{
+	switch (op->type)
+	{
+		case VOPERAND_IMMEDIATE:
+		case VOPERAND_LABEL:
+		case VOPERAND_INVALID:
+		case VOPERAND_INDIRECT:
+			return 0;
+	}
+	// anything the allocator didn't assign could be any register
+	if (op->virtual)
+		return PEEPHOLE_ALL;
+	switch (op->type)
+	{
+		case VOPERAND_REGISTER:
+		case VOPERAND_INDIRECT_REGISTER:
+			return register_bit(op, &op->reg);
+		case VOPERAND_INDIRECT_REGISTER_DISPLACEMENT:
+			return (u64)1 << op->reg_indirect_displacement.reg.index;
+		case VOPERAND_INDIRECT_REGISTER_INDEXED:
+			return ((u64)1 << op->reg_indirect_indexed.reg.index) |
+				   ((u64)1 << op->reg_indirect_indexed.indexed_reg.index);
+	}
+	return PEEPHOLE_ALL;
+}
+
+static bool sets_flags(vopcode_t opcode)
+{
+	switch (opcode)
+	{
+		case VOP_ADD:
+		case VOP_SUB:
+		case VOP_AND:
+		case VOP_OR:
+		case VOP_XOR:
+		case VOP_CMP:
+		case VOP_TEST:
+			return true;
+	}
+	return false;
+}
+
+// a write of less than 32 bits keeps the rest of the register
+static bool writes_whole_register(voperand_t *op)
+{
+	return op->type == VOPERAND_REGISTER && op->size != VOPERAND_SIZE_8_BITS && op->size != VOPERAND_SIZE_16_BITS;
+}
+
+static void instruction_registers(vinstr_t *instr, u64 *uses, u64 *defs)
+{
+	*uses = *defs = 0;
+	switch (instr->opcode)
+	{
+		case VOP_LABEL:
+		case VOP_JMP:
+			return;
+		case VOP_CALL:
+			*uses = PEEPHOLE_ARGUMENTS;
+			*defs = PEEPHOLE_CALLER_SAVED | (PEEPHOLE_FLAGS - PEEPHOLE_XMM(0)) | PEEPHOLE_FLAGS;
+			return;
+		case VOP_RET:
+		case VOP_TAILCALL:
+		case VOP_HLT:
+		case VOP_PHI:
+			*uses = PEEPHOLE_ALL;
+			return;
+		case VOP_POP:
+			*uses = voperand_is_memory(&instr->operands[0]) ? operand_registers(&instr->operands[0]) : 0;
+			*defs = writes_whole_register(&instr->operands[0]) ? operand_registers(&instr->operands[0]) : 0;
+			return;
+	}
+	if (vopcode_is_conditional_jump(instr->opcode))
+	{
+		*uses = PEEPHOLE_FLAGS;
+		return;
+	}
+	for (size_t i = 0; i < instr->numoperands; ++i)
+	{
+		voperand_t *op = &instr->operands[i];
+		u64 regs = operand_registers(op);
+		if (i > 0 || op->type != VOPERAND_REGISTER || !vinstr_first_operand_is_written(instr))
+		{
+			*uses |= regs;
+			continue;
+		}
+		if (!vinstr_first_operand_is_definition(instr) || !writes_whole_register(op))
+			*uses |= regs;
+		*defs |= regs;
+	}
+	if (sets_flags(instr->opcode))
+		*defs |= PEEPHOLE_FLAGS;
+	// idiv and imul also write rdx and leave the flags undefined, the rax in the first operand is already counted
+	if (vopcode_uses_rdx_rax(instr->opcode))
+		*defs |= ((u64)1 << RDX) | PEEPHOLE_FLAGS;
+}
+
+// whether none of the registers in mask are read after instr before being written again
+static bool dead_after(peephole_t *p, vinstr_t *instr, u64 mask)
+{
+	if (mask & PEEPHOLE_ALWAYS_LIVE)
+		return false;
+	for (vinstr_t *it = instr->next; it != p->end; it = it->next)
+	{
+		u64 uses, defs;
+		instruction_registers(it, &uses, &defs);
+		if (uses & mask)
+			return false;
+		mask &= ~defs;
+		if (!mask)
+			return true;
+	}
+	return !(p->block_live_out & mask);
+}
+
+static vinstr_t *next_in_block(peephole_t *p, vinstr_t *instr)
+{
+	return instr->next != p->end ? instr->next : NULL;
+}
+
+static bool same_register(voperand_t *a, voperand_t *b)
+{
+	return a->type == VOPERAND_REGISTER && b->type == VOPERAND_REGISTER && a->size == b->size &&
+		   register_bit(a, &a->reg) == register_bit(b, &b->reg);
+}
+
+static bool fits_imm32(voperand_t *op)
+{
+	i64 value = imm_cast_int64_t(&op->imm);
+	return value >= INT32_MIN && value <= INT32_MAX;
+}
+
+static bool is_integer_alu(vopcode_t opcode)
+{
+	switch (opcode)
+	{
+		case VOP_ADD:
+		case VOP_SUB:
+		case VOP_MUL:
+		case VOP_AND:
+		case VOP_OR:
+		case VOP_XOR:
+			return true;
+	}
+	return false;
+}
+
+static int memory_operands(vinstr_t *instr)
+{
+	int n = 0;
+	for (size_t i = 0; i < instr->numoperands; ++i)
+		n += voperand_is_memory(&instr->operands[i]);
+	return n;
+}
+
+// whether src can take the place of a register operand at index i of instr
+static bool can_substitute(vinstr_t *instr, size_t i, voperand_t *src)
+{
+	// the divisor or multiplier is read after rdx:rax is set up
+	if (vopcode_uses_rdx_rax(instr->opcode) && (operand_registers(src) & (((u64)1 << RAX) | ((u64)1 << RDX))))
+		return false;
+	if (src->type == VOPERAND_REGISTER)
+		return true;
+	bool alu = is_integer_alu(instr->opcode);
+	switch (instr->opcode)
+	{
+		case VOP_MOV:
+			// only a register can be loaded with a 64 bit constant
+			if (i == 0)
+				return false;
+			if (src->type == VOPERAND_IMMEDIATE)
+				return fits_imm32(src) || instr->operands[0].type == VOPERAND_REGISTER;
+			return memory_operands(instr) == 0;
+		case VOP_PUSH:
+			return src->type == VOPERAND_IMMEDIATE ? fits_imm32(src) : true;
+		case VOP_CMP:
+		case VOP_TEST:
+			alu = true;
+			break;
+	}
+	if (!alu || i == 0)
+		return instr->opcode == VOP_CMP && i == 0 && voperand_is_memory(src) && memory_operands(instr) == 0;
+	if (src->type == VOPERAND_IMMEDIATE)
+		return fits_imm32(src);
+	return voperand_is_memory(src) && memory_operands(instr) == 0;
+}
+
+static void remove_instruction(peephole_t *p, vinstr_t *instr)
+{
+	vinstr_list_remove(&p->function->instructions, instr);
+}
+
+// mov r, r
+static bool remove_self_move(peephole_t *p, vinstr_t *instr)
+{
+	voperand_t *ops = instr->operands;
+	// a 32 bit move clears the upper half of the register
+	if (!same_register(&ops[0], &ops[1]) || ops[0].size == VOPERAND_SIZE_32_BITS)
+		return false;
+	remove_instruction(p, instr);
+	return true;
+}
+
+// a register that is written and never read
+static bool remove_dead_move(peephole_t *p, vinstr_t *instr)
+{
+	voperand_t *dst = &instr->operands[0];
+	if (dst->type != VOPERAND_REGISTER || !writes_whole_register(dst) || !dead_after(p, instr, operand_registers(dst)))
+		return false;
+	remove_instruction(p, instr);
+	return true;
+}
+
+// mov [m], r then mov r2, [m] reads back what was stored, mov r, [m] then mov [m], r stores what is already there
+static bool forward_store(peephole_t *p, vinstr_t *instr)
+{
+	vinstr_t *next = next_in_block(p, instr);
+	if (!next || next->opcode != VOP_MOV)
+		return false;
+	voperand_t *ops = instr->operands, *nops = next->operands;
+	if (voperand_is_memory(&ops[0]) && ops[1].type == VOPERAND_REGISTER && voperand_equal(&ops[0], &nops[1]) &&
+		nops[0].type == VOPERAND_REGISTER && ops[1].size == nops[0].size)
+	{
+		if (same_register(&nops[0], &ops[1]))
+			remove_instruction(p, next);
+		else
+			nops[1] = ops[1];
+		return true;
+	}
+	if (ops[0].type == VOPERAND_REGISTER && voperand_is_memory(&ops[1]) && voperand_equal(&ops[1], &nops[0]) &&
+		same_register(&ops[0], &nops[1]) && !(operand_registers(&ops[1]) & operand_registers(&ops[0])))
+	{
+		remove_instruction(p, next);
+		return true;
+	}
+	return false;
+}
+
+// mov t, x then a instruction that reads t, which isn't used after, reads x instead
+static bool propagate_copy(peephole_t *p, vinstr_t *instr)
+{
+	vinstr_t *next = next_in_block(p, instr);
+	voperand_t *t = &instr->operands[0], *x = &instr->operands[1];
+	if (!next || t->type != VOPERAND_REGISTER || next->opcode == VOP_PHI || next->opcode == VOP_CALL)
+		return false;
+	if (x->type == VOPERAND_REGISTER && (x->size != t->size || is_floating_point_register(x) != is_floating_point_register(t)))
+		return false;
+
+	u64 bit = operand_registers(t);
+	bool found = false;
+	for (size_t i = 0; i < next->numoperands; ++i)
+	{
+		voperand_t *op = &next->operands[i];
+		if (!(operand_registers(op) & bit))
+			continue;
+		bool written = i == 0 && vinstr_first_operand_is_written(next);
+		if (written || !voperand_equal(op, t) || !can_substitute(next, i, x))
+			return false;
+		found = true;
+	}
+	u64 uses, defs;
+	instruction_registers(next, &uses, &defs);
+	if (!found || (defs & bit) || !dead_after(p, next, bit))
+		return false;
+	for (size_t i = 0; i < next->numoperands; ++i)
+	{
+		if (voperand_equal(&next->operands[i], t))
+			next->operands[i] = *x;
+	}
+	remove_instruction(p, instr);
+	return true;
+}
+
+// mov t, x then op t, y then mov x, t is op x, y when t isn't used after
+static bool fold_move_chain(peephole_t *p, vinstr_t *instr)
+{
+	vinstr_t *op = next_in_block(p, instr);
+	vinstr_t *back = op ? next_in_block(p, op) : NULL;
+	if (!back || back->opcode != VOP_MOV || op->numoperands != 2)
+		return false;
+	if (!is_integer_alu(op->opcode) && op->opcode != VOP_FADD && op->opcode != VOP_FSUB && op->opcode != VOP_FMUL &&
+		op->opcode != VOP_FDIV)
+		return false;
+	voperand_t *t = &instr->operands[0], *x = &instr->operands[1], *y = &op->operands[1];
+	if (t->type != VOPERAND_REGISTER || !voperand_equal(&op->operands[0], t) || !voperand_equal(&back->operands[0], x) ||
+		!voperand_equal(&back->operands[1], t))
+		return false;
+	if (x->size != t->size || (x->type != VOPERAND_REGISTER && (!voperand_is_memory(x) || is_floating_point_register(t))))
+		return false;
+	// the address of x has to be the same for the load and the store
+	u64 bit = operand_registers(t);
+	if ((operand_registers(y) & bit) || (voperand_is_memory(x) && (voperand_is_memory(y) || (operand_registers(x) & bit))))
+		return false;
+	if (!dead_after(p, back, bit))
+		return false;
+	op->operands[0] = *x;
+	remove_instruction(p, instr);
+	remove_instruction(p, back);
+	return true;
+}
+
+// mov r, 0 is xor r, r when nothing reads the flags
+static bool zero_with_xor(peephole_t *p, vinstr_t *instr)
+{
+	voperand_t *ops = instr->operands;
+	if (ops[0].type != VOPERAND_REGISTER || is_floating_point_register(&ops[0]) || !writes_whole_register(&ops[0]))
+		return false;
+	if (ops[1].type != VOPERAND_IMMEDIATE || imm_cast_int64_t(&ops[1].imm) != 0 || !dead_after(p, instr, PEEPHOLE_FLAGS))
+		return false;
+	instr->opcode = VOP_XOR;
+	ops[1] = ops[0];
+	return true;
+}
+
+// mov r, a then add r, b with a register and a constant or two registers is lea r, [a + b] when nothing reads the
+// flags
+static bool add_with_lea(peephole_t *p, vinstr_t *instr)
+{
+	vinstr_t *next = next_in_block(p, instr);
+	voperand_t *r = &instr->operands[0];
+	if (!next || (next->opcode != VOP_ADD && next->opcode != VOP_SUB) || next->numoperands != 2 ||
+		!voperand_equal(&next->operands[0], r))
+		return false;
+	if (r->type != VOPERAND_REGISTER || is_floating_point_register(r) || !writes_whole_register(r))
+		return false;
+	voperand_t *base = &instr->operands[1], *offset = &next->operands[1];
+	if (base->type == VOPERAND_IMMEDIATE && next->opcode == VOP_ADD)
+	{
+		voperand_t *tmp = base;
+		base = offset;
+		offset = tmp;
+	}
+	if (base->type != VOPERAND_REGISTER || base->size != r->size || same_register(base, r))
+		return false;
+	voperand_t address = {.size = VOPERAND_SIZE_NATIVE};
+	if (offset->type == VOPERAND_IMMEDIATE)
+	{
+		i64 disp = imm_cast_int64_t(&offset->imm);
+		if (next->opcode == VOP_SUB)
+			disp = -disp;
+		if (disp < INT32_MIN || disp > INT32_MAX)
+			return false;
+		address.type = VOPERAND_INDIRECT_REGISTER_DISPLACEMENT;
+		address.reg_indirect_displacement.reg = base->reg;
+		address.reg_indirect_displacement.disp = (i32)disp;
+	}
+	else if (offset->type == VOPERAND_REGISTER && next->opcode == VOP_ADD && offset->size == r->size &&
+			 !same_register(offset, r))
+	{
+		address.type = VOPERAND_INDIRECT_REGISTER_INDEXED;
+		address.reg_indirect_indexed.reg = base->reg;
+		address.reg_indirect_indexed.indexed_reg = offset->reg;
+		address.reg_indirect_indexed.scale = 1;
+	}
+	else
+		return false;
+	if (!dead_after(p, next, PEEPHOLE_FLAGS))
+		return false;
+	instr->opcode = VOP_LEA;
+	instr->operands[1] = address;
+	remove_instruction(p, next);
+	return true;
+}
+
+// add r, 0 and sub r, 0, e.g after a call without arguments
+static bool remove_add_zero(peephole_t *p, vinstr_t *instr)
+{
+	voperand_t *ops = instr->operands;
+	if (instr->numoperands != 2 || ops[1].type != VOPERAND_IMMEDIATE || imm_cast_int64_t(&ops[1].imm) != 0 ||
+		!dead_after(p, instr, PEEPHOLE_FLAGS))
+		return false;
+	remove_instruction(p, instr);
+	return true;
+}
+
+// push x then pop y is a move
+static bool fold_push_pop(peephole_t *p, vinstr_t *instr)
+{
+	vinstr_t *next = next_in_block(p, instr);
+	if (!next || next->opcode != VOP_POP)
+		return false;
+	voperand_t *x = &instr->operands[0], *y = &next->operands[0];
+	if (voperand_equal(x, y))
+	{
+		remove_instruction(p, instr);
+		remove_instruction(p, next);
+		return true;
+	}
+	if (voperand_is_memory(x) && voperand_is_memory(y))
+		return false;
+	if (x->type != VOPERAND_IMMEDIATE && (x->size != y->size || is_floating_point_register(x)))
+		return false;
+	if (y->type != VOPERAND_REGISTER && (x->type != VOPERAND_REGISTER || !voperand_is_memory(y)))
+		return false;
+	// the memory operand of a pop is addressed after rsp is incremented
+	if ((operand_registers(x) | operand_registers(y)) & ((u64)1 << RSP))
+		return false;
+	instr->opcode = VOP_MOV;
+	instr->operands[1] = *x;
+	instr->operands[0] = *y;
+	instr->numoperands = 2;
+	remove_instruction(p, next);
+	return true;
+}
+
+typedef struct
+{
+	vopcode_t opcode;
+	bool (*apply)(peephole_t *p, vinstr_t *instr);
+} peephole_pattern_t;
+
+// tried in order, the first pattern that applies rewrites the instruction
+static peephole_pattern_t patterns[] = {{VOP_MOV, remove_self_move},
+										{VOP_MOV, remove_dead_move},
+										{VOP_MOV, forward_store},
+										{VOP_MOV, fold_move_chain},
+										{VOP_MOV, propagate_copy},
+										{VOP_MOV, add_with_lea},
+										{VOP_MOV, zero_with_xor},
+										{VOP_LEA, remove_dead_move},
+										{VOP_ADD, remove_add_zero},
+										{VOP_SUB, remove_add_zero},
+										{VOP_PUSH, fold_push_pop}};
+
+static bool compute_liveness(peephole_t *p, arena_t *allocator)
+{
+	cfg_t *cfg = &p->cfg;
+	u64 *uses = (u64 *)arena_alloc(allocator, sizeof(u64) * cfg->numblocks);
+	u64 *defs = (u64 *)arena_alloc(allocator, sizeof(u64) * cfg->numblocks);
+	p->live_out = (u64 *)arena_alloc(allocator, sizeof(u64) * cfg->numblocks);
+	if (!uses || !defs || !p->live_out)
+		return false;
+	for (size_t i = 0; i < cfg->numblocks; ++i)
+	{
+		basic_block_t *bb = &cfg->blocks[i];
+		uses[i] = defs[i] = 0;
+		p->live_out[i] = bb->rpo == -1 ? PEEPHOLE_ALL : 0;
+		for (vinstr_t *instr = bb->last;; instr = instr->prev)
+		{
+			u64 u, d;
+			instruction_registers(instr, &u, &d);
+			uses[i] = (uses[i] & ~d) | u;
+			defs[i] |= d;
+			if (instr == bb->first)
+				break;
+		}
+	}
+	bool changed = true;
+	while (changed)
+	{
+		changed = false;
+		for (size_t i = cfg->numrpo; i-- > 0;)
+		{
+			basic_block_t *bb = cfg->rpo[i];
+			u64 out = 0;
+			for (size_t k = 0; k < bb->numsucc; ++k)
+			{
+				size_t s = bb->succ[k]->index;
+				out |= uses[s] | (p->live_out[s] & ~defs[s]);
+			}
+			if (out != p->live_out[bb->index])
+			{
+				p->live_out[bb->index] = out;
+				changed = true;
+			}
+		}
+	}
+	return true;
+}
+
+static bool optimize_block(peephole_t *p, basic_block_t *bb)
+{
+	vinstr_list_t *list = &p->function->instructions;
+	vinstr_t *before = bb->first->prev;
+	p->end = bb->last->next;
+	p->block_live_out = p->live_out[bb->index];
+
+	// start over after every rewrite, it can make a earlier pattern match
+	bool changed = false;
+	for (vinstr_t *instr = bb->first; instr != p->end;)
+	{
+		bool applied = false;
+		for (size_t i = 0; i < COUNT_OF(patterns) && !applied; ++i)
+		{
+			if (patterns[i].opcode == instr->opcode)
+				applied = patterns[i].apply(p, instr);
+		}
+		if (!applied)
+		{
+			instr = instr->next;
+			continue;
+		}
+		changed = true;
+		instr = before ? before->next : list->head;
+	}
+	return changed;
+}
+
+bool optimize_peephole(function_t *f, arena_t *allocator)
+{
+	peephole_t p = {0};
+	p.function = f;
+	bool changed = true;
+	while (changed && f->instructions.head)
+	{
+		changed = false;
+		if (!cfg_build(&p.cfg, f, allocator) || !compute_liveness(&p, allocator))
+			return false;
+		for (size_t i = 0; i < p.cfg.numblocks; ++i)
+		{
+			if (p.cfg.blocks[i].rpo != -1 && optimize_block(&p, &p.cfg.blocks[i]))
+				changed = true;
+		}
+	}
+	return true;
+}
@@ -0,0 +1,611 @@
+#include "regalloc.h"
+#include "std.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+// caller saved registers first, they don't have to be preserved in the prologue
+static const int integer_registers[] = {RAX, RCX, RDX, RSI, RDI, R8, R9, RBX, R12, R13, R14, R15};
+
+static voperand_t physical_register_operand(int reg, voperand_size_t size)
+{
+	vregister_t vr = {.index = reg};
+	voperand_t op = register_operand(vr);
+	op.size = size;
+	op.virtual = false;
+	return op;
+}
+
+static voperand_t frame_operand(i32 offset, voperand_size_t size)
+{
+	vregister_t bp = {.index = RBP};
+	voperand_t op = indirect_register_displacement_operand(bp, offset, size);
+	op.virtual = false;
+	return op;
+}
+
+static vinstr_t *insert_mov(vinstr_list_t *list, vinstr_t *at, bool before, voperand_t dst, voperand_t src)
+{
+	vinstr_t *instr = before ? vinstr_list_insert_before(list, at) : vinstr_list_insert_after(list, at);
+	if (!instr)
+		return NULL;
+	instr->opcode = VOP_MOV;
+	instr->operands[0] = dst;
+	instr->operands[1] = src;
+	instr->numoperands = 2;
+	return instr;
+}
+
+// the fixed vregs are only live for a few instructions around each call and at the start, a interval of their own
+// would cover most of the function
+static bool count_fixed_positions(regalloc_t *ra, size_t numpositions)
+{
+	liveness_t *lv = &ra->liveness;
+	cfg_t *cfg = &ra->cfg;
+	u32 *live_at = (u32 *)arena_alloc(ra->allocator, sizeof(u32) * numpositions);
+	if (!live_at)
+		return false;
+	memset(live_at, 0, sizeof(u32) * numpositions);
+	int vregs[LIVENESS_MAX_VREGS_PER_INSTRUCTION];
+	for (size_t i = 0; i < cfg->numblocks; ++i)
+	{
+		basic_block_t *bb = &cfg->blocks[i];
+		u32 live = 0;
+		for (int vreg = VREG_RETURN_VALUE; vreg < VREG_MAX; ++vreg)
+		{
+			if (liveness_live_out(lv, bb, vreg))
+				live |= 1u << vreg;
+		}
+		for (vinstr_t *instr = bb->last; instr != bb->first->prev; instr = instr->prev)
+		{
+			u32 mask = live;
+			size_t n = vinstr_defined_vregs(instr, vregs);
+			for (size_t k = 0; k < n; ++k)
+			{
+				if (vregs[k] >= VREG_MAX)
+					continue;
+				mask |= 1u << vregs[k];
+				live &= ~(1u << vregs[k]);
+			}
+			n = vinstr_used_vregs(instr, vregs);
+			for (size_t k = 0; k < n; ++k)
+			{
+				if (vregs[k] >= VREG_MAX)
+					continue;
+				mask |= 1u << vregs[k];
+				live |= 1u << vregs[k];
+			}
+			live_at[cfg_position(cfg, instr)] = mask;
+		}
+	}
+	for (int vreg = VREG_RETURN_VALUE; vreg < VREG_MAX; ++vreg)
+	{
+		size_t *before = (size_t *)arena_alloc(ra->allocator, sizeof(size_t) * (numpositions + 1));
+		if (!before)
+			return false;
+		before[0] = 0;
+		for (size_t position = 0; position < numpositions; ++position)
+			before[position + 1] = before[position] + ((live_at[position] >> vreg) & 1);
+		ra->fixed_before[vreg] = before;
+	}
+	return true;
+}
+
+static bool operand_reads_rdx_rax(voperand_t *op)
+{
+	vregister_t *regs[2];
+	size_t n = op->virtual ? voperand_registers(op, regs) : 0;
+	for (size_t i = 0; i < n; ++i)
+	{
+		if (regs[i]->index == VREG_RETURN_VALUE || regs[i]->index == VREG_ARGUMENT_0 + 2)
+			return true;
+	}
+	return false;
+}
+
+// idiv and the one operand imul get their first operand moved into rax and the result moved back out, a immediate
+// second operand is loaded into a register. rax is then a fixed vreg at the instruction and the rdx it clobbers is
+// one as well, see vinstr_defined_vregs, so neither allocator gives them to a vreg that is live across it
+static bool fix_rdx_rax_operands(function_t *f)
+{
+	vinstr_list_t *list = &f->instructions;
+	vinstr_list_foreach(list, instr)
+	{
+		voperand_t *ops = instr->operands;
+		if (!vopcode_uses_rdx_rax(instr->opcode) || instr->numoperands != 2)
+			continue;
+		// cqo writes rdx before idiv reads the divisor
+		if (ops[1].type == VOPERAND_IMMEDIATE || operand_reads_rdx_rax(&ops[1]))
+		{
+			voperand_t tmp = register_operand(function_new_vreg(f));
+			tmp.size = ops[0].size;
+			if (!insert_mov(list, instr, true, tmp, ops[1]))
+				return false;
+			ops[1] = tmp;
+		}
+		if (ops[0].type == VOPERAND_REGISTER && ops[0].virtual && ops[0].reg.index == VREG_RETURN_VALUE)
+			continue;
+		vregister_t rv = {.index = VREG_RETURN_VALUE};
+		voperand_t rax = register_operand(rv);
+		rax.size = ops[0].size;
+		if (!insert_mov(list, instr, true, rax, ops[0]) || !insert_mov(list, instr, false, ops[0], rax))
+			return false;
+		ops[0] = rax;
+	}
+	return true;
+}
+
+bool regalloc_init(regalloc_t *ra, function_t *f, arena_t *allocator)
+{
+	memset(ra, 0, sizeof(regalloc_t));
+	ra->function = f;
+	ra->allocator = allocator;
+	if (!fix_rdx_rax_operands(f) || !cfg_build(&ra->cfg, f, allocator) || !liveness_compute(&ra->liveness, &ra->cfg, allocator))
+		return false;
+
+	liveness_t *lv = &ra->liveness;
+	size_t numpositions = f->instructions.count;
+	ra->assignments = (regalloc_assignment_t *)arena_alloc(allocator, sizeof(regalloc_assignment_t) * lv->numvregs);
+	ra->is_floating_point = (bool *)arena_alloc(allocator, sizeof(bool) * lv->numvregs);
+	ra->sizes = (voperand_size_t *)arena_alloc(allocator, sizeof(voperand_size_t) * lv->numvregs);
+	ra->calls_before = (size_t *)arena_alloc(allocator, sizeof(size_t) * (numpositions + 1));
+	if (!ra->assignments || !ra->is_floating_point || !ra->sizes || !ra->calls_before)
+		return false;
+
+	for (size_t i = 0; i < lv->numvregs; ++i)
+	{
+		ra->assignments[i].reg = -1;
+		ra->assignments[i].spill_slot = -1;
+		ra->is_floating_point[i] = false;
+		ra->sizes[i] = VOPERAND_SIZE_64_BITS;
+	}
+
+	size_t position = 0;
+	size_t numcalls = 0;
+	vinstr_list_foreach(&f->instructions, instr)
+	{
+		ra->calls_before[position++] = numcalls;
+		if (instr->opcode == VOP_CALL)
+			++numcalls;
+		// the register class follows from the size the vreg is used with
+		for (size_t i = 0; i < instr->numoperands; ++i)
+		{
+			voperand_t *op = &instr->operands[i];
+			if (op->type != VOPERAND_REGISTER || !op->virtual || op->reg.index < VREG_MAX)
+				continue;
+			if (!voperand_is_floating_point(op))
+				continue;
+			size_t slot = liveness_slot(lv, op->reg.index);
+			ra->is_floating_point[slot] = true;
+			ra->sizes[slot] = op->size;
+		}
+	}
+	ra->calls_before[position] = numcalls;
+	return count_fixed_positions(ra, numpositions);
+}
+
+bool regalloc_crosses_call(regalloc_t *ra, live_interval_t *interval)
+{
+	// a call at the start defines the vreg, a call at the end can't read it
+	if (interval->end <= interval->start + 1)
+		return false;
+	return ra->calls_before[interval->end] != ra->calls_before[interval->start + 1];
+}
+
+void regalloc_spill(regalloc_t *ra, live_interval_t *interval)
+{
+	regalloc_assignment_t *a = &ra->assignments[liveness_slot(&ra->liveness, interval->vreg)];
+	a->reg = -1;
+	a->spill_slot = ra->numspillslots++;
+	++ra->stats.numspilled;
+}
+
+void regalloc_assign(regalloc_t *ra, live_interval_t *interval, int reg)
+{
+	size_t slot = liveness_slot(&ra->liveness, interval->vreg);
+	ra->assignments[slot].reg = reg;
+	ra->assignments[slot].spill_slot = -1;
+	if (!ra->is_floating_point[slot])
+		ra->used_registers |= 1 << reg;
+	++ra->stats.numallocated;
+}
+
+typedef struct
+{
+	int vreg;
+	int reg;
+	bool floating_point;
+	voperand_size_t size;
+	int spill_slot;
+} scratch_t;
+
+static i32 spill_slot_offset(i32 spillbase, int slot)
+{
+	return -(spillbase + REGALLOC_SPILL_SLOT_SIZE * (slot + 1));
+}
+
+// maps a vreg in a operand to a physical register, spilled vregs get one of the scratch registers for this instruction
+static bool rewrite_vreg(regalloc_t *ra, vregister_t *vr, scratch_t *scratch, size_t *numscratch)
+{
+	switch (vr->index)
+	{
+		case VREG_SP:
+			vr->index = RSP;
+			return true;
+		case VREG_BP:
+			vr->index = RBP;
+			return true;
+		case VREG_RETURN_VALUE:
+			vr->index = RAX; // or xmm0 for a floating point operand
+			return true;
+	}
+	if (vr->index < VREG_MAX)
+	{
+		vr->index = regalloc_fixed_register(vr->index, vr->index >= VREG_FLOAT_ARGUMENT_0);
+		return vr->index != -1;
+	}
+	size_t slot = liveness_slot(&ra->liveness, vr->index);
+	if (slot >= ra->liveness.numvregs)
+		return false;
+	regalloc_assignment_t *a = &ra->assignments[slot];
+	if (a->reg != -1)
+	{
+		vr->index = a->reg;
+		return true;
+	}
+	if (a->spill_slot == -1)
+		return false;
+
+	size_t numsameclass = 0;
+	for (size_t i = 0; i < *numscratch; ++i)
+	{
+		if (scratch[i].vreg == vr->index)
+		{
+			vr->index = scratch[i].reg;
+			return true;
+		}
+		if (scratch[i].floating_point == ra->is_floating_point[slot])
+			++numsameclass;
+	}
+	if (numsameclass >= 2)
+	{
+		printf("too many spilled vregs in one instruction in function '%s'\n", ra->function->name);
+		return false;
+	}
+	scratch_t *s = &scratch[(*numscratch)++];
+	s->vreg = vr->index;
+	s->floating_point = ra->is_floating_point[slot];
+	s->size = ra->sizes[slot];
+	s->spill_slot = a->spill_slot;
+	if (s->floating_point)
+		s->reg = numsameclass ? REGALLOC_SCRATCH_XMM_REGISTER_1 : REGALLOC_SCRATCH_XMM_REGISTER_0;
+	else
+		s->reg = numsameclass ? REGALLOC_SCRATCH_REGISTER_1 : REGALLOC_SCRATCH_REGISTER_0;
+	vr->index = s->reg;
+	return true;
+}
+
+static bool rewrite_operand(regalloc_t *ra, voperand_t *op, scratch_t *scratch, size_t *numscratch)
+{
+	if (!op->virtual)
+		return true;
+	bool ok = true;
+	switch (op->type)
+	{
+		case VOPERAND_REGISTER:
+		case VOPERAND_INDIRECT_REGISTER:
+			ok = rewrite_vreg(ra, &op->reg, scratch, numscratch);
+			break;
+		case VOPERAND_INDIRECT_REGISTER_DISPLACEMENT:
+			ok = rewrite_vreg(ra, &op->reg_indirect_displacement.reg, scratch, numscratch);
+			break;
+		case VOPERAND_INDIRECT_REGISTER_INDEXED:
+			ok = rewrite_vreg(ra, &op->reg_indirect_indexed.reg, scratch, numscratch) &&
+				 rewrite_vreg(ra, &op->reg_indirect_indexed.indexed_reg, scratch, numscratch);
+			break;
+		default:
+			return true;
+	}
+	op->virtual = false;
+	return ok;
+}
+
+static bool contains_vreg(int *vregs, size_t n, int vreg)
+{
+	for (size_t i = 0; i < n; ++i)
+	{
+		if (vregs[i] == vreg)
+			return true;
+	}
+	return false;
+}
+
+static int compare_interval_starts(const void *a, const void *b)
+{
+	const live_interval_t *ia = *(const live_interval_t **)a, *ib = *(const live_interval_t **)b;
+	return ia->start < ib->start ? -1 : ia->start > ib->start;
+}
+
+// spilled vregs whose intervals don't overlap are never live at the same time, they can share a slot
+static bool share_spill_slots(regalloc_t *ra)
+{
+	liveness_t *lv = &ra->liveness;
+	if (!ra->numspillslots)
+		return true;
+	live_interval_t **spilled = (live_interval_t **)arena_alloc(ra->allocator, sizeof(live_interval_t *) * lv->numvregs);
+	size_t *ends = (size_t *)arena_alloc(ra->allocator, sizeof(size_t) * lv->numvregs);
+	if (!spilled || !ends)
+		return false;
+	size_t numspilled = 0;
+	for (size_t slot = VREG_MAX; slot < lv->numvregs; ++slot)
+	{
+		if (ra->assignments[slot].spill_slot != -1)
+			spilled[numspilled++] = &lv->intervals[slot];
+	}
+	qsort(spilled, numspilled, sizeof(live_interval_t *), compare_interval_starts);
+
+	// ends holds where the last interval given each slot ends
+	size_t numslots = 0;
+	for (size_t i = 0; i < numspilled; ++i)
+	{
+		size_t s = 0;
+		while (s < numslots && ends[s] >= spilled[i]->start)
+			++s;
+		if (s == numslots)
+			++numslots;
+		ends[s] = spilled[i]->end;
+		ra->assignments[liveness_slot(lv, spilled[i]->vreg)].spill_slot = s;
+	}
+	ra->numspillslots = numslots;
+	return true;
+}
+
+bool regalloc_rewrite(regalloc_t *ra)
+{
+	function_t *f = ra->function;
+	vinstr_list_t *list = &f->instructions;
+
+	vinstr_t *alloca = NULL;
+	vinstr_list_foreach(list, instr)
+	{
+		if (instr->opcode == VOP_ALLOCA)
+		{
+			alloca = instr;
+			break;
+		}
+	}
+
+	u32 saved = ra->used_registers & X64_CALLEE_SAVED_REGISTERS;
+	size_t numsaved = 0;
+	for (int i = 0; i < X64_REGISTER_MAX; ++i)
+		numsaved += (saved >> i) & 1;
+
+	if ((ra->numspillslots || numsaved) && !alloca)
+	{
+		printf("function '%s' has no stack frame for spilled registers\n", f->name);
+		return false;
+	}
+
+	if (!share_spill_slots(ra))
+		return false;
+
+	// the locals take up the frame below rbp, the spill slots go below them
+	i32 spillbase = 0;
+	if (alloca)
+	{
+		spillbase = imm_cast_int32_t(&alloca->operands[0].imm);
+		spillbase = (spillbase + REGALLOC_SPILL_SLOT_SIZE - 1) & ~(REGALLOC_SPILL_SLOT_SIZE - 1);
+	}
+
+	int used[LIVENESS_MAX_VREGS_PER_INSTRUCTION];
+	int defined[LIVENESS_MAX_VREGS_PER_INSTRUCTION];
+	for (vinstr_t *instr = list->head; instr;)
+	{
+		vinstr_t *next = instr->next;
+		size_t numused = vinstr_used_vregs(instr, used);
+		size_t numdefined = vinstr_defined_vregs(instr, defined);
+
+		scratch_t scratch[4];
+		size_t numscratch = 0;
+		for (size_t i = 0; i < instr->numoperands; ++i)
+		{
+			if (!rewrite_operand(ra, &instr->operands[i], scratch, &numscratch))
+				return false;
+		}
+
+		// copies between vregs that ended up in the same register, e.g after coalescing
+		voperand_t *a = &instr->operands[0];
+		voperand_t *b = &instr->operands[1];
+		if (instr->opcode == VOP_MOV && !numscratch && a->type == VOPERAND_REGISTER && b->type == VOPERAND_REGISTER &&
+			a->reg.index == b->reg.index && voperand_is_floating_point(a) == voperand_is_floating_point(b))
+		{
+			vinstr_list_remove(list, instr);
+			instr = next;
+			continue;
+		}
+
+		for (size_t i = 0; i < numscratch; ++i)
+		{
+			scratch_t *s = &scratch[i];
+			voperand_t reg = physical_register_operand(s->reg, s->size);
+			voperand_t mem = frame_operand(spill_slot_offset(spillbase, s->spill_slot), s->size);
+			if (contains_vreg(used, numused, s->vreg) && !insert_mov(list, instr, true, reg, mem))
+				return false;
+			if (contains_vreg(defined, numdefined, s->vreg) && !insert_mov(list, instr, false, mem, reg))
+				return false;
+		}
+		instr = next;
+	}
+
+	if (!alloca)
+		return true;
+
+	// callee saved registers are kept in the frame after the spill slots
+	int saveslot = ra->numspillslots;
+	for (int r = 0; r < X64_REGISTER_MAX; ++r)
+	{
+		if (!((saved >> r) & 1))
+			continue;
+		voperand_t reg = physical_register_operand(r, VOPERAND_SIZE_64_BITS);
+		voperand_t mem = frame_operand(spill_slot_offset(spillbase, saveslot++), VOPERAND_SIZE_64_BITS);
+		if (!insert_mov(list, alloca, false, mem, reg))
+			return false;
+		for (vinstr_t *instr = list->head; instr; instr = instr->next)
+		{
+			if (instr->opcode == VOP_LEAVE && !insert_mov(list, instr, true, reg, mem))
+				return false;
+		}
+	}
+	f->saved_registers = saved;
+
+	// rsp has to stay 16 byte aligned for calls
+	i32 framesize = spillbase + REGALLOC_SPILL_SLOT_SIZE * (ra->numspillslots + numsaved);
+	alloca->operands[0] = imm32_operand((framesize + 15) & ~15);
+	return true;
+}
+
+static bool register_available(regalloc_t *ra, live_interval_t *interval, bool crosses_call, bool floating_point, int reg)
+{
+	// there are no callee saved xmm registers
+	if (crosses_call && (floating_point || !x64_register_is_callee_saved(reg)))
+		return false;
+	// the return value and the arguments are always in the same registers
+	for (int vreg = VREG_RETURN_VALUE; vreg < VREG_MAX; ++vreg)
+	{
+		size_t *before = ra->fixed_before[vreg];
+		if (regalloc_fixed_register(vreg, floating_point) == reg && before[interval->end + 1] != before[interval->start])
+			return false;
+	}
+	return true;
+}
+
+static void insert_active(live_interval_t **active, size_t *numactive, live_interval_t *interval)
+{
+	size_t i = *numactive;
+	while (i > 0 && active[i - 1]->end > interval->end)
+	{
+		active[i] = active[i - 1];
+		--i;
+	}
+	active[i] = interval;
+	++*numactive;
+}
+
+static void remove_active(live_interval_t **active, size_t *numactive, size_t index)
+{
+	for (size_t i = index + 1; i < *numactive; ++i)
+		active[i - 1] = active[i];
+	--*numactive;
+}
+
+bool regalloc_linear_scan(function_t *f, arena_t *allocator, regalloc_stats_t *stats)
+{
+	regalloc_t ra;
+	if (!regalloc_init(&ra, f, allocator))
+		return false;
+	liveness_t *lv = &ra.liveness;
+
+	// sort the intervals by start position, positions are bounded by the instruction count so bucket them
+	size_t numpositions = f->instructions.count;
+	size_t *buckets = (size_t *)arena_alloc(allocator, sizeof(size_t) * (numpositions + 1));
+	live_interval_t **sorted = (live_interval_t **)arena_alloc(allocator, sizeof(live_interval_t *) * lv->numvregs);
+	if (!buckets || !sorted)
+		return false;
+	memset(buckets, 0, sizeof(size_t) * (numpositions + 1));
+	for (size_t i = VREG_MAX; i < lv->numvregs; ++i)
+	{
+		if (lv->intervals[i].start != LIVENESS_NONE)
+			++buckets[lv->intervals[i].start + 1];
+	}
+	for (size_t i = 1; i <= numpositions; ++i)
+		buckets[i] += buckets[i - 1];
+	size_t numsorted = 0;
+	for (size_t i = VREG_MAX; i < lv->numvregs; ++i)
+	{
+		if (lv->intervals[i].start == LIVENESS_NONE)
+			continue;
+		sorted[buckets[lv->intervals[i].start]++] = &lv->intervals[i];
+		++numsorted;
+	}
+
+	// active intervals sorted by end, one list for each register class
+	live_interval_t *active[2][X64_REGISTER_MAX];
+	size_t numactive[2] = {0, 0};
+	bool inuse[2][X64_REGISTER_MAX] = {0};
+
+	for (size_t i = 0; i < numsorted; ++i)
+	{
+		live_interval_t *current = sorted[i];
+		size_t slot = liveness_slot(lv, current->vreg);
+		int cls = ra.is_floating_point[slot] ? 1 : 0;
+
+		// expire the intervals that ended before this one starts
+		for (int c = 0; c < 2; ++c)
+		{
+			while (numactive[c] > 0 && active[c][0]->end < current->start)
+			{
+				inuse[c][ra.assignments[liveness_slot(lv, active[c][0]->vreg)].reg] = false;
+				remove_active(active[c], &numactive[c], 0);
+			}
+		}
+
+		bool crosses_call = regalloc_crosses_call(&ra, current);
+		int reg = -1;
+		if (cls == 0)
+		{
+			for (size_t k = 0; k < COUNT_OF(integer_registers) && reg == -1; ++k)
+			{
+				int r = integer_registers[k];
+				if (!inuse[0][r] && register_available(&ra, current, crosses_call, false, r))
+					reg = r;
+			}
+		}
+		else
+		{
+			for (int r = 0; r < REGALLOC_SCRATCH_XMM_REGISTER_0 && reg == -1; ++r)
+			{
+				if (!inuse[1][r] && register_available(&ra, current, crosses_call, true, r))
+					reg = r;
+			}
+		}
+
+		if (reg != -1)
+		{
+			inuse[cls][reg] = true;
+			regalloc_assign(&ra, current, reg);
+			insert_active(active[cls], &numactive[cls], current);
+			continue;
+		}
+
+		// no register left, spill whichever interval ends last
+		size_t victim = numactive[cls];
+		for (size_t k = numactive[cls]; k-- > 0;)
+		{
+			int r = ra.assignments[liveness_slot(lv, active[cls][k]->vreg)].reg;
+			if (register_available(&ra, current, crosses_call, cls == 1, r))
+			{
+				victim = k;
+				break;
+			}
+		}
+		if (victim < numactive[cls] && active[cls][victim]->end > current->end)
+		{
+			live_interval_t *spilled = active[cls][victim];
+			reg = ra.assignments[liveness_slot(lv, spilled->vreg)].reg;
+			regalloc_spill(&ra, spilled);
+			--ra.stats.numallocated;
+			remove_active(active[cls], &numactive[cls], victim);
+			regalloc_assign(&ra, current, reg);
+			insert_active(active[cls], &numactive[cls], current);
+		}
+		else
+		{
+			regalloc_spill(&ra, current);
+		}
+	}
+
+	if (!regalloc_rewrite(&ra))
+		return false;
+	if (stats)
+		*stats = ra.stats;
+	return true;
+}
@@ -0,0 +1,107 @@
+#ifndef REGALLOC_H
+#define REGALLOC_H
+#include "compile.h"
+#include "liveness.h"
+
+typedef enum
+{
+	RAX,
+	RCX,
+	RDX,
+	RBX,
+	RSP,
+	RBP,
+	RSI,
+	RDI,
+	R8,
+	R9,
+	R10,
+	R11,
+	R12,
+	R13,
+	R14,
+	R15,
+	X64_REGISTER_MAX
+} x64_register_t;
+
+// xmm registers use the same numbering, the operand size tells them apart
+#define X64_XMM_REGISTER_MAX (16)
+
+// System V, the callee has to preserve rbx, rbp, rsp and r12-r15, everything else including all xmm registers can be
+// clobbered by a call
+#define X64_CALLEE_SAVED_REGISTERS ((1 << RBX) | (1 << RBP) | (1 << RSP) | (1 << R12) | (1 << R13) | (1 << R14) | (1 << R15))
+
+// never allocated, used to load and store spilled vregs around the instruction that uses them
+#define REGALLOC_SCRATCH_REGISTER_0 (R10)
+#define REGALLOC_SCRATCH_REGISTER_1 (R11)
+#define REGALLOC_SCRATCH_XMM_REGISTER_0 (14)
+#define REGALLOC_SCRATCH_XMM_REGISTER_1 (15)
+
+#define REGALLOC_SPILL_SLOT_SIZE (8)
+
+typedef struct
+{
+	size_t numspilled;
+	size_t numallocated;
+} regalloc_stats_t;
+
+typedef struct
+{
+	int reg; // -1 if the vreg is spilled
+	int spill_slot; // -1 if the vreg is in a register
+} regalloc_assignment_t;
+
+// state shared by the allocators, everything is indexed by liveness slot
+typedef struct
+{
+	function_t *function;
+	arena_t *allocator;
+	cfg_t cfg;
+	liveness_t liveness;
+
+	regalloc_assignment_t *assignments;
+	bool *is_floating_point;
+	voperand_size_t *sizes; // size used to spill and reload the vreg
+	size_t *calls_before; // amount of calls before each position
+	size_t *fixed_before[VREG_MAX]; // positions before each one a fixed vreg is live at, from VREG_RETURN_VALUE on
+
+	size_t numspillslots;
+	u32 used_registers;
+	regalloc_stats_t stats;
+} regalloc_t;
+
+static bool x64_register_is_callee_saved(int reg)
+{
+	return (X64_CALLEE_SAVED_REGISTERS >> reg) & 1;
+}
+
+static const int x64_integer_argument_registers[VREG_NUM_INTEGER_ARGUMENTS] = {RDI, RSI, RDX, RCX, R8, R9};
+
+// the register a fixed vreg is in, a xmm register for floating_point. -1 if it has none of that kind
+static int regalloc_fixed_register(int vreg, bool floating_point)
+{
+	if (vreg == VREG_RETURN_VALUE)
+		return floating_point ? 0 : RAX;
+	if (vreg >= VREG_ARGUMENT_0 && vreg < VREG_FLOAT_ARGUMENT_0)
+		return floating_point ? -1 : x64_integer_argument_registers[vreg - VREG_ARGUMENT_0];
+	if (vreg >= VREG_FLOAT_ARGUMENT_0 && vreg < VREG_MAX)
+		return floating_point ? vreg - VREG_FLOAT_ARGUMENT_0 : -1;
+	return -1;
+}
+
+bool regalloc_init(regalloc_t *ra, function_t *f, arena_t *allocator);
+bool regalloc_crosses_call(regalloc_t *ra, live_interval_t *interval);
+void regalloc_spill(regalloc_t *ra, live_interval_t *interval);
+void regalloc_assign(regalloc_t *ra, live_interval_t *interval, int reg);
+// replaces the vregs with the assigned registers, loads and stores spilled vregs through the scratch registers
+// and grows the stack frame for the spill slots and callee saved registers that were used. spilled vregs that are
+// never live at the same time share a slot and the frame is rounded up to 16 bytes
+bool regalloc_rewrite(regalloc_t *ra);
+
+// rewrites every vreg operand in the function to a x64 register or a spill slot in the stack frame
+// the stack, frame pointer and return value vregs become rsp, rbp and rax, the argument vregs the System V registers
+bool regalloc_linear_scan(function_t *f, arena_t *allocator, regalloc_stats_t *stats);
+// slower but coalesces copies and spills by use count weighted with the loop depth, used for -O2
+bool regalloc_graph_coloring(function_t *f, arena_t *allocator, regalloc_stats_t *stats);
+
+#endif
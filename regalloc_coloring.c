@@ -0,0 +1,702 @@
+#include "regalloc.h"
+#include "std.h"
+#include <stdio.h>
+#include <limits.h>
+
+// iterated register coalescing, George and Appel
+// Modern Compiler Implementation in C, chapter 11
+
+// nodes 0..15 are the x64 registers, 16..31 the xmm registers and the vregs follow after
+#define NUM_PRECOLORED (X64_REGISTER_MAX + X64_XMM_REGISTER_MAX)
+
+static const int integer_colors[] = {RAX, RCX, RDX, RSI, RDI, R8, R9, RBX, R12, R13, R14, R15};
+static const int caller_saved_integer_registers[] = {RAX, RCX, RDX, RSI, RDI, R8, R9};
+#define NUM_XMM_COLORS (REGALLOC_SCRATCH_XMM_REGISTER_0)
+
+typedef enum
+{
+	NODE_PRECOLORED,
+	NODE_INITIAL,
+	NODE_SIMPLIFY,
+	NODE_FREEZE,
+	NODE_SPILL,
+	NODE_SPILLED,
+	NODE_COALESCED,
+	NODE_COLORED,
+	NODE_SELECT,
+	NODE_LIST_MAX
+} node_list_t;
+
+typedef enum
+{
+	MOVE_COALESCED,
+	MOVE_CONSTRAINED,
+	MOVE_FROZEN,
+	MOVE_WORKLIST,
+	MOVE_ACTIVE,
+	MOVE_LIST_MAX
+} move_list_t;
+
+typedef struct link_s
+{
+	int value;
+	struct link_s *next;
+} link_t;
+
+typedef struct
+{
+	int src, dst;
+	int list;
+	int prev, next;
+} move_t;
+
+typedef struct
+{
+	int list;
+	int prev, next;
+	int degree;
+	int alias;
+	int color;
+	double cost;
+	link_t *adjacent;
+	link_t *moves;
+} node_t;
+
+typedef struct
+{
+	regalloc_t *ra;
+	arena_t *allocator;
+
+	node_t *nodes;
+	size_t numnodes;
+	int node_lists[NODE_LIST_MAX];
+
+	move_t *moves;
+	size_t nummoves;
+	int move_lists[MOVE_LIST_MAX];
+
+	u64 *adjacency; // lower triangle bit matrix
+	int *select_stack;
+	size_t select_stack_size;
+} coloring_t;
+
+static bool is_precolored(int n)
+{
+	return n < NUM_PRECOLORED;
+}
+
+static bool node_is_floating_point(coloring_t *c, int n)
+{
+	if (is_precolored(n))
+		return n >= X64_REGISTER_MAX;
+	return c->ra->is_floating_point[n - NUM_PRECOLORED];
+}
+
+static int num_colors(coloring_t *c, int n)
+{
+	return node_is_floating_point(c, n) ? NUM_XMM_COLORS : COUNT_OF(integer_colors);
+}
+
+static int vreg_node(coloring_t *c, int vreg)
+{
+	// the fixed vregs are the precolored nodes of their registers
+	if (vreg >= VREG_FLOAT_ARGUMENT_0 && vreg < VREG_MAX)
+		return X64_REGISTER_MAX + regalloc_fixed_register(vreg, true);
+	if (vreg < VREG_MAX)
+		return regalloc_fixed_register(vreg, false);
+	return NUM_PRECOLORED + liveness_slot(&c->ra->liveness, vreg);
+}
+
+static void node_list_remove(coloring_t *c, int n)
+{
+	node_t *node = &c->nodes[n];
+	if (node->prev != -1)
+		c->nodes[node->prev].next = node->next;
+	else
+		c->node_lists[node->list] = node->next;
+	if (node->next != -1)
+		c->nodes[node->next].prev = node->prev;
+	node->prev = node->next = -1;
+}
+
+static void node_list_push(coloring_t *c, int list, int n)
+{
+	node_t *node = &c->nodes[n];
+	node->list = list;
+	node->prev = -1;
+	node->next = c->node_lists[list];
+	if (node->next != -1)
+		c->nodes[node->next].prev = n;
+	c->node_lists[list] = n;
+}
+
+static void node_list_move(coloring_t *c, int n, int list)
+{
+	node_list_remove(c, n);
+	node_list_push(c, list, n);
+}
+
+static void move_list_move(coloring_t *c, int m, int list)
+{
+	move_t *move = &c->moves[m];
+	if (move->list != -1)
+	{
+		if (move->prev != -1)
+			c->moves[move->prev].next = move->next;
+		else
+			c->move_lists[move->list] = move->next;
+		if (move->next != -1)
+			c->moves[move->next].prev = move->prev;
+	}
+	move->list = list;
+	move->prev = -1;
+	move->next = c->move_lists[list];
+	if (move->next != -1)
+		c->moves[move->next].prev = m;
+	c->move_lists[list] = m;
+}
+
+static bool prepend(coloring_t *c, link_t **list, int value)
+{
+	link_t *l = (link_t *)arena_alloc(c->allocator, sizeof(link_t));
+	if (!l)
+		return false;
+	l->value = value;
+	l->next = *list;
+	*list = l;
+	return true;
+}
+
+static size_t adjacency_bit(int u, int v)
+{
+	if (u < v)
+	{
+		int t = u;
+		u = v;
+		v = t;
+	}
+	return (size_t)u * (u + 1) / 2 + v;
+}
+
+static bool adjacent(coloring_t *c, int u, int v)
+{
+	size_t bit = adjacency_bit(u, v);
+	return (c->adjacency[bit / 64] >> (bit % 64)) & 1;
+}
+
+static bool add_edge(coloring_t *c, int u, int v)
+{
+	if (u == v || adjacent(c, u, v) || node_is_floating_point(c, u) != node_is_floating_point(c, v))
+		return true;
+	size_t bit = adjacency_bit(u, v);
+	c->adjacency[bit / 64] |= (u64)1 << (bit % 64);
+	if (!is_precolored(u))
+	{
+		if (!prepend(c, &c->nodes[u].adjacent, v))
+			return false;
+		++c->nodes[u].degree;
+	}
+	if (!is_precolored(v))
+	{
+		if (!prepend(c, &c->nodes[v].adjacent, u))
+			return false;
+		++c->nodes[v].degree;
+	}
+	return true;
+}
+
+static bool is_move(vinstr_t *instr)
+{
+	if (instr->opcode != VOP_MOV || instr->numoperands != 2)
+		return false;
+	voperand_t *a = &instr->operands[0];
+	voperand_t *b = &instr->operands[1];
+	if (a->type != VOPERAND_REGISTER || b->type != VOPERAND_REGISTER || !a->virtual || !b->virtual)
+		return false;
+	if (a->reg.index < VREG_RETURN_VALUE || b->reg.index < VREG_RETURN_VALUE)
+		return false;
+	return voperand_is_floating_point(a) == voperand_is_floating_point(b);
+}
+
+static double loop_weight(int depth)
+{
+	double w = 1.0;
+	for (int i = 0; i < depth && i < 8; ++i)
+		w *= 10.0;
+	return w;
+}
+
+static bool build(coloring_t *c)
+{
+	regalloc_t *ra = c->ra;
+	liveness_t *lv = &ra->liveness;
+	cfg_t *cfg = &ra->cfg;
+
+	size_t words = (c->numnodes + 63) / 64;
+	u64 *live = (u64 *)arena_alloc(c->allocator, sizeof(u64) * words);
+	if (!live)
+		return false;
+
+	int used[LIVENESS_MAX_VREGS_PER_INSTRUCTION];
+	int defined[LIVENESS_MAX_VREGS_PER_INSTRUCTION];
+	for (size_t i = 0; i < cfg->numblocks; ++i)
+	{
+		basic_block_t *bb = &cfg->blocks[i];
+		double weight = loop_weight(bb->loop_depth);
+
+		memset(live, 0, sizeof(u64) * words);
+		for (size_t slot = VREG_RETURN_VALUE; slot < lv->numvregs; ++slot)
+		{
+			int vreg = lv->intervals[slot].vreg;
+			if (liveness_live_out(lv, bb, vreg))
+			{
+				int n = vreg_node(c, vreg);
+				live[n / 64] |= (u64)1 << (n % 64);
+			}
+		}
+
+		for (vinstr_t *instr = bb->last; instr != bb->first->prev; instr = instr->prev)
+		{
+			size_t numused = vinstr_used_vregs(instr, used);
+			size_t numdefined = vinstr_defined_vregs(instr, defined);
+			for (size_t k = 0; k < numused; ++k)
+				used[k] = vreg_node(c, used[k]);
+			for (size_t k = 0; k < numdefined; ++k)
+				defined[k] = vreg_node(c, defined[k]);
+
+			if (is_move(instr) && numused == 1 && numdefined == 1)
+			{
+				// the source doesn't interfere with the destination, they can share a register
+				live[used[0] / 64] &= ~((u64)1 << (used[0] % 64));
+
+				int m = c->nummoves++;
+				c->moves[m].dst = defined[0];
+				c->moves[m].src = used[0];
+				c->moves[m].list = -1;
+				move_list_move(c, m, MOVE_WORKLIST);
+				if (!prepend(c, &c->nodes[defined[0]].moves, m) || !prepend(c, &c->nodes[used[0]].moves, m))
+					return false;
+			}
+
+			// the divisor or multiplier of idiv and imul is read after rdx:rax is set up, it can be in neither
+			if (vopcode_uses_rdx_rax(instr->opcode))
+			{
+				for (size_t k = 0; k < numused; ++k)
+				{
+					if (!add_edge(c, used[k], RAX) || !add_edge(c, used[k], RDX))
+						return false;
+				}
+			}
+
+			for (size_t k = 0; k < numdefined; ++k)
+				live[defined[k] / 64] |= (u64)1 << (defined[k] % 64);
+
+			for (size_t w = 0; w < words; ++w)
+			{
+				for (int b = 0; b < 64 && live[w] >> b; ++b)
+				{
+					if (!((live[w] >> b) & 1))
+						continue;
+					int l = w * 64 + b;
+					for (size_t k = 0; k < numdefined; ++k)
+					{
+						if (!add_edge(c, l, defined[k]))
+							return false;
+					}
+					// everything that is live across a call is clobbered in the caller saved registers
+					if (instr->opcode != VOP_CALL)
+						continue;
+					for (size_t k = 0; k < COUNT_OF(caller_saved_integer_registers); ++k)
+					{
+						if (!add_edge(c, l, caller_saved_integer_registers[k]))
+							return false;
+					}
+					for (int k = 0; k < NUM_XMM_COLORS; ++k)
+					{
+						if (!add_edge(c, l, X64_REGISTER_MAX + k))
+							return false;
+					}
+				}
+			}
+
+			for (size_t k = 0; k < numdefined; ++k)
+			{
+				live[defined[k] / 64] &= ~((u64)1 << (defined[k] % 64));
+				c->nodes[defined[k]].cost += weight;
+			}
+			for (size_t k = 0; k < numused; ++k)
+			{
+				live[used[k] / 64] |= (u64)1 << (used[k] % 64);
+				c->nodes[used[k]].cost += weight;
+			}
+		}
+	}
+	return true;
+}
+
+static bool move_related(coloring_t *c, int n)
+{
+	for (link_t *l = c->nodes[n].moves; l; l = l->next)
+	{
+		int list = c->moves[l->value].list;
+		if (list == MOVE_ACTIVE || list == MOVE_WORKLIST)
+			return true;
+	}
+	return false;
+}
+
+static bool is_adjacent_node(coloring_t *c, int n)
+{
+	int list = c->nodes[n].list;
+	return list != NODE_SELECT && list != NODE_COALESCED;
+}
+
+static void enable_moves(coloring_t *c, int n)
+{
+	for (link_t *l = c->nodes[n].moves; l; l = l->next)
+	{
+		if (c->moves[l->value].list == MOVE_ACTIVE)
+			move_list_move(c, l->value, MOVE_WORKLIST);
+	}
+}
+
+static void decrement_degree(coloring_t *c, int m)
+{
+	if (is_precolored(m))
+		return;
+	int d = c->nodes[m].degree--;
+	if (d != num_colors(c, m))
+		return;
+	enable_moves(c, m);
+	for (link_t *l = c->nodes[m].adjacent; l; l = l->next)
+	{
+		if (is_adjacent_node(c, l->value))
+			enable_moves(c, l->value);
+	}
+	node_list_move(c, m, move_related(c, m) ? NODE_FREEZE : NODE_SIMPLIFY);
+}
+
+static void simplify(coloring_t *c)
+{
+	int n = c->node_lists[NODE_SIMPLIFY];
+	node_list_move(c, n, NODE_SELECT);
+	c->select_stack[c->select_stack_size++] = n;
+	for (link_t *l = c->nodes[n].adjacent; l; l = l->next)
+	{
+		if (is_adjacent_node(c, l->value))
+			decrement_degree(c, l->value);
+	}
+}
+
+static int get_alias(coloring_t *c, int n)
+{
+	while (c->nodes[n].list == NODE_COALESCED)
+		n = c->nodes[n].alias;
+	return n;
+}
+
+static void add_work_list(coloring_t *c, int u)
+{
+	if (!is_precolored(u) && !move_related(c, u) && c->nodes[u].degree < num_colors(c, u))
+		node_list_move(c, u, NODE_SIMPLIFY);
+}
+
+// George, coalescing with a precolored node is safe if every neighbour already interferes with it or is insignificant
+static bool ok(coloring_t *c, int t, int r)
+{
+	return c->nodes[t].degree < num_colors(c, t) || is_precolored(t) || adjacent(c, t, r);
+}
+
+// Briggs, the combined node has fewer than K neighbours of significant degree
+static bool conservative(coloring_t *c, int u, int v)
+{
+	int k = 0;
+	int K = num_colors(c, u);
+	for (int pass = 0; pass < 2; ++pass)
+	{
+		for (link_t *l = c->nodes[pass ? v : u].adjacent; l; l = l->next)
+		{
+			int n = l->value;
+			if (!is_adjacent_node(c, n))
+				continue;
+			// neighbours of both are counted once
+			if (pass && adjacent(c, n, u))
+				continue;
+			if (is_precolored(n) || c->nodes[n].degree >= K)
+				++k;
+		}
+	}
+	return k < K;
+}
+
+static bool combine(coloring_t *c, int u, int v)
+{
+	node_list_move(c, v, NODE_COALESCED);
+	c->nodes[v].alias = u;
+	for (link_t *l = c->nodes[v].moves; l; l = l->next)
+	{
+		if (!prepend(c, &c->nodes[u].moves, l->value))
+			return false;
+	}
+	enable_moves(c, v);
+	for (link_t *l = c->nodes[v].adjacent; l; l = l->next)
+	{
+		if (!is_adjacent_node(c, l->value))
+			continue;
+		if (!add_edge(c, l->value, u))
+			return false;
+		decrement_degree(c, l->value);
+	}
+	if (!is_precolored(u) && c->nodes[u].degree >= num_colors(c, u) && c->nodes[u].list == NODE_FREEZE)
+		node_list_move(c, u, NODE_SPILL);
+	return true;
+}
+
+static bool coalesce(coloring_t *c)
+{
+	int m = c->move_lists[MOVE_WORKLIST];
+	int x = get_alias(c, c->moves[m].src);
+	int y = get_alias(c, c->moves[m].dst);
+	int u = x, v = y;
+	if (is_precolored(y))
+	{
+		u = y;
+		v = x;
+	}
+
+	if (u == v)
+	{
+		move_list_move(c, m, MOVE_COALESCED);
+		add_work_list(c, u);
+		return true;
+	}
+	if (is_precolored(v) || adjacent(c, u, v))
+	{
+		move_list_move(c, m, MOVE_CONSTRAINED);
+		add_work_list(c, u);
+		add_work_list(c, v);
+		return true;
+	}
+
+	bool can_combine;
+	if (is_precolored(u))
+	{
+		can_combine = true;
+		for (link_t *l = c->nodes[v].adjacent; l && can_combine; l = l->next)
+		{
+			if (is_adjacent_node(c, l->value) && !ok(c, l->value, u))
+				can_combine = false;
+		}
+	}
+	else
+	{
+		can_combine = conservative(c, u, v);
+	}
+
+	if (!can_combine)
+	{
+		move_list_move(c, m, MOVE_ACTIVE);
+		return true;
+	}
+	move_list_move(c, m, MOVE_COALESCED);
+	if (!combine(c, u, v))
+		return false;
+	add_work_list(c, u);
+	return true;
+}
+
+static void freeze_moves(coloring_t *c, int u)
+{
+	for (link_t *l = c->nodes[u].moves; l; l = l->next)
+	{
+		int m = l->value;
+		int list = c->moves[m].list;
+		if (list != MOVE_ACTIVE && list != MOVE_WORKLIST)
+			continue;
+		int x = c->moves[m].src, y = c->moves[m].dst;
+		int v = get_alias(c, y) == get_alias(c, u) ? get_alias(c, x) : get_alias(c, y);
+		move_list_move(c, m, MOVE_FROZEN);
+		if (!is_precolored(v) && c->nodes[v].list == NODE_FREEZE && !move_related(c, v) &&
+			c->nodes[v].degree < num_colors(c, v))
+			node_list_move(c, v, NODE_SIMPLIFY);
+	}
+}
+
+static void freeze(coloring_t *c)
+{
+	int u = c->node_lists[NODE_FREEZE];
+	node_list_move(c, u, NODE_SIMPLIFY);
+	freeze_moves(c, u);
+}
+
+static void select_spill(coloring_t *c)
+{
+	// cheapest to spill relative to how many neighbours it frees up
+	int best = -1;
+	double bestcost = 0.0;
+	for (int n = c->node_lists[NODE_SPILL]; n != -1; n = c->nodes[n].next)
+	{
+		double cost = c->nodes[n].cost / (c->nodes[n].degree + 1);
+		if (best == -1 || cost < bestcost)
+		{
+			best = n;
+			bestcost = cost;
+		}
+	}
+	node_list_move(c, best, NODE_SIMPLIFY);
+	freeze_moves(c, best);
+}
+
+static void assign_colors(coloring_t *c)
+{
+	while (c->select_stack_size > 0)
+	{
+		int n = c->select_stack[--c->select_stack_size];
+		bool fp = node_is_floating_point(c, n);
+		bool taken[X64_REGISTER_MAX] = {0};
+		for (link_t *l = c->nodes[n].adjacent; l; l = l->next)
+		{
+			int w = get_alias(c, l->value);
+			int list = c->nodes[w].list;
+			if (list == NODE_COLORED || list == NODE_PRECOLORED)
+				taken[c->nodes[w].color] = true;
+		}
+
+		int color = -1;
+		if (fp)
+		{
+			for (int r = 0; r < NUM_XMM_COLORS && color == -1; ++r)
+			{
+				if (!taken[r])
+					color = r;
+			}
+		}
+		else
+		{
+			// a vreg that is live across a call interferes with the caller saved registers already,
+			// the others prefer them over the callee saved ones that have to be preserved
+			for (size_t k = 0; k < COUNT_OF(integer_colors) && color == -1; ++k)
+			{
+				if (!taken[integer_colors[k]])
+					color = integer_colors[k];
+			}
+		}
+
+		if (color == -1)
+		{
+			node_list_move(c, n, NODE_SPILLED);
+			continue;
+		}
+		node_list_move(c, n, NODE_COLORED);
+		c->nodes[n].color = color;
+	}
+
+	for (int n = c->node_lists[NODE_COALESCED]; n != -1; n = c->nodes[n].next)
+	{
+		int a = get_alias(c, n);
+		c->nodes[n].color = c->nodes[a].list == NODE_SPILLED ? -1 : c->nodes[a].color;
+	}
+}
+
+bool regalloc_graph_coloring(function_t *f, arena_t *allocator, regalloc_stats_t *stats)
+{
+	coloring_t c = {0};
+	regalloc_t ra;
+	if (!regalloc_init(&ra, f, allocator))
+		return false;
+	liveness_t *lv = &ra.liveness;
+	c.ra = &ra;
+	c.allocator = allocator;
+
+	c.numnodes = NUM_PRECOLORED + lv->numvregs;
+	size_t nummoves = 0;
+	vinstr_list_foreach(&f->instructions, instr)
+	{
+		if (is_move(instr))
+			++nummoves;
+	}
+	size_t numbits = c.numnodes * (c.numnodes + 1) / 2;
+	c.nodes = (node_t *)arena_alloc(allocator, sizeof(node_t) * c.numnodes);
+	c.moves = (move_t *)arena_alloc(allocator, sizeof(move_t) * (nummoves + 1));
+	c.adjacency = (u64 *)arena_alloc(allocator, sizeof(u64) * ((numbits + 63) / 64));
+	c.select_stack = (int *)arena_alloc(allocator, sizeof(int) * c.numnodes);
+	if (!c.nodes || !c.moves || !c.adjacency || !c.select_stack)
+		return false;
+	memset(c.adjacency, 0, sizeof(u64) * ((numbits + 63) / 64));
+
+	for (int i = 0; i < NODE_LIST_MAX; ++i)
+		c.node_lists[i] = -1;
+	for (int i = 0; i < MOVE_LIST_MAX; ++i)
+		c.move_lists[i] = -1;
+	for (size_t n = 0; n < c.numnodes; ++n)
+	{
+		node_t *node = &c.nodes[n];
+		memset(node, 0, sizeof(node_t));
+		node->alias = n;
+		node->color = -1;
+		node->prev = node->next = -1;
+		if (is_precolored(n))
+		{
+			node->list = NODE_PRECOLORED;
+			node->degree = INT_MAX / 2;
+			node->color = n < X64_REGISTER_MAX ? n : n - X64_REGISTER_MAX;
+		}
+		else
+		{
+			node->list = NODE_INITIAL;
+		}
+	}
+
+	if (!build(&c))
+		return false;
+
+	// nodes for the fixed vregs and the ones that aren't used by this function stay out of the graph
+	for (size_t slot = VREG_MAX; slot < lv->numvregs; ++slot)
+	{
+		if (lv->intervals[slot].start == LIVENESS_NONE)
+			continue;
+		int n = NUM_PRECOLORED + slot;
+		if (c.nodes[n].degree >= num_colors(&c, n))
+			node_list_push(&c, NODE_SPILL, n);
+		else if (move_related(&c, n))
+			node_list_push(&c, NODE_FREEZE, n);
+		else
+			node_list_push(&c, NODE_SIMPLIFY, n);
+	}
+
+	for (;;)
+	{
+		if (c.node_lists[NODE_SIMPLIFY] != -1)
+			simplify(&c);
+		else if (c.move_lists[MOVE_WORKLIST] != -1)
+		{
+			if (!coalesce(&c))
+				return false;
+		}
+		else if (c.node_lists[NODE_FREEZE] != -1)
+			freeze(&c);
+		else if (c.node_lists[NODE_SPILL] != -1)
+			select_spill(&c);
+		else
+			break;
+	}
+	assign_colors(&c);
+
+	for (size_t slot = VREG_MAX; slot < lv->numvregs; ++slot)
+	{
+		live_interval_t *interval = &lv->intervals[slot];
+		if (interval->start == LIVENESS_NONE)
+			continue;
+		int color = c.nodes[NUM_PRECOLORED + slot].color;
+		if (color == -1)
+			regalloc_spill(&ra, interval);
+		else
+			regalloc_assign(&ra, interval, color);
+	}
+
+	if (!regalloc_rewrite(&ra))
+		return false;
+	if (stats)
+		*stats = ra.stats;
+	return true;
+}
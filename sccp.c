@@ -0,0 +1,657 @@
+#include "optimize.h"
+#include "std.h"
+#include <stdio.h>
+#include <math.h>
+
+// sparse conditional constant propagation, Wegman and Zadeck
+// a vreg is only evaluated once the block defining it is known to execute, so constants flowing around a loop or
+// through a branch that is never taken still fold
+
+typedef enum
+{
+	LATTICE_UNDEFINED, // nothing known yet, or the definition never executes
+	LATTICE_CONSTANT,
+	LATTICE_OVERDEFINED
+} lattice_state_t;
+
+typedef struct
+{
+	lattice_state_t state;
+	bool is_floating_point;
+	i64 i;
+	double d;
+} lattice_t;
+
+typedef struct
+{
+	function_t *function;
+	arena_t *allocator;
+	cfg_t cfg;
+
+	lattice_t *values; // indexed by vreg
+	int numvregs;
+
+	// instructions reading each vreg, phi arguments included
+	vinstr_t **uses;
+	size_t *firstuse; // numvregs + 1 offsets into uses
+
+	bool *executable; // by block
+	bool (*edges)[2]; // by block and successor
+
+	basic_block_t **block_worklist;
+	size_t numblockwork;
+	vinstr_t **worklist;
+	bool *queued; // by instruction id
+	size_t numwork;
+} sccp_t;
+
+static lattice_t overdefined()
+{
+	lattice_t v = {.state = LATTICE_OVERDEFINED};
+	return v;
+}
+
+static lattice_t integer_constant(i64 i)
+{
+	lattice_t v = {.state = LATTICE_CONSTANT, .i = i};
+	return v;
+}
+
+static lattice_t floating_point_constant(double d)
+{
+	lattice_t v = {.state = LATTICE_CONSTANT, .is_floating_point = true, .d = d};
+	return v;
+}
+
+static bool lattice_equal(lattice_t *a, lattice_t *b)
+{
+	if (a->state != b->state)
+		return false;
+	if (a->state != LATTICE_CONSTANT)
+		return true;
+	if (a->is_floating_point != b->is_floating_point)
+		return false;
+	return a->is_floating_point ? !memcmp(&a->d, &b->d, sizeof(double)) : a->i == b->i;
+}
+
+static lattice_t meet(lattice_t a, lattice_t b)
+{
+	if (a.state == LATTICE_UNDEFINED)
+		return b;
+	if (b.state == LATTICE_UNDEFINED)
+		return a;
+	if (a.state == LATTICE_OVERDEFINED || !lattice_equal(&a, &b))
+		return overdefined();
+	return a;
+}
+
+// width in bytes a integer operand is computed in, native is 64 bits
+static int integer_width(voperand_size_t size)
+{
+	switch (size)
+	{
+		case VOPERAND_SIZE_8_BITS:
+		case VOPERAND_SIZE_16_BITS:
+		case VOPERAND_SIZE_32_BITS:
+			return size;
+	}
+	return 8;
+}
+
+static i64 truncate(i64 value, int width)
+{
+	switch (width)
+	{
+		case 1:
+			return (i8)value;
+		case 2:
+			return (i16)value;
+		case 4:
+			return (i32)value;
+	}
+	return value;
+}
+
+static bool is_ssa_vreg(sccp_t *s, voperand_t *op)
+{
+	return op->type == VOPERAND_REGISTER && op->virtual && op->reg.index >= VREG_MAX && op->reg.index < s->numvregs;
+}
+
+static lattice_t operand_value(sccp_t *s, voperand_t *op)
+{
+	if (op->type == VOPERAND_IMMEDIATE)
+	{
+		if (op->size == VOPERAND_SIZE_DOUBLE)
+		{
+			double d;
+			memcpy(&d, &op->imm.dq, sizeof(d));
+			return floating_point_constant(d);
+		}
+		if (op->size == VOPERAND_SIZE_FLOAT)
+			return overdefined();
+		return integer_constant(imm_cast_int64_t(&op->imm));
+	}
+	if (is_ssa_vreg(s, op))
+		return s->values[op->reg.index];
+	return overdefined();
+}
+
+static voperand_t constant_operand(lattice_t *v)
+{
+	if (v->is_floating_point)
+	{
+		i64 bits;
+		memcpy(&bits, &v->d, sizeof(bits));
+		voperand_t op = imm64_operand(bits);
+		op.size = VOPERAND_SIZE_DOUBLE;
+		return op;
+	}
+	if (v->i >= INT32_MIN && v->i <= INT32_MAX)
+		return imm32_operand((i32)v->i);
+	return imm64_operand(v->i);
+}
+
+static lattice_t fold_integer(vopcode_t op, i64 a, i64 b, int width)
+{
+	u64 ua = a, ub = b;
+	switch (op)
+	{
+		case VOP_ADD:
+			return integer_constant(truncate(ua + ub, width));
+		case VOP_SUB:
+			return integer_constant(truncate(ua - ub, width));
+		case VOP_MUL:
+			return integer_constant(truncate(ua * ub, width));
+		case VOP_AND:
+			return integer_constant(truncate(a & b, width));
+		case VOP_OR:
+			return integer_constant(truncate(a | b, width));
+		case VOP_XOR:
+			return integer_constant(truncate(a ^ b, width));
+		case VOP_SHL:
+			return integer_constant(truncate(ua << (b & (width * 8 - 1)), width));
+		case VOP_SHR:
+		{
+			u64 mask = width == 8 ? ~(u64)0 : ((u64)1 << (width * 8)) - 1;
+			return integer_constant(truncate((ua & mask) >> (b & (width * 8 - 1)), width));
+		}
+		case VOP_SAR:
+			return integer_constant(truncate(a >> (b & (width * 8 - 1)), width));
+		case VOP_MULH:
+			if (width == 4)
+				return integer_constant(truncate((a * b) >> 32, width));
+			if (width == 8)
+				return integer_constant((i64)(((__int128)a * b) >> 64));
+			return overdefined();
+		case VOP_DIV:
+		case VOP_MOD:
+			// left for the program to trap on
+			if (b == 0 || (a == INT64_MIN && b == -1))
+				return overdefined();
+			return integer_constant(truncate(op == VOP_DIV ? a / b : a % b, width));
+	}
+	return overdefined();
+}
+
+static lattice_t fold_floating_point(vopcode_t op, double a, double b)
+{
+	switch (op)
+	{
+		case VOP_FADD:
+			return floating_point_constant(a + b);
+		case VOP_FSUB:
+			return floating_point_constant(a - b);
+		case VOP_FMUL:
+			return floating_point_constant(a * b);
+		case VOP_FDIV:
+			return floating_point_constant(a / b);
+		case VOP_FMOD:
+			return floating_point_constant(fmod(a, b));
+	}
+	return overdefined();
+}
+
+static bool is_edge_executable(sccp_t *s, basic_block_t *from, basic_block_t *to)
+{
+	for (size_t i = 0; i < from->numsucc; ++i)
+	{
+		if (from->succ[i] == to && s->edges[from->index][i])
+			return true;
+	}
+	return false;
+}
+
+static lattice_t evaluate_phi(sccp_t *s, vinstr_t *instr)
+{
+	basic_block_t *bb = cfg_block(&s->cfg, instr);
+	lattice_t v = {.state = LATTICE_UNDEFINED};
+	for (size_t i = 0; i < instr->phi->numargs; ++i)
+	{
+		vphi_arg_t *arg = &instr->phi->args[i];
+		basic_block_t *pred = cfg_label_block(&s->cfg, arg->label);
+		if (!pred || !is_edge_executable(s, pred, bb) || arg->value.type == VOPERAND_INVALID)
+			continue;
+		v = meet(v, operand_value(s, &arg->value));
+	}
+	return v;
+}
+
+static lattice_t evaluate(sccp_t *s, vinstr_t *instr)
+{
+	voperand_t *ops = instr->operands;
+	if (instr->opcode == VOP_PHI)
+		return evaluate_phi(s, instr);
+	if (instr->opcode == VOP_MOV)
+	{
+		lattice_t v = operand_value(s, &ops[1]);
+		if (v.state == LATTICE_CONSTANT && !v.is_floating_point)
+			v.i = truncate(v.i, integer_width(ops[0].size));
+		if (v.state == LATTICE_CONSTANT && v.is_floating_point != voperand_is_floating_point(&ops[0]))
+			return overdefined();
+		return v;
+	}
+	if (instr->opcode == VOP_SITOFP || instr->opcode == VOP_FPTOSI)
+	{
+		lattice_t v = operand_value(s, &ops[1]);
+		if (v.state != LATTICE_CONSTANT)
+			return v;
+		if (instr->opcode == VOP_SITOFP && !v.is_floating_point && ops[0].size == VOPERAND_SIZE_DOUBLE)
+			return floating_point_constant((double)v.i);
+		if (instr->opcode == VOP_FPTOSI && v.is_floating_point && v.d > (double)INT64_MIN && v.d < (double)INT64_MAX)
+			return integer_constant(truncate((i64)v.d, integer_width(ops[0].size)));
+		return overdefined();
+	}
+	if (instr->numoperands != 3 || instr->opcode > VOP_NOT)
+		return overdefined();
+
+	lattice_t a = operand_value(s, &ops[1]);
+	lattice_t b = operand_value(s, &ops[2]);
+	if (a.state == LATTICE_OVERDEFINED || b.state == LATTICE_OVERDEFINED)
+		return overdefined();
+	if (a.state == LATTICE_UNDEFINED || b.state == LATTICE_UNDEFINED)
+		return a.state == LATTICE_UNDEFINED ? a : b;
+	if (voperand_is_floating_point(&ops[0]))
+	{
+		if (!a.is_floating_point || !b.is_floating_point || ops[0].size != VOPERAND_SIZE_DOUBLE)
+			return overdefined();
+		return fold_floating_point(instr->opcode, a.d, b.d);
+	}
+	if (a.is_floating_point || b.is_floating_point)
+		return overdefined();
+	return fold_integer(instr->opcode, a.i, b.i, integer_width(ops[0].size));
+}
+
+// the compare or test that sets the flags a conditional jump reads, NULL if something in between could change them
+static vinstr_t *flags_definition(basic_block_t *bb, vinstr_t *jump)
+{
+	for (vinstr_t *instr = jump->prev; instr && instr != bb->first->prev; instr = instr->prev)
+	{
+		if (instr->opcode == VOP_CMP || instr->opcode == VOP_TEST)
+			return instr;
+		if (instr->opcode != VOP_MOV && instr->opcode != VOP_PHI && instr->opcode != VOP_LABEL)
+			return NULL;
+	}
+	return NULL;
+}
+
+// 1 if the jump is taken, 0 if it falls through, -1 if it isn't known yet and 2 if it can go either way
+static int evaluate_condition(sccp_t *s, basic_block_t *bb, vinstr_t *jump)
+{
+	vinstr_t *flags = flags_definition(bb, jump);
+	if (!flags || flags->numoperands != 2)
+		return 2;
+	lattice_t a = operand_value(s, &flags->operands[0]);
+	lattice_t b = operand_value(s, &flags->operands[1]);
+	if (a.state == LATTICE_OVERDEFINED || b.state == LATTICE_OVERDEFINED || a.is_floating_point != b.is_floating_point)
+		return 2;
+	if (a.state == LATTICE_UNDEFINED || b.state == LATTICE_UNDEFINED)
+		return -1;
+
+	// test compares a & b with zero
+	int order;
+	if (a.is_floating_point)
+	{
+		if (flags->opcode == VOP_TEST || isnan(a.d) || isnan(b.d))
+			return 2;
+		order = a.d < b.d ? -1 : a.d > b.d;
+	}
+	else
+	{
+		int width = integer_width(flags->operands[0].size);
+		i64 x = flags->opcode == VOP_TEST ? truncate(a.i & b.i, width) : truncate(a.i, width);
+		i64 y = flags->opcode == VOP_TEST ? 0 : truncate(b.i, width);
+		order = x < y ? -1 : x > y;
+	}
+	switch (jump->opcode)
+	{
+		case VOP_JZ:
+			return order == 0;
+		case VOP_JNZ:
+			return order != 0;
+		case VOP_JL:
+			return order < 0;
+		case VOP_JLE:
+			return order <= 0;
+		case VOP_JG:
+			return order > 0;
+		case VOP_JGE:
+			return order >= 0;
+	}
+	return 2;
+}
+
+static void mark_edge(sccp_t *s, basic_block_t *bb, size_t succ)
+{
+	if (s->edges[bb->index][succ])
+		return;
+	s->edges[bb->index][succ] = true;
+	basic_block_t *to = bb->succ[succ];
+	if (!s->executable[to->index])
+	{
+		s->executable[to->index] = true;
+		s->block_worklist[s->numblockwork++] = to;
+		return;
+	}
+	// a new way into the block, only its phis can change
+	ssa_block_foreach_phi(to, phi)
+	{
+		if (!s->queued[phi->id])
+		{
+			s->queued[phi->id] = true;
+			s->worklist[s->numwork++] = phi;
+		}
+	}
+}
+
+static void visit_terminator(sccp_t *s, basic_block_t *bb)
+{
+	vinstr_t *last = bb->last;
+	if (!vopcode_is_conditional_jump(last->opcode) || bb->numsucc < 2)
+	{
+		for (size_t i = 0; i < bb->numsucc; ++i)
+			mark_edge(s, bb, i);
+		return;
+	}
+	int taken = evaluate_condition(s, bb, last);
+	if (taken == 1 || taken == 2)
+		mark_edge(s, bb, 0);
+	if (taken == 0 || taken == 2)
+		mark_edge(s, bb, 1);
+}
+
+static void visit(sccp_t *s, vinstr_t *instr)
+{
+	basic_block_t *bb = cfg_block(&s->cfg, instr);
+	if (!s->executable[bb->index])
+		return;
+	if (instr->opcode == VOP_CMP || instr->opcode == VOP_TEST || vopcode_is_jump(instr->opcode))
+	{
+		visit_terminator(s, bb);
+		return;
+	}
+	if (instr->numoperands == 0 || !is_ssa_vreg(s, &instr->operands[0]) || !vinstr_first_operand_is_written(instr))
+		return;
+
+	int v = instr->operands[0].reg.index;
+	lattice_t value = meet(s->values[v], evaluate(s, instr));
+	if (lattice_equal(&value, &s->values[v]))
+		return;
+	s->values[v] = value;
+	for (size_t i = s->firstuse[v]; i < s->firstuse[v + 1]; ++i)
+	{
+		vinstr_t *use = s->uses[i];
+		if (!s->queued[use->id])
+		{
+			s->queued[use->id] = true;
+			s->worklist[s->numwork++] = use;
+		}
+	}
+}
+
+static size_t instruction_uses(sccp_t *s, vinstr_t *instr, int *vregs)
+{
+	size_t n = 0;
+	if (instr->opcode == VOP_PHI)
+	{
+		for (size_t i = 0; i < instr->phi->numargs; ++i)
+		{
+			if (is_ssa_vreg(s, &instr->phi->args[i].value))
+				vregs[n++] = instr->phi->args[i].value.reg.index;
+		}
+		return n;
+	}
+	int used[LIVENESS_MAX_VREGS_PER_INSTRUCTION];
+	size_t numused = vinstr_used_vregs(instr, used);
+	for (size_t i = 0; i < numused; ++i)
+	{
+		if (used[i] >= VREG_MAX && used[i] < s->numvregs)
+			vregs[n++] = used[i];
+	}
+	return n;
+}
+
+static bool build_uses(sccp_t *s)
+{
+	cfg_t *cfg = &s->cfg;
+	s->numvregs = s->function->numvregs;
+	s->values = (lattice_t *)arena_alloc(s->allocator, sizeof(lattice_t) * s->numvregs);
+	s->firstuse = (size_t *)arena_alloc(s->allocator, sizeof(size_t) * (s->numvregs + 1));
+	bool *defined = (bool *)arena_alloc(s->allocator, sizeof(bool) * s->numvregs);
+	if (!s->values || !s->firstuse || !defined)
+		return false;
+	memset(s->values, 0, sizeof(lattice_t) * s->numvregs);
+	memset(s->firstuse, 0, sizeof(size_t) * (s->numvregs + 1));
+	memset(defined, 0, sizeof(bool) * s->numvregs);
+
+	int *vregs = NULL;
+	size_t maxargs = LIVENESS_MAX_VREGS_PER_INSTRUCTION;
+	vinstr_list_foreach(&s->function->instructions, instr)
+	{
+		if (instr->phi && instr->phi->numargs > maxargs)
+			maxargs = instr->phi->numargs;
+	}
+	vregs = (int *)arena_alloc(s->allocator, sizeof(int) * maxargs);
+	if (!vregs)
+		return false;
+
+	vinstr_list_foreach(&s->function->instructions, instr)
+	{
+		size_t n = instruction_uses(s, instr, vregs);
+		for (size_t i = 0; i < n; ++i)
+			++s->firstuse[vregs[i] + 1];
+		if (instr->numoperands > 0 && is_ssa_vreg(s, &instr->operands[0]) && vinstr_first_operand_is_written(instr))
+			defined[instr->operands[0].reg.index] = true;
+	}
+	for (int v = 0; v < s->numvregs; ++v)
+	{
+		s->firstuse[v + 1] += s->firstuse[v];
+		// read without any definition, e.g a local that is never assigned
+		if (!defined[v])
+			s->values[v] = overdefined();
+	}
+	s->uses = (vinstr_t **)arena_alloc(s->allocator, sizeof(vinstr_t *) * (s->firstuse[s->numvregs] + 1));
+	size_t *fill = (size_t *)arena_alloc(s->allocator, sizeof(size_t) * s->numvregs);
+	if (!s->uses || !fill)
+		return false;
+	memcpy(fill, s->firstuse, sizeof(size_t) * s->numvregs);
+	vinstr_list_foreach(&s->function->instructions, instr)
+	{
+		size_t n = instruction_uses(s, instr, vregs);
+		for (size_t i = 0; i < n; ++i)
+			s->uses[fill[vregs[i]]++] = instr;
+	}
+
+	s->executable = (bool *)arena_alloc(s->allocator, sizeof(bool) * cfg->numblocks);
+	s->edges = (bool(*)[2])arena_alloc(s->allocator, sizeof(bool[2]) * cfg->numblocks);
+	s->block_worklist = (basic_block_t **)arena_alloc(s->allocator, sizeof(basic_block_t *) * cfg->numblocks);
+	s->worklist = (vinstr_t **)arena_alloc(s->allocator, sizeof(vinstr_t *) * cfg->numids);
+	s->queued = (bool *)arena_alloc(s->allocator, sizeof(bool) * cfg->numids);
+	if (!s->executable || !s->edges || !s->block_worklist || !s->worklist || !s->queued)
+		return false;
+	memset(s->executable, 0, sizeof(bool) * cfg->numblocks);
+	memset(s->edges, 0, sizeof(bool[2]) * cfg->numblocks);
+	memset(s->queued, 0, sizeof(bool) * cfg->numids);
+	return true;
+}
+
+static void propagate(sccp_t *s)
+{
+	while (s->numblockwork > 0 || s->numwork > 0)
+	{
+		if (s->numwork > 0)
+		{
+			vinstr_t *instr = s->worklist[--s->numwork];
+			s->queued[instr->id] = false;
+			visit(s, instr);
+			continue;
+		}
+		basic_block_t *bb = s->block_worklist[--s->numblockwork];
+		for (vinstr_t *instr = bb->first; instr != bb->last->next; instr = instr->next)
+			visit(s, instr);
+		visit_terminator(s, bb);
+	}
+}
+
+// a condition that still reads a undefined value once nothing changes anymore can go either way. the jump is taken,
+// which skips the body of a if, and propagation goes on from there. returns false when there was none
+static bool resolve_undefined_condition(sccp_t *s)
+{
+	for (size_t i = 0; i < s->cfg.numblocks; ++i)
+	{
+		basic_block_t *bb = &s->cfg.blocks[i];
+		if (!s->executable[i] || !vopcode_is_conditional_jump(bb->last->opcode) || bb->numsucc < 2 ||
+			s->edges[i][0] || s->edges[i][1])
+			continue;
+		mark_edge(s, bb, 0);
+		return true;
+	}
+	return false;
+}
+
+static bool is_constant(sccp_t *s, voperand_t *op)
+{
+	return is_ssa_vreg(s, op) && s->values[op->reg.index].state == LATTICE_CONSTANT;
+}
+
+// registers that are read as a value, not as part of a address, can be replaced by a immediate
+static void replace_operands(sccp_t *s, vinstr_t *instr)
+{
+	if (instr->opcode == VOP_PHI)
+	{
+		for (size_t i = 0; i < instr->phi->numargs; ++i)
+		{
+			voperand_t *op = &instr->phi->args[i].value;
+			if (is_constant(s, op))
+				*op = constant_operand(&s->values[op->reg.index]);
+		}
+		return;
+	}
+	size_t first, last;
+	switch (instr->opcode)
+	{
+		case VOP_MOV:
+		case VOP_CMP:
+		case VOP_TEST:
+			first = last = 1;
+			break;
+		case VOP_PUSH:
+			first = last = 0;
+			break;
+		default:
+			if (!vopcode_overwrites_first_operand(instr->opcode) || instr->opcode >= VOP_MOV ||
+				instr->opcode == VOP_SITOFP || instr->opcode == VOP_FPTOSI)
+				return;
+			first = 1;
+			last = instr->numoperands - 1;
+			break;
+	}
+	for (size_t i = first; i <= last && i < instr->numoperands; ++i)
+	{
+		voperand_t *op = &instr->operands[i];
+		if (is_constant(s, op))
+			*op = constant_operand(&s->values[op->reg.index]);
+	}
+}
+
+static void remove_phi_arguments(sccp_t *s, vinstr_t *phi)
+{
+	basic_block_t *bb = cfg_block(&s->cfg, phi);
+	size_t n = 0;
+	for (size_t i = 0; i < phi->phi->numargs; ++i)
+	{
+		basic_block_t *pred = cfg_label_block(&s->cfg, phi->phi->args[i].label);
+		if (pred && is_edge_executable(s, pred, bb))
+			phi->phi->args[n++] = phi->phi->args[i];
+	}
+	phi->phi->numargs = n;
+}
+
+static bool rewrite(sccp_t *s)
+{
+	cfg_t *cfg = &s->cfg;
+	vinstr_list_t *list = &s->function->instructions;
+	for (size_t i = 0; i < cfg->numblocks; ++i)
+	{
+		basic_block_t *bb = &cfg->blocks[i];
+		vinstr_t *end = bb->last->next;
+		if (!s->executable[i])
+		{
+			for (vinstr_t *instr = bb->first; instr != end;)
+			{
+				vinstr_t *next = instr->next;
+				vinstr_list_remove(list, instr);
+				instr = next;
+			}
+			continue;
+		}
+
+		// a constant phi stays until dead code elimination, its uses and arguments get the constant
+		vinstr_t *last = bb->last;
+		for (vinstr_t *instr = bb->first; instr != end; instr = instr->next)
+		{
+			voperand_t *dst = &instr->operands[0];
+			if (instr->opcode == VOP_PHI)
+				remove_phi_arguments(s, instr);
+			if (instr->opcode != VOP_PHI && instr->numoperands > 0 && is_constant(s, dst) &&
+				vinstr_first_operand_is_written(instr))
+			{
+				instr->opcode = VOP_MOV;
+				instr->operands[1] = constant_operand(&s->values[dst->reg.index]);
+				instr->numoperands = 2;
+				continue;
+			}
+			replace_operands(s, instr);
+		}
+
+		if (!vopcode_is_conditional_jump(last->opcode) || bb->numsucc < 2 || (s->edges[i][0] && s->edges[i][1]))
+			continue;
+		// every executable conditional jump has a way out after resolve_undefined_condition
+		assert(s->edges[i][0] || s->edges[i][1]);
+		// the condition is known, the compare that set the flags goes with the jump
+		vinstr_t *flags = flags_definition(bb, last);
+		if (flags)
+			vinstr_list_remove(list, flags);
+		if (s->edges[i][0])
+			last->opcode = VOP_JMP;
+		else
+			vinstr_list_remove(list, last);
+	}
+	return true;
+}
+
+bool optimize_sccp(function_t *f, arena_t *allocator)
+{
+	if (!f->instructions.head)
+		return true;
+	sccp_t s = {0};
+	s.function = f;
+	s.allocator = allocator;
+	if (!cfg_build(&s.cfg, f, allocator) || !build_uses(&s))
+		return false;
+	s.executable[0] = true;
+	s.block_worklist[s.numblockwork++] = &s.cfg.blocks[0];
+	do
+		propagate(&s);
+	while (resolve_undefined_condition(&s));
+	return rewrite(&s);
+}
@@ -0,0 +1,427 @@
+#include "optimize.h"
+#include "regalloc.h"
+#include "std.h"
+#include <stdio.h>
+
+// list scheduling of the instructions between two barriers, which is at most a basic block. every instruction is a
+// node of a dependency graph with edges for the registers, memory and flags it shares with the ones before it, the
+// instructions are then picked by the longest path of latencies to the end of the region. a load or a divide is
+// started as early as its operands allow so the instructions that don't need its result run while it completes.
+// a copy stays together with the two operand instructions that modify it after, moving the copy away would only make
+// both values live longer
+
+// longer blocks are scheduled in pieces of this many instructions
+#define SCHEDULE_MAX_REGION (128)
+
+// instructions in one node, registers they read or write and the memory operands they access
+#define SCHEDULE_MAX_INSTRUCTIONS (4)
+#define SCHEDULE_MAX_REGISTERS (32)
+#define SCHEDULE_MAX_MEMORY_OPERANDS (16)
+
+// how many nodes after the first one that isn't scheduled yet can be picked, which bounds how many more values are
+// live at once than in the original order
+#define SCHEDULE_WINDOW (8)
+
+// cycles from the start of a load that hits the first level cache to its value
+#define SCHEDULE_LOAD_LATENCY (4)
+
+// x64 registers and the fixed vregs are numbered as the register, the xmm registers after those and the other vregs
+// last, so the scheduler works the same before and after register allocation
+#define SCHEDULE_XMM(reg) (X64_REGISTER_MAX + (reg))
+#define SCHEDULE_VREG(vreg) (X64_REGISTER_MAX + X64_XMM_REGISTER_MAX + (vreg))
+
+#define SCHEDULE_NO_EDGE (-1)
+
+typedef struct
+{
+	vinstr_t **instrs; // a copy and the instructions after it that modify the copy
+	size_t numinstrs;
+	int uses[SCHEDULE_MAX_REGISTERS], defs[SCHEDULE_MAX_REGISTERS];
+	size_t numuses, numdefs;
+	voperand_t *memory[SCHEDULE_MAX_MEMORY_OPERANDS];
+	bool written[SCHEDULE_MAX_MEMORY_OPERANDS];
+	size_t nummemory;
+	bool sets_flags;
+	bool long_latency; // has a instruction that takes more than a cycle
+	int latency;
+	int height; // longest path of latencies from the start of the instruction to the end of the region
+	int earliest; // cycle the operands are ready at
+	size_t numpreds; // predecessors that aren't scheduled yet
+	bool scheduled;
+} schedule_node_t;
+
+typedef struct
+{
+	function_t *function;
+	bool frame_escapes;
+	schedule_node_t *nodes;
+	i16 *edges; // latency of the edge from a node to a later one, SCHEDULE_NO_EDGE without one
+	size_t *order;
+} schedule_t;
+
+// cycles until the result can be used, roughly what recent Intel and AMD cores take for the register forms
+static int opcode_latency(vopcode_t opcode)
+{
+	switch (opcode)
+	{
+		case VOP_MUL:
+			return 3;
+		case VOP_MULH:
+			return 4;
+		case VOP_DIV:
+		case VOP_MOD:
+			return 26;
+		case VOP_FADD:
+		case VOP_FSUB:
+		case VOP_FMUL:
+			return 4;
+		case VOP_FDIV:
+			return 14;
+		case VOP_FMOD:
+			return 20;
+		case VOP_SITOFP:
+			return 5;
+		case VOP_FPTOSI:
+			return 6;
+	}
+	return 1;
+}
+
+// every arithmetic instruction is treated as changing the flags, only the compares are read by a conditional jump
+static bool sets_flags(vopcode_t opcode)
+{
+	return opcode <= VOP_NOT || opcode == VOP_CMP || opcode == VOP_TEST;
+}
+
+static bool is_stack_or_frame_pointer(voperand_t *op)
+{
+	if (op->type != VOPERAND_REGISTER)
+		return false;
+	if (op->virtual)
+		return op->reg.index < VREG_RETURN_VALUE;
+	return !voperand_is_floating_point(op) && (op->reg.index == RSP || op->reg.index == RBP);
+}
+
+// instructions nothing is moved across, they end a region
+static bool is_barrier(vinstr_t *instr)
+{
+	switch (instr->opcode)
+	{
+		case VOP_PUSH:
+		case VOP_POP:
+		case VOP_ENTER:
+		case VOP_LEAVE:
+		case VOP_CALL:
+		case VOP_LABEL:
+		case VOP_ALLOCA:
+		case VOP_PHI:
+			return true;
+	}
+	if (vopcode_ends_block(instr->opcode))
+		return true;
+	// moves rsp or uses the address of the frame
+	for (size_t i = 0; i < instr->numoperands; ++i)
+	{
+		if (is_stack_or_frame_pointer(&instr->operands[i]))
+			return true;
+	}
+	return false;
+}
+
+static int register_number(voperand_t *op, vregister_t *reg)
+{
+	// only a register operand itself can be a xmm register, addresses are always formed from general purpose ones
+	bool floating_point = op->type == VOPERAND_REGISTER && voperand_is_floating_point(op);
+	int index = reg->index;
+	if (op->virtual)
+	{
+		// the fixed vregs are the System V registers, the return value and first float argument are both xmm0
+		int fixed = index < VREG_MAX ? regalloc_fixed_register(index, floating_point) : -1;
+		if (fixed == -1)
+			return SCHEDULE_VREG(index);
+		index = fixed;
+	}
+	return floating_point ? SCHEDULE_XMM(index) : index;
+}
+
+static bool contains(int *regs, size_t n, int reg)
+{
+	for (size_t i = 0; i < n; ++i)
+	{
+		if (regs[i] == reg)
+			return true;
+	}
+	return false;
+}
+
+static void add_register(int *regs, size_t *n, int reg)
+{
+	if (!contains(regs, *n, reg))
+		regs[(*n)++] = reg;
+}
+
+static void add_registers(voperand_t *op, int *regs, size_t *n)
+{
+	vregister_t *r[2];
+	size_t k = voperand_registers(op, r);
+	for (size_t i = 0; i < k; ++i)
+		add_register(regs, n, register_number(op, r[i]));
+}
+
+// whether instr reads and writes the register the copy before it wrote
+static bool modifies_copy(vinstr_t *copy, vinstr_t *instr)
+{
+	voperand_t *dst = &copy->operands[0], *op = &instr->operands[0];
+	return instr->numoperands && op->type == VOPERAND_REGISTER && op->virtual == dst->virtual &&
+		   op->reg.index == dst->reg.index && vinstr_first_operand_is_written(instr) &&
+		   !vinstr_first_operand_is_definition(instr) && !is_barrier(instr);
+}
+
+static void add_instruction(schedule_node_t *node, vinstr_t *instr)
+{
+	bool reads_memory = false;
+	for (size_t i = 0; i < instr->numoperands; ++i)
+	{
+		voperand_t *op = &instr->operands[i];
+		if (op->type == VOPERAND_IMMEDIATE || op->type == VOPERAND_LABEL)
+			continue;
+		bool written = i == 0 && vinstr_first_operand_is_written(instr);
+		// a write of less than 32 bits keeps the rest of the register, the old value is read too
+		bool read = !written || !vinstr_first_operand_is_definition(instr) || op->size == VOPERAND_SIZE_8_BITS ||
+					op->size == VOPERAND_SIZE_16_BITS;
+		if (op->type == VOPERAND_REGISTER)
+		{
+			if (written)
+				add_registers(op, node->defs, &node->numdefs);
+			if (read)
+				add_registers(op, node->uses, &node->numuses);
+			continue;
+		}
+		add_registers(op, node->uses, &node->numuses);
+		if (!voperand_is_memory(op) || instr->opcode == VOP_LEA)
+			continue;
+		node->memory[node->nummemory] = op;
+		node->written[node->nummemory++] = written;
+		reads_memory |= read;
+	}
+	// idiv and imul write rdx:rax, before register allocation too as the allocators move the first operand into rax
+	if (vopcode_uses_rdx_rax(instr->opcode))
+	{
+		add_register(node->defs, &node->numdefs, RAX);
+		add_register(node->defs, &node->numdefs, RDX);
+	}
+	node->sets_flags |= sets_flags(instr->opcode);
+	// the instructions of a node depend on each other, the result is ready after all of them
+	int latency = opcode_latency(instr->opcode) + (reads_memory ? SCHEDULE_LOAD_LATENCY : 0);
+	node->latency += latency;
+	node->long_latency |= latency > 1;
+}
+
+// groups the region into nodes, returns the amount
+static size_t init_nodes(schedule_t *s, vinstr_t **region, size_t n)
+{
+	size_t numnodes = 0;
+	for (size_t i = 0; i < n;)
+	{
+		schedule_node_t *node = &s->nodes[numnodes++];
+		memset(node, 0, sizeof(schedule_node_t));
+		node->instrs = &region[i];
+		vinstr_t *copy = region[i];
+		bool is_copy = copy->opcode == VOP_MOV && copy->operands[0].type == VOPERAND_REGISTER;
+		do
+		{
+			add_instruction(node, region[i++]);
+			++node->numinstrs;
+		} while (is_copy && i < n && node->numinstrs < SCHEDULE_MAX_INSTRUCTIONS && modifies_copy(copy, region[i]));
+	}
+	return numnodes;
+}
+
+static void add_edge(schedule_t *s, size_t n, size_t from, size_t to, int latency)
+{
+	i16 *edge = &s->edges[from * n + to];
+	if (*edge < latency)
+		*edge = latency;
+}
+
+// the edges from node i to the later node j, only the order matters for a write after a read or write
+static void add_dependencies(schedule_t *s, size_t n, size_t i, size_t j)
+{
+	schedule_node_t *a = &s->nodes[i], *b = &s->nodes[j];
+	for (size_t k = 0; k < a->numdefs; ++k)
+	{
+		if (contains(b->uses, b->numuses, a->defs[k]))
+			add_edge(s, n, i, j, a->latency);
+		if (contains(b->defs, b->numdefs, a->defs[k]))
+			add_edge(s, n, i, j, 0);
+	}
+	for (size_t k = 0; k < a->numuses; ++k)
+	{
+		if (contains(b->defs, b->numdefs, a->uses[k]))
+			add_edge(s, n, i, j, 0);
+	}
+	// a base register that changes in between already orders the two through the instruction that changes it
+	for (size_t x = 0; x < a->nummemory; ++x)
+	{
+		for (size_t y = 0; y < b->nummemory; ++y)
+		{
+			if ((!a->written[x] && !b->written[y]) || !optimize_may_alias(a->memory[x], b->memory[y], s->frame_escapes))
+				continue;
+			add_edge(s, n, i, j, a->written[x] && !b->written[y] ? a->latency : 0);
+		}
+	}
+}
+
+// whether a conditional jump after the region reads the flags the region leaves
+static bool flags_live_after(vinstr_t *end)
+{
+	for (vinstr_t *instr = end; instr; instr = instr->next)
+	{
+		if (vopcode_is_conditional_jump(instr->opcode))
+			return true;
+		if (sets_flags(instr->opcode) || instr->opcode == VOP_CALL || instr->opcode == VOP_LABEL ||
+			vopcode_ends_block(instr->opcode))
+			return false;
+	}
+	return false;
+}
+
+static void build_graph(schedule_t *s, size_t n, vinstr_t *end)
+{
+	for (size_t i = 0; i < n * n; ++i)
+		s->edges[i] = SCHEDULE_NO_EDGE;
+	for (size_t i = 0; i < n; ++i)
+	{
+		for (size_t j = i + 1; j < n; ++j)
+			add_dependencies(s, n, i, j);
+	}
+	// the compare has to stay the last instruction that sets the flags
+	if (!flags_live_after(end))
+		return;
+	size_t last = n;
+	for (size_t i = n; i-- > 0 && last == n;)
+	{
+		if (s->nodes[i].sets_flags)
+			last = i;
+	}
+	for (size_t i = 0; i < last; ++i)
+	{
+		if (s->nodes[i].sets_flags)
+			add_edge(s, n, i, last, 0);
+	}
+}
+
+// only instructions that take more than a cycle are started early, moving the others just makes values live longer
+static int priority(schedule_node_t *node)
+{
+	return node->long_latency ? node->height : 0;
+}
+
+// picks the instruction that can start first, the long latency one with the longest path after it when several can
+static bool better_candidate(schedule_node_t *a, schedule_node_t *b, int cycle)
+{
+	bool reada = a->earliest <= cycle, readb = b->earliest <= cycle;
+	if (reada != readb)
+		return reada;
+	if (!reada && a->earliest != b->earliest)
+		return a->earliest < b->earliest;
+	return priority(a) > priority(b);
+}
+
+static void schedule_region(schedule_t *s, vinstr_t **region, size_t n, vinstr_t *end)
+{
+	if (!end)
+		return;
+	n = init_nodes(s, region, n);
+	if (n < 2)
+		return;
+	build_graph(s, n, end);
+	for (size_t i = n; i-- > 0;)
+	{
+		schedule_node_t *node = &s->nodes[i];
+		node->height = node->latency;
+		for (size_t j = i + 1; j < n; ++j)
+		{
+			i16 edge = s->edges[i * n + j];
+			if (edge == SCHEDULE_NO_EDGE)
+				continue;
+			++s->nodes[j].numpreds;
+			if (edge + s->nodes[j].height > node->height)
+				node->height = edge + s->nodes[j].height;
+		}
+	}
+
+	// one instruction is issued per cycle, a instruction waits until the results it depends on are ready
+	int cycle = 0;
+	size_t first = 0; // first node that isn't scheduled yet
+	bool changed = false;
+	for (size_t step = 0; step < n; ++step)
+	{
+		while (s->nodes[first].scheduled)
+			++first;
+		size_t best = n;
+		for (size_t i = first; i < n && i <= first + SCHEDULE_WINDOW; ++i)
+		{
+			schedule_node_t *node = &s->nodes[i];
+			if (node->scheduled || node->numpreds)
+				continue;
+			// ties keep the original order
+			if (best == n || better_candidate(node, &s->nodes[best], cycle))
+				best = i;
+		}
+		schedule_node_t *node = &s->nodes[best];
+		if (node->earliest > cycle)
+			cycle = node->earliest;
+		node->scheduled = true;
+		for (size_t j = best + 1; j < n; ++j)
+		{
+			i16 edge = s->edges[best * n + j];
+			if (edge == SCHEDULE_NO_EDGE)
+				continue;
+			--s->nodes[j].numpreds;
+			if (cycle + edge > s->nodes[j].earliest)
+				s->nodes[j].earliest = cycle + edge;
+		}
+		s->order[step] = best;
+		changed |= best != step;
+		cycle += node->numinstrs;
+	}
+	if (!changed)
+		return;
+	for (size_t step = 0; step < n; ++step)
+	{
+		schedule_node_t *node = &s->nodes[s->order[step]];
+		for (size_t i = 0; i < node->numinstrs; ++i)
+			vinstr_list_move_before(&s->function->instructions, node->instrs[i], end);
+	}
+}
+
+bool optimize_schedule(function_t *f, arena_t *allocator)
+{
+	schedule_t s = {0};
+	s.function = f;
+	s.frame_escapes = optimize_frame_pointer_escapes(f);
+	s.nodes = (schedule_node_t *)arena_alloc(allocator, sizeof(schedule_node_t) * SCHEDULE_MAX_REGION);
+	s.edges = (i16 *)arena_alloc(allocator, sizeof(i16) * SCHEDULE_MAX_REGION * SCHEDULE_MAX_REGION);
+	s.order = (size_t *)arena_alloc(allocator, sizeof(size_t) * SCHEDULE_MAX_REGION);
+	vinstr_t **region = (vinstr_t **)arena_alloc(allocator, sizeof(vinstr_t *) * SCHEDULE_MAX_REGION);
+	if (!s.nodes || !s.edges || !s.order || !region)
+		return false;
+
+	// the instructions are only moved in front of the one that ends their region, which stays where it is
+	size_t n = 0;
+	for (vinstr_t *instr = f->instructions.head; instr; instr = instr->next)
+	{
+		bool barrier = is_barrier(instr);
+		if (!barrier && n < SCHEDULE_MAX_REGION)
+		{
+			region[n++] = instr;
+			continue;
+		}
+		schedule_region(&s, region, n, instr);
+		n = 0;
+		if (!barrier)
+			region[n++] = instr;
+	}
+	return true;
+}
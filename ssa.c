@@ -0,0 +1,561 @@
+#include "ssa.h"
+#include "std.h"
+#include <stdio.h>
+
+// Cytron, Ferrante, Rosen, Wegman and Zadeck, Efficiently Computing Static Single Assignment Form and the Control
+// Dependence Graph. phis are only placed where the vreg is live (pruned SSA) and the dominance frontiers are found
+// with the runner walk from Cooper, Harvey and Kennedy
+
+typedef struct block_link_s
+{
+	basic_block_t *block;
+	struct block_link_s *next;
+} block_link_t;
+
+typedef struct
+{
+	function_t *function;
+	arena_t *allocator;
+	cfg_t cfg;
+	liveness_t liveness;
+
+	block_link_t **frontiers;
+
+	// indexed by the vregs from before renaming, only the ones with more than one definition are renamed
+	int numvregs;
+	int *numdefs;
+	voperand_t *defoperands;
+	block_link_t **defblocks;
+	int *current; // name the vreg has at this point of the dominator tree walk, -1 if it isn't defined yet
+
+	// previous names, popped when the walk leaves the block that pushed them
+	int *undo_vregs, *undo_names;
+	size_t numundo, maxundo;
+} ssa_builder_t;
+
+static bool push_block(arena_t *allocator, block_link_t **list, basic_block_t *bb)
+{
+	block_link_t *link = (block_link_t *)arena_alloc(allocator, sizeof(block_link_t));
+	if (!link)
+		return false;
+	link->block = bb;
+	link->next = *list;
+	*list = link;
+	return true;
+}
+
+static vinstr_t *insert_instruction(vinstr_list_t *list, vinstr_t *after, vopcode_t opcode, size_t numoperands,
+									voperand_t a, voperand_t b)
+{
+	vinstr_t *instr = vinstr_list_insert_after(list, after);
+	if (!instr)
+		return NULL;
+	instr->opcode = opcode;
+	instr->operands[0] = a;
+	instr->operands[1] = b;
+	instr->numoperands = numoperands;
+	return instr;
+}
+
+static bool same_register(voperand_t *a, voperand_t *b)
+{
+	return a->type == VOPERAND_REGISTER && b->type == VOPERAND_REGISTER && a->reg.index == b->reg.index;
+}
+
+static bool is_commutative(vopcode_t op)
+{
+	switch (op)
+	{
+		case VOP_ADD:
+		case VOP_MUL:
+		case VOP_FADD:
+		case VOP_FMUL:
+		case VOP_AND:
+		case VOP_OR:
+		case VOP_XOR:
+		case VOP_MULH:
+			return true;
+	}
+	return false;
+}
+
+// op a, b reads and writes a, as a = a op b the destination can get a new name
+static void to_three_operands(function_t *f)
+{
+	vinstr_list_foreach(&f->instructions, instr)
+	{
+		if (!vopcode_overwrites_first_operand(instr->opcode) || vinstr_first_operand_is_definition(instr))
+			continue;
+		voperand_t *dst = &instr->operands[0];
+		if (dst->type != VOPERAND_REGISTER || !dst->virtual || dst->reg.index < VREG_MAX)
+			continue;
+		if (instr->numoperands == 2)
+		{
+			instr->operands[2] = instr->operands[1];
+			instr->operands[1] = *dst;
+			instr->numoperands = 3;
+		}
+		else if (instr->numoperands == 1 && instr->opcode == VOP_NOT)
+		{
+			voperand_t mask = instr->operands[0].size == VOPERAND_SIZE_64_BITS ? imm64_operand(-1) : imm32_operand(-1);
+			instr->opcode = VOP_XOR;
+			instr->operands[1] = *dst;
+			instr->operands[2] = mask;
+			instr->numoperands = 3;
+		}
+	}
+}
+
+static bool label_blocks(function_t *f, arena_t *allocator)
+{
+	cfg_t cfg;
+	if (!cfg_build(&cfg, f, allocator))
+		return false;
+	for (size_t i = 0; i < cfg.numblocks; ++i)
+	{
+		basic_block_t *bb = &cfg.blocks[i];
+		if (bb->first->opcode == VOP_LABEL)
+			continue;
+		vinstr_t *label = vinstr_list_insert_before(&f->instructions, bb->first);
+		if (!label)
+			return false;
+		label->opcode = VOP_LABEL;
+		label->operands[0] = label_operand(function_new_label(f));
+		label->numoperands = 1;
+	}
+	return true;
+}
+
+static bool renamed(ssa_builder_t *b, int vreg)
+{
+	return vreg >= VREG_MAX && vreg < b->numvregs && b->numdefs[vreg] > 1;
+}
+
+// blocks where a definition in bb stops dominating, for every join the runner walks up from each predecessor until
+// it reaches the immediate dominator of the join
+static bool compute_frontiers(ssa_builder_t *b)
+{
+	cfg_t *cfg = &b->cfg;
+	b->frontiers = (block_link_t **)arena_alloc(b->allocator, sizeof(block_link_t *) * cfg->numblocks);
+	if (!b->frontiers)
+		return false;
+	memset(b->frontiers, 0, sizeof(block_link_t *) * cfg->numblocks);
+	for (size_t i = 0; i < cfg->numrpo; ++i)
+	{
+		basic_block_t *join = cfg->rpo[i];
+		if (join->numpred < 2)
+			continue;
+		for (size_t j = 0; j < join->numpred; ++j)
+		{
+			basic_block_t *runner = join->pred[j];
+			if (runner->rpo == -1)
+				continue;
+			while (runner != join->idom)
+			{
+				block_link_t *df = b->frontiers[runner->index];
+				if (df && df->block == join)
+					break; // already added from another predecessor
+				if (!push_block(b->allocator, &b->frontiers[runner->index], join))
+					return false;
+				runner = runner->idom;
+			}
+		}
+	}
+	return true;
+}
+
+static bool collect_definitions(ssa_builder_t *b)
+{
+	cfg_t *cfg = &b->cfg;
+	b->numvregs = b->function->numvregs;
+	b->numdefs = (int *)arena_alloc(b->allocator, sizeof(int) * b->numvregs);
+	b->defoperands = (voperand_t *)arena_alloc(b->allocator, sizeof(voperand_t) * b->numvregs);
+	b->defblocks = (block_link_t **)arena_alloc(b->allocator, sizeof(block_link_t *) * b->numvregs);
+	b->current = (int *)arena_alloc(b->allocator, sizeof(int) * b->numvregs);
+	if (!b->numdefs || !b->defoperands || !b->defblocks || !b->current)
+		return false;
+	memset(b->numdefs, 0, sizeof(int) * b->numvregs);
+	memset(b->defblocks, 0, sizeof(block_link_t *) * b->numvregs);
+	for (int i = 0; i < b->numvregs; ++i)
+		b->current[i] = -1;
+
+	for (size_t i = 0; i < cfg->numblocks; ++i)
+	{
+		basic_block_t *bb = &cfg->blocks[i];
+		for (vinstr_t *instr = bb->first; instr != bb->last->next; instr = instr->next)
+		{
+			int vregs[LIVENESS_MAX_VREGS_PER_INSTRUCTION];
+			size_t n = vinstr_defined_vregs(instr, vregs);
+			for (size_t k = 0; k < n; ++k)
+			{
+				int v = vregs[k];
+				if (v < VREG_MAX || v >= b->numvregs)
+					continue;
+				b->defoperands[v] = instr->operands[0];
+				++b->numdefs[v];
+				b->maxundo += 1;
+				if (bb->rpo != -1 && (!b->defblocks[v] || b->defblocks[v]->block != bb) &&
+					!push_block(b->allocator, &b->defblocks[v], bb))
+					return false;
+			}
+		}
+	}
+	return true;
+}
+
+static vinstr_t *insert_phi(ssa_builder_t *b, basic_block_t *bb, int vreg)
+{
+	vphi_t *phi = (vphi_t *)arena_alloc(b->function->instructions.allocator,
+										sizeof(vphi_t) + sizeof(vphi_arg_t) * bb->numpred);
+	vinstr_t *instr = vinstr_list_insert_after(&b->function->instructions, bb->first);
+	if (!phi || !instr)
+		return NULL;
+	phi->vreg = vreg;
+	phi->numargs = 0;
+	for (size_t i = 0; i < bb->numpred; ++i)
+	{
+		// a conditional jump to the next block is the same edge twice
+		bool duplicate = false;
+		for (size_t j = 0; j < i; ++j)
+			duplicate |= bb->pred[j] == bb->pred[i];
+		if (duplicate)
+			continue;
+		vphi_arg_t *arg = &phi->args[phi->numargs++];
+		arg->value = invalid_operand();
+		arg->label = ssa_block_label(bb->pred[i]);
+	}
+	instr->opcode = VOP_PHI;
+	instr->operands[0] = b->defoperands[vreg];
+	instr->numoperands = 1;
+	instr->phi = phi;
+	return instr;
+}
+
+static bool place_phis(ssa_builder_t *b)
+{
+	cfg_t *cfg = &b->cfg;
+	int *hasphi = (int *)arena_alloc(b->allocator, sizeof(int) * cfg->numblocks);
+	int *queued = (int *)arena_alloc(b->allocator, sizeof(int) * cfg->numblocks);
+	basic_block_t **worklist = (basic_block_t **)arena_alloc(b->allocator, sizeof(basic_block_t *) * cfg->numblocks);
+	if (!hasphi || !queued || !worklist)
+		return false;
+	for (size_t i = 0; i < cfg->numblocks; ++i)
+		hasphi[i] = queued[i] = -1;
+
+	for (int v = VREG_MAX; v < b->numvregs; ++v)
+	{
+		if (!renamed(b, v))
+			continue;
+		size_t n = 0;
+		for (block_link_t *it = b->defblocks[v]; it; it = it->next)
+		{
+			if (queued[it->block->index] == v)
+				continue;
+			queued[it->block->index] = v;
+			worklist[n++] = it->block;
+		}
+		while (n > 0)
+		{
+			basic_block_t *bb = worklist[--n];
+			for (block_link_t *it = b->frontiers[bb->index]; it; it = it->next)
+			{
+				basic_block_t *df = it->block;
+				if (hasphi[df->index] == v || !liveness_live_in(&b->liveness, df, v))
+					continue;
+				if (!insert_phi(b, df, v))
+					return false;
+				hasphi[df->index] = v;
+				++b->maxundo;
+				if (queued[df->index] != v)
+				{
+					queued[df->index] = v;
+					worklist[n++] = df;
+				}
+			}
+		}
+	}
+	return true;
+}
+
+static void define(ssa_builder_t *b, vregister_t *reg)
+{
+	int v = reg->index;
+	b->undo_vregs[b->numundo] = v;
+	b->undo_names[b->numundo++] = b->current[v];
+	*reg = function_new_vreg(b->function);
+	b->current[v] = reg->index;
+}
+
+static void use(ssa_builder_t *b, vregister_t *reg)
+{
+	// a read before any definition keeps the old name, the value is undefined either way
+	if (renamed(b, reg->index) && b->current[reg->index] != -1)
+		reg->index = b->current[reg->index];
+}
+
+static void rename_block(ssa_builder_t *b, basic_block_t *bb)
+{
+	cfg_t *cfg = &b->cfg;
+	// phis were inserted after the label, so the end of the block is the label of the next one
+	vinstr_t *end = bb->index + 1 < cfg->numblocks ? cfg->blocks[bb->index + 1].first : NULL;
+	for (vinstr_t *instr = bb->first; instr != end; instr = instr->next)
+	{
+		if (instr->opcode == VOP_PHI)
+		{
+			define(b, &instr->operands[0].reg);
+			continue;
+		}
+		for (size_t i = 0; i < instr->numoperands; ++i)
+		{
+			voperand_t *op = &instr->operands[i];
+			if (!op->virtual || (i == 0 && op->type == VOPERAND_REGISTER && vinstr_first_operand_is_definition(instr)))
+				continue;
+			vregister_t *regs[2];
+			size_t n = voperand_registers(op, regs);
+			for (size_t k = 0; k < n; ++k)
+				use(b, regs[k]);
+		}
+		voperand_t *dst = &instr->operands[0];
+		if (instr->numoperands > 0 && dst->type == VOPERAND_REGISTER && dst->virtual &&
+			vinstr_first_operand_is_written(instr) && renamed(b, dst->reg.index))
+			define(b, &dst->reg);
+	}
+
+	size_t label = ssa_block_label(bb);
+	for (size_t i = 0; i < bb->numsucc; ++i)
+	{
+		ssa_block_foreach_phi(bb->succ[i], phi)
+		{
+			for (size_t k = 0; k < phi->phi->numargs; ++k)
+			{
+				vphi_arg_t *arg = &phi->phi->args[k];
+				int name = b->current[phi->phi->vreg];
+				if (arg->label != label || name == -1)
+					continue;
+				arg->value = phi->operands[0];
+				arg->value.reg.index = name;
+			}
+		}
+	}
+}
+
+// walks the dominator tree, a block sees the names of the definitions in the blocks dominating it
+static bool rename_vregs(ssa_builder_t *b)
+{
+	cfg_t *cfg = &b->cfg;
+	b->undo_vregs = (int *)arena_alloc(b->allocator, sizeof(int) * (b->maxundo + 1));
+	b->undo_names = (int *)arena_alloc(b->allocator, sizeof(int) * (b->maxundo + 1));
+	size_t *marks = (size_t *)arena_alloc(b->allocator, sizeof(size_t) * cfg->numblocks);
+	size_t *nextchild = (size_t *)arena_alloc(b->allocator, sizeof(size_t) * cfg->numblocks);
+	basic_block_t **stack = (basic_block_t **)arena_alloc(b->allocator, sizeof(basic_block_t *) * cfg->numblocks);
+	if (!b->undo_vregs || !b->undo_names || !marks || !nextchild || !stack)
+		return false;
+	if (!cfg->numrpo)
+		return true;
+
+	size_t sp = 0;
+	stack[sp++] = cfg->rpo[0];
+	marks[cfg->rpo[0]->index] = 0;
+	nextchild[cfg->rpo[0]->index] = 0;
+	rename_block(b, cfg->rpo[0]);
+	while (sp > 0)
+	{
+		basic_block_t *bb = stack[sp - 1];
+		if (nextchild[bb->index] < bb->numdomchildren)
+		{
+			basic_block_t *child = bb->dom_children[nextchild[bb->index]++];
+			marks[child->index] = b->numundo;
+			nextchild[child->index] = 0;
+			stack[sp++] = child;
+			rename_block(b, child);
+			continue;
+		}
+		while (b->numundo > marks[bb->index])
+		{
+			--b->numundo;
+			b->current[b->undo_vregs[b->numundo]] = b->undo_names[b->numundo];
+		}
+		--sp;
+	}
+	return true;
+}
+
+bool ssa_construct(function_t *f, arena_t *allocator)
+{
+	if (!f->instructions.head)
+		return true;
+	to_three_operands(f);
+	if (!label_blocks(f, allocator))
+		return false;
+
+	ssa_builder_t b = {0};
+	b.function = f;
+	b.allocator = allocator;
+	return cfg_build(&b.cfg, f, allocator) && liveness_compute(&b.liveness, &b.cfg, allocator) &&
+		   compute_frontiers(&b) && collect_definitions(&b) && place_phis(&b) && rename_vregs(&b);
+}
+
+// the copies of a edge happen at the same time, a copy can only be done once no other copy still reads its
+// destination, a cycle is broken by saving one of the destinations in a new vreg
+static vinstr_t *insert_parallel_copy(function_t *f, vinstr_t *at, voperand_t *dsts, voperand_t *srcs, size_t n)
+{
+	while (n > 0)
+	{
+		size_t ready = n;
+		for (size_t i = 0; i < n && ready == n; ++i)
+		{
+			bool read = false;
+			for (size_t j = 0; j < n; ++j)
+				read |= j != i && same_register(&srcs[j], &dsts[i]);
+			if (!read)
+				ready = i;
+		}
+		if (ready == n)
+		{
+			voperand_t tmp = dsts[0];
+			tmp.reg = function_new_vreg(f);
+			at = insert_instruction(&f->instructions, at, VOP_MOV, 2, tmp, dsts[0]);
+			if (!at)
+				return NULL;
+			for (size_t j = 0; j < n; ++j)
+			{
+				if (same_register(&srcs[j], &dsts[0]))
+					srcs[j] = tmp;
+			}
+			ready = 0;
+		}
+		at = insert_instruction(&f->instructions, at, VOP_MOV, 2, dsts[ready], srcs[ready]);
+		if (!at)
+			return NULL;
+		dsts[ready] = dsts[n - 1];
+		srcs[ready] = srcs[n - 1];
+		--n;
+	}
+	return at;
+}
+
+static bool insert_edge_copies(function_t *f, basic_block_t *pred, basic_block_t *bb, voperand_t *dsts,
+							   voperand_t *srcs, size_t n)
+{
+	vinstr_list_t *list = &f->instructions;
+	vinstr_t *last = pred->last;
+	bool critical = pred->numsucc == 2 && pred->succ[0] != pred->succ[1];
+	if (!critical)
+	{
+		// before the jump that ends the block, moves don't change the flags of a conditional one
+		vinstr_t *at = vopcode_is_jump(last->opcode) ? last->prev : last;
+		return insert_parallel_copy(f, at, dsts, srcs, n) != NULL;
+	}
+
+	vinstr_t *label;
+	if (pred->succ[0] == bb)
+	{
+		// new block at the end of the function that jumps back to bb
+		label = insert_instruction(list, list->tail, VOP_LABEL, 1, label_operand(function_new_label(f)), invalid_operand());
+		if (!label)
+			return false;
+		vinstr_t *at = insert_parallel_copy(f, label, dsts, srcs, n);
+		if (!at || !insert_instruction(list, at, VOP_JMP, 1, label_operand(ssa_block_label(bb)), invalid_operand()))
+			return false;
+		last->operands[0].label = label->operands[0].label;
+		return true;
+	}
+	// falls through into bb
+	label = insert_instruction(list, last, VOP_LABEL, 1, label_operand(function_new_label(f)), invalid_operand());
+	return label && insert_parallel_copy(f, label, dsts, srcs, n) != NULL;
+}
+
+static bool remove_phis(function_t *f, cfg_t *cfg, arena_t *allocator)
+{
+	size_t maxphis = 0;
+	vinstr_list_foreach(&f->instructions, instr)
+	{
+		if (instr->opcode == VOP_PHI)
+			++maxphis;
+	}
+	voperand_t *dsts = (voperand_t *)arena_alloc(allocator, sizeof(voperand_t) * (maxphis + 1));
+	voperand_t *srcs = (voperand_t *)arena_alloc(allocator, sizeof(voperand_t) * (maxphis + 1));
+	if (!dsts || !srcs)
+		return false;
+
+	for (size_t i = 0; i < cfg->numblocks; ++i)
+	{
+		basic_block_t *bb = &cfg->blocks[i];
+		for (size_t j = 0; j < bb->numpred; ++j)
+		{
+			basic_block_t *pred = bb->pred[j];
+			bool duplicate = false;
+			for (size_t k = 0; k < j; ++k)
+				duplicate |= bb->pred[k] == pred;
+			if (duplicate || pred->rpo == -1)
+				continue;
+
+			size_t n = 0;
+			size_t label = ssa_block_label(pred);
+			ssa_block_foreach_phi(bb, phi)
+			{
+				for (size_t k = 0; k < phi->phi->numargs; ++k)
+				{
+					vphi_arg_t *arg = &phi->phi->args[k];
+					if (arg->label != label || arg->value.type == VOPERAND_INVALID ||
+						same_register(&arg->value, &phi->operands[0]))
+						continue;
+					dsts[n] = phi->operands[0];
+					srcs[n++] = arg->value;
+				}
+			}
+			if (n && !insert_edge_copies(f, pred, bb, dsts, srcs, n))
+				return false;
+		}
+	}
+
+	for (vinstr_t *instr = f->instructions.head; instr;)
+	{
+		vinstr_t *next = instr->next;
+		if (instr->opcode == VOP_PHI)
+			vinstr_list_remove(&f->instructions, instr);
+		instr = next;
+	}
+	return true;
+}
+
+// the x64 ALU instructions only have two operands, a = b op c becomes a = b; a op= c
+static bool to_two_operands(function_t *f)
+{
+	vinstr_list_foreach(&f->instructions, instr)
+	{
+		if (!vopcode_overwrites_first_operand(instr->opcode) || instr->numoperands != 3 ||
+			instr->operands[0].type != VOPERAND_REGISTER)
+			continue;
+		voperand_t dst = instr->operands[0], a = instr->operands[1], b = instr->operands[2];
+		if (same_register(&dst, &b) && !same_register(&dst, &a) && is_commutative(instr->opcode))
+		{
+			b = a;
+		}
+		else if (!same_register(&dst, &a))
+		{
+			if (same_register(&dst, &b))
+			{
+				voperand_t tmp = b;
+				tmp.reg = function_new_vreg(f);
+				if (!insert_instruction(&f->instructions, instr->prev, VOP_MOV, 2, tmp, b))
+					return false;
+				b = tmp;
+			}
+			if (!insert_instruction(&f->instructions, instr->prev, VOP_MOV, 2, dst, a))
+				return false;
+		}
+		instr->operands[1] = b;
+		instr->operands[2] = invalid_operand();
+		instr->numoperands = 2;
+	}
+	return true;
+}
+
+bool ssa_destruct(function_t *f, arena_t *allocator)
+{
+	if (!f->instructions.head)
+		return true;
+	cfg_t cfg;
+	return cfg_build(&cfg, f, allocator) && remove_phis(f, &cfg, allocator) && to_two_operands(f);
+}
@@ -0,0 +1,39 @@
+#ifndef SSA_H
+#define SSA_H
+#include "liveness.h"
+
+// renames the vregs that are assigned more than once so every vreg has a single definition, a VOP_PHI is placed at
+// the start of the blocks where different definitions meet
+// every block is given a label so phi arguments can name their predecessor and two operand ALU instructions are
+// rewritten to the three operand form, the fixed vregs are left alone
+bool ssa_construct(function_t *f, arena_t *allocator);
+
+// replaces the phis with copies at the end of the predecessors, critical edges get a block of their own
+// and the three operand instructions go back to two operands for the backend
+bool ssa_destruct(function_t *f, arena_t *allocator);
+
+static size_t ssa_block_label(basic_block_t *bb)
+{
+	return bb->first->opcode == VOP_LABEL ? bb->first->operands[0].label : (size_t)-1;
+}
+
+// the phis are always right after the label of the block
+#define ssa_block_foreach_phi(bb, it)                                                                                  \
+	for (vinstr_t *it = (bb)->first->next; it && it->opcode == VOP_PHI; it = it->next)
+
+// drops the arguments coming from the predecessor with the given label, once that edge is gone
+static void ssa_remove_phi_arguments(basic_block_t *bb, size_t label)
+{
+	ssa_block_foreach_phi(bb, phi)
+	{
+		size_t n = 0;
+		for (size_t i = 0; i < phi->phi->numargs; ++i)
+		{
+			if (phi->phi->args[i].label != label)
+				phi->phi->args[n++] = phi->phi->args[i];
+		}
+		phi->phi->numargs = n;
+	}
+}
+
+#endif
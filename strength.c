@@ -0,0 +1,536 @@
+#include "optimize.h"
+#include "std.h"
+#include <stdio.h>
+
+// strength reduction on SSA form. a multiply of a induction variable by a constant becomes a induction variable of
+// its own that is stepped with a add, multiplies and divides by powers of two become shifts and other constant
+// divisors are replaced by a multiply with the reciprocal from Granlund and Montgomery, Division by Invariant
+// Integers using Multiplication, with the magic numbers computed as in Hacker's Delight 10-1
+
+// width in bytes of a integer operation that can be rewritten, 0 for the rest
+static int integer_width(voperand_t *op)
+{
+	switch (op->size)
+	{
+		case VOPERAND_SIZE_32_BITS:
+			return 4;
+		case VOPERAND_SIZE_NATIVE:
+		case VOPERAND_SIZE_64_BITS:
+			return 8;
+	}
+	return 0;
+}
+
+// products wrap around like the instructions they replace
+static i64 wrapping_multiply(i64 a, i64 b, int width)
+{
+	i64 value = (i64)((u64)a * (u64)b);
+	return width == 4 ? (i32)value : value;
+}
+
+// k if value is 2^k, -1 otherwise
+static int exact_log2(i64 value)
+{
+	if (value <= 0 || (value & (value - 1)))
+		return -1;
+	int k = 0;
+	while (((i64)1 << k) != value)
+		++k;
+	return k;
+}
+
+static voperand_t integer_operand(i64 value, int width)
+{
+	if (width == 4 || (value >= INT32_MIN && value <= INT32_MAX))
+		return imm32_operand((i32)value);
+	return imm64_operand(value);
+}
+
+static bool is_ssa_register(voperand_t *op)
+{
+	return op->type == VOPERAND_REGISTER && op->virtual && op->reg.index >= VREG_MAX;
+}
+
+static voperand_t new_temporary(function_t *f, voperand_size_t size)
+{
+	voperand_t op = register_operand(function_new_vreg(f));
+	op.size = size;
+	return op;
+}
+
+static bool insert_instruction(function_t *f, vinstr_t *before, vopcode_t opcode, voperand_t dst, voperand_t a,
+							   voperand_t b)
+{
+	vinstr_t *instr = vinstr_list_insert_before(&f->instructions, before);
+	if (!instr)
+		return false;
+	instr->opcode = opcode;
+	instr->operands[0] = dst;
+	instr->operands[1] = a;
+	instr->operands[2] = b;
+	instr->numoperands = 3;
+	return true;
+}
+
+static bool insert_copy(function_t *f, vinstr_t *before, voperand_t dst, voperand_t src)
+{
+	vinstr_t *instr = vinstr_list_insert_before(&f->instructions, before);
+	if (!instr)
+		return false;
+	instr->opcode = VOP_MOV;
+	instr->operands[0] = dst;
+	instr->operands[1] = src;
+	instr->numoperands = 2;
+	return true;
+}
+
+static void set_instruction(vinstr_t *instr, vopcode_t opcode, voperand_t a, voperand_t b)
+{
+	instr->opcode = opcode;
+	instr->operands[1] = a;
+	instr->operands[2] = b;
+	instr->numoperands = 3;
+}
+
+static void set_copy(vinstr_t *instr, voperand_t src)
+{
+	instr->opcode = VOP_MOV;
+	instr->operands[1] = src;
+	instr->numoperands = 2;
+}
+
+// smallest m and s so that mulh(n, m) >> s is n / d for every n of the width, d > 1
+static void signed_magic(i64 d, int width, i64 *multiplier, int *shift)
+{
+	int bits = width * 8;
+	u64 mask = bits == 64 ? ~(u64)0 : ((u64)1 << bits) - 1;
+	u64 two = (u64)1 << (bits - 1);
+	u64 ad = (u64)d;
+	u64 anc = two - 1 - two % ad;
+	u64 q1 = two / anc, r1 = two - q1 * anc;
+	u64 q2 = two / ad, r2 = two - q2 * ad;
+	u64 delta;
+	int p = bits - 1;
+	do
+	{
+		++p;
+		q1 = (q1 * 2) & mask;
+		r1 = (r1 * 2) & mask;
+		if (r1 >= anc)
+		{
+			++q1;
+			r1 -= anc;
+		}
+		q2 = (q2 * 2) & mask;
+		r2 = (r2 * 2) & mask;
+		if (r2 >= ad)
+		{
+			++q2;
+			r2 -= ad;
+		}
+		delta = ad - r2;
+	} while (q1 < delta || (q1 == delta && r1 == 0));
+	*multiplier = wrapping_multiply((i64)((q2 + 1) & mask), 1, width);
+	*shift = p - bits;
+}
+
+static bool reduce_multiply(vinstr_t *instr, int width)
+{
+	voperand_t *ops = instr->operands;
+	if (ops[1].type == VOPERAND_IMMEDIATE)
+	{
+		voperand_t tmp = ops[1];
+		ops[1] = ops[2];
+		ops[2] = tmp;
+	}
+	if (ops[2].type != VOPERAND_IMMEDIATE)
+		return true;
+	i64 c = imm_cast_int64_t(&ops[2].imm);
+	int k = exact_log2(c);
+	if (c == 0)
+		set_copy(instr, integer_operand(0, width));
+	else if (c == 1)
+		set_copy(instr, ops[1]);
+	else if (k > 0)
+		set_instruction(instr, VOP_SHL, ops[1], imm32_operand(k));
+	return true;
+}
+
+// the quotient rounds towards zero, a negative dividend gets 2^k - 1 added before the arithmetic shift
+static bool reduce_power_of_two_divide(function_t *f, vinstr_t *instr, int width, i64 c, int k)
+{
+	voperand_t n = instr->operands[1];
+	voperand_size_t size = instr->operands[0].size;
+	int bits = width * 8;
+	voperand_t sign = new_temporary(f, size);
+	voperand_t bias = new_temporary(f, size);
+	voperand_t biased = new_temporary(f, size);
+	if (!insert_instruction(f, instr, VOP_SAR, sign, n, imm32_operand(bits - 1)) ||
+		!insert_instruction(f, instr, VOP_SHR, bias, sign, imm32_operand(bits - k)) ||
+		!insert_instruction(f, instr, VOP_ADD, biased, n, bias))
+		return false;
+	if (instr->opcode == VOP_DIV)
+	{
+		set_instruction(instr, VOP_SAR, biased, imm32_operand(k));
+		return true;
+	}
+	voperand_t rounded = new_temporary(f, size);
+	if (!insert_instruction(f, instr, VOP_AND, rounded, biased, integer_operand(-c, width)))
+		return false;
+	set_instruction(instr, VOP_SUB, n, rounded);
+	return true;
+}
+
+static bool reduce_constant_divide(function_t *f, vinstr_t *instr, int width, i64 c)
+{
+	voperand_t n = instr->operands[1];
+	voperand_size_t size = instr->operands[0].size;
+	i64 multiplier;
+	int shift;
+	signed_magic(c, width, &multiplier, &shift);
+
+	// the one operand imul that gives the high half has no immediate form, the multiplier is loaded first
+	voperand_t m = new_temporary(f, size);
+	voperand_t q = new_temporary(f, size);
+	if (!insert_copy(f, instr, m, integer_operand(multiplier, width)) || !insert_instruction(f, instr, VOP_MULH, q, n, m))
+		return false;
+	// the multiplier didn't fit as a positive number, the high half is short by n
+	if (multiplier < 0)
+	{
+		voperand_t t = new_temporary(f, size);
+		if (!insert_instruction(f, instr, VOP_ADD, t, q, n))
+			return false;
+		q = t;
+	}
+	if (shift > 0)
+	{
+		voperand_t t = new_temporary(f, size);
+		if (!insert_instruction(f, instr, VOP_SAR, t, q, imm32_operand(shift)))
+			return false;
+		q = t;
+	}
+	// plus one for a negative dividend to round towards zero
+	voperand_t sign = new_temporary(f, size);
+	if (!insert_instruction(f, instr, VOP_SHR, sign, n, imm32_operand(width * 8 - 1)))
+		return false;
+	if (instr->opcode == VOP_DIV)
+	{
+		set_instruction(instr, VOP_ADD, q, sign);
+		return true;
+	}
+	voperand_t quotient = new_temporary(f, size);
+	voperand_t product = new_temporary(f, size);
+	if (!insert_instruction(f, instr, VOP_ADD, quotient, q, sign) ||
+		!insert_instruction(f, instr, VOP_MUL, product, quotient, integer_operand(c, width)))
+		return false;
+	set_instruction(instr, VOP_SUB, n, product);
+	return true;
+}
+
+static bool reduce_divide(function_t *f, vinstr_t *instr, int width)
+{
+	voperand_t *ops = instr->operands;
+	if (ops[2].type != VOPERAND_IMMEDIATE || ops[1].type == VOPERAND_IMMEDIATE)
+		return true;
+	i64 c = imm_cast_int64_t(&ops[2].imm);
+	// negative divisors are rare enough to leave to the divide instruction
+	if (c <= 0)
+		return true;
+	if (c == 1)
+	{
+		set_copy(instr, instr->opcode == VOP_DIV ? ops[1] : integer_operand(0, width));
+		return true;
+	}
+	int k = exact_log2(c);
+	if (k > 0)
+		return reduce_power_of_two_divide(f, instr, width, c, k);
+	return reduce_constant_divide(f, instr, width, c);
+}
+
+static bool reduce_operators(function_t *f)
+{
+	vinstr_list_foreach(&f->instructions, instr)
+	{
+		if (instr->numoperands != 3 || !is_ssa_register(&instr->operands[0]))
+			continue;
+		int width = integer_width(&instr->operands[0]);
+		if (!width || voperand_is_memory(&instr->operands[1]) || voperand_is_memory(&instr->operands[2]))
+			continue;
+		bool ok = true;
+		if (instr->opcode == VOP_MUL)
+			ok = reduce_multiply(instr, width);
+		else if (instr->opcode == VOP_DIV || instr->opcode == VOP_MOD)
+			ok = reduce_divide(f, instr, width);
+		if (!ok)
+			return false;
+	}
+	return true;
+}
+
+// i = phi(start, next) in the loop header with next = i + step inside the loop
+typedef struct
+{
+	vinstr_t *phi;
+	vinstr_t *increment;
+	i64 step;
+	voperand_t start;
+} induction_variable_t;
+
+// the multiplied variable i * factor, stepped along with i
+typedef struct
+{
+	induction_variable_t *iv;
+	i64 factor;
+	voperand_t value, next;
+} reduced_variable_t;
+
+typedef struct
+{
+	function_t *function;
+	arena_t *allocator;
+	cfg_t cfg;
+	cfg_loop_t *loop;
+	vinstr_t **definitions; // by vreg
+
+	induction_variable_t *ivs;
+	size_t numivs;
+	reduced_variable_t *reduced;
+	size_t numreduced, maxreduced;
+	vinstr_t *preheader;
+} reducer_t;
+
+static bool find_definitions(reducer_t *r)
+{
+	function_t *f = r->function;
+	r->definitions = (vinstr_t **)arena_alloc(r->allocator, sizeof(vinstr_t *) * f->numvregs);
+	if (!r->definitions)
+		return false;
+	memset(r->definitions, 0, sizeof(vinstr_t *) * f->numvregs);
+	vinstr_list_foreach(&f->instructions, instr)
+	{
+		if (instr->numoperands > 0 && is_ssa_register(&instr->operands[0]) &&
+			vinstr_first_operand_is_definition(instr))
+			r->definitions[instr->operands[0].reg.index] = instr;
+	}
+	return true;
+}
+
+static bool inside_loop(reducer_t *r, size_t label)
+{
+	basic_block_t *bb = cfg_label_block(&r->cfg, label);
+	return bb && cfg_loop_contains(r->loop, bb);
+}
+
+static bool find_induction_variable(reducer_t *r, vinstr_t *phi, induction_variable_t *iv)
+{
+	int width = integer_width(&phi->operands[0]);
+	if (!width)
+		return false;
+	int self = phi->operands[0].reg.index;
+	voperand_t *next = NULL, *start = NULL;
+	for (size_t i = 0; i < phi->phi->numargs; ++i)
+	{
+		vphi_arg_t *arg = &phi->phi->args[i];
+		voperand_t **value = inside_loop(r, arg->label) ? &next : &start;
+		if (*value && !voperand_equal(*value, &arg->value))
+			return false;
+		*value = &arg->value;
+	}
+	if (!next || !start || !is_ssa_register(next) ||
+		(start->type != VOPERAND_IMMEDIATE && !is_ssa_register(start)))
+		return false;
+
+	vinstr_t *increment = r->definitions[next->reg.index];
+	if (!increment || increment->numoperands != 3 || !cfg_loop_contains(r->loop, cfg_block(&r->cfg, increment)))
+		return false;
+	if (increment->operands[0].size != phi->operands[0].size)
+		return false;
+	voperand_t *a = &increment->operands[1], *b = &increment->operands[2];
+	if (increment->opcode == VOP_ADD && b->type == VOPERAND_REGISTER && b->reg.index == self)
+	{
+		voperand_t *tmp = a;
+		a = b;
+		b = tmp;
+	}
+	if (!is_ssa_register(a) || a->reg.index != self || b->type != VOPERAND_IMMEDIATE)
+		return false;
+	if (increment->opcode != VOP_ADD && increment->opcode != VOP_SUB)
+		return false;
+	iv->phi = phi;
+	iv->increment = increment;
+	iv->step = imm_cast_int64_t(&b->imm);
+	if (increment->opcode == VOP_SUB)
+		iv->step = -iv->step;
+	iv->start = *start;
+	return true;
+}
+
+static vphi_t *new_phi(function_t *f, vphi_t *like)
+{
+	vphi_t *phi = (vphi_t *)arena_alloc(f->instructions.allocator, sizeof(vphi_t) + sizeof(vphi_arg_t) * like->numargs);
+	if (!phi)
+		return NULL;
+	phi->numargs = like->numargs;
+	for (size_t i = 0; i < like->numargs; ++i)
+		phi->args[i].label = like->args[i].label;
+	return phi;
+}
+
+// j = phi(start * factor, j + step * factor) next to the phi of the induction variable
+static reduced_variable_t *reduce_variable(reducer_t *r, induction_variable_t *iv, i64 factor)
+{
+	for (size_t i = 0; i < r->numreduced; ++i)
+	{
+		if (r->reduced[i].iv == iv && r->reduced[i].factor == factor)
+			return &r->reduced[i];
+	}
+	if (r->numreduced >= r->maxreduced)
+		return NULL;
+	function_t *f = r->function;
+	voperand_t *dst = &iv->phi->operands[0];
+	int width = integer_width(dst);
+
+	// which arguments come from inside the loop has to be known before a new preheader renames the others
+	vphi_t *old = iv->phi->phi;
+	bool *inside = (bool *)arena_alloc(r->allocator, sizeof(bool) * old->numargs);
+	if (!inside)
+		return NULL;
+	for (size_t i = 0; i < old->numargs; ++i)
+		inside[i] = inside_loop(r, old->args[i].label);
+
+	voperand_t start;
+	if (iv->start.type == VOPERAND_IMMEDIATE)
+		start = integer_operand(wrapping_multiply(imm_cast_int64_t(&iv->start.imm), factor, width), width);
+	else
+	{
+		if (!r->preheader)
+			r->preheader = optimize_loop_preheader(f, r->loop);
+		if (!r->preheader)
+			return NULL;
+		start = new_temporary(f, dst->size);
+		if (!insert_instruction(f, r->preheader, VOP_MUL, start, iv->start, integer_operand(factor, width)))
+			return NULL;
+	}
+
+	reduced_variable_t *reduced = &r->reduced[r->numreduced++];
+	reduced->iv = iv;
+	reduced->factor = factor;
+	reduced->value = new_temporary(f, dst->size);
+	reduced->next = new_temporary(f, dst->size);
+
+	vinstr_t *phi = vinstr_list_insert_after(&f->instructions, iv->phi);
+	if (!phi || !(phi->phi = new_phi(f, iv->phi->phi)))
+		return NULL;
+	phi->opcode = VOP_PHI;
+	phi->operands[0] = reduced->value;
+	phi->numoperands = 1;
+	phi->phi->vreg = reduced->value.reg.index;
+	for (size_t i = 0; i < phi->phi->numargs; ++i)
+		phi->phi->args[i].value = inside[i] ? reduced->next : start;
+
+	vinstr_t *step = vinstr_list_insert_after(&f->instructions, iv->increment);
+	if (!step)
+		return NULL;
+	step->opcode = VOP_ADD;
+	step->operands[0] = reduced->next;
+	step->operands[1] = reduced->value;
+	step->operands[2] = integer_operand(wrapping_multiply(iv->step, factor, width), width);
+	step->numoperands = 3;
+	return reduced;
+}
+
+static bool reduce_loop(reducer_t *r, bool *changed)
+{
+	cfg_loop_t *loop = r->loop;
+	basic_block_t *header = loop->header;
+	r->numivs = 0;
+	ssa_block_foreach_phi(header, phi)
+	{
+		if (find_induction_variable(r, phi, &r->ivs[r->numivs]))
+			++r->numivs;
+	}
+	if (!r->numivs)
+		return true;
+	r->numreduced = 0;
+	r->preheader = NULL;
+
+	for (size_t i = 0; i < loop->numblocks; ++i)
+	{
+		basic_block_t *bb = loop->blocks[i];
+		for (vinstr_t *instr = bb->first; instr != bb->last->next; instr = instr->next)
+		{
+			if (instr->opcode != VOP_MUL || instr->numoperands != 3 || !is_ssa_register(&instr->operands[0]))
+				continue;
+			voperand_t *x = &instr->operands[1], *c = &instr->operands[2];
+			if (x->type == VOPERAND_IMMEDIATE)
+			{
+				voperand_t *tmp = x;
+				x = c;
+				c = tmp;
+			}
+			if (!is_ssa_register(x) || c->type != VOPERAND_IMMEDIATE)
+				continue;
+			// a shift is as cheap as the add and doesn't keep another register alive
+			i64 factor = imm_cast_int64_t(&c->imm);
+			if (factor == 0 || factor == 1 || factor == -1 || exact_log2(factor) > 0)
+				continue;
+			for (size_t k = 0; k < r->numivs; ++k)
+			{
+				induction_variable_t *iv = &r->ivs[k];
+				bool current = x->reg.index == iv->phi->operands[0].reg.index;
+				bool next = x->reg.index == iv->increment->operands[0].reg.index;
+				if ((!current && !next) || instr->operands[0].size != iv->phi->operands[0].size)
+					continue;
+				reduced_variable_t *reduced = reduce_variable(r, iv, factor);
+				if (!reduced)
+					break;
+				set_copy(instr, current ? reduced->value : reduced->next);
+				*changed = true;
+				break;
+			}
+		}
+	}
+	return true;
+}
+
+static bool reduce_induction_variables(function_t *f, arena_t *allocator)
+{
+	reducer_t r = {0};
+	r.function = f;
+	r.allocator = allocator;
+	r.maxreduced = f->instructions.count;
+	r.ivs = (induction_variable_t *)arena_alloc(allocator, sizeof(induction_variable_t) * f->instructions.count);
+	r.reduced = (reduced_variable_t *)arena_alloc(allocator, sizeof(reduced_variable_t) * r.maxreduced);
+	bool *done = (bool *)arena_alloc(allocator, sizeof(bool) * f->numlabels);
+	if (!r.ivs || !r.reduced || !done)
+		return false;
+	memset(done, 0, sizeof(bool) * f->numlabels);
+
+	// each loop once, by the label of its header, the cfg is rebuilt after a loop got new instructions
+	size_t numlabels = f->numlabels;
+	bool changed = true;
+	while (changed)
+	{
+		changed = false;
+		if (!cfg_build(&r.cfg, f, allocator) || !find_definitions(&r))
+			return false;
+		for (size_t i = 0; i < r.cfg.numloops && !changed; ++i)
+		{
+			size_t label = ssa_block_label(r.cfg.loops[i].header);
+			if (label >= numlabels || done[label])
+				continue;
+			done[label] = true;
+			r.loop = &r.cfg.loops[i];
+			if (!reduce_loop(&r, &changed))
+				return false;
+		}
+	}
+	return true;
+}
+
+bool optimize_strength_reduction(function_t *f, arena_t *allocator)
+{
+	if (!f->instructions.head)
+		return true;
+	return reduce_induction_variables(f, allocator) && reduce_operators(f);
+}
@@ -0,0 +1,131 @@
+#include "optimize.h"
+#include "std.h"
+#include <stdio.h>
+
+// a call whose result is returned right away doesn't need the frame of the caller anymore. the arguments in registers
+// stay where they are and the pushed ones are stored over the incoming ones of the caller, the frame is left and the
+// callee is jumped to, so it returns straight to the caller's caller. that keeps the stack from growing with
+// recursion that ends in a call
+
+// copies of the result between the call and the return that are followed
+#define TAILCALL_MAX_STEPS (32)
+
+static function_t *function_by_index(compiler_t *ctx, i64 index)
+{
+	hash_map_foreach_entry(ctx->functions, entry, {
+		function_t *f = entry->data;
+		if (f->index == index)
+			return f;
+	});
+	return NULL;
+}
+
+static bool holds_result(int *vregs, size_t n, int vreg)
+{
+	for (size_t i = 0; i < n; ++i)
+	{
+		if (vregs[i] == vreg)
+			return true;
+	}
+	return false;
+}
+
+// whether the code after the call only moves the result around until the function returns it
+static bool returns_result(vinstr_t **labels, vinstr_t *instr)
+{
+	int vregs[TAILCALL_MAX_STEPS + 1];
+	size_t numvregs = 0;
+	vregs[numvregs++] = VREG_RETURN_VALUE;
+	for (size_t step = 0; instr && step < TAILCALL_MAX_STEPS; ++step)
+	{
+		switch (instr->opcode)
+		{
+			case VOP_LABEL:
+				instr = instr->next;
+				continue;
+			// the end label is gone when cfg cleanup merged the only return into the block before it
+			case VOP_LEAVE:
+				return instr->next && instr->next->opcode == VOP_RET;
+			case VOP_JMP:
+				instr = labels[instr->operands[0].label];
+				continue;
+			case VOP_MOV:
+			{
+				voperand_t *dst = &instr->operands[0], *src = &instr->operands[1];
+				if (dst->type != VOPERAND_REGISTER || !dst->virtual)
+					return false;
+				bool result = src->type == VOPERAND_REGISTER && src->virtual && holds_result(vregs, numvregs, src->reg.index);
+				if (!result)
+					return false;
+				if (!holds_result(vregs, numvregs, dst->reg.index))
+					vregs[numvregs++] = dst->reg.index;
+				instr = instr->next;
+				continue;
+			}
+		}
+		return false;
+	}
+	return false;
+}
+
+static bool lower_tail_call(function_t *f, vinstr_t **labels, vinstr_t *call, function_t *callee)
+{
+	// the pushed arguments have to fit where the caller's own were passed
+	optimize_call_site_t site;
+	if (callee->argcost > f->argcost || !optimize_call_site(callee, call, &site))
+		return true;
+	if (!returns_result(labels, site.pop ? site.pop->next : call->next))
+		return true;
+
+	// the arguments are all in registers or constants, so the incoming ones can be overwritten in any order
+	vregister_t bpreg = {.index = VREG_BP};
+	for (size_t i = 0; i < callee->numparameters; ++i)
+	{
+		function_parameter_t *p = &callee->parameters[i];
+		if (p->reg != -1)
+			continue;
+		vinstr_t *push = site.arguments[i];
+		voperand_t arg = push->operands[0];
+		voperand_size_t size = voperand_is_floating_point(&arg) ? arg.size : (voperand_size_t)p->size;
+		push->opcode = VOP_MOV;
+		push->operands[0] = indirect_register_displacement_operand(bpreg, p->offset, size);
+		push->operands[1] = arg;
+		push->numoperands = 2;
+	}
+	if (site.padding)
+		vinstr_list_remove(&f->instructions, site.padding);
+	vinstr_t *leave = vinstr_list_insert_before(&f->instructions, call);
+	if (!leave)
+		return false;
+	leave->opcode = VOP_LEAVE;
+	call->opcode = VOP_TAILCALL;
+	// what comes after is unreachable now, cfg cleanup removes it
+	if (site.pop)
+		vinstr_list_remove(&f->instructions, site.pop);
+	return true;
+}
+
+bool optimize_tail_calls(compiler_t *ctx, function_t *f, arena_t *allocator)
+{
+	// the callee could be given a pointer into the frame that is about to go away
+	if (!f->instructions.head || optimize_frame_pointer_escapes(f))
+		return true;
+	vinstr_t **labels = (vinstr_t **)arena_alloc(allocator, sizeof(vinstr_t *) * f->numlabels);
+	if (!labels)
+		return false;
+	memset(labels, 0, sizeof(vinstr_t *) * f->numlabels);
+	vinstr_list_foreach(&f->instructions, instr)
+	{
+		if (instr->opcode == VOP_LABEL)
+			labels[instr->operands[0].label] = instr;
+	}
+	for (vinstr_t *instr = f->instructions.head; instr; instr = instr->next)
+	{
+		if (instr->opcode != VOP_CALL || instr->operands[0].type != VOPERAND_IMMEDIATE)
+			continue;
+		function_t *callee = function_by_index(ctx, imm_cast_int64_t(&instr->operands[0].imm));
+		if (callee && !lower_tail_call(f, labels, instr, callee))
+			return false;
+	}
+	return true;
+}
@@ -52,24 +52,10 @@ static int coerce_type(int a, int b)
     return b;
 }
 
-static int ast_is_scope_node(ast_node_t* n)
-{
-    return n->type == AST_PROGRAM || n->type == AST_FUNCTION_DECL || n->type == AST_BLOCK_STMT || n->type == AST_DO_WHILE_STMT || n->type == AST_WHILE_STMT || n->type == AST_FOR_STMT || n->type == AST_IF_STMT;
-}
-
 //can either be AST_PROGRAM, AST_FUNCTION_DECL, AST_BLOCK
-static ast_node_t *ast_find_scope_node(ast_node_t *head, ast_node_t* n)
+static ast_node_t *ast_find_scope_node(ast_node_t* n)
 {
-    traverse_context_t ctx = { 0 };
-    ast_tree_node_by_node(&ctx, head, n);
-    //assumption that parent is always AST_PROGRAM
-    for (int i = 1; i < ctx.numresults; ++i)
-    {
-        ast_node_t* it = ast_tree_traverse_get_visitee(&ctx, i);
-        if (ast_is_scope_node(it))
-            return it;
-    }
-    return NULL;
+    return ast_enclosing_scope(n);
 }
 
 static ast_node_t *ast_node_expression_type(ast_node_t *head, ast_node_t* n)
@@ -84,7 +70,7 @@ static ast_node_t *ast_node_expression_type(ast_node_t *head, ast_node_t* n)
     case AST_IDENTIFIER:
     {
         //get current scope
-        ast_node_t *scope = ast_find_scope_node(head, n);
+        ast_node_t *scope = ast_find_scope_node(n);
 
         //find ident by name in tree
         traverse_context_t ctx = { 0 };
@@ -0,0 +1,10 @@
+int add(int a, int b)
+{
+	return a + b;
+}
+
+int main()
+{
+	int x = 4;
+	return add(x + 1, x * 3);
+}
@@ -0,0 +1,15 @@
+int scale(double v, int n, double w)
+{
+	int r = v * n + w;
+	return r;
+}
+
+int main()
+{
+	int x = 3;
+	double h = 0.5;
+	int a = scale(h * x, x + 1, 2.25);
+	int b = scale(h, 4, h + 0.25);
+	int c = scale(x, x * 2, 1.75);
+	return a * 100 + b * 10 + c;
+}
@@ -0,0 +1,27 @@
+int seven(int a, int b, int c, int d, int e, int f, int g)
+{
+	return a + b * 2 + c * 3 + d * 4 + e * 5 + f * 6 + g * 7;
+}
+
+int eight(int a, int b, int c, int d, int e, int f, int g, int h)
+{
+	return a - b + c - d + e - f + g * h;
+}
+
+int nine(int a, int b, int c, int d, int e, int f, int g, int h, int i)
+{
+	int w[3];
+	w[0] = g;
+	w[1] = h;
+	w[2] = i;
+	return a + b + c + d + e + f + w[0] * 100 + w[1] * 10 + w[2];
+}
+
+int main()
+{
+	int x = 2;
+	int r = seven(x, x + 1, x * 2, 5, x - 1, 7, x * x);
+	int s = eight(1, 2, 3, 4, 5, 6, x + 5, r % 10);
+	int t = nine(x, 1, 1, 1, 1, 1, x + 1, s, seven(1, 0, 0, 0, 0, 0, x));
+	return (r + s * 3 + t) % 251;
+}
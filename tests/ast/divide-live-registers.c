@@ -0,0 +1,24 @@
+int main()
+{
+	int v[4];
+	v[0] = 100;
+	v[1] = 7;
+	v[2] = 3;
+	v[3] = 1000;
+	int a = v[0];
+	int b = v[1];
+	int c = v[2];
+	int d = v[3];
+	int s = 0;
+	int i = 0;
+	while (i < 3)
+	{
+		int x = a / b;
+		int y = d % c;
+		int z = (a + i) / 7;
+		int w = d / 3;
+		s = s + x + y + z + w + a + b + c + d + i;
+		i = i + 1;
+	}
+	return s % 256;
+}
@@ -0,0 +1,12 @@
+int main()
+{
+	int a[4];
+	int i = 1;
+	int j = 1;
+	a[i] = 5;
+	int x = a[i];
+	a[j] = 9;
+	int y = a[i];
+	a[i] = x + y;
+	return x * 10 + y + a[1];
+}
@@ -0,0 +1,32 @@
+int twice(int x)
+{
+	return x + x;
+}
+
+inline int mix_hint(int x)
+{
+	int a = x * 3 + 1;
+	int b = a ^ 5;
+	int c = b * 7 - a;
+	int d = c & 255;
+	int e = d + b * 2;
+	return e % 97;
+}
+
+int mix_plain(int x)
+{
+	int a = x * 3 + 1;
+	int b = a ^ 5;
+	int c = b * 7 - a;
+	int d = c & 255;
+	int e = d + b * 2;
+	return e % 97;
+}
+
+int main()
+{
+	int v[1];
+	v[0] = 9;
+	int x = v[0];
+	return twice(x) + mix_hint(x) + mix_plain(x + 1);
+}
@@ -0,0 +1,15 @@
+int main()
+{
+	int a[4];
+	int j = 0;
+	a[0] = 3;
+	int s = 0;
+	int i = 0;
+	while (i < 5)
+	{
+		s = s + a[0];
+		a[j] = a[j] + 1;
+		i = i + 1;
+	}
+	return s;
+}
@@ -0,0 +1,33 @@
+int main()
+{
+	int v[3];
+	v[0] = 4;
+	v[1] = 5;
+	v[2] = 6;
+	int s = 0;
+	int i = 0;
+	while (i < 3)
+	{
+		int x = v[i];
+		s = s * 2;
+		if (5 < x)
+			s = s + 1;
+		if (5 <= x)
+			s = s + 2;
+		if (5 > x)
+			s = s + 4;
+		if (5 >= x)
+			s = s + 8;
+		if (5 == x)
+			s = s + 16;
+		if (5 != x)
+			s = s + 32;
+		s = s + (5 < x) + (4 < 5);
+		i = i + 1;
+	}
+	if (3 > 4)
+		s = s + 64;
+	if (1)
+		s = s + 128;
+	return s;
+}
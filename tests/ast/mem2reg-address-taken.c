@@ -0,0 +1,14 @@
+int main()
+{
+	int a[3];
+	int k = 0;
+	a[0] = 1;
+	a[1] = 2;
+	a[2] = 3;
+	while (k < 3)
+	{
+		a[k] = a[k] * 10 + k;
+		k = k + 1;
+	}
+	return a[0] + a[1] + a[2] + k;
+}
@@ -0,0 +1,18 @@
+void set(int *p, int v)
+{
+	*p = v;
+}
+
+int main()
+{
+	int a = 1;
+	int b = 2;
+	int *p = &a;
+	set(p, 40);
+	*p = *p + b;
+	b = a + 1;
+	int *q = &b;
+	int c = b + 100;
+	set(q, c);
+	return a + b;
+}
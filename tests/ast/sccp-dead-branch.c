@@ -0,0 +1,15 @@
+int main()
+{
+	int x = 4;
+	int y = 0;
+	if (x * 2 > 10)
+		y = 100;
+	else
+		y = 7;
+	while (x < 3)
+	{
+		y = y + 50;
+		x = x + 1;
+	}
+	return y + x;
+}
@@ -0,0 +1,10 @@
+int main()
+{
+	int x;
+	int n = 5;
+	if (n > 1000)
+		x = 1;
+	if (x > 0)
+		return 1;
+	return 2;
+}
@@ -0,0 +1,24 @@
+int pick(int n)
+{
+	int x;
+	if (n > 1000)
+		x = 1;
+	int r = 10;
+	if (x > 0)
+		r = r * 1;
+	else
+		r = r + 0;
+	return r + n;
+}
+
+int main()
+{
+	int x;
+	int n = 5;
+	int r = 3;
+	if (n > 1000)
+		x = 1;
+	if (x > 0)
+		r = 3;
+	return r + pick(5);
+}
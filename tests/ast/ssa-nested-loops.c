@@ -0,0 +1,21 @@
+int main()
+{
+	int total = 0;
+	int i = 0;
+	while (i < 6)
+	{
+		int j = 0;
+		int row = i;
+		while (j < i)
+		{
+			if (j % 2)
+				row = row + j;
+			else
+				row = row * 2 - j;
+			j = j + 1;
+		}
+		total = total + row;
+		i = i + 1;
+	}
+	return total;
+}
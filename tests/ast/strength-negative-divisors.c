@@ -0,0 +1,19 @@
+int main()
+{
+	int v[6];
+	v[0] = 100;
+	v[1] = 0 - 100;
+	v[2] = 0 - 2147483647 - 1;
+	v[3] = 2147483647;
+	v[4] = 0 - 7;
+	v[5] = 6;
+	int s = 0;
+	int i = 0;
+	while (i < 6)
+	{
+		int x = v[i];
+		s = s + x / (0 - 7) + x % (0 - 7) + x / 3 + x % 3 + x / (0 - 8) + x % 8 + x / 16;
+		i = i + 1;
+	}
+	return s;
+}
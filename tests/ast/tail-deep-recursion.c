@@ -0,0 +1,13 @@
+int count(int n, int acc)
+{
+	if (n == 0)
+		return acc;
+	int m = n - 1;
+	int a = acc + 3;
+	return count(m, a);
+}
+
+int main()
+{
+	return count(1000000, 0);
+}
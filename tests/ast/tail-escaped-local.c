@@ -0,0 +1,25 @@
+int use(int *p)
+{
+	int pad[8];
+	int i = 0;
+	while (i < 8)
+	{
+		pad[i] = 1000 + i;
+		i = i + 1;
+	}
+	int s = 0;
+	i = 0;
+	while (i < 8)
+	{
+		s = s + pad[i] * i;
+		i = i + 1;
+	}
+	return *p + s;
+}
+
+int main()
+{
+	int local = 7;
+	int *p = &local;
+	return use(p);
+}
@@ -0,0 +1,51 @@
+int sum8(int a, int b, int c, int d, int e, int f, int g, int h)
+{
+	int w[8];
+	w[0] = a;
+	w[1] = b;
+	w[2] = c;
+	w[3] = d;
+	w[4] = e;
+	w[5] = f;
+	w[6] = g;
+	w[7] = h;
+	int s = 0;
+	int i = 0;
+	while (i < 8)
+	{
+		s = s * 3 + w[i];
+		i = i + 1;
+	}
+	return s;
+}
+
+int few(int x)
+{
+	int y = x + 1;
+	int z = 0;
+	while (y < 100)
+	{
+		z = z + y % 7;
+		y = y * 2 + z;
+	}
+	return sum8(x, y, z, y, x, z, x, y);
+}
+
+int more(int a, int b, int c, int d, int e, int f, int g, int h, int i, int j)
+{
+	return sum8(j, i, h, g, f, e, d, c);
+}
+
+int main()
+{
+	int keep[4];
+	int i = 0;
+	while (i < 4)
+	{
+		keep[i] = i + 1;
+		i = i + 1;
+	}
+	int r = few(3);
+	int s = more(1, 2, 3, 4, 5, 6, 7, 8, 9, 10);
+	return r + s + keep[0] * 5 + keep[1] * 7 + keep[2] * 11 + keep[3] * 13;
+}
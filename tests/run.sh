@@ -26,3 +26,110 @@ check_return()
 check_return exit-code 123
 check_return precedence 18
 check_return while-loop 9
+
+ast="bin/ast64"
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# the programs in tests/ast are interpreted after compiling at the given optimization levels, each has to return the same
+check_result_at()
+{
+	for level in $1;
+	do
+		$ast $level -run "tests/ast/$2.c"
+		retval=$?
+		if [ $retval -ne "$3" ]; then
+			echo "Fail for $2 at $level, expected $3 got $retval"
+			exit
+		fi
+	done
+}
+
+check_result()
+{
+	check_result_at "-O0 -O1 -O2" "$1" "$2"
+}
+
+# the amount of calls left in main after inlining with the given options, the result has to stay the same
+check_inline()
+{
+	out=$($ast $1 -print-instructions -run "tests/ast/$2.c")
+	retval=$?
+	calls=$(echo "$out" | awk '/^main:$/ { m = 1; next } /^[A-Za-z_0-9]+:$/ { m = 0 } m && /: call /' | wc -l)
+	if [ $retval -ne "$3" ] || [ $calls -ne "$4" ]; then
+		echo "Fail for $2 with '$1', expected $3 with $4 calls got $retval with $calls"
+		exit
+	fi
+}
+
+# the tree written with -emit-ast is the same on every run and loading it back gives the same program
+check_ast_round_trip()
+{
+	for run in 1 2;
+	do
+		$ast -emit-ast "$tmp/$1-$run.ast" -run "tests/ast/$1.c"
+	done
+	if ! cmp -s "$tmp/$1-1.ast" "$tmp/$1-2.ast"; then
+		echo "Fail for $1, -emit-ast wrote a different tree on the second run"
+		exit
+	fi
+	$ast -load-ast "$tmp/$1-1.ast" -run
+	retval=$?
+	if [ $retval -ne "$2" ]; then
+		echo "Fail for $1 loaded with -load-ast, expected $2 got $retval"
+		exit
+	fi
+}
+
+# the function bodies are parsed on one and on four threads, both have to give the same tree and result
+check_threads()
+{
+	for threads in 1 4;
+	do
+		$ast -j $threads -emit-ast "$tmp/$1-j$threads.ast" -run "tests/ast/$1.c"
+		retval=$?
+		if [ $retval -ne "$2" ]; then
+			echo "Fail for $1 with -j $threads, expected $2 got $retval"
+			exit
+		fi
+	done
+	if ! cmp -s "$tmp/$1-j1.ast" "$tmp/$1-j4.ast"; then
+		echo "Fail for $1, the trees parsed with -j 1 and -j 4 differ"
+		exit
+	fi
+}
+
+check_result ssa-nested-loops 80
+check_result mem2reg-address-taken 66
+check_result sccp-dead-branch 11
+check_result gvn-store-between-loads 73
+check_result licm-aliasing-store 25
+check_result strength-negative-divisors 10
+check_result literal-left-compare 143
+check_result mem2reg-pointer-to-local 185
+check_result tail-escaped-local 243
+check_result tail-stack-arguments 150
+# without tail calls the recursion runs out of stack, so only the optimized levels
+check_result_at "-O1 -O2" tail-deep-recursion 192
+check_result call-expression-arguments 17
+check_result call-stack-arguments 100
+check_result call-float-argument 71
+check_result sccp-undefined-branch 2
+check_result sccp-undefined-condition 18
+check_result divide-live-registers 67
+
+check_threads call-stack-arguments 100
+check_threads tail-stack-arguments 150
+check_threads mem2reg-pointer-to-local 185
+
+check_ast_round_trip call-stack-arguments 100
+check_ast_round_trip call-float-argument 71
+check_ast_round_trip literal-left-compare 143
+check_ast_round_trip mem2reg-pointer-to-local 185
+
+check_result inline-budget 30
+check_inline "-inline-budget 0" inline-budget 30 3
+# twice fits the default budget and mix_hint only because inline makes its budget four times as large, the same body
+# in mix_plain is still called
+check_inline "" inline-budget 30 1
+check_inline "-O2" inline-budget 30 1
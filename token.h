@@ -63,6 +63,9 @@ enum TOKEN_TYPE
 	TK_TYPEDEF,
 	TK_ARROW,
 	TK_ENUM,
+	TK_LOGICAL_AND,
+	TK_LOGICAL_OR,
+	TK_INLINE,
 
 	TK_EOF,
 	TK_MAX,
@@ -116,6 +119,9 @@ static const char* token_type_strings[TK_MAX] = {[TK_IDENT] = "ident",
 												 [TK_TYPEDEF] = "typedef",
 												 [TK_ARROW] = "->",
 												 [TK_ENUM] = "enum",
+												 [TK_LOGICAL_AND] = "&&",
+												 [TK_LOGICAL_OR] = "||",
+												 [TK_INLINE] = "inline",
 												 [TK_EOF] = "eof"};
 
 static const int is_token_printable(int type)
@@ -3,9 +3,10 @@
 #include <stdbool.h>
 
 static const char* vopcode_names[] = {
-	"add",	"sub", "mul", "div", "mod",	 "fadd", "fsub",  "fmul", "fdiv", "fmod",  "sitofp", "fptosi", "and",
-	"or",	"xor", "not", "mov", "load", "lea",	 "store", "push", "pop",  "enter", "leave",	 "call",   "ret",
-	"test", "cmp", "jmp", "jnz", "jz",	 "jle",	 "jge",	  "jg",	  "jl",	  "label", "alloca", "hlt",	   NULL};
+	"add",	"sub",	"mul", "div",  "mod",  "fadd", "fsub", "fmul",	"fdiv", "fmod", "sitofp", "fptosi", "and",
+	"or",	"xor",	"shl", "shr",  "sar",  "mulh", "not",  "mov",	"load", "lea",	"store",  "push",	"pop",
+	"enter", "leave", "call", "ret", "tailcall", "test", "cmp", "jmp", "jnz", "jz",	"jle",	"jge",	  "jg",		"jl",
+	"label", "alloca", "hlt", "phi", NULL};
 
 typedef enum
 {	
@@ -27,6 +28,10 @@ typedef enum
 	VOP_AND,
 	VOP_OR,
 	VOP_XOR,
+	VOP_SHL,
+	VOP_SHR, // logical
+	VOP_SAR, // arithmetic
+	VOP_MULH, // high half of the signed product
 	VOP_NOT,
 	
 	VOP_MOV,
@@ -43,6 +48,7 @@ typedef enum
 
 	VOP_CALL,
 	VOP_RET,
+	VOP_TAILCALL, // jumps to a function after the frame was left, it returns to the caller's caller
 
 	VOP_TEST,
 	VOP_CMP,
@@ -56,7 +62,8 @@ typedef enum
 	VOP_JL,
 	VOP_LABEL,
 	VOP_ALLOCA,
-	VOP_HLT
+	VOP_HLT,
+	VOP_PHI
 } vopcode_t;
 
 static bool vopcode_overwrites_first_operand(vopcode_t op)
@@ -64,4 +71,27 @@ static bool vopcode_overwrites_first_operand(vopcode_t op)
 	return op <= VOP_LEA;
 }
 
+// idiv and the one operand imul, they divide or multiply rdx:rax. the register allocators put the first operand in
+// rax, the second one can't be a immediate and rdx is clobbered
+static bool vopcode_uses_rdx_rax(vopcode_t op)
+{
+	return op == VOP_DIV || op == VOP_MOD || op == VOP_MULH;
+}
+
+static bool vopcode_is_jump(vopcode_t op)
+{
+	return op >= VOP_JMP && op <= VOP_JL;
+}
+
+static bool vopcode_is_conditional_jump(vopcode_t op)
+{
+	return op > VOP_JMP && op <= VOP_JL;
+}
+
+// the instruction is always the last one in a basic block
+static bool vopcode_ends_block(vopcode_t op)
+{
+	return vopcode_is_jump(op) || op == VOP_RET || op == VOP_TAILCALL || op == VOP_HLT;
+}
+
 #endif
@@ -64,9 +64,8 @@ void push(heap_string *s, voperand_t *op)
 
 bool x86(function_t *f, heap_string *s)
 {
-	for(size_t i = 0; i < f->instruction_index; ++i)
+	vinstr_list_foreach(&f->instructions, instr)
 	{
-		vinstr_t* instr = &f->instructions[i];
 		voperand_t* op = &instr->operands[0];
 		switch(instr->opcode)
 		{
@@ -74,6 +73,10 @@ bool x86(function_t *f, heap_string *s)
 				db(s, 0xe8);
 				dd(s, 0x0); // TODO: replace
 				break;
+			case VOP_TAILCALL:
+				db(s, 0xe9);
+				dd(s, 0x0); // TODO: replace
+				break;
 
 			case VOP_SUB:
 				assert(instr->numoperands == 2);
@@ -99,7 +102,7 @@ bool x86(function_t *f, heap_string *s)
 			case VOP_ALLOCA:
 			{
 				i32 numbytes = voperand_cast_i32(&instr->operands[0]);
-				numbytes += 16 - (numbytes % 16);
+				numbytes = (numbytes + 15) & ~15;
 				db(s, 0x81);
 				db(s, 0xec);
 				dd(s, numbytes);